@@ -0,0 +1,143 @@
+/**
+   tcp_proxy
+   AccessDump.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Offline decoder for the binary access log. Prints one line per session, or CSV with -c
+// Usage: accessdump [-c] file...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "AccessLog.h"
+#include "Trace.h"
+
+using namespace std;
+
+static const char* reasonNames[TRACE_CLOSE_REASONS] = { "?", "client closed", "target closed", "client error", "target error",
+	"connect failed", "idle", "shed", "shutdown" };
+
+/**
+ * Format Endpoint
+ * "1.2.3.4:80" or "[::1]:80", "-" when there is no address
+ */
+static void formatEndpoint(char* out, size_t n, const AccessEndpoint& e) {
+	char ip[INET6_ADDRSTRLEN];
+	if(e.family == 4) {
+		inet_ntop(AF_INET, e.addr, ip, sizeof(ip));
+		snprintf(out, n, "%s:%u", ip, e.port);
+	} else if(e.family == 6) {
+		inet_ntop(AF_INET6, e.addr, ip, sizeof(ip));
+		snprintf(out, n, "[%s]:%u", ip, e.port);
+	} else {
+		snprintf(out, n, "-");
+	}
+}
+
+/**
+ * Print Record
+ * One session as text or as a CSV row
+ */
+static void printRecord(const AccessRecord& r, bool csv) {
+	char client[64], backend[64], when[32];
+	formatEndpoint(client, sizeof(client), r.client);
+	formatEndpoint(backend, sizeof(backend), r.backend);
+	const char* reason = (r.reason < TRACE_CLOSE_REASONS) ? reasonNames[r.reason] : "?";
+
+	time_t sec = r.startUs / 1000000ULL;
+	struct tm t;
+	localtime_r(&sec, &t);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &t);
+
+	if(csv) {
+		printf("%s.%06llu,%llu,%u,%s,%s,%llu,%llu,%s,%u,%u,%u\n", when, (unsigned long long)(r.startUs % 1000000ULL),
+			(unsigned long long)r.durationUs, r.connectUs, client, backend, (unsigned long long)r.bytesClient,
+			(unsigned long long)r.bytesProxy, reason, r.error, r.loop, r.session);
+		return;
+	}
+
+	printf("%s.%06llu %s -> %s", when, (unsigned long long)(r.startUs % 1000000ULL), client, backend);
+	if(r.connectUs > 0)
+		printf(" connect %.3f ms", r.connectUs / 1000.0);
+	printf(" duration %.3f s in %llu out %llu %s", r.durationUs / 1e6, (unsigned long long)r.bytesClient,
+		(unsigned long long)r.bytesProxy, reason);
+	if(r.error != 0)
+		printf(" (%s)", strerror(r.error));
+	printf(" loop %u", r.loop);
+	if(r.session != 0)
+		printf(" session %u", r.session);
+	printf("\n");
+}
+
+/**
+ * Dump
+ * Print every record of one log file
+ *
+ * @param path Log file
+ * @param csv CSV rows instead of text
+ * @return True if the file was read. False if otherwise
+ */
+static bool dump(const char* path, bool csv) {
+	FILE* f = fopen(path, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "accessdump: Could not open %s\n", path);
+		return false;
+	}
+
+	AccessLogHeader h;
+	if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, ACCESS_LOG_MAGIC, sizeof(h.magic)) != 0 || h.version != ACCESS_LOG_VERSION ||
+		h.recordSize != sizeof(AccessRecord)) {
+		fprintf(stderr, "accessdump: %s is not an access log of this version\n", path);
+		fclose(f);
+		return false;
+	}
+
+	AccessRecord recs[256];
+	size_t n, total = 0;
+	while((n = fread(recs, sizeof(AccessRecord), 256, f)) > 0) {
+		for(size_t i = 0; i < n; i++)
+			printRecord(recs[i], csv);
+		total += n;
+	}
+	fclose(f);
+	// The summary goes to stderr so the CSV can be piped on as it is
+	fprintf(stderr, "accessdump: %s: %zu records\n", path, total);
+	return true;
+}
+
+int main(int argc, const char* argv[]) {
+	bool csv = false;
+	int files = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-c") == 0) {
+			if(!csv)
+				printf("start,duration_us,connect_us,client,backend,bytes_client,bytes_proxy,reason,error,loop,session\n");
+			csv = true;
+			continue;
+		}
+		if(dump(argv[i], csv))
+			files++;
+	}
+	if(files == 0) {
+		printf("Usage: %s [-c] file...\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
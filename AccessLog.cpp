@@ -0,0 +1,328 @@
+/**
+   tcp_proxy
+   AccessLog.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "AccessLog.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+thread_local AccessBlock* AccessLog::current = NULL;
+thread_local uint16_t AccessLog::loop = 0;
+int AccessLog::fd = -1;
+string AccessLog::path;
+AccessBlock* AccessLog::blocks = NULL;
+unsigned int AccessLog::blockCount = 0;
+AccessBlock* AccessLog::freeList = NULL;
+AccessBlock* AccessLog::pending = NULL;
+AccessBlock** AccessLog::pendingTail = &AccessLog::pending;
+pthread_mutex_t AccessLog::lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t AccessLog::ready = PTHREAD_COND_INITIALIZER;
+pthread_t AccessLog::writer;
+bool AccessLog::stopping = false;
+int64_t AccessLog::realtimeOffsetUs = 0;
+atomic<uint64_t> AccessLog::written(0);
+atomic<uint64_t> AccessLog::dropped(0);
+
+/**
+ * Open
+ * Open (or create) the log file, allocate the blocks and start the writer thread. Called once by the acceptor before the event
+ * loops attach
+ *
+ * @param p Log file
+ * @param nblocks Blocks to allocate, at least one per event loop plus one for the writer to work on
+ * @return Bytes allocated for the blocks, for the caller's memory accounting. 0 if the file couldn't be used
+ */
+size_t AccessLog::open(string p, unsigned int nblocks) {
+	AccessLogHeader want;
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, ACCESS_LOG_MAGIC, sizeof(want.magic));
+	want.version = ACCESS_LOG_VERSION;
+	want.recordSize = sizeof(AccessRecord);
+
+	int f = ::open(p.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if(f < 0) {
+		printf("AccessLog: Could not open %s: %s\n", p.c_str(), strerror(errno));
+		return 0;
+	}
+
+	// A new file gets the header, an existing one must have been written with the same record layout
+	struct stat st;
+	AccessLogHeader have;
+	bool ok;
+	if(fstat(f, &st) == 0 && st.st_size == 0)
+		ok = (write(f, &want, sizeof(want)) == sizeof(want));
+	else
+		ok = (pread(f, &have, sizeof(have), 0) == sizeof(have) && memcmp(&have, &want, sizeof(have)) == 0);
+	if(!ok) {
+		printf("AccessLog: %s is not an access log of this version, not logging\n", p.c_str());
+		::close(f);
+		return 0;
+	}
+
+	timespec rt, mono;
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	realtimeOffsetUs = (int64_t)(rt.tv_sec - mono.tv_sec) * 1000000 + (rt.tv_nsec - mono.tv_nsec) / 1000;
+
+	blockCount = (nblocks < 2) ? 2 : nblocks;
+	blocks = new AccessBlock[blockCount];
+	freeList = NULL;
+	for(unsigned int i = 0; i < blockCount; i++) {
+		// Touched here so the loops don't take the page faults
+		blocks[i].records = new AccessRecord[ACCESS_LOG_RECORDS];
+		memset(blocks[i].records, 0, ACCESS_LOG_RECORDS * sizeof(AccessRecord));
+		blocks[i].count = 0;
+		blocks[i].filledSince = 0;
+		blocks[i].next = freeList;
+		freeList = &blocks[i];
+	}
+	pending = NULL;
+	pendingTail = &pending;
+	stopping = false;
+	fd = f;
+	path = p;
+
+	if(pthread_create(&writer, NULL, writerThread, NULL) != 0) {
+		printf("AccessLog: Could not start the writer thread\n");
+		fd = -1;
+		::close(f);
+		for(unsigned int i = 0; i < blockCount; i++)
+			delete [] blocks[i].records;
+		delete [] blocks;
+		blocks = NULL;
+		return 0;
+	}
+
+	size_t bytes = blockCount * (sizeof(AccessBlock) + ACCESS_LOG_RECORDS * sizeof(AccessRecord));
+	printf("AccessLog: Logging sessions to %s, %u blocks of %u records\n", p.c_str(), blockCount, ACCESS_LOG_RECORDS);
+	return bytes;
+}
+
+/**
+ * Close
+ * Write what is pending, stop the writer thread and release the blocks. Called by the acceptor once every event loop has detached
+ */
+void AccessLog::close() {
+	if(fd < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&ready);
+	pthread_mutex_unlock(&lock);
+	pthread_join(writer, NULL);
+
+	::close(fd);
+	fd = -1;
+	for(unsigned int i = 0; i < blockCount; i++)
+		delete [] blocks[i].records;
+	delete [] blocks;
+	blocks = NULL;
+	freeList = NULL;
+	printf("AccessLog: %llu records written to %s, %llu dropped\n", (unsigned long long)written.load(), path.c_str(),
+		(unsigned long long)dropped.load());
+}
+
+/**
+ * Attach
+ * Give the calling event loop thread a block to fill. Does nothing if the access log is off
+ *
+ * @param l Event loop number recorded with every record
+ */
+void AccessLog::attach(int l) {
+	if(fd < 0 || current != NULL)
+		return;
+	pthread_mutex_lock(&lock);
+	AccessBlock* b = freeList;
+	if(b != NULL)
+		freeList = b->next;
+	pthread_mutex_unlock(&lock);
+	if(b == NULL) {
+		printf("AccessLog: No block left for event loop %i, raise access_log_blocks\n", l);
+		return;
+	}
+	b->count = 0;
+	b->filledSince = 0;
+	loop = l;
+	current = b;
+}
+
+/**
+ * Detach
+ * Hand the calling thread's records to the writer and stop logging from it
+ */
+void AccessLog::detach() {
+	AccessBlock* b = current;
+	if(b == NULL)
+		return;
+	current = NULL;
+
+	pthread_mutex_lock(&lock);
+	b->next = NULL;
+	if(b->count > 0) {
+		*pendingTail = b;
+		pendingTail = &b->next;
+		pthread_cond_signal(&ready);
+	} else {
+		b->next = freeList;
+		freeList = b;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Hand Off
+ * Queue a block for the writer and take a free one in its place
+ *
+ * @param b The calling thread's block
+ * @return The block to fill next. If the writer is so far behind that none is free, b itself: its records are dropped
+ */
+AccessBlock* AccessLog::handOff(AccessBlock* b) {
+	pthread_mutex_lock(&lock);
+	AccessBlock* n = freeList;
+	if(n != NULL) {
+		freeList = n->next;
+		b->next = NULL;
+		*pendingTail = b;
+		pendingTail = &b->next;
+		pthread_cond_signal(&ready);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if(n == NULL) {
+		dropped.fetch_add(b->count, memory_order_relaxed);
+		n = b;
+	}
+	n->count = 0;
+	n->filledSince = 0;
+	return n;
+}
+
+/**
+ * Trim Partial
+ * Cut a partly written record off the end of the log so the decoder never reads it as whole. The file is a header followed by whole
+ * records, whatever wrote them
+ *
+ * @param fd Access log
+ * @return True if the log ends on a record boundary again. False if otherwise
+ */
+static bool trimPartial(int fd) {
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(AccessLogHeader))
+		return false;
+	off_t excess = (st.st_size - sizeof(AccessLogHeader)) % sizeof(AccessRecord);
+	return excess == 0 || ftruncate(fd, st.st_size - excess) == 0;
+}
+
+/**
+ * Writer Thread
+ * Write whatever blocks are pending with one writev(), oldest first, and put them back on the free list. Runs until close() and
+ * everything pending is written. The records of a short write that made it to the file count as written, a partial one is cut off.
+ * If that fails nothing more is appended, so the log stays readable up to the partial record
+ */
+void* AccessLog::writerThread(void* arg) {
+	struct iovec iov[IOV_MAX];
+	bool appending = true;
+	pthread_mutex_lock(&lock);
+	for(;;) {
+		while(pending == NULL && !stopping)
+			pthread_cond_wait(&ready, &lock);
+		if(pending == NULL)
+			break;
+
+		AccessBlock* batch = pending;
+		pending = NULL;
+		pendingTail = &pending;
+		pthread_mutex_unlock(&lock);
+
+		AccessBlock* b = batch;
+		while(b != NULL) {
+			int n = 0;
+			size_t total = 0;
+			uint64_t records = 0;
+			for(; b != NULL && n < IOV_MAX; b = b->next, n++) {
+				iov[n].iov_base = b->records;
+				iov[n].iov_len = b->count * sizeof(AccessRecord);
+				total += iov[n].iov_len;
+				records += b->count;
+			}
+
+			if(!appending) {
+				dropped.fetch_add(records, memory_order_relaxed);
+				continue;
+			}
+
+			// O_APPEND keeps the records whole even with a predecessor appending, a short write only happens on a full disk
+			ssize_t w;
+			do {
+				w = writev(fd, iov, n);
+			} while(w < 0 && errno == EINTR);
+			if(w == (ssize_t)total) {
+				written.fetch_add(records, memory_order_relaxed);
+				continue;
+			}
+
+			printf("AccessLog: Write to %s failed: %s\n", path.c_str(), (w < 0) ? strerror(errno) : "short write");
+			uint64_t whole = (w > 0) ? w / sizeof(AccessRecord) : 0;
+			if(w > 0 && w % sizeof(AccessRecord) != 0 && !trimPartial(fd)) {
+				printf("AccessLog: Could not cut the partial record off %s: %s, not logging any more\n", path.c_str(), strerror(errno));
+				appending = false;
+			}
+			written.fetch_add(whole, memory_order_relaxed);
+			dropped.fetch_add(records - whole, memory_order_relaxed);
+		}
+
+		pthread_mutex_lock(&lock);
+		while(batch != NULL) {
+			AccessBlock* next = batch->next;
+			batch->next = freeList;
+			freeList = batch;
+			batch = next;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/**
+ * Endpoint
+ * Pack a socket address into an AccessEndpoint
+ *
+ * @param sa IPv4 or IPv6 address, NULL for none
+ * @param out Packed address
+ */
+void AccessLog::endpoint(const sockaddr* sa, AccessEndpoint* out) {
+	memset(out, 0, sizeof(AccessEndpoint));
+	if(sa == NULL)
+		return;
+	if(sa->sa_family == AF_INET) {
+		const sockaddr_in* in = (const sockaddr_in*)sa;
+		memcpy(out->addr, &in->sin_addr, 4);
+		out->port = ntohs(in->sin_port);
+		out->family = 4;
+	} else if(sa->sa_family == AF_INET6) {
+		const sockaddr_in6* in6 = (const sockaddr_in6*)sa;
+		memcpy(out->addr, &in6->sin6_addr, 16);
+		out->port = ntohs(in6->sin6_port);
+		out->family = 6;
+	}
+}
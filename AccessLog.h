@@ -0,0 +1,182 @@
+/**
+   tcp_proxy
+   AccessLog.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef ACCESSLOG_H_
+#define ACCESSLOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+// File layout: an AccessLogHeader, then AccessRecords until the end of the file. Native byte order, decoded on the same machine.
+// The proxy appends to an existing file with the same header, so a successor taking over with handover continues the same log
+#define ACCESS_LOG_MAGIC "TCPACLOG"
+#define ACCESS_LOG_VERSION 1
+#define ACCESS_LOG_RECORDS 1024 // Records per block, a block is what a loop fills before handing it to the writer thread
+#define ACCESS_LOG_FLUSH 1000 // Milliseconds a partly filled block may wait before it is handed off anyway
+
+/**
+ * Access Endpoint
+ * An address in 20 bytes. family is 4 or 6, 0 when there is no address (a session that never connected has no backend)
+ */
+struct AccessEndpoint {
+	uint8_t addr[16]; // IPv4 addresses use the first 4 bytes, network order
+	uint16_t port; // Host order
+	uint8_t family;
+	uint8_t reserved;
+};
+
+/**
+ * Access Record
+ * One closed session, 88 bytes
+ */
+struct AccessRecord {
+	uint64_t startUs; // CLOCK_REALTIME microseconds the client was accepted
+	uint64_t durationUs; // Accept to close
+	uint64_t bytesClient; // Bytes read from the client
+	uint64_t bytesProxy; // Bytes read from the backend
+	uint32_t connectUs; // Accept to backend connected, 0 if it never connected
+	uint32_t session; // Trace id of the session, 0 when tracing is off
+	uint32_t error; // errno when the session closed on a socket error
+	uint16_t loop; // Event loop that ran the session, 0 for the acceptor, worker + 1
+	uint8_t reason; // TRACE_CLOSE_* reason
+	uint8_t reserved;
+	AccessEndpoint client;
+	AccessEndpoint backend;
+};
+
+/**
+ * Access Log Header
+ */
+struct AccessLogHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize; // sizeof(AccessRecord)
+};
+
+/**
+ * Access Block
+ * ACCESS_LOG_RECORDS records, owned by one event loop while it fills them, then by the writer thread
+ */
+struct AccessBlock {
+	AccessRecord* records;
+	unsigned int count;
+	long filledSince; // Time the owning loop first saw records in the block, 0 while it has none
+	AccessBlock* next;
+};
+
+/**
+ * Access Log
+ * Per session access records in a binary file. Each event loop thread fills a block of its own, taking a record is a TLS load and a
+ * bounds check, no locking and no allocation. Full blocks, and partly filled ones every ACCESS_LOG_FLUSH ms, are handed to a writer
+ * thread that writes everything pending with one writev(). The blocks are allocated up front: if the writer falls that far behind a
+ * loop reuses its full block and the records in it are counted as dropped, the loops never wait for the disk
+ */
+class AccessLog {
+private:
+	static thread_local AccessBlock* current; // This thread's block, NULL if the access log is off
+	static thread_local uint16_t loop;
+	static int fd;
+	static string path;
+	static AccessBlock* blocks; // All of them, for close()
+	static unsigned int blockCount;
+	static AccessBlock* freeList;
+	static AccessBlock* pending; // Handed off, oldest first
+	static AccessBlock** pendingTail;
+	static pthread_mutex_t lock;
+	static pthread_cond_t ready;
+	static pthread_t writer;
+	static bool stopping;
+	static int64_t realtimeOffsetUs; // CLOCK_REALTIME - CLOCK_MONOTONIC, record times are taken on the monotonic clock
+	static atomic<uint64_t> written;
+	static atomic<uint64_t> dropped;
+
+	static void* writerThread(void* arg);
+	static AccessBlock* handOff(AccessBlock* b);
+
+public:
+	static size_t open(string p, unsigned int nblocks);
+	static void close();
+	static void attach(int l);
+	static void detach();
+	static void endpoint(const sockaddr* sa, AccessEndpoint* out);
+
+	static bool isOpen() {
+		return fd >= 0;
+	}
+
+	// This thread's block has records tick() still has to hand off
+	static bool holding() {
+		return current != NULL && current->count > 0;
+	}
+
+	/**
+	 * Next
+	 * A record to fill in for a closed session. It is written out with the rest of the block, the caller only fills it in
+	 *
+	 * @param openedUs Upstream::nowUs() the session was accepted, converted to wall clock time for startUs
+	 * @return The record with startUs and loop set. NULL if the access log is off
+	 */
+	static AccessRecord* next(uint64_t openedUs) {
+		AccessBlock* b = current;
+		if(b == NULL)
+			return NULL;
+		if(b->count == ACCESS_LOG_RECORDS)
+			b = current = handOff(b);
+		AccessRecord* r = &b->records[b->count++];
+		r->startUs = openedUs + realtimeOffsetUs;
+		r->loop = loop;
+		r->reserved = 0;
+		return r;
+	}
+
+	/**
+	 * Tick
+	 * Called once per event loop pass. Hands this thread's block off once it has held records for ACCESS_LOG_FLUSH ms, so records
+	 * reach the file within a couple of seconds however slowly sessions close
+	 *
+	 * @param now nowMs()
+	 */
+	static void tick(long now) {
+		AccessBlock* b = current;
+		if(b == NULL || b->count == 0)
+			return;
+		if(b->filledSince == 0)
+			b->filledSince = now;
+		else if(now - b->filledSince >= ACCESS_LOG_FLUSH)
+			current = handOff(b);
+	}
+
+	static uint64_t getWritten() {
+		return written.load(memory_order_relaxed);
+	}
+
+	static uint64_t getDropped() {
+		return dropped.load(memory_order_relaxed);
+	}
+};
+
+#endif
@@ -0,0 +1,131 @@
+/**
+   tcp_proxy
+   Affinity.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Affinity.h"
+
+/**
+ * Pin Current Thread
+ * Restrict the calling thread to a single CPU
+ *
+ * @param cpu CPU number
+ * @return True if the affinity was set. False if otherwise
+ */
+bool Affinity::pinCurrentThread(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(err != 0) {
+		printf("Affinity: Could not pin thread to CPU %i: %s\n", cpu, strerror(err));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Current Node
+ * NUMA node of the CPU the calling thread is running on
+ *
+ * @return Node number. 0 if it couldn't be determined
+ */
+int Affinity::currentNode() {
+	unsigned int cpu = 0, node = 0;
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+	return (int)node;
+}
+
+/**
+ * Prefer Local Memory
+ * Set the calling thread's memory policy to prefer the NUMA node it is running on. Call after pinCurrentThread() and before the
+ * thread allocates its buffers and session table so their pages are placed on the local node
+ *
+ * @return True if the policy was set. False if otherwise
+ */
+bool Affinity::preferLocalMemory() {
+	int node = currentNode();
+	unsigned long mask[16];
+	memset(mask, 0, sizeof(mask));
+	if(node >= (int)(sizeof(mask) * 8))
+		return false;
+	mask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+
+	if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0) {
+		printf("Affinity: Could not set the memory policy for node %i: %s\n", node, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Incoming CPU
+ * CPU that processed the most recent packets of an accepted connection (the CPU servicing its NIC receive queue)
+ *
+ * @param sd Accepted socket descriptor
+ * @return CPU number. -1 if unknown
+ */
+int Affinity::incomingCpu(SOCKET sd) {
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+	if(getsockopt(sd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+		return -1;
+	return cpu;
+}
+
+/**
+ * Attach CPU Steering
+ * Attach a classic BPF program to a SO_REUSEPORT group that selects the listener belonging to the worker pinned to the CPU handling
+ * the incoming SYN. CPUs without a worker fall back to cpu % group size
+ *
+ * @param sd Any listening socket in the group
+ * @param cpus CPU of each listener, in the order the listeners joined the group (-1 if not pinned)
+ * @return True if the program was attached. False if otherwise
+ */
+bool Affinity::attachCpuSteering(SOCKET sd, vector<int>& cpus) {
+	vector<sock_filter> prog;
+
+	// A = CPU the packet is being processed on
+	sock_filter ld = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (unsigned int)(SKF_AD_OFF + SKF_AD_CPU));
+	prog.push_back(ld);
+
+	// if(A == cpu[i]) return i
+	for(unsigned int i = 0; i < cpus.size(); i++) {
+		if(cpus[i] < 0)
+			continue;
+		sock_filter jeq = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned int)cpus[i], 0, 1);
+		sock_filter ret = BPF_STMT(BPF_RET | BPF_K, i);
+		prog.push_back(jeq);
+		prog.push_back(ret);
+	}
+
+	// return A % group size
+	sock_filter mod = BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned int)cpus.size());
+	sock_filter reta = BPF_STMT(BPF_RET | BPF_A, 0);
+	prog.push_back(mod);
+	prog.push_back(reta);
+
+	sock_fprog fprog;
+	fprog.len = prog.size();
+	fprog.filter = &prog[0];
+	if(setsockopt(sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) != 0) {
+		printf("Affinity: Could not attach the reuseport steering program: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
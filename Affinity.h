@@ -0,0 +1,51 @@
+/**
+   tcp_proxy
+   Affinity.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <vector>
+
+#define SOCKET int
+
+using namespace std;
+
+/**
+ * Affinity
+ * CPU pinning, NUMA memory placement and connection steering helpers for the worker threads
+ */
+class Affinity {
+public:
+	static bool pinCurrentThread(int cpu);
+	static int currentNode();
+	static bool preferLocalMemory();
+	static int incomingCpu(SOCKET sd);
+	static bool attachCpuSteering(SOCKET sd, vector<int>& cpus);
+};
+
+#endif
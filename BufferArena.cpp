@@ -0,0 +1,166 @@
+/**
+   tcp_proxy
+   BufferArena.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "BufferArena.h"
+
+uint8_t* BufferArena::base = NULL;
+size_t BufferArena::size = 0;
+size_t BufferArena::top = 0;
+void* BufferArena::lists[ARENA_CLASSES] = { NULL };
+int BufferArena::backing = ARENA_OFF;
+bool BufferArena::locked = false;
+pthread_mutex_t BufferArena::lock = PTHREAD_MUTEX_INITIALIZER;
+atomic<size_t> BufferArena::used(0);
+atomic<size_t> BufferArena::carved(0);
+atomic<unsigned long long> BufferArena::misses(0);
+
+/**
+ * Open
+ * Map the region, before any buffer is allocated. Reserved huge pages are tried first, then a normal mapping with transparent huge
+ * pages requested, which the kernel may or may not honor. The region lives as long as the process: blocks go on being returned to
+ * it until the last thread has exited
+ *
+ * @param bytes Region size, rounded up to a whole huge page
+ * @param lockPages mlock() the region, faulting it all in now instead of on first use
+ * @return False if the region couldn't be mapped, buffers then come from malloc(). True if otherwise
+ */
+bool BufferArena::open(size_t bytes, bool lockPages) {
+	if(base != NULL)
+		return true;
+	size = (bytes + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+
+	void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(mem != MAP_FAILED) {
+		backing = ARENA_HUGETLB;
+	} else {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED) {
+			printf("BufferArena: Could not map %zu bytes: %s\n", size, strerror(errno));
+			size = 0;
+			return false;
+		}
+		backing = (madvise(mem, size, MADV_HUGEPAGE) == 0) ? ARENA_THP : ARENA_PAGES;
+	}
+
+	locked = false;
+	if(lockPages) {
+		if(mlock(mem, size) == 0)
+			locked = true;
+		else
+			printf("BufferArena: Could not lock the region, it will be faulted in on use: %s\n", strerror(errno));
+	}
+
+	base = (uint8_t*)mem;
+	printf("BufferArena: %zu MB region backed by %s%s\n", size / (1024 * 1024), backingName(backing), locked ? ", locked" : "");
+	return true;
+}
+
+/**
+ * Class Of
+ * Smallest size class whose blocks hold n bytes
+ *
+ * @param n Bytes including the owner's header
+ * @return Class, ARENA_CLASSES if n is too large for any
+ */
+int BufferArena::classOf(size_t n) {
+	int cls = 0;
+	while(cls < ARENA_CLASSES && ARENA_HEADER + ((size_t)ARENA_MIN << cls) < n)
+		cls++;
+	return cls;
+}
+
+/**
+ * Alloc
+ * Take a block from its class' free list, or cut a new one off the region
+ *
+ * @param n Bytes needed, at most ARENA_HEADER + 64KB
+ * @return The block, NULL if the arena is off, n is too large or the region is used up. The caller then uses malloc()
+ */
+void* BufferArena::alloc(size_t n) {
+	if(base == NULL)
+		return NULL;
+	int cls = classOf(n);
+	if(cls == ARENA_CLASSES) {
+		misses++;
+		return NULL;
+	}
+	size_t stride = ARENA_HEADER + ((size_t)ARENA_MIN << cls);
+
+	void* p = NULL;
+	pthread_mutex_lock(&lock);
+	if(lists[cls] != NULL) {
+		p = lists[cls];
+		lists[cls] = *(void**)p;
+	} else if(top + stride <= size) {
+		p = base + top;
+		top += stride;
+		carved.store(top, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if(p == NULL) {
+		misses++;
+		return NULL;
+	}
+	used.fetch_add(stride, memory_order_relaxed);
+	return p;
+}
+
+/**
+ * Free
+ * Put a block back on its class' free list
+ *
+ * @param p Block from alloc()
+ * @param n The size it was allocated with
+ */
+void BufferArena::free(void* p, size_t n) {
+	int cls = classOf(n);
+	used.fetch_sub(ARENA_HEADER + ((size_t)ARENA_MIN << cls), memory_order_relaxed);
+
+	pthread_mutex_lock(&lock);
+	*(void**)p = lists[cls];
+	lists[cls] = p;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Report
+ * Print the arena's usage. Fragmentation is the part of the carved region sitting on the free lists: blocks are never split or
+ * merged, so memory freed in one size class can't serve another
+ */
+void BufferArena::report() {
+	if(base == NULL)
+		return;
+	size_t c = getCarved();
+	size_t u = getUsed();
+	size_t freeBytes[ARENA_CLASSES];
+	pthread_mutex_lock(&lock);
+	for(int cls = 0; cls < ARENA_CLASSES; cls++) {
+		freeBytes[cls] = 0;
+		for(void* p = lists[cls]; p != NULL; p = *(void**)p)
+			freeBytes[cls] += ARENA_HEADER + ((size_t)ARENA_MIN << cls);
+	}
+	pthread_mutex_unlock(&lock);
+
+	printf("BufferArena: %zu bytes in use, %zu carved of %zu (%.1f%% fragmented), %llu requests fell back to malloc\n", u, c, size,
+		(c > 0) ? (c - u) * 100.0 / c : 0.0, getMisses());
+	for(int cls = 0; cls < ARENA_CLASSES; cls++) {
+		if(freeBytes[cls] > 0)
+			printf("BufferArena:   %u byte blocks: %zu bytes free\n", ARENA_MIN << cls, freeBytes[cls]);
+	}
+}
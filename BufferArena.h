@@ -0,0 +1,111 @@
+/**
+   tcp_proxy
+   BufferArena.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BUFFERARENA_H_
+#define BUFFERARENA_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <atomic>
+
+using namespace std;
+
+#define ARENA_CLASSES 9 // Block sizes: 256 bytes to 64KB of data in powers of two
+#define ARENA_MIN 256
+#define ARENA_HEADER 64 // Room in front of each block's data for its owner's header (ByteBlock), keeps blocks cache line aligned
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+// How the region is backed
+#define ARENA_OFF 0
+#define ARENA_PAGES 1 // Normal pages, huge pages were not available
+#define ARENA_THP 2 // Transparent huge pages (madvise)
+#define ARENA_HUGETLB 3 // Reserved huge pages (MAP_HUGETLB)
+
+/**
+ * Buffer Arena
+ * One large region, preallocated at startup, that all relay buffers and ByteBuffer blocks are carved from. Tens of thousands of
+ * sessions' buffers then share a few huge pages instead of spreading over as many 4KB pages, which keeps TLB misses down. Blocks
+ * are cut off the top of the region as needed and never split or merged, a freed block goes on its size class' free list. The
+ * threads' ByteBlockPools cache blocks in front of the arena, so the lock is only taken when a pool runs dry or overflows.
+ * Requests that don't fit a class or the region fall back to malloc()
+ */
+class BufferArena {
+private:
+	static uint8_t* base; // NULL while the arena is off
+	static size_t size;
+	static size_t top; // Bytes cut off the region so far
+	static void* lists[ARENA_CLASSES]; // Free blocks by class, linked through their first word
+	static int backing;
+	static bool locked;
+	static pthread_mutex_t lock;
+	static atomic<size_t> used; // Bytes in blocks handed out
+	static atomic<size_t> carved; // Equals top, readable without the lock
+	static atomic<unsigned long long> misses; // Requests that fell back to malloc()
+
+	static int classOf(size_t n);
+
+public:
+	static bool open(size_t bytes, bool lockPages);
+	static void* alloc(size_t n);
+	static void free(void* p, size_t n);
+	static void report();
+
+	// True if p was carved from the arena
+	static bool owns(const void* p) {
+		return base != NULL && (const uint8_t*)p >= base && (const uint8_t*)p < base + size;
+	}
+
+	static int getBacking() {
+		return (base != NULL) ? backing : ARENA_OFF;
+	}
+
+	static size_t getSize() {
+		return (base != NULL) ? size : 0;
+	}
+
+	static size_t getUsed() {
+		return used.load(memory_order_relaxed);
+	}
+
+	static size_t getCarved() {
+		return carved.load(memory_order_relaxed);
+	}
+
+	static unsigned long long getMisses() {
+		return misses.load(memory_order_relaxed);
+	}
+
+	static const char* backingName(int b) {
+		switch(b) {
+		case ARENA_PAGES:
+			return "normal pages";
+		case ARENA_THP:
+			return "transparent huge pages";
+		case ARENA_HUGETLB:
+			return "hugetlb pages";
+		default:
+			return "off";
+		}
+	}
+};
+
+#endif
@@ -17,6 +17,130 @@
 */
 
 #include "ByteBuffer.h"
+#include "BufferArena.h"
+
+thread_local ByteBlockPool ByteBlockPool::local;
+
+/**
+ * ByteBlockPool Constructor
+ */
+ByteBlockPool::ByteBlockPool() {
+	for(int i = 0; i < BB_POOL_CLASSES; i++) {
+		lists[i] = NULL;
+		count[i] = 0;
+	}
+}
+
+/**
+ * ByteBlockPool Destructor
+ * The thread is exiting, free the pooled blocks. Blocks still referenced elsewhere are freed by whoever drops them last
+ */
+ByteBlockPool::~ByteBlockPool() {
+	for(int i = 0; i < BB_POOL_CLASSES; i++) {
+		while(lists[i] != NULL) {
+			ByteBlock* b = lists[i];
+			lists[i] = b->next;
+			dispose(b);
+		}
+	}
+}
+
+/**
+ * Alloc
+ * Take a block with room for at least capacity bytes from the calling thread's pool, or allocate one. The block starts with one reference
+ *
+ * @param capacity Bytes needed
+ * @return New block. NULL if no more memory available
+ */
+ByteBlock* ByteBlockPool::alloc(unsigned int capacity) {
+	ByteBlockPool* pool = &local;
+	int cls = 0;
+	unsigned int size = BB_POOL_MIN;
+	while(size < capacity && cls < BB_POOL_CLASSES) {
+		size <<= 1;
+		cls++;
+	}
+
+	ByteBlock* b;
+	if(cls < BB_POOL_CLASSES && pool->lists[cls] != NULL) {
+		b = pool->lists[cls];
+		pool->lists[cls] = b->next;
+		pool->count[cls]--;
+	} else {
+		// Too large for a size class, allocated exactly and never pooled
+		if(cls == BB_POOL_CLASSES) {
+			size = capacity;
+			pool = NULL;
+		}
+		// From the buffer arena when there is one and it has room
+		void* mem = BufferArena::alloc(sizeof(ByteBlock) + size);
+		if(mem == NULL)
+			mem = malloc(sizeof(ByteBlock) + size);
+		if(mem == NULL)
+			return NULL;
+		b = new (mem) ByteBlock();
+		b->capacity = size;
+		b->pool = pool;
+	}
+	b->refs.store(1, memory_order_relaxed);
+	b->next = NULL;
+	return b;
+}
+
+/**
+ * Release
+ * Drop a reference to a block. The last reference returns it to the pool it came from if that is the calling thread's and the pool
+ * isn't full, otherwise frees it
+ *
+ * @param b Block, may be NULL
+ */
+void ByteBlockPool::release(ByteBlock* b) {
+	if(b == NULL || b->refs.fetch_sub(1, memory_order_acq_rel) != 1)
+		return;
+
+	ByteBlockPool* pool = &local;
+	if(b->pool == pool) {
+		int cls = 0;
+		while(((unsigned int)BB_POOL_MIN << cls) < b->capacity)
+			cls++;
+		if(pool->count[cls] < BB_POOL_KEEP) {
+			b->next = pool->lists[cls];
+			pool->lists[cls] = b;
+			pool->count[cls]++;
+			return;
+		}
+	}
+	dispose(b);
+}
+
+/**
+ * Dispose
+ * Give a block's memory back to where it came from
+ *
+ * @param b Block without references
+ */
+void ByteBlockPool::dispose(ByteBlock* b) {
+	unsigned int size = sizeof(ByteBlock) + b->capacity;
+	b->~ByteBlock();
+	if(BufferArena::owns(b))
+		BufferArena::free(b, size);
+	else
+		::free(b);
+}
+
+/**
+ * Pooled
+ * Number of free blocks in the calling thread's pool that alloc(capacity) could take
+ *
+ * @param capacity Bytes needed
+ * @return Blocks on capacity's free list. 0 if capacity is too large to pool
+ */
+unsigned int ByteBlockPool::pooled(unsigned int capacity) {
+	int cls = 0;
+	while(((unsigned int)BB_POOL_MIN << cls) < capacity && cls < BB_POOL_CLASSES)
+		cls++;
+	return (cls < BB_POOL_CLASSES) ? local.count[cls] : 0;
+}
 
 /**
  * ByteBuffer constructor
@@ -27,7 +151,9 @@
 ByteBuffer::ByteBuffer(unsigned int size) {
 	rpos = 0;
 	wpos = 0;
-	buf.reserve(size);
+	block = (size > 0) ? ByteBlockPool::alloc(size) : NULL;
+	offset = 0;
+	length = 0;
 #ifdef BB_UTILITY
 	name = "";
 #endif
@@ -40,10 +166,12 @@ ByteBuffer::ByteBuffer(unsigned int size) {
  * @param arr byte array of data (should be of length len)
  * @param size Size of space to allocate
  */
-ByteBuffer::ByteBuffer(byte* arr, unsigned int size) {
+ByteBuffer::ByteBuffer(uint8_t* arr, unsigned int size) {
 	rpos = 0;
 	wpos = 0;
-	buf.reserve(size);
+	block = (size > 0) ? ByteBlockPool::alloc(size) : NULL;
+	offset = 0;
+	length = 0;
 	putBytes(arr, size);
 #ifdef BB_UTILITY
 	name = "";
@@ -51,10 +179,121 @@ ByteBuffer::ByteBuffer(byte* arr, unsigned int size) {
 }
 
 /**
- * ByteBuffer Deconstructor
+ * ByteBuffer copy constructor
+ * Share the storage of another ByteBuffer. Nothing is copied until one of the two is written to
+ *
+ * @param src ByteBuffer to share
+ */
+ByteBuffer::ByteBuffer(const ByteBuffer& src) {
+	rpos = src.rpos;
+	wpos = src.wpos;
+	block = src.block;
+	offset = src.offset;
+	length = src.length;
+	if(block != NULL)
+		block->refs.fetch_add(1, memory_order_relaxed);
+#ifdef BB_UTILITY
+	name = src.name;
+#endif
+}
+
+/**
+ * ByteBuffer slice constructor
+ * Share part of the storage of another ByteBuffer. The range is clipped to src's size
+ *
+ * @param src ByteBuffer to share
+ * @param start Index in src of the first byte of the slice
+ * @param len Length of the slice
+ */
+ByteBuffer::ByteBuffer(const ByteBuffer& src, unsigned int start, unsigned int len) {
+	if(start > src.length)
+		start = src.length;
+	if(len > src.length - start)
+		len = src.length - start;
+
+	rpos = 0;
+	wpos = 0;
+	block = (len > 0) ? src.block : NULL;
+	offset = (len > 0) ? src.offset + start : 0;
+	length = len;
+	if(block != NULL)
+		block->refs.fetch_add(1, memory_order_relaxed);
+#ifdef BB_UTILITY
+	name = "";
+#endif
+}
+
+/**
+ * Assignment
+ * Drop the current storage and share src's
  *
+ * @param src ByteBuffer to share
+ */
+ByteBuffer& ByteBuffer::operator=(const ByteBuffer& src) {
+	if(src.block != NULL)
+		src.block->refs.fetch_add(1, memory_order_relaxed);
+	ByteBlockPool::release(block);
+
+	rpos = src.rpos;
+	wpos = src.wpos;
+	block = src.block;
+	offset = src.offset;
+	length = src.length;
+#ifdef BB_UTILITY
+	name = src.name;
+#endif
+	return *this;
+}
+
+/**
+ * ByteBuffer Deconstructor
+ * Drops this buffer's reference to the storage
  */
 ByteBuffer::~ByteBuffer() {
+	ByteBlockPool::release(block);
+}
+
+/**
+ * Own
+ * Copy on write. Before a write the storage has to be this buffer's alone and large enough: if it is shared or too small the view is
+ * copied into a new block (growing by at least double so byte at a time writes stay linear) and the old one is released
+ *
+ * @param need Bytes the view must have room for
+ */
+void ByteBuffer::own(unsigned int need) {
+	if(block != NULL && offset + need <= block->capacity && block->refs.load(memory_order_acquire) == 1)
+		return;
+
+	unsigned int cap = (block != NULL) ? block->capacity : 0;
+	if(cap < need)
+		cap = (need > cap * 2) ? need : cap * 2;
+	ByteBlock* b = ByteBlockPool::alloc(cap);
+	if(b == NULL)
+		throw bad_alloc();
+	if(length > 0)
+		memcpy(b->data(), block->data() + offset, length);
+	ByteBlockPool::release(block);
+	block = b;
+	offset = 0;
+}
+
+/**
+ * Write
+ * Copy bytes in at the write position. Writing past the end grows the buffer, a gap between the end and the write position is zeroed
+ *
+ * @param b Bytes to write
+ * @param len Number of bytes
+ */
+void ByteBuffer::write(const uint8_t* b, unsigned int len) {
+	unsigned int end = wpos + len;
+	own((end > length) ? end : length);
+	uint8_t* data = block->data() + offset;
+	if(wpos > length)
+		memset(data + length, 0, wpos - length);
+	memcpy(data + wpos, b, len);
+	if(end > length)
+		length = end;
+	wpos = end;
 }
 
 /**
@@ -74,28 +313,37 @@ unsigned int ByteBuffer::bytesRemaining() {
 void ByteBuffer::clear() {
 	rpos = 0;
 	wpos = 0;
-	buf.clear();
+	length = 0;
+	offset = 0;
+
+	// Storage someone else still views is left to them
+	if(block != NULL && block->refs.load(memory_order_acquire) > 1) {
+		ByteBlockPool::release(block);
+		block = NULL;
+	}
 }
 
 /**
  * Clone
- * Allocate an exact copy of the ByteBuffer on the heap and return a pointer
+ * Allocate a copy of the ByteBuffer on the heap and return a pointer. The copy shares this buffer's storage, the bytes are only
+ * duplicated if one of the two is written to
  *
- * @return A pointer to the newly cloned ByteBuffer. NULL if no more memory available
+ * @return A pointer to the newly cloned ByteBuffer
  */
 ByteBuffer* ByteBuffer::clone() {
-	ByteBuffer* ret = new ByteBuffer(buf.size());
-
-	// Copy data
-	for(unsigned int i = 0; i < buf.size(); i++) {
-		ret->put(i, (byte)get(i));
-	}
-
-	// Reset positions
-	ret->setReadPos(0);
-	ret->setWritePos(0);
+	return new ByteBuffer(*this);
+}
 
-	return ret;
+/**
+ * Slice
+ * Allocate a ByteBuffer on the heap viewing part of this one's contents. Like clone(), the storage is shared
+ *
+ * @param start Index of the first byte of the slice
+ * @param len Length of the slice, clipped to the end of this buffer
+ * @return A pointer to the new ByteBuffer
+ */
+ByteBuffer* ByteBuffer::slice(unsigned int start, unsigned int len) {
+	return new ByteBuffer(*this, start, len);
 }
 
 /**
@@ -110,14 +358,11 @@ bool ByteBuffer::equals(ByteBuffer* other) {
 	if(size() != other->size())
 		return false;
 
-	// Compare byte by byte
+	// Views of the same bytes are equal without looking
 	unsigned int len = size();
-	for(unsigned int i = 0; i < len; i++) {
-		if((byte)get(i) != (byte)other->get(i))
-			return false;
-	}
-
-	return true;
+	if(len == 0 || (block == other->block && offset == other->offset))
+		return true;
+	return memcmp(getData(), other->getData(), len) == 0;
 }
 
 /**
@@ -127,11 +372,34 @@ bool ByteBuffer::equals(ByteBuffer* other) {
  * @param newSize The amount of memory to allocate
  */
 void ByteBuffer::resize(unsigned int newSize) {
-	buf.resize(newSize);
+	if(newSize > 0) {
+		own(newSize);
+		if(newSize > length)
+			memset(block->data() + offset + length, 0, newSize - length);
+	}
+	length = newSize;
 	rpos = 0;
 	wpos = 0;
 }
 
+/**
+ * Fill
+ * Size the buffer for data about to be written into it directly, without a copy. The contents are undefined until then, resize()
+ * trims the buffer to what was actually written. Read and write positions are reset. The old contents are about to be overwritten,
+ * so storage that is shared or too small is replaced without copying them
+ *
+ * @param len Number of bytes
+ * @return The buffer's storage, len bytes that belong to this buffer alone
+ */
+uint8_t* ByteBuffer::fill(unsigned int len) {
+	length = 0;
+	own(len);
+	length = len;
+	rpos = 0;
+	wpos = 0;
+	return block->data() + offset;
+}
+
 /**
  * Size
  * Returns the size of the internal buffer...not necessarily the length of bytes used as data!
@@ -139,7 +407,7 @@ void ByteBuffer::resize(unsigned int newSize) {
  * @return size of the internal buffer
  */
 unsigned int ByteBuffer::size() {
-	return buf.size();
+	return length;
 }
 
 // Replacement
@@ -153,17 +421,18 @@ unsigned int ByteBuffer::size() {
  * @param start Index to start from. By default, start is 0
  * @param firstOccuranceOnly If true, only replace the first occurance of the key. If false, replace all occurances. False by default
  */
-void ByteBuffer::replace(byte key, byte rep, unsigned int start, bool firstOccuranceOnly) {
-    unsigned int len = buf.size();
+void ByteBuffer::replace(uint8_t key, uint8_t rep, unsigned int start, bool firstOccuranceOnly) {
+    unsigned int len = length;
     for(unsigned int i = start; i < len; i++) {
-        byte data = read<byte>(i);
+        uint8_t data = read<uint8_t>(i);
         // Wasn't actually found, bounds of buffer were exceeded
         if((key != 0) && (data == 0))
             break;
         
         // Key was found in array, perform replacement
         if(data == key) {
-            buf[i] = rep;
+            own(length);
+            block->data()[offset + i] = rep;
             if(firstOccuranceOnly)
                 return;
         }
@@ -172,21 +441,21 @@ void ByteBuffer::replace(byte key, byte rep, unsigned int start, bool firstOccur
 
 // Read Functions
 
-byte ByteBuffer::peek() {
-	return read<byte>(rpos);
+uint8_t ByteBuffer::peek() {
+	return read<uint8_t>(rpos);
 }
 
-byte ByteBuffer::get() {
-	return read<byte>();
+uint8_t ByteBuffer::get() {
+	return read<uint8_t>();
 }
 
-byte ByteBuffer::get(unsigned int index) {
-	return read<byte>(index);
+uint8_t ByteBuffer::get(unsigned int index) {
+	return read<uint8_t>(index);
 }
 
-void ByteBuffer::getBytes(byte* buf, unsigned int len) {
+void ByteBuffer::getBytes(uint8_t* buf, unsigned int len) {
 	for(unsigned int i = 0; i < len; i++) {
-		buf[i] = read<byte>();
+		buf[i] = read<uint8_t>();
 	}
 }
 
@@ -242,31 +511,27 @@ short ByteBuffer::getShort(unsigned int index) {
 // Write Functions
 
 void ByteBuffer::put(ByteBuffer* src) {
-	int len = src->size();
-	for(int i = 0; i < len; i++)
-		append<byte>(src->get(i));
+	// Take a reference first in case src is this buffer
+	ByteBuffer copy(*src);
+	if(copy.size() > 0)
+		write(copy.getData(), copy.size());
 }
 
-void ByteBuffer::put(byte b) {
-	append<byte>(b);
+void ByteBuffer::put(uint8_t b) {
+	append<uint8_t>(b);
 }
 
-void ByteBuffer::put(byte b, unsigned int index) {
-	insert<byte>(b, index);
+void ByteBuffer::put(uint8_t b, unsigned int index) {
+	insert<uint8_t>(b, index);
 }
 
-void ByteBuffer::putBytes(byte* b, unsigned int len) {
-	// Insert the data one byte at a time into the internal buffer at position i+starting index
-	for(unsigned int i = 0; i < len; i++)
-		append<byte>(b[i]);
+void ByteBuffer::putBytes(uint8_t* b, unsigned int len) {
+	write(b, len);
 }
 
-void ByteBuffer::putBytes(byte* b, unsigned int len, unsigned int index) {
+void ByteBuffer::putBytes(uint8_t* b, unsigned int len, unsigned int index) {
 	wpos = index;
-
-	// Insert the data one byte at a time into the internal buffer at position i+starting index
-	for(unsigned int i = 0; i < len; i++)
-		append<byte>(b[i]);
+	write(b, len);
 }
 
 void ByteBuffer::putChar(char value) {
@@ -327,25 +592,22 @@ std::string ByteBuffer::getName() {
 }
 
 void ByteBuffer::printAscii() {
-	unsigned int length = buf.size();
 	std::cout << "ByteBuffer " << name.c_str() << ", Length: " << length << ". ASCII Print" << std::endl;
 	for(unsigned int i = 0; i < length; i++) {
-		printf("%c ", buf[i]);
+		printf("%c ", get(i));
 	}
 	printf("\n");
 }
 
 void ByteBuffer::printHex() {
-	unsigned int length = buf.size();
 	std::cout << "ByteBuffer " << name.c_str() << ", Length: " << length << ". Hex Print" << std::endl;
 	for(unsigned int i = 0; i < length; i++) {
-		printf("0x%02x ", buf[i]);
+		printf("0x%02x ", get(i));
 	}
 	printf("\n");
 }
 
 void ByteBuffer::printPosition() {
-	unsigned int length = buf.size();
 	std::cout << "ByteBuffer " << name.c_str() << ", Length: " << length << " Read Pos: " << rpos << ". Write Pos: " << wpos << std::endl;
 }
 #endif
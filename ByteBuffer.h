@@ -24,8 +24,13 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <stdint.h>
+#include <atomic>
+#include <new>
 #include <vector>
 
+#include "ByteCodec.h"
+
 #ifdef BB_UTILITY
 #include <iostream>
 #include <stdio.h>
@@ -33,12 +38,56 @@
 
 using namespace std;
 
-typedef unsigned char byte;
+#define BB_POOL_CLASSES 9 // Pooled block sizes: 256 bytes to 64KB in powers of two
+#define BB_POOL_MIN 256
+#define BB_POOL_KEEP 32 // Free blocks kept per size class
+
+class ByteBlockPool;
+
+/**
+ * Byte Block
+ * Backing storage shared by every ByteBuffer that views it. The data follows the header in the same allocation
+ */
+struct ByteBlock {
+	atomic<unsigned int> refs;
+	unsigned int capacity;
+	ByteBlockPool* pool; // Pool of the thread that allocated the block, NULL if it was too large to pool
+	ByteBlock* next; // Free list link while pooled
+
+	uint8_t* data() {
+		return (uint8_t*)(this + 1);
+	}
+};
+
+/**
+ * Byte Block Pool
+ * Per thread free lists of blocks by size class. A block whose last reference is dropped on the thread that allocated it goes back
+ * on that thread's list, one dropped anywhere else is freed, so the lists are never shared and need no locking
+ */
+class ByteBlockPool {
+private:
+	ByteBlock* lists[BB_POOL_CLASSES];
+	unsigned int count[BB_POOL_CLASSES];
+
+	static thread_local ByteBlockPool local;
+
+	static void dispose(ByteBlock* b);
+
+public:
+	ByteBlockPool();
+	~ByteBlockPool();
+
+	static ByteBlock* alloc(unsigned int capacity);
+	static void release(ByteBlock* b);
+	static unsigned int pooled(unsigned int capacity); // Free blocks the calling thread holds in capacity's size class
+};
 
 class ByteBuffer {
 private:
 	unsigned int rpos, wpos;
-	vector<byte> buf;
+	ByteBlock* block; // Shared storage, NULL until something is written
+	unsigned int offset; // Start of this buffer's view in the block
+	unsigned int length; // Length of the view
 
 #ifdef BB_UTILITY
 	string name;
@@ -51,46 +100,89 @@ private:
 	}
 	
 	template <typename T> T read(unsigned int index) const {
-		if(index + sizeof(T) <= buf.size())
-			return *((T*)&buf[index]);
+		if(index + sizeof(T) <= length) {
+			T data;
+			memcpy((uint8_t*)&data, block->data() + offset + index, sizeof(T));
+			return data;
+		}
 		return 0;
 	}
 
 	template <typename T> void append(T data) {
-		unsigned int s = sizeof(data);
-
-		if (size() < (wpos + s))
-			buf.resize(wpos + s);
-		memcpy(&buf[wpos], (byte*)&data, s);
-
-		wpos += s;
+		write((uint8_t*)&data, sizeof(data));
 	}
 	
 	template <typename T> void insert(T data, unsigned int index) {
 		if((index + sizeof(data)) > size())
 			return;
 
-		memcpy(&buf[index], (byte*)&data, sizeof(data));
+		own(length);
+		memcpy(block->data() + offset + index, (uint8_t*)&data, sizeof(data));
 		wpos = index+sizeof(data);
 	}
 
+	template <typename O, typename T> Checked<T> readAs(unsigned int index) const {
+		if(block == NULL)
+			return Checked<T>{ 0, false };
+		return O::template get<T>(block->data() + offset, length, index);
+	}
+
+	template <typename O, typename T> Checked<T> takeAs() {
+		Checked<T> r = readAs<O, T>(rpos);
+		if(r.ok)
+			rpos += sizeof(T);
+		return r;
+	}
+
+	template <typename O, typename T> void appendAs(T data) {
+		uint8_t b[sizeof(T)];
+		O::template put<T>(b, data);
+		write(b, sizeof(T));
+	}
+
+	template <typename O, typename T> void insertAs(T data, unsigned int index) {
+		if(index > length || length - index < sizeof(T))
+			return;
+		own(length);
+		O::template put<T>(block->data() + offset + index, data);
+		wpos = index + sizeof(T);
+	}
+
+	void own(unsigned int need); // Copy on write: make the storage this buffer's alone with room for need bytes
+	void write(const uint8_t* b, unsigned int len); // Copy len bytes in at wpos, growing the buffer as needed
+
 public:
 	ByteBuffer(unsigned int size = 4096);
-	ByteBuffer(byte* arr, unsigned int size);
+	ByteBuffer(uint8_t* arr, unsigned int size);
+	ByteBuffer(const ByteBuffer& src); // Shares src's storage
+	ByteBuffer(const ByteBuffer& src, unsigned int start, unsigned int len); // Shares a slice of src's storage
+	ByteBuffer& operator=(const ByteBuffer& src);
 	~ByteBuffer();
 
 	unsigned int bytesRemaining(); // Number of bytes from the current read position till the end of the buffer
 	void clear(); // Clear our the vector and reset read and write positions
 	ByteBuffer* clone(); // Return a new instance of a bytebuffer with the exact same contents and the same state (rpos, wpos)
+	ByteBuffer* slice(unsigned int start, unsigned int len); // Return a new instance viewing len bytes from start, positions at 0
 	//ByteBuffer compact(); // TODO?
 	bool equals(ByteBuffer* other); // Compare if the contents are equivalent
 	void resize(unsigned int newSize);
+	uint8_t* fill(unsigned int len); // Make the buffer len bytes long and return its storage to be filled in place (recv() etc)
 	unsigned int size(); // Size of internal vector
+
+	// Contents for reading in place (send() etc). Only valid until this buffer is next written to
+	const uint8_t* getData() const {
+		return (block != NULL) ? block->data() + offset : NULL;
+	}
+
+	// True if another buffer views the same storage, a write would copy it first
+	bool isShared() const {
+		return block != NULL && block->refs.load(memory_order_acquire) > 1;
+	}
     
     // Basic Searching (Linear)
     template <typename T> int find(T key, unsigned int start=0) {
         int ret = -1;
-        unsigned int len = buf.size();
+        unsigned int len = length;
         for(unsigned int i = start; i < len; i++) {
             T data = read<T>(i);
             // Wasn't actually found, bounds of buffer were exceeded
@@ -107,14 +199,14 @@ public:
     }
     
     // Replacement
-    void replace(byte key, byte rep, unsigned int start = 0, bool firstOccuranceOnly=false);
+    void replace(uint8_t key, uint8_t rep, unsigned int start = 0, bool firstOccuranceOnly=false);
 	
 	// Read
 
-	byte peek(); // Relative peek. Reads and returns the next byte in the buffer from the current position but does not increment the read position
-	byte get(); // Relative get method. Reads the byte at the buffers current position then increments the position
-	byte get(unsigned int index); // Absolute get method. Read byte at index
-	void getBytes(byte* buf, unsigned int len); // Absolute read into array buf of length len
+	uint8_t peek(); // Relative peek. Reads and returns the next byte in the buffer from the current position but does not increment the read position
+	uint8_t get(); // Relative get method. Reads the byte at the buffers current position then increments the position
+	uint8_t get(unsigned int index); // Absolute get method. Read byte at index
+	void getBytes(uint8_t* buf, unsigned int len); // Absolute read into array buf of length len
 	char getChar(); // Relative
 	char getChar(unsigned int index); // Absolute
 	double getDouble();
@@ -131,10 +223,10 @@ public:
 	// Write
 
 	void put(ByteBuffer* src); // Relative write of the entire contents of another ByteBuffer (src)
-	void put(byte b); // Relative write
-	void put(byte b, unsigned int index); // Absolute write at index
-	void putBytes(byte* b, unsigned int len); // Relative write
-	void putBytes(byte* b, unsigned int len, unsigned int index); // Absolute write starting at index
+	void put(uint8_t b); // Relative write
+	void put(uint8_t b, unsigned int index); // Absolute write at index
+	void putBytes(uint8_t* b, unsigned int len); // Relative write
+	void putBytes(uint8_t* b, unsigned int len, unsigned int index); // Absolute write starting at index
 	void putChar(char value); // Relative
 	void putChar(char value, unsigned int index); // Absolute
 	void putDouble(double value);
@@ -148,6 +240,58 @@ public:
 	void putShort(short value);
 	void putShort(short value, unsigned int index);
 
+	// Byte order aware access to fixed width integers (ByteCodec.h). The accessors above use host byte order and read 0 past the end,
+	// these say whether the field was there. A relative read only advances the read position when it was. Absolute writes must lie
+	// within size() like the ones above
+
+	template <typename T> Checked<T> getBE() {
+		return takeAs<BigEndian, T>();
+	}
+
+	template <typename T> Checked<T> getBE(unsigned int index) const {
+		return readAs<BigEndian, T>(index);
+	}
+
+	template <typename T> Checked<T> getLE() {
+		return takeAs<LittleEndian, T>();
+	}
+
+	template <typename T> Checked<T> getLE(unsigned int index) const {
+		return readAs<LittleEndian, T>(index);
+	}
+
+	template <typename T> void putBE(T value) {
+		appendAs<BigEndian, T>(value);
+	}
+
+	template <typename T> void putBE(T value, unsigned int index) {
+		insertAs<BigEndian, T>(value, index);
+	}
+
+	template <typename T> void putLE(T value) {
+		appendAs<LittleEndian, T>(value);
+	}
+
+	template <typename T> void putLE(T value, unsigned int index) {
+		insertAs<LittleEndian, T>(value, index);
+	}
+
+	// Relative read of a whole fixed layout record (a ByteCodec.h Layout). False, with nothing read, if it isn't all there
+	template <typename L> bool getRecord(typename L::Struct* out) {
+		if(block == NULL || rpos > length || !L::decode(block->data() + offset + rpos, length - rpos, out))
+			return false;
+		rpos += L::size;
+		return true;
+	}
+
+	// Relative write of a fixed layout record
+	template <typename L> void putRecord(const typename L::Struct& in) {
+		uint8_t b[L::size];
+		memset(b, 0, sizeof(b));
+		L::encode(in, b);
+		write(b, L::size);
+	}
+
 	// Buffer Position Accessors & Mutators
 
 	void setReadPos(unsigned int r) {
@@ -0,0 +1,290 @@
+/**
+   tcp_proxy
+   ByteBufferTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// ByteBuffer copy on write test. Copies, clones and slices must view the same block without copying it, and a write through any of
+// them must copy the view first and leave the others as they were. A block whose last reference is dropped on the thread that
+// allocated it goes back on that thread's pool, one dropped on another thread is freed and lands in no pool. fill() on a shared or
+// too small block must hand back storage of its own without copying the old contents into it. Built with AddressSanitizer (see the
+// Makefile) so touching a block past its end or after its last release fails the test.
+// Usage: bytebuffertest
+// Exits non-zero if any case failed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ByteBuffer.h"
+
+using namespace std;
+
+static int cases = 0, failed = 0;
+
+static void check(bool ok, const char* what) {
+	cases++;
+	if(!ok) {
+		failed++;
+		printf("bytebuffertest: FAILED %s\n", what);
+	}
+}
+
+static void pattern(uint8_t* p, unsigned int len, uint8_t seed) {
+	for(unsigned int i = 0; i < len; i++)
+		p[i] = (uint8_t)(i * 7 + seed);
+}
+
+static bool hasPattern(const uint8_t* p, unsigned int len, uint8_t seed) {
+	for(unsigned int i = 0; i < len; i++) {
+		if(p[i] != (uint8_t)(i * 7 + seed))
+			return false;
+	}
+	return true;
+}
+
+// A buffer of len patterned bytes
+static ByteBuffer* makeBuffer(unsigned int len, uint8_t seed) {
+	ByteBuffer* b = new ByteBuffer(len);
+	pattern(b->fill(len), len, seed);
+	return b;
+}
+
+static void testCopy() {
+	ByteBuffer* a = makeBuffer(1000, 1);
+	ByteBuffer* c = a->clone();
+	check(c->getData() == a->getData(), "clone shares the block");
+	check(a->isShared() && c->isShared(), "clone and original are shared");
+	check(c->equals(a), "clone equals the original");
+
+	// A write through the clone copies it, the original keeps its bytes and block
+	const uint8_t* before = a->getData();
+	c->put(0xee, 10);
+	check(c->getData() != a->getData(), "write through a clone copies it");
+	check(a->getData() == before && hasPattern(a->getData(), 1000, 1), "original untouched by a write through its clone");
+	check(c->get(10) == 0xee && c->get(9) == a->get(9) && c->get(11) == a->get(11), "clone keeps the rest of the contents");
+	check(!a->isShared() && !c->isShared(), "neither is shared after the copy");
+
+	// Sole owner again: writes go in place
+	c->put(0xdd, 20);
+	check(c->get(20) == 0xdd, "write to a sole owner");
+	const uint8_t* own = c->getData();
+	c->put(0xcc, 30);
+	check(c->getData() == own, "write to a sole owner stays in place");
+
+	// Assignment shares too, and drops what the target had
+	ByteBuffer d(16);
+	d.putInt(42);
+	d = *a;
+	check(d.getData() == a->getData() && a->isShared(), "assignment shares the block");
+	d.clear();
+	check(!a->isShared() && hasPattern(a->getData(), 1000, 1), "clear() leaves shared contents to the other holder");
+
+	delete c;
+	delete a;
+}
+
+static void testSlice() {
+	ByteBuffer* a = makeBuffer(4000, 2);
+	ByteBuffer* s = a->slice(100, 200);
+	check(s->size() == 200 && s->getData() == a->getData() + 100, "slice views the block in place");
+	check(s->isShared(), "slice is shared");
+	check(s->get(0) == a->get(100) && s->get(199) == a->get(299), "slice contents");
+	check(s->get(200) == 0, "read past the end of a slice");
+	check(!s->getBE<uint32_t>(198).ok, "checked read past the end of a slice");
+
+	// Slice of a slice, and clipping to the end
+	ByteBuffer* ss = s->slice(50, 1000);
+	check(ss->size() == 150 && ss->getData() == a->getData() + 150, "slice of a slice is clipped and in place");
+	ByteBuffer* past = a->slice(5000, 10);
+	check(past->size() == 0 && past->getData() == NULL && !past->isShared(), "slice past the end is empty and shares nothing");
+
+	// Writes through the slice copy just the slice
+	s->put(0xaa, 0);
+	check(s->getData() != a->getData() + 100 && s->get(0) == 0xaa && s->size() == 200, "write through a slice copies it");
+	check(hasPattern(a->getData(), 4000, 2), "original untouched by a write through a slice");
+	check(ss->getData() == a->getData() + 150, "other slices still view the original");
+
+	// Writes through the original copy the original, slices keep the old bytes
+	const uint8_t* old = a->getData();
+	a->put(0xbb, 160);
+	check(a->getData() != old && a->get(160) == 0xbb, "write to a sliced original copies it");
+	check(ss->get(10) == (uint8_t)(160 * 7 + 2), "slice keeps the bytes from before the write");
+
+	// Appending to a slice copies it rather than writing over the bytes after it in the shared block
+	ByteBuffer* t = a->slice(0, 10);
+	t->setWritePos(10);
+	t->put(0x11);
+	check(t->size() == 11 && a->get(10) == (uint8_t)(10 * 7 + 2), "append to a slice leaves the block alone");
+
+	delete t;
+	delete past;
+	delete ss;
+	delete s;
+	delete a;
+}
+
+static void testOwnShared() {
+	// Every write path copies a shared view first
+	ByteBuffer* a = makeBuffer(64, 3);
+	struct { const char* name; void (*write)(ByteBuffer*); } writes[] = {
+		{ "put at index", [](ByteBuffer* b) { b->put(1, 5); } },
+		{ "putInt at index", [](ByteBuffer* b) { b->putInt(1, 8); } },
+		{ "putBE at index", [](ByteBuffer* b) { b->putBE<uint32_t>(1, 8); } },
+		{ "putBytes at index", [](ByteBuffer* b) { uint8_t x[4] = { 1, 2, 3, 4 }; b->putBytes(x, 4, 0); } },
+		{ "append", [](ByteBuffer* b) { b->setWritePos(64); b->putShort(7); } },
+		{ "replace", [](ByteBuffer* b) { b->replace(3, 0); } },
+		{ "resize", [](ByteBuffer* b) { b->resize(128); } },
+		{ "fill", [](ByteBuffer* b) { memset(b->fill(64), 0, 64); } },
+	};
+	for(unsigned int i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+		ByteBuffer* c = a->clone();
+		writes[i].write(c);
+		char what[64];
+		snprintf(what, sizeof(what), "%s on a shared block copies it", writes[i].name);
+		check(c->getData() != a->getData() && !a->isShared() && hasPattern(a->getData(), 64, 3), what);
+		delete c;
+	}
+	delete a;
+}
+
+static void* dropOnThread(void* arg) {
+	ByteBuffer* b = (ByteBuffer*)arg;
+	unsigned int before = ByteBlockPool::pooled(4096);
+	delete b;
+	return (void*)(long)(ByteBlockPool::pooled(4096) == before);
+}
+
+static void* poolThread(void* arg) {
+	// A fresh thread starts with an empty pool
+	check(ByteBlockPool::pooled(4096) == 0, "new thread's pool is empty");
+
+	// Dropped on the owning thread: back on its pool, and the next allocation of that size takes it
+	ByteBuffer* a = makeBuffer(4096, 4);
+	const uint8_t* block = a->getData();
+	ByteBuffer* c = a->clone();
+	delete a;
+	check(ByteBlockPool::pooled(4096) == 0, "block with a reference left isn't pooled");
+	delete c;
+	check(ByteBlockPool::pooled(4096) == 1, "last reference dropped on the owning thread pools the block");
+	ByteBuffer* b = new ByteBuffer(4096);
+	check(ByteBlockPool::pooled(4096) == 0 && b->fill(4096) == block, "allocation reuses the pooled block");
+	delete b;
+
+	// Dropped on another thread: freed there, neither pool gets it
+	a = makeBuffer(4096, 5);
+	c = a->clone();
+	unsigned int before = ByteBlockPool::pooled(4096);
+	delete a;
+	pthread_t t;
+	void* r;
+	pthread_create(&t, NULL, dropOnThread, c);
+	pthread_join(t, &r);
+	check(r != NULL, "last reference dropped on a foreign thread doesn't go on its pool");
+	check(ByteBlockPool::pooled(4096) == before, "nor back on the owning thread's pool");
+
+	// A clone dropped first on the foreign thread leaves the block to the owner, which pools it
+	a = makeBuffer(4096, 6);
+	pthread_create(&t, NULL, dropOnThread, a->clone());
+	pthread_join(t, &r);
+	check(!a->isShared() && hasPattern(a->getData(), 4096, 6), "foreign thread dropping a clone leaves the owner's contents");
+	delete a;
+	check(ByteBlockPool::pooled(4096) == before + 1, "owner pools the block after the foreign clone is gone");
+
+	// The pool keeps at most BB_POOL_KEEP blocks per class
+	ByteBuffer* many[BB_POOL_KEEP + 8];
+	for(int i = 0; i < BB_POOL_KEEP + 8; i++)
+		many[i] = new ByteBuffer(4096);
+	for(int i = 0; i < BB_POOL_KEEP + 8; i++)
+		delete many[i];
+	check(ByteBlockPool::pooled(4096) == BB_POOL_KEEP, "pool is capped at BB_POOL_KEEP blocks");
+	check(ByteBlockPool::pooled(1 << 20) == 0, "blocks too large for a size class aren't pooled");
+	return NULL;
+}
+
+static void testPool() {
+	pthread_t t;
+	pthread_create(&t, NULL, poolThread, NULL);
+	pthread_join(t, NULL);
+}
+
+static void* fillThread(void* arg) {
+	// Shared block: fill() takes storage of its own. Seed the pool with a marked block so it's the one handed out, contents of the
+	// shared block showing up in it would mean they were copied
+	ByteBuffer* a = makeBuffer(4096, 7);
+	ByteBuffer* c = a->clone();
+	ByteBuffer* marker = new ByteBuffer(4096);
+	memset(marker->fill(4096), 0x5a, 4096);
+	uint8_t* mark = marker->fill(4096);
+	delete marker;
+	uint8_t* p = a->fill(4096);
+	check(p == mark && p != c->getData(), "fill() on a shared block takes new storage");
+	check(p[0] == 0x5a && p[2048] == 0x5a && p[4095] == 0x5a, "fill() on a shared block doesn't copy the old contents");
+	check(hasPattern(c->getData(), 4096, 7) && !c->isShared(), "fill() leaves the other holder's contents");
+	memset(p, 0, 4096);
+	check(hasPattern(c->getData(), 4096, 7), "writes into filled storage don't reach the other holder");
+	delete c;
+
+	// Sole owner with room: in place
+	uint8_t* q = a->fill(1000);
+	check(q == p && a->size() == 1000, "fill() on a sole owner with room stays in place");
+	check(a->fill(4096) == p && a->size() == 4096, "fill() back up to the capacity stays in place");
+
+	// Sole owner too small: grows into a fresh block without a copy
+	marker = new ByteBuffer(8192);
+	memset(marker->fill(8192), 0x3c, 8192);
+	mark = marker->fill(8192);
+	delete marker;
+	pattern(a->fill(4096), 4096, 8);
+	p = a->fill(8192);
+	check(p == mark && p[0] == 0x3c && p[4095] == 0x3c, "fill() past the capacity doesn't copy the old contents");
+
+	// Slice: fill() replaces the view and leaves the bytes after it in the block
+	ByteBuffer* whole = makeBuffer(4096, 9);
+	ByteBuffer* s = whole->slice(0, 100);
+	memset(s->fill(200), 0, 200);
+	check(hasPattern(whole->getData(), 4096, 9), "fill() on a slice doesn't write into the block it views");
+	check(s->size() == 200, "fill() on a slice sizes it");
+
+	// Trimmed by resize() after a short read, positions reset
+	a->setReadPos(5);
+	a->fill(8192);
+	a->resize(10);
+	check(a->size() == 10 && a->getReadPos() == 0, "resize() trims a filled buffer");
+
+	delete s;
+	delete whole;
+	delete a;
+	return NULL;
+}
+
+static void testFill() {
+	// On a thread of its own so the pool holds only what the test puts there
+	pthread_t t;
+	pthread_create(&t, NULL, fillThread, NULL);
+	pthread_join(t, NULL);
+}
+
+int main(int argc, const char* argv[]) {
+	testCopy();
+	testSlice();
+	testOwnShared();
+	testPool();
+	testFill();
+
+	printf("bytebuffertest: %i checks, %i failed\n", cases, failed);
+	return (failed == 0) ? 0 : 1;
+}
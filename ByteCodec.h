@@ -0,0 +1,167 @@
+/**
+   tcp_proxy
+   ByteCodec.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BYTECODEC_H_
+#define BYTECODEC_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <bit>
+#include <type_traits>
+
+using namespace std;
+
+/**
+ * Checked
+ * Result of a read that can run past the end of the data. ok is false then and value is 0, so a missing field can't pass for a zero
+ */
+template <typename T> struct Checked {
+	T value;
+	bool ok;
+
+	explicit operator bool() const {
+		return ok;
+	}
+};
+
+/**
+ * Byte Order
+ * Loads and stores of fixed width integers in a given byte order, at any alignment. At run time a field is moved with memcpy(),
+ * which compiles to a single unaligned load or store, plus a bswap when the order differs from the host's. In constant expressions
+ * the bytes are composed one at a time instead. A field narrower than its integer type (N < sizeof(T), TLS' 24 bit lengths) is
+ * always composed byte by byte and zero extended
+ */
+template <bool Big> struct ByteOrder {
+	static constexpr bool swaps = (Big != (endian::native == endian::big));
+
+	template <typename T> static constexpr T swap(T v) {
+		if constexpr (sizeof(T) == 2)
+			return (T)__builtin_bswap16((uint16_t)v);
+		else if constexpr (sizeof(T) == 4)
+			return (T)__builtin_bswap32((uint32_t)v);
+		else if constexpr (sizeof(T) == 8)
+			return (T)__builtin_bswap64((uint64_t)v);
+		else
+			return v;
+	}
+
+	template <typename T, unsigned int N = sizeof(T)> static constexpr T get(const uint8_t* p) {
+		static_assert(is_integral<T>::value, "ByteOrder: only integers have a byte order");
+		static_assert(N >= 1 && N <= sizeof(T), "ByteOrder: field wider than its type");
+		if constexpr (N == sizeof(T)) {
+			if(!is_constant_evaluated()) {
+				T v;
+				memcpy(&v, p, sizeof(T));
+				return swaps ? swap(v) : v;
+			}
+		}
+		typedef typename make_unsigned<T>::type U;
+		U v = 0;
+		for(unsigned int i = 0; i < N; i++)
+			v = (U)((v << 8) | p[Big ? i : N - 1 - i]);
+		return (T)v;
+	}
+
+	template <typename T, unsigned int N = sizeof(T)> static constexpr void put(uint8_t* p, T value) {
+		static_assert(is_integral<T>::value, "ByteOrder: only integers have a byte order");
+		static_assert(N >= 1 && N <= sizeof(T), "ByteOrder: field wider than its type");
+		if constexpr (N == sizeof(T)) {
+			if(!is_constant_evaluated()) {
+				T v = swaps ? swap(value) : value;
+				memcpy(p, &v, sizeof(T));
+				return;
+			}
+		}
+		typedef typename make_unsigned<T>::type U;
+		U v = (U)value;
+		for(unsigned int i = 0; i < N; i++) {
+			p[Big ? N - 1 - i : i] = (uint8_t)v;
+			v = (U)(v >> 8);
+		}
+	}
+
+	// Bounds checked load of the field at index in a len byte buffer
+	template <typename T, unsigned int N = sizeof(T)> static constexpr Checked<T> get(const uint8_t* p, unsigned int len, unsigned int index) {
+		if(index > len || len - index < N)
+			return Checked<T>{ 0, false };
+		return Checked<T>{ get<T, N>(p + index), true };
+	}
+};
+
+typedef ByteOrder<true> BigEndian; // Network byte order
+typedef ByteOrder<false> LittleEndian;
+
+// Struct and type of a pointer to data member
+template <typename M> struct MemberOf;
+template <typename S, typename T> struct MemberOf<T S::*> {
+	typedef S Struct;
+	typedef T Type;
+};
+
+/**
+ * Field
+ * One integer member of a fixed layout record: where it sits on the wire, how wide it is there and in what byte order
+ *
+ * Member: pointer to the struct member, Order: BigEndian or LittleEndian, Offset: byte offset on the wire, Bytes: width on the wire
+ */
+template <auto Member, typename Order, unsigned int Offset, unsigned int Bytes = sizeof(typename MemberOf<decltype(Member)>::Type)>
+struct Field {
+	typedef typename MemberOf<decltype(Member)>::Struct Struct;
+	typedef typename MemberOf<decltype(Member)>::Type Type;
+	static constexpr unsigned int end = Offset + Bytes;
+
+	static constexpr void decode(const uint8_t* p, Struct* s) {
+		s->*Member = Order::template get<Type, Bytes>(p + Offset);
+	}
+
+	static constexpr void encode(const Struct& s, uint8_t* p) {
+		Order::template put<Type, Bytes>(p + Offset, s.*Member);
+	}
+};
+
+/**
+ * Layout
+ * A fixed layout record declared as its Fields. decode() checks the length once for the whole record, then every field is a single
+ * load (and bswap) straight into the struct member, there is no loop or table at run time
+ *
+ *   struct Header { uint32_t id; uint8_t type; uint16_t len; };
+ *   typedef Layout<Field<&Header::id, BigEndian, 0>, Field<&Header::type, BigEndian, 4>, Field<&Header::len, BigEndian, 6> > HeaderLayout;
+ */
+template <typename First, typename... Rest> struct Layout {
+	typedef typename First::Struct Struct;
+	static_assert((is_same<Struct, typename Rest::Struct>::value && ...), "Layout: fields of different structs");
+
+	static constexpr unsigned int size = max({ First::end, Rest::end... });
+
+	static constexpr bool decode(const uint8_t* p, unsigned int len, Struct* out) {
+		if(len < size)
+			return false;
+		First::decode(p, out);
+		(Rest::decode(p, out), ...);
+		return true;
+	}
+
+	// Writes size bytes at p. Bytes no field covers are left as they are
+	static constexpr void encode(const Struct& in, uint8_t* p) {
+		First::encode(in, p);
+		(Rest::encode(in, p), ...);
+	}
+};
+
+#endif
@@ -0,0 +1,152 @@
+/**
+   tcp_proxy
+   ClientHello.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "ClientHello.h"
+
+// TLS constants used by the parser
+#define TLS_HANDSHAKE 22
+#define TLS_CLIENT_HELLO 1
+#define TLS_EXT_SERVER_NAME 0
+#define TLS_EXT_ALPN 16
+#define TLS_SNI_HOST_NAME 0
+
+/**
+ * ClientHello Constructor
+ */
+ClientHello::ClientHello() {
+	sni = NULL;
+	sniLen = 0;
+	alpn = NULL;
+	alpnLen = 0;
+	needed = 0;
+}
+
+/**
+ * Parse
+ * Parse the ClientHello at the start of data. Every length field is checked against the end of the enclosing structure before it is
+ * used, so a hostile hello can't make the parser read past len
+ *
+ * @param data Bytes received so far
+ * @param len Length of data
+ * @return HELLO_OK, HELLO_NEED_MORE or HELLO_INVALID
+ */
+int ClientHello::parse(const uint8_t* data, unsigned int len) {
+	sni = NULL;
+	alpn = NULL;
+	sniLen = alpnLen = 0;
+
+	// Record header: type, version, length
+	if(len < 5) {
+		needed = 5;
+		return HELLO_NEED_MORE;
+	}
+	if(data[0] != TLS_HANDSHAKE || data[1] != 3)
+		return HELLO_INVALID;
+	unsigned int recLen = BigEndian::get<uint16_t>(data + 3);
+	if(recLen > HELLO_MAX_RECORD || recLen < 4)
+		return HELLO_INVALID;
+	if(len < 5 + recLen) {
+		needed = 5 + recLen;
+		return HELLO_NEED_MORE;
+	}
+
+	const uint8_t* p = data + 5;
+	const uint8_t* end = p + recLen;
+
+	// Handshake header: type, 24 bit length. Hellos spanning several records aren't supported
+	if(p[0] != TLS_CLIENT_HELLO)
+		return HELLO_INVALID;
+	unsigned int hsLen = BigEndian::get<uint32_t, 3>(p + 1);
+	p += 4;
+	if(hsLen > (unsigned int)(end - p))
+		return HELLO_INVALID;
+	end = p + hsLen;
+
+	// client_version, random
+	if(end - p < 34)
+		return HELLO_INVALID;
+	p += 34;
+
+	// session_id
+	if(end - p < 1 || end - p < 1 + p[0])
+		return HELLO_INVALID;
+	p += 1 + p[0];
+
+	// cipher_suites
+	if(end - p < 2)
+		return HELLO_INVALID;
+	unsigned int n = BigEndian::get<uint16_t>(p);
+	if((unsigned int)(end - p) < 2 + n)
+		return HELLO_INVALID;
+	p += 2 + n;
+
+	// compression_methods
+	if(end - p < 1 || end - p < 1 + p[0])
+		return HELLO_INVALID;
+	p += 1 + p[0];
+
+	// No extensions at all
+	if(p == end)
+		return HELLO_OK;
+
+	if(end - p < 2)
+		return HELLO_INVALID;
+	n = BigEndian::get<uint16_t>(p);
+	p += 2;
+	if((unsigned int)(end - p) < n)
+		return HELLO_INVALID;
+	end = p + n;
+
+	while(end - p >= 4) {
+		unsigned int type = BigEndian::get<uint16_t>(p);
+		unsigned int extLen = BigEndian::get<uint16_t>(p + 2);
+		p += 4;
+		if((unsigned int)(end - p) < extLen)
+			return HELLO_INVALID;
+		const uint8_t* ext = p;
+		const uint8_t* extEnd = p + extLen;
+		p = extEnd;
+
+		if(type == TLS_EXT_SERVER_NAME && extEnd - ext >= 2) {
+			// server_name_list: (name_type, 16 bit length, name)*
+			ext += 2;
+			while(extEnd - ext >= 3) {
+				unsigned int nameType = ext[0];
+				unsigned int nameLen = BigEndian::get<uint16_t>(ext + 1);
+				ext += 3;
+				if((unsigned int)(extEnd - ext) < nameLen)
+					return HELLO_INVALID;
+				if(nameType == TLS_SNI_HOST_NAME && sni == NULL) {
+					sni = (const char*)ext;
+					sniLen = nameLen;
+				}
+				ext += nameLen;
+			}
+		} else if(type == TLS_EXT_ALPN && extEnd - ext >= 3) {
+			// protocol_name_list: (8 bit length, name)*, only the client's first preference is kept
+			ext += 2;
+			unsigned int protoLen = ext[0];
+			if(protoLen > 0 && (unsigned int)(extEnd - ext - 1) >= protoLen) {
+				alpn = (const char*)ext + 1;
+				alpnLen = protoLen;
+			}
+		}
+	}
+
+	return HELLO_OK;
+}
@@ -0,0 +1,53 @@
+/**
+   tcp_proxy
+   ClientHello.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef CLIENTHELLO_H_
+#define CLIENTHELLO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ByteCodec.h"
+
+// ClientHello::parse() results
+#define HELLO_OK 0 // The hello was parsed, sni/alpn are set if the client sent them
+#define HELLO_NEED_MORE 1 // More data is needed, the hello is complete once `needed` bytes have arrived
+#define HELLO_INVALID 2 // Not a TLS handshake, malformed, or a hello spread over several records
+
+// Largest TLS record payload
+#define HELLO_MAX_RECORD 16384
+
+/**
+ * Client Hello
+ * Bounded parser for the first TLS record of a connection. Nothing is copied, sni and alpn point into the caller's buffer
+ */
+class ClientHello {
+public:
+	const char* sni; // server_name (host_name entry), NULL if absent
+	unsigned int sniLen;
+	const char* alpn; // First protocol of the application_layer_protocol_negotiation extension, NULL if absent
+	unsigned int alpnLen;
+	unsigned int needed; // Bytes needed in total when parse() returns HELLO_NEED_MORE
+
+public:
+	ClientHello();
+
+	int parse(const uint8_t* data, unsigned int len);
+};
+
+#endif
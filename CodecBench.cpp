@@ -0,0 +1,200 @@
+/**
+   tcp_proxy
+   CodecBench.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Field decoding benchmark: the byte order aware accessors of ByteCodec.h against the ByteBuffer accessors and the hand written
+// shifts they replace. Decodes big endian 32 bit fields at unaligned offsets, then 8 byte frame headers laid out like the tunnel's
+// Usage: codecbench [-n fields] [-r rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "ByteBuffer.h"
+#include "ByteCodec.h"
+
+using namespace std;
+
+// The codec also works in constant expressions
+static constexpr uint8_t known[] = { 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0 };
+static_assert(BigEndian::get<uint16_t>(known) == 0x1234, "codecbench: big endian 16 bit load");
+static_assert(LittleEndian::get<uint32_t>(known) == 0x78563412, "codecbench: little endian 32 bit load");
+static_assert(BigEndian::get<uint32_t, 3>(known) == 0x123456, "codecbench: 24 bit load");
+static_assert(BigEndian::get<uint64_t>(known) == 0x123456789abcdef0ULL, "codecbench: 64 bit load");
+static_assert(!BigEndian::get<uint32_t>(known, sizeof(known), 6).ok, "codecbench: checked load past the end");
+
+struct Header {
+	uint32_t id;
+	uint8_t type;
+	uint8_t flags;
+	uint16_t len;
+};
+
+typedef Layout<Field<&Header::id, BigEndian, 0>, Field<&Header::type, BigEndian, 4>, Field<&Header::flags, BigEndian, 5>,
+	Field<&Header::len, BigEndian, 6> > HeaderLayout;
+
+static double nowNs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Keeps the compiler from dropping the loops
+static volatile uint64_t sink;
+
+static void report(const char* name, const char* unit, double ns, unsigned long ops, uint64_t sum, uint64_t expect, bool* ok) {
+	printf("%-28s %6.2f ns/%s%s\n", name, ns / ops, unit, (sum == expect) ? "" : "  WRONG RESULT");
+	if(sum != expect)
+		*ok = false;
+	sink = sum;
+}
+
+int main(int argc, const char* argv[]) {
+	unsigned int fields = 4096;
+	unsigned int rounds = 2000;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			fields = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			rounds = atoi(argv[++i]);
+		else {
+			printf("Usage: %s [-n fields] [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(fields == 0 || rounds == 0) {
+		printf("Usage: %s [-n fields] [-r rounds]\n", argv[0]);
+		return 1;
+	}
+
+	// One byte of padding in front so every field is misaligned
+	unsigned int len = 1 + fields * 4;
+	uint8_t* raw = new uint8_t[len];
+	srand(1);
+	for(unsigned int i = 0; i < len; i++)
+		raw[i] = rand();
+	ByteBuffer bb(raw, len);
+	const uint8_t* data = raw + 1;
+	unsigned long ops = (unsigned long)fields * rounds;
+
+	uint64_t expect = 0;
+	for(unsigned int i = 0; i < fields; i++)
+		expect += ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) | ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+	expect *= rounds;
+
+	printf("codecbench: %u big endian 32 bit fields at odd offsets, %u rounds\n", fields, rounds);
+	bool ok = true;
+	uint64_t sum;
+	double t;
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < fields; i++)
+			sum += (uint32_t)ntohl(bb.getInt(1 + i * 4));
+	}
+	report("ByteBuffer::getInt + ntohl", "field", nowNs() - t, ops, sum, expect, &ok);
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < fields; i++) {
+			const uint8_t* p = data + i * 4;
+			sum += ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+		}
+	}
+	report("shifts", "field", nowNs() - t, ops, sum, expect, &ok);
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < fields; i++)
+			sum += BigEndian::get<uint32_t>(data + i * 4);
+	}
+	report("BigEndian::get", "field", nowNs() - t, ops, sum, expect, &ok);
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < fields; i++) {
+			Checked<uint32_t> v = BigEndian::get<uint32_t>(data, len - 1, i * 4);
+			if(v)
+				sum += v.value;
+		}
+	}
+	report("BigEndian::get checked", "field", nowNs() - t, ops, sum, expect, &ok);
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < fields; i++) {
+			Checked<uint32_t> v = bb.getBE<uint32_t>(1 + i * 4);
+			if(v)
+				sum += v.value;
+		}
+	}
+	report("ByteBuffer::getBE", "field", nowNs() - t, ops, sum, expect, &ok);
+
+	// Frame headers: 8 bytes each, id, type, flags and length
+	unsigned int headers = fields / 2;
+	expect = 0;
+	for(unsigned int i = 0; i < headers; i++) {
+		const uint8_t* p = data + i * 8;
+		expect += (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]) + p[4] + p[5] + ((p[6] << 8) | p[7]);
+	}
+	expect *= rounds;
+	ops = (unsigned long)headers * rounds;
+	printf("\ncodecbench: %u frame headers\n", headers);
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < headers; i++) {
+			const uint8_t* p = data + i * 8;
+			uint32_t id = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+			unsigned int plen = (p[6] << 8) | p[7];
+			sum += id + p[4] + p[5] + plen;
+		}
+	}
+	report("shifts", "header", nowNs() - t, ops, sum, expect, &ok);
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < headers; i++) {
+			Header h;
+			if(HeaderLayout::decode(data + i * 8, len - 1 - i * 8, &h))
+				sum += h.id + h.type + h.flags + h.len;
+		}
+	}
+	report("Layout::decode", "header", nowNs() - t, ops, sum, expect, &ok);
+
+	sum = 0;
+	t = nowNs();
+	for(unsigned int r = 0; r < rounds; r++) {
+		bb.setReadPos(1);
+		Header h;
+		while(bb.getRecord<HeaderLayout>(&h))
+			sum += h.id + h.type + h.flags + h.len;
+	}
+	report("ByteBuffer::getRecord", "header", nowNs() - t, ops, sum, expect, &ok);
+
+	delete [] raw;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,316 @@
+/**
+   tcp_proxy
+   CodecTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// ByteCodec.h round trip test. Every width is stored and loaded in both byte orders at every alignment and checked against the
+// bytes composed by hand; fields narrower than their type (24 bit lengths) must zero extend and write only their own bytes. Checked
+// reads are tried at every index around the end of buffers of every small length, directly and through ByteBuffer, and fixed layouts
+// must encode to the expected wire bytes, decode back, and refuse a short record without touching the output. Built with
+// AddressSanitizer (see the Makefile) so a read past the end fails the test.
+// Usage: codectest
+// Exits non-zero if any case failed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <vector>
+
+#include "ByteBuffer.h"
+#include "ByteCodec.h"
+
+using namespace std;
+
+static int cases = 0, failed = 0;
+
+static void check(bool ok, const char* what) {
+	cases++;
+	if(!ok) {
+		failed++;
+		printf("codectest: FAILED %s\n", what);
+	}
+}
+
+static uint64_t rnd = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t nextRand() {
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	return rnd;
+}
+
+// The n low bytes of v as they should appear on the wire
+static void reference(uint8_t* out, uint64_t v, unsigned int n, bool big) {
+	for(unsigned int i = 0; i < n; i++)
+		out[big ? n - 1 - i : i] = (uint8_t)(v >> (8 * i));
+}
+
+/*
+ * Widths and byte orders
+ */
+
+template <typename Order, typename T, unsigned int N> static void roundTrip(const char* name, bool big) {
+	typedef typename make_unsigned<T>::type U;
+	const U mask = (N == sizeof(T)) ? (U)~(U)0 : (U)(((U)1 << (8 * N)) - 1);
+	char what[96];
+	int before = failed;
+	for(int round = 0; round < 200; round++) {
+		U v = (U)nextRand();
+		if(round < 4)
+			v = (round == 0) ? 0 : (round == 1) ? (U)~(U)0 : (round == 2) ? (U)1 : (U)((U)1 << (8 * sizeof(T) - 1));
+		for(unsigned int off = 0; off < 8; off++) {
+			// Guard bytes on both sides catch a store wider than the field
+			uint8_t buf[32], want[32];
+			memset(buf, 0xa5, sizeof(buf));
+			memset(want, 0xa5, sizeof(want));
+			reference(want + 8 + off, (uint64_t)v, N, big);
+			Order::template put<T, N>(buf + 8 + off, (T)v);
+			snprintf(what, sizeof(what), "%s put, offset %u", name, off);
+			if(memcmp(buf, want, sizeof(buf)) != 0) {
+				check(false, what);
+				return;
+			}
+			T got = Order::template get<T, N>(buf + 8 + off);
+			snprintf(what, sizeof(what), "%s get, offset %u", name, off);
+			if((U)got != (U)(v & mask)) {
+				check(false, what);
+				return;
+			}
+		}
+	}
+	snprintf(what, sizeof(what), "%s round trip", name);
+	check(failed == before, what);
+}
+
+static void testWidths() {
+	roundTrip<BigEndian, uint8_t, 1>("BE uint8", true);
+	roundTrip<BigEndian, uint16_t, 2>("BE uint16", true);
+	roundTrip<BigEndian, uint32_t, 4>("BE uint32", true);
+	roundTrip<BigEndian, uint64_t, 8>("BE uint64", true);
+	roundTrip<BigEndian, int16_t, 2>("BE int16", true);
+	roundTrip<BigEndian, int32_t, 4>("BE int32", true);
+	roundTrip<BigEndian, int64_t, 8>("BE int64", true);
+	roundTrip<LittleEndian, uint8_t, 1>("LE uint8", false);
+	roundTrip<LittleEndian, uint16_t, 2>("LE uint16", false);
+	roundTrip<LittleEndian, uint32_t, 4>("LE uint32", false);
+	roundTrip<LittleEndian, uint64_t, 8>("LE uint64", false);
+	roundTrip<LittleEndian, int16_t, 2>("LE int16", false);
+	roundTrip<LittleEndian, int32_t, 4>("LE int32", false);
+	roundTrip<LittleEndian, int64_t, 8>("LE int64", false);
+
+	// Known wire bytes, and signed values keep their sign
+	uint8_t b[8] = { 0x80, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0xff };
+	check(BigEndian::get<uint16_t>(b) == 0x8001 && LittleEndian::get<uint16_t>(b) == 0x0180, "16 bit known bytes");
+	check(BigEndian::get<uint32_t>(b) == 0x80010203 && LittleEndian::get<uint32_t>(b) == 0x03020180, "32 bit known bytes");
+	check(BigEndian::get<uint64_t>(b) == 0x80010203040506ffULL && LittleEndian::get<uint64_t>(b) == 0xff06050403020180ULL,
+		"64 bit known bytes");
+	check(BigEndian::get<int16_t>(b) == -32767 && LittleEndian::get<int64_t>(b) < 0, "signed loads keep the sign");
+	BigEndian::put<int32_t>(b, -2);
+	check(b[0] == 0xff && b[1] == 0xff && b[2] == 0xff && b[3] == 0xfe, "signed store");
+}
+
+/*
+ * Narrow fields
+ */
+
+static void testNarrow() {
+	roundTrip<BigEndian, uint32_t, 3>("BE 24 bit", true);
+	roundTrip<LittleEndian, uint32_t, 3>("LE 24 bit", false);
+	roundTrip<BigEndian, uint64_t, 5>("BE 40 bit", true);
+	roundTrip<LittleEndian, uint64_t, 6>("LE 48 bit", false);
+	roundTrip<BigEndian, uint64_t, 7>("BE 56 bit", true);
+	roundTrip<BigEndian, uint16_t, 1>("BE 8 bit in 16", true);
+
+	uint8_t b[4] = { 0xff, 0xff, 0xfe, 0x77 };
+	check(BigEndian::get<uint32_t, 3>(b) == 0xfffffe, "24 bit load");
+	check(LittleEndian::get<uint32_t, 3>(b) == 0xfeffff, "24 bit little endian load");
+	check(BigEndian::get<int32_t, 3>(b) == 0xfffffe, "24 bit load into a signed type zero extends");
+
+	// High bits that don't fit are dropped, the byte after the field is left alone
+	BigEndian::put<uint32_t, 3>(b, 0xaa123456);
+	check(b[0] == 0x12 && b[1] == 0x34 && b[2] == 0x56 && b[3] == 0x77, "24 bit store drops the high byte");
+	LittleEndian::put<uint32_t, 3>(b, 0x00abcdef);
+	check(b[0] == 0xef && b[1] == 0xcd && b[2] == 0xab && b[3] == 0x77, "24 bit little endian store");
+}
+
+/*
+ * Checked reads
+ */
+
+template <typename T, unsigned int N> static void checkedAt(const char* name) {
+	char what[96];
+	int before = failed;
+	for(unsigned int len = 0; len <= 12 && failed == before; len++) {
+		// Exactly len bytes on the heap, so a read past the end is caught
+		uint8_t* buf = (uint8_t*)malloc((len > 0) ? len : 1);
+		for(unsigned int i = 0; i < len; i++)
+			buf[i] = (uint8_t)(0x11 * (i + 1));
+		for(unsigned int index = 0; index <= len + 2; index++) {
+			Checked<T> be = BigEndian::get<T, N>(buf, len, index);
+			Checked<T> le = LittleEndian::get<T, N>(buf, len, index);
+			bool fits = index + N <= len;
+			bool ok = (be.ok == fits && le.ok == fits && (bool)be == fits);
+			if(fits)
+				ok = ok && be.value == BigEndian::get<T, N>(buf + index) && le.value == LittleEndian::get<T, N>(buf + index);
+			else
+				ok = ok && be.value == 0 && le.value == 0;
+			if(!ok) {
+				snprintf(what, sizeof(what), "%s checked read, length %u index %u", name, len, index);
+				check(false, what);
+				break;
+			}
+		}
+		// An index far past the end must not wrap around the length check
+		if(BigEndian::get<T, N>(buf, len, UINT_MAX).ok || BigEndian::get<T, N>(buf, len, UINT_MAX - N + 1).ok) {
+			snprintf(what, sizeof(what), "%s checked read at a huge index, length %u", name, len);
+			check(false, what);
+		}
+		free(buf);
+	}
+	snprintf(what, sizeof(what), "%s checked reads", name);
+	check(failed == before, what);
+}
+
+static void testChecked() {
+	checkedAt<uint8_t, 1>("8 bit");
+	checkedAt<uint16_t, 2>("16 bit");
+	checkedAt<uint32_t, 3>("24 bit");
+	checkedAt<uint32_t, 4>("32 bit");
+	checkedAt<uint64_t, 8>("64 bit");
+
+	// Through ByteBuffer: a relative read that isn't all there doesn't move the read position
+	ByteBuffer bb(16);
+	bb.putBE<uint16_t>(0x1234);
+	bb.putLE<uint32_t>(0x89abcdef);
+	bb.put((uint8_t)0x42);
+	check(bb.size() == 7, "ByteBuffer typed writes");
+	Checked<uint16_t> a = bb.getBE<uint16_t>();
+	Checked<uint32_t> b = bb.getLE<uint32_t>();
+	check(a.ok && a.value == 0x1234 && b.ok && b.value == 0x89abcdef && bb.getReadPos() == 6, "ByteBuffer relative reads");
+	Checked<uint16_t> c = bb.getBE<uint16_t>();
+	check(!c.ok && c.value == 0 && bb.getReadPos() == 6, "ByteBuffer relative read past the end leaves the position");
+	check(bb.getBE<uint8_t>().value == 0x42 && bb.getReadPos() == 7, "ByteBuffer last byte");
+	check(!bb.getBE<uint8_t>().ok && bb.getReadPos() == 7, "ByteBuffer read at the end");
+	check(bb.getBE<uint32_t>(3).ok && !bb.getBE<uint32_t>(4).ok && !bb.getLE<uint64_t>(0).ok, "ByteBuffer absolute reads at the end");
+	check(!bb.getBE<uint16_t>(UINT_MAX).ok, "ByteBuffer absolute read at a huge index");
+
+	// An absolute write past the end is ignored
+	bb.putBE<uint32_t>(0xdeadbeef, 4);
+	check(bb.size() == 7 && bb.getBE<uint16_t>(4).value == 0xab89, "ByteBuffer absolute write past the end ignored");
+	bb.putBE<uint16_t>(0xbeef, 5);
+	check(bb.size() == 7 && bb.getBE<uint16_t>(5).value == 0xbeef, "ByteBuffer absolute write ending at the end");
+
+	ByteBuffer empty(0);
+	check(!empty.getBE<uint8_t>(0).ok && !empty.getLE<uint32_t>().ok, "empty ByteBuffer reads");
+}
+
+/*
+ * Layouts
+ */
+
+struct Record {
+	uint32_t id;
+	uint8_t type;
+	uint32_t length; // 24 bits on the wire
+	uint16_t port; // Little endian on the wire
+	int64_t stamp;
+};
+
+// Byte 8 is a gap no field covers
+typedef Layout<Field<&Record::id, BigEndian, 0>, Field<&Record::type, BigEndian, 4>, Field<&Record::length, BigEndian, 5, 3>,
+	Field<&Record::port, LittleEndian, 9>, Field<&Record::stamp, BigEndian, 11> > RecordLayout;
+
+static_assert(RecordLayout::size == 19, "codectest: layout size is the end of the last field");
+
+// Layouts work in constant expressions too
+static constexpr Record constDecode() {
+	constexpr uint8_t wire[19] = { 0, 0, 1, 2, 7, 0, 0x10, 0, 0, 0x50, 0, 0, 0, 0, 0, 0, 0, 0, 9 };
+	Record r = { 0, 0, 0, 0, 0 };
+	RecordLayout::decode(wire, sizeof(wire), &r);
+	return r;
+}
+static_assert(constDecode().id == 0x102 && constDecode().length == 0x1000 && constDecode().port == 0x50 && constDecode().stamp == 9,
+	"codectest: constant expression decode");
+
+static bool sameRecord(const Record& a, const Record& b) {
+	return a.id == b.id && a.type == b.type && a.length == b.length && a.port == b.port && a.stamp == b.stamp;
+}
+
+static void testLayout() {
+	Record in = { 0xdeadbeef, 0x17, 0x00abcdef, 0x1f90, -5 };
+	uint8_t wire[RecordLayout::size + 2];
+	memset(wire, 0xa5, sizeof(wire));
+	RecordLayout::encode(in, wire);
+	const uint8_t want[] = { 0xde, 0xad, 0xbe, 0xef, 0x17, 0xab, 0xcd, 0xef, 0xa5, 0x90, 0x1f,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfb, 0xa5, 0xa5 };
+	check(memcmp(wire, want, sizeof(want)) == 0, "layout encodes the expected wire bytes and leaves the gap alone");
+
+	Record out;
+	memset(&out, 0, sizeof(out));
+	check(RecordLayout::decode(wire, RecordLayout::size, &out) && sameRecord(in, out), "layout round trip");
+
+	// Random records, at every alignment
+	int before = failed;
+	for(int i = 0; i < 1000 && failed == before; i++) {
+		Record r = { (uint32_t)nextRand(), (uint8_t)nextRand(), (uint32_t)nextRand() & 0xffffff, (uint16_t)nextRand(), (int64_t)nextRand() };
+		uint8_t buf[RecordLayout::size + 8];
+		RecordLayout::encode(r, buf + i % 8);
+		Record back;
+		if(!RecordLayout::decode(buf + i % 8, RecordLayout::size, &back) || !sameRecord(r, back))
+			check(false, "layout round trip of a random record");
+	}
+	check(failed == before, "layout round trips of random records");
+
+	// A short record is refused and the output left as it was
+	for(unsigned int len = 0; len < RecordLayout::size; len++) {
+		uint8_t* exact = (uint8_t*)malloc((len > 0) ? len : 1);
+		memcpy(exact, wire, len);
+		Record keep = { 1, 2, 3, 4, 5 };
+		Record r = keep;
+		bool res = RecordLayout::decode(exact, len, &r);
+		free(exact);
+		if(res || !sameRecord(r, keep)) {
+			check(false, "layout decode of a short record");
+			break;
+		}
+	}
+
+	// Through ByteBuffer, records back to back
+	ByteBuffer bb(64);
+	Record second = { 1, 2, 3, 4, 5 };
+	bb.putRecord<RecordLayout>(in);
+	bb.putRecord<RecordLayout>(second);
+	check(bb.size() == 2 * RecordLayout::size, "ByteBuffer putRecord size");
+	check(memcmp(bb.getData(), want, RecordLayout::size - 11) == 0 && bb.getData()[8] == 0, "ByteBuffer putRecord zeroes the gap");
+	Record r1, r2, r3;
+	check(bb.getRecord<RecordLayout>(&r1) && sameRecord(in, r1), "ByteBuffer getRecord first");
+	check(bb.getRecord<RecordLayout>(&r2) && sameRecord(second, r2), "ByteBuffer getRecord second");
+	check(!bb.getRecord<RecordLayout>(&r3) && bb.getReadPos() == 2 * RecordLayout::size, "ByteBuffer getRecord at the end");
+	bb.setReadPos(RecordLayout::size + 1);
+	check(!bb.getRecord<RecordLayout>(&r3) && bb.getReadPos() == RecordLayout::size + 1, "ByteBuffer getRecord of a partial record");
+}
+
+int main(int argc, const char* argv[]) {
+	testWidths();
+	testNarrow();
+	testChecked();
+	testLayout();
+
+	printf("codectest: %i checks, %i failed\n", cases, failed);
+	return (failed == 0) ? 0 : 1;
+}
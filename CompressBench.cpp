@@ -0,0 +1,234 @@
+/**
+   tcp_proxy
+   CompressBench.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Tunnel compression benchmark. Streams representative payloads through a Compressor at each tunnel_compression setting, one
+// write at a time the way a tunnel stream does, and decodes every write with a Decompressor to check it. Reports the wire ratio
+// (raw and bypassed writes included), deflate and inflate cost per input byte, the thread CPU time of the whole run per input byte,
+// the share of bytes bypassed, and the latency each write picks up: its compress plus decompress time, mean and p99
+// Usage: compressbench [-m MB per run] [-w write size]
+// Exits non-zero if a write didn't decode back to its input
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "Compression.h"
+
+using namespace std;
+
+static double nowNs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// CPU time of the calling thread. Read once per run, it costs a syscall
+static double cpuNs() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Payloads
+ */
+
+static uint32_t rnd = 12345;
+
+static uint32_t nextRand() {
+	rnd = rnd * 1103515245 + 12345;
+	return rnd >> 8;
+}
+
+// HTTP/1.1 requests and responses with varying paths, ids and bodies
+static void makeHttp(vector<uint8_t>& out, size_t len) {
+	static const char* paths[] = { "/api/v2/orders", "/api/v2/users", "/static/app.js", "/healthz", "/api/v2/search" };
+	char buf[1024];
+	while(out.size() < len) {
+		uint32_t id = nextRand() % 100000;
+		int n = snprintf(buf, sizeof(buf), "GET %s/%u?page=%u HTTP/1.1\r\nHost: backend.internal\r\nUser-Agent: client/3.1\r\n"
+			"Accept: application/json\r\nX-Request-Id: %08x-%04x\r\n\r\n"
+			"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %u\r\nCache-Control: no-cache\r\n\r\n",
+			paths[id % 5], id, id % 7, nextRand(), nextRand() & 0xffff, 40 + id % 200);
+		out.insert(out.end(), buf, buf + n);
+	}
+	out.resize(len);
+}
+
+// JSON records, as a log shipper or API would send them
+static void makeJson(vector<uint8_t>& out, size_t len) {
+	static const char* levels[] = { "info", "warn", "error", "debug" };
+	char buf[512];
+	long ts = 1700000000000L;
+	while(out.size() < len) {
+		ts += nextRand() % 50;
+		int n = snprintf(buf, sizeof(buf), "{\"ts\":%ld,\"level\":\"%s\",\"service\":\"billing\",\"user\":%u,\"latency_ms\":%u.%u,"
+			"\"msg\":\"request completed\",\"status\":%u}\n", ts, levels[nextRand() % 4], nextRand() % 5000, nextRand() % 300,
+			nextRand() % 10, (nextRand() % 10 == 0) ? 500 : 200);
+		out.insert(out.end(), buf, buf + n);
+	}
+	out.resize(len);
+}
+
+// Fixed size binary records: increasing timestamps, small counters, a few flag bytes
+static void makeRecords(vector<uint8_t>& out, size_t len) {
+	uint64_t ts = 1700000000000000ULL;
+	while(out.size() < len) {
+		uint8_t rec[32];
+		memset(rec, 0, sizeof(rec));
+		ts += nextRand() % 1000;
+		memcpy(rec, &ts, 8);
+		uint32_t v = nextRand() % 4096;
+		memcpy(rec + 8, &v, 4);
+		rec[12] = nextRand() % 4;
+		rec[16] = 0x7f;
+		v = nextRand();
+		memcpy(rec + 20, &v, 4);
+		out.insert(out.end(), rec, rec + sizeof(rec));
+	}
+	out.resize(len);
+}
+
+// Already compressed or encrypted data, should all be bypassed
+static void makeRandom(vector<uint8_t>& out, size_t len) {
+	out.resize(len);
+	for(size_t i = 0; i < len; i++)
+		out[i] = nextRand() & 0xff;
+}
+
+// Compressible and incompressible stretches taking turns, as on a tunnel carrying TLS next to plain text
+static void makeMixed(vector<uint8_t>& out, size_t len) {
+	vector<uint8_t> part;
+	while(out.size() < len) {
+		part.clear();
+		if((out.size() / (256 * 1024)) % 2 == 0)
+			makeJson(part, 256 * 1024);
+		else
+			makeRandom(part, 256 * 1024);
+		out.insert(out.end(), part.begin(), part.end());
+	}
+	out.resize(len);
+}
+
+/*
+ * Runs
+ */
+
+struct Run {
+	unsigned long long in, wire, bypassed;
+	double deflateNs, inflateNs;
+	double cpuNs; // Thread CPU time of the run, compress and decompress together
+	vector<double> writeNs;
+	bool ok;
+};
+
+static void runOne(const vector<uint8_t>& data, unsigned int writeSize, int mode, Run* r) {
+	MemoryBudget budget(0, 0);
+	size_t usage = 0;
+	Compressor* c = new Compressor(mode, &budget, &usage);
+	Decompressor* d = new Decompressor(&budget, &usage);
+	vector<uint8_t> packed(Compressor::bound(writeSize)), unpacked(writeSize);
+
+	r->in = r->wire = r->bypassed = 0;
+	r->deflateNs = r->inflateNs = 0;
+	r->writeNs.clear();
+	r->ok = true;
+	double cpu = cpuNs();
+	for(size_t off = 0; off < data.size() && r->ok; off += writeSize) {
+		unsigned int len = min((size_t)writeSize, data.size() - off);
+		const uint8_t* w = &data[off];
+
+		double t0 = nowNs();
+		unsigned int n = c->compress(w, len, packed.data(), packed.size());
+		double t1 = nowNs();
+		unsigned int got = 0;
+		if(n > 0) {
+			d->begin(packed.data(), n);
+			int m;
+			while((m = d->next(unpacked.data() + got, unpacked.size() - got)) > 0)
+				got += m;
+			r->ok = (m == 0 && got == len && memcmp(unpacked.data(), w, len) == 0);
+		} else {
+			r->bypassed += len;
+		}
+		double t2 = nowNs();
+
+		r->in += len;
+		r->wire += (n > 0) ? n : len;
+		r->deflateNs += t1 - t0;
+		r->inflateNs += t2 - t1;
+		r->writeNs.push_back(t2 - t0);
+	}
+	r->cpuNs = cpuNs() - cpu;
+	delete d;
+	delete c;
+}
+
+int main(int argc, const char* argv[]) {
+	size_t megs = 16;
+	unsigned int writeSize = 0;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			megs = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			writeSize = atoi(argv[++i]);
+		else {
+			printf("Usage: %s [-m MB per run] [-w write size]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(megs == 0)
+		megs = 1;
+
+	struct { const char* name; void (*make)(vector<uint8_t>&, size_t); } payloads[] = {
+		{ "http", makeHttp }, { "json", makeJson }, { "records", makeRecords }, { "random", makeRandom }, { "mixed", makeMixed }
+	};
+	// An interactive write, a typical socket read and a full tunnel read
+	unsigned int sizes[] = { 256, 4096, 16384 };
+	unsigned int nsizes = 3;
+	if(writeSize > 0) {
+		sizes[0] = writeSize;
+		nsizes = 1;
+	}
+	struct { const char* name; int mode; } modes[] = { { "fast", COMPRESS_FAST }, { "ratio", COMPRESS_RATIO } };
+
+	printf("%-8s %6s %-6s %7s %9s %9s %9s %9s %11s %11s\n", "payload", "write", "mode", "ratio", "deflate", "inflate", "cpu",
+		"bypassed", "added mean", "added p99");
+	bool ok = true;
+	Run r;
+	for(unsigned int p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+		vector<uint8_t> data;
+		payloads[p].make(data, megs << 20);
+		for(unsigned int s = 0; s < nsizes; s++) {
+			for(unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+				runOne(data, sizes[s], modes[m].mode, &r);
+				sort(r.writeNs.begin(), r.writeNs.end());
+				double mean = (r.deflateNs + r.inflateNs) / r.writeNs.size();
+				double p99 = r.writeNs[r.writeNs.size() * 99 / 100];
+				printf("%-8s %6u %-6s %6.1f%% %6.2f ns/B %6.2f ns/B %6.2f ns/B %8.1f%% %8.2f us %8.2f us%s\n", payloads[p].name,
+					sizes[s], modes[m].name, 100.0 * r.wire / r.in, r.deflateNs / r.in, r.inflateNs / r.in, r.cpuNs / r.in,
+					100.0 * r.bypassed / r.in, mean / 1000, p99 / 1000, r.ok ? "" : "  WRONG RESULT");
+				ok = ok && r.ok;
+			}
+		}
+	}
+	return ok ? 0 : 1;
+}
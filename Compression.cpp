@@ -0,0 +1,184 @@
+/**
+   tcp_proxy
+   Compression.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Compression.h"
+
+/**
+ * Z Alloc
+ * zlib allocator. The size is kept in front of the block so zFree can release the charge
+ */
+static voidpf zAlloc(voidpf opaque, uInt items, uInt size) {
+	ZAccount* a = (ZAccount*)opaque;
+	size_t n = (size_t)items * size;
+	size_t* p = (size_t*)malloc(n + sizeof(size_t));
+	if(p == NULL)
+		return Z_NULL;
+	a->budget->charge(a->usage, n, true);
+	p[0] = n;
+	return p + 1;
+}
+
+/**
+ * Z Free
+ */
+static void zFree(voidpf opaque, voidpf ptr) {
+	ZAccount* a = (ZAccount*)opaque;
+	size_t* p = (size_t*)ptr - 1;
+	a->budget->release(a->usage, p[0]);
+	free(p);
+}
+
+/**
+ * Compressor Constructor
+ * COMPRESS_FAST favours speed: level 1 with a 4 KB window, around 50 KB of state. COMPRESS_RATIO uses level 6 with the full 32 KB
+ * window, around 256 KB of state
+ *
+ * @param mode COMPRESS_FAST or COMPRESS_RATIO
+ * @param b Memory budget zlib's state is charged to
+ * @param usage Account within the budget
+ */
+Compressor::Compressor(int mode, MemoryBudget* b, size_t* usage) {
+	account.budget = b;
+	account.usage = usage;
+	bypass = 0;
+	backoff = COMPRESS_BYPASS_MIN;
+	bytesIn = bytesOut = bytesRaw = 0;
+
+	zs.zalloc = zAlloc;
+	zs.zfree = zFree;
+	zs.opaque = &account;
+	if(mode == COMPRESS_RATIO)
+		ok = (deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	else
+		ok = (deflateInit2(&zs, 1, Z_DEFLATED, -12, 5, Z_DEFAULT_STRATEGY) == Z_OK);
+}
+
+/**
+ * Compressor Destructor
+ */
+Compressor::~Compressor() {
+	deflateEnd(&zs);
+}
+
+/**
+ * Compress
+ * Compress one write and flush it. A write that doesn't shrink by at least 1/16 still has to go out compressed (the peer's inflater
+ * must see what deflate consumed), but starts a bypass
+ *
+ * @param in Data read from the local socket
+ * @param len Length of in
+ * @param out Output buffer
+ * @param cap Size of out, at least bound(len)
+ * @return Length of the compressed data in out. 0 if the write should be sent raw
+ */
+unsigned int Compressor::compress(const uint8_t* in, unsigned int len, uint8_t* out, unsigned int cap) {
+	if(!ok || len < COMPRESS_MIN || bypass > 0) {
+		if(bypass > 0)
+			bypass--;
+		bytesRaw += len;
+		return 0;
+	}
+
+	zs.next_in = (Bytef*)in;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = cap;
+	int res = deflate(&zs, Z_SYNC_FLUSH);
+
+	// Shouldn't happen with cap >= bound(len). The peer never sees this stream's output again, so it stays consistent
+	if(res != Z_OK || zs.avail_in != 0 || zs.avail_out == 0) {
+		ok = false;
+		bytesRaw += len;
+		return 0;
+	}
+
+	unsigned int n = cap - zs.avail_out;
+	bytesIn += len;
+	bytesOut += n;
+
+	if(n >= len - len / 16) {
+		bypass = backoff;
+		if(backoff < COMPRESS_BYPASS_MAX)
+			backoff *= 2;
+	} else {
+		backoff = COMPRESS_BYPASS_MIN;
+	}
+	return n;
+}
+
+/**
+ * Decompressor Constructor
+ * Accepts the output of either compression mode
+ *
+ * @param b Memory budget zlib's state is charged to
+ * @param usage Account within the budget
+ */
+Decompressor::Decompressor(MemoryBudget* b, size_t* usage) {
+	account.budget = b;
+	account.usage = usage;
+
+	zs.zalloc = zAlloc;
+	zs.zfree = zFree;
+	zs.opaque = &account;
+	zs.next_in = Z_NULL;
+	zs.avail_in = 0;
+	ok = (inflateInit2(&zs, -15) == Z_OK);
+}
+
+/**
+ * Decompressor Destructor
+ */
+Decompressor::~Decompressor() {
+	inflateEnd(&zs);
+}
+
+/**
+ * Begin
+ * Set the next compressed write as input. It must stay valid until next() has returned 0
+ *
+ * @param in Compressed data
+ * @param len Length of in
+ */
+void Decompressor::begin(const uint8_t* in, unsigned int len) {
+	zs.next_in = (Bytef*)in;
+	zs.avail_in = len;
+}
+
+/**
+ * Next
+ * Produce the next piece of the current input's output
+ *
+ * @param out Output buffer
+ * @param cap Size of out
+ * @return Bytes produced, 0 once the input is fully decoded, -1 if the data is corrupt
+ */
+int Decompressor::next(uint8_t* out, unsigned int cap) {
+	if(!ok)
+		return -1;
+
+	zs.next_out = out;
+	zs.avail_out = cap;
+	int res = inflate(&zs, Z_SYNC_FLUSH);
+
+	// Z_BUF_ERROR only means there was nothing left to do
+	if(res != Z_OK && res != Z_BUF_ERROR) {
+		ok = false;
+		return -1;
+	}
+	return cap - zs.avail_out;
+}
@@ -0,0 +1,93 @@
+/**
+   tcp_proxy
+   Compression.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "Config.h"
+#include "MemoryBudget.h"
+
+#define COMPRESS_MIN 64 // Writes smaller than this are sent as they are, the flush would cost more than it saves
+#define COMPRESS_BYPASS_MIN 16 // Writes sent raw after one that didn't compress
+#define COMPRESS_BYPASS_MAX 1024 // The bypass doubles every time the probe after it fails, up to this
+
+/**
+ * Z Account
+ * zlib's allocations are charged to a memory budget account
+ */
+struct ZAccount {
+	MemoryBudget* budget;
+	size_t* usage;
+};
+
+/**
+ * Compressor
+ * One direction of a streaming raw deflate. Every compress() call ends with a sync flush, so whatever was written is fully
+ * decodable by the peer right away and small interactive writes are never held back. The dictionary carries over from write to
+ * write, which is what makes a stream of small messages compress. Writes that don't compress put the compressor in bypass: the
+ * next writes are sent raw without being fed to deflate, and the peer's Decompressor never sees them either, so both stay in step
+ */
+class Compressor {
+private:
+	z_stream zs;
+	ZAccount account;
+	bool ok; // False once deflate failed, everything is sent raw from then on
+	unsigned int bypass; // Writes still to be sent raw
+	unsigned int backoff; // Bypass length after the next write that doesn't compress
+
+public:
+	// Totals, for the tunnel's report
+	unsigned long long bytesIn; // Bytes fed to deflate
+	unsigned long long bytesOut; // Bytes deflate produced from them
+	unsigned long long bytesRaw; // Bytes sent raw (small writes and bypass)
+
+public:
+	Compressor(int mode, MemoryBudget* b, size_t* usage);
+	~Compressor();
+
+	unsigned int compress(const uint8_t* in, unsigned int len, uint8_t* out, unsigned int cap);
+
+	// Output space compress() needs for len bytes of input
+	static unsigned int bound(unsigned int len) {
+		return len + (len >> 8) + 64;
+	}
+};
+
+/**
+ * Decompressor
+ * Receiving end of a Compressor. Output is produced in pieces so a highly compressed write never needs more than the caller's buffer
+ */
+class Decompressor {
+private:
+	z_stream zs;
+	ZAccount account;
+	bool ok;
+
+public:
+	Decompressor(MemoryBudget* b, size_t* usage);
+	~Decompressor();
+
+	void begin(const uint8_t* in, unsigned int len);
+	int next(uint8_t* out, unsigned int cap);
+};
+
+#endif
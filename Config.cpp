@@ -0,0 +1,362 @@
+/**
+   tcp_proxy
+   Config.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Config.h"
+
+/**
+ * Config Constructor
+ * Populate every value with its compile time default
+ */
+Config::Config() {
+	serverPort = PROXYSERVER_PORT;
+	acceptBatch = PROXYSERVER_ACCEPT_BATCH;
+	reserveFd = true;
+	udpMode = false;
+	workers = 0;
+	handoffQueueSize = 1024;
+	acceptorCpu = -1;
+	numaLocal = false;
+	steering = STEER_LOAD;
+	sessionEngine = ENGINE_CALLBACK;
+	connectTimeout = 5000;
+	connectAttemptDelay = 250;
+	idleTimeout = 0;
+	drainTimeout = 30;
+	handoverPath = "";
+
+	sniRouting = false;
+	sniDefault = "";
+
+	mirror = "";
+	mirrorSample = 100;
+	mirrorQueue = 262144;
+	mirrorMemory = 0;
+
+	tunnelMode = TUNNEL_OFF;
+	tunnelConnections = 2;
+	tunnelWindow = 262144;
+	tunnelCompression = COMPRESS_OFF;
+
+	traceEvents = 0;
+	tracePath = "/tmp/tcp_proxy.trace";
+	accessLog = "";
+	accessLogBlocks = 16;
+	statsShm = "";
+
+	relayBufferSize = 16384;
+	memoryLimit = 0;
+	memorySessionLimit = 262144;
+	memoryShedDelay = 1000;
+	bufferArena = 0;
+	bufferArenaLock = false;
+
+	lagProbeInterval = 100;
+	overloadLag = 0;
+	overloadDefer = 1000;
+	overloadRst = true;
+	overloadPassEvents = 64;
+
+	ioQuantum = 16384;
+	ioPassBudget = 131072;
+
+	zerocopyThreshold = 0;
+
+	udpBatch = 32;
+	udpIdleTimeout = 60;
+	udpOffload = false;
+
+	proxyHost = PROXYCLIENT_HOST;
+	proxyPort = PROXYCLIENT_PORT;
+
+	tcpNoDelay = false;
+	sndBuf = 0;
+	rcvBuf = 0;
+	deferAccept = 0;
+	fastOpenQueue = 0;
+	fastOpenConnect = false;
+	notSentLowat = 0;
+	keepAlive = false;
+	keepIdle = 0;
+	keepIntvl = 0;
+	keepCnt = 0;
+	reusePort = false;
+}
+
+/**
+ * Config Destructor
+ */
+Config::~Config() {
+}
+
+/**
+ * Load
+ * Read a configuration file made of "key = value" lines. Blank lines and anything following a '#' are ignored
+ *
+ * @param path Path to the configuration file
+ * @return True if the file was read and every line was understood. False if otherwise
+ */
+bool Config::load(string path) {
+	ifstream in(path.c_str());
+	if(!in.is_open()) {
+		printf("Config: Could not open %s\n", path.c_str());
+		return false;
+	}
+
+	bool ok = true;
+	string line;
+	int lineNum = 0;
+	while(getline(in, line)) {
+		lineNum++;
+
+		// Strip comments
+		size_t hash = line.find('#');
+		if(hash != string::npos)
+			line.erase(hash);
+
+		// Skip blank lines
+		size_t first = line.find_first_not_of(" \t\r");
+		if(first == string::npos)
+			continue;
+
+		size_t eq = line.find('=');
+		if(eq == string::npos) {
+			printf("Config: %s:%i: expected key = value\n", path.c_str(), lineNum);
+			ok = false;
+			continue;
+		}
+
+		// Trim whitespace around the key and the value
+		string key = line.substr(first, eq - first);
+		string value = line.substr(eq + 1);
+		key.erase(key.find_last_not_of(" \t\r") + 1);
+		size_t vfirst = value.find_first_not_of(" \t\r");
+		value = (vfirst == string::npos) ? "" : value.substr(vfirst);
+		value.erase(value.find_last_not_of(" \t\r") + 1);
+
+		if(!set(key, value)) {
+			printf("Config: %s:%i: unknown key '%s'\n", path.c_str(), lineNum, key.c_str());
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+/**
+ * Validate
+ * Reject combinations of settings the server can't run with. Called once everything is loaded
+ *
+ * @return True if the configuration is usable. False if otherwise
+ */
+bool Config::validate() {
+	bool ok = true;
+
+	// Only workers own reuseport listeners, the acceptor would run with no listener at all
+	if(steering == STEER_REUSEPORT_CBPF && workers <= 0) {
+		printf("Config: steering = reuseport_cbpf needs workers > 0\n");
+		ok = false;
+	}
+
+	return ok;
+}
+
+/**
+ * Set
+ * Assign a single configuration value by name
+ *
+ * @param key Name of the setting
+ * @param value String form of the value. Booleans accept 1/0, yes/no, true/false, on/off
+ * @return True if the key is known. False if otherwise
+ */
+bool Config::set(string key, string value) {
+	int i = atoi(value.c_str());
+	bool b = (value == "1" || value == "yes" || value == "true" || value == "on");
+
+	if(key == "server_port")
+		serverPort = i;
+	else if(key == "accept_batch")
+		acceptBatch = (i > 0) ? i : 1;
+	else if(key == "reserve_fd")
+		reserveFd = b;
+	else if(key == "mode")
+		udpMode = (value == "udp");
+	else if(key == "workers")
+		workers = i;
+	else if(key == "handoff_queue_size")
+		handoffQueueSize = i;
+	else if(key == "worker_cpus") {
+		// Comma separated list of CPU numbers
+		workerCpus.clear();
+		size_t pos = 0;
+		while(pos < value.size()) {
+			size_t comma = value.find(',', pos);
+			if(comma == string::npos)
+				comma = value.size();
+			workerCpus.push_back(atoi(value.substr(pos, comma - pos).c_str()));
+			pos = comma + 1;
+		}
+	} else if(key == "acceptor_cpu")
+		acceptorCpu = i;
+	else if(key == "numa_local")
+		numaLocal = b;
+	else if(key == "steering") {
+		if(value == "load")
+			steering = STEER_LOAD;
+		else if(value == "incoming_cpu")
+			steering = STEER_INCOMING_CPU;
+		else if(value == "reuseport_cbpf")
+			steering = STEER_REUSEPORT_CBPF;
+		else
+			return false;
+	} else if(key == "session_engine") {
+		if(value == "callback")
+			sessionEngine = ENGINE_CALLBACK;
+		else if(value == "coroutine")
+			sessionEngine = ENGINE_COROUTINE;
+		else if(value == "policy")
+			sessionEngine = ENGINE_POLICY;
+		else
+			return false;
+	} else if(key == "connect_timeout")
+		connectTimeout = i;
+	else if(key == "connect_attempt_delay")
+		connectAttemptDelay = (i < 10) ? 10 : i;
+	else if(key == "idle_timeout")
+		idleTimeout = i;
+	else if(key == "drain_timeout")
+		drainTimeout = i;
+	else if(key == "handover_path")
+		handoverPath = value;
+	else if(key == "sni_routing")
+		sniRouting = b;
+	else if(key == "sni_route")
+		sniRoutes.push_back(value);
+	else if(key == "sni_default")
+		sniDefault = value;
+	else if(key == "mirror")
+		mirror = value;
+	else if(key == "mirror_sample")
+		mirrorSample = (i < 0) ? 0 : ((i > 100) ? 100 : i);
+	else if(key == "mirror_queue")
+		mirrorQueue = strtoull(value.c_str(), NULL, 10);
+	else if(key == "mirror_memory")
+		mirrorMemory = strtoull(value.c_str(), NULL, 10);
+	else if(key == "tunnel_mode") {
+		if(value == "off")
+			tunnelMode = TUNNEL_OFF;
+		else if(value == "client")
+			tunnelMode = TUNNEL_CLIENT;
+		else if(value == "server")
+			tunnelMode = TUNNEL_SERVER;
+		else
+			return false;
+	} else if(key == "tunnel_connections")
+		tunnelConnections = i;
+	else if(key == "tunnel_window")
+		tunnelWindow = i;
+	else if(key == "tunnel_compression") {
+		if(value == "off")
+			tunnelCompression = COMPRESS_OFF;
+		else if(value == "fast")
+			tunnelCompression = COMPRESS_FAST;
+		else if(value == "ratio")
+			tunnelCompression = COMPRESS_RATIO;
+		else
+			return false;
+	} else if(key == "trace_events")
+		traceEvents = i;
+	else if(key == "trace_path")
+		tracePath = value;
+	else if(key == "access_log")
+		accessLog = value;
+	else if(key == "access_log_blocks")
+		accessLogBlocks = i;
+	else if(key == "stats_shm")
+		statsShm = value;
+	else if(key == "relay_buffer_size")
+		relayBufferSize = i;
+	else if(key == "memory_limit")
+		memoryLimit = strtoull(value.c_str(), NULL, 10);
+	else if(key == "memory_session_limit")
+		memorySessionLimit = strtoull(value.c_str(), NULL, 10);
+	else if(key == "memory_shed_delay")
+		memoryShedDelay = i;
+	else if(key == "buffer_arena")
+		bufferArena = strtoull(value.c_str(), NULL, 10);
+	else if(key == "buffer_arena_lock")
+		bufferArenaLock = b;
+	else if(key == "lag_probe_interval")
+		lagProbeInterval = (i < 0) ? 0 : i;
+	else if(key == "overload_lag")
+		overloadLag = (i < 0) ? 0 : i;
+	else if(key == "overload_defer")
+		overloadDefer = (i < 0) ? 0 : i;
+	else if(key == "overload_reject") {
+		if(value == "rst")
+			overloadRst = true;
+		else if(value == "close")
+			overloadRst = false;
+		else
+			return false;
+	} else if(key == "overload_pass_events")
+		overloadPassEvents = (i < 1) ? 1 : i;
+	else if(key == "io_quantum")
+		ioQuantum = (i < 0) ? 0 : i;
+	else if(key == "io_pass_budget")
+		ioPassBudget = (i < 0) ? 0 : i;
+	else if(key == "zerocopy_threshold")
+		zerocopyThreshold = (i < 0) ? 0 : i;
+	else if(key == "udp_batch")
+		udpBatch = i;
+	else if(key == "udp_idle_timeout")
+		udpIdleTimeout = i;
+	else if(key == "udp_offload")
+		udpOffload = b;
+	else if(key == "proxy_host")
+		proxyHost = value;
+	else if(key == "proxy_port")
+		proxyPort = i;
+	else if(key == "tcp_nodelay")
+		tcpNoDelay = b;
+	else if(key == "sndbuf")
+		sndBuf = i;
+	else if(key == "rcvbuf")
+		rcvBuf = i;
+	else if(key == "defer_accept")
+		deferAccept = i;
+	else if(key == "fastopen_queue")
+		fastOpenQueue = i;
+	else if(key == "fastopen_connect")
+		fastOpenConnect = b;
+	else if(key == "notsent_lowat")
+		notSentLowat = i;
+	else if(key == "keepalive")
+		keepAlive = b;
+	else if(key == "keepalive_idle")
+		keepIdle = i;
+	else if(key == "keepalive_interval")
+		keepIntvl = i;
+	else if(key == "keepalive_count")
+		keepCnt = i;
+	else if(key == "reuseport")
+		reusePort = b;
+	else
+		return false;
+
+	return true;
+}
@@ -0,0 +1,158 @@
+/**
+   tcp_proxy
+   Config.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef PROXYCONFIG_H_
+#define PROXYCONFIG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <fstream>
+#include <vector>
+
+#include "config.h"
+
+using namespace std;
+
+// Connection steering modes (Config::steering)
+#define STEER_LOAD 0 // Acceptor hands each connection to the least loaded worker
+#define STEER_INCOMING_CPU 1 // Acceptor hands each connection to the worker pinned to its SO_INCOMING_CPU
+#define STEER_REUSEPORT_CBPF 2 // Each worker owns a SO_REUSEPORT listener, a BPF program picks the one pinned to the SYN's CPU
+
+// Session engines (Config::sessionEngine)
+#define ENGINE_CALLBACK 0 // Pooled Sessions driven by the select() handlers
+#define ENGINE_COROUTINE 1 // CoroSession coroutines driven by the Reactor
+#define ENGINE_POLICY 2 // RelayCore, the compile time policy relay, in place of ProxyServer
+
+// Tunnel modes (Config::tunnelMode)
+#define TUNNEL_OFF 0
+#define TUNNEL_CLIENT 1 // Carry client sessions over a few persistent connections to a peer proxy at proxyHost:proxyPort
+#define TUNNEL_SERVER 2 // Accept tunnels from peer proxies and connect their streams to proxyHost:proxyPort
+
+// Tunnel compression (Config::tunnelCompression)
+#define COMPRESS_OFF 0
+#define COMPRESS_FAST 1 // deflate level 1, small window: cheapest CPU per byte saved
+#define COMPRESS_RATIO 2 // deflate level 6, full window
+
+/**
+ * Runtime configuration
+ * Values default to the compile time settings in config.h and may be overridden by a "key = value" file passed on the command line
+ */
+class Config {
+public:
+	// Proxy Server
+	int serverPort;
+	int acceptBatch; // Most connections accepted per wakeup of the listening socket, 1 = one per wakeup
+	bool reserveFd; // Keep a spare descriptor to shed pending connections with when descriptors run out
+	bool udpMode; // Relay datagrams (UdpRelay) instead of TCP streams
+	int workers; // Relay threads fed by the accepting thread. 0 relays on the accepting thread
+	int handoffQueueSize; // Accepted connections that may wait for each worker
+	vector<int> workerCpus; // CPU each worker is pinned to (worker i uses entry i % size). Empty leaves workers unpinned
+	int acceptorCpu; // CPU the accepting thread is pinned to, -1 leaves it unpinned
+	bool numaLocal; // Workers prefer memory from the NUMA node of their CPU
+	int steering; // STEER_* mode used to pick the worker for a new connection
+	int sessionEngine; // ENGINE_* implementation that relays TCP sessions
+	int connectTimeout; // Milliseconds allowed for an upstream connect, 0 = no limit
+	int connectAttemptDelay; // Milliseconds before the next resolved address joins a connect race (RFC 8305 Connection Attempt Delay)
+	int idleTimeout; // Seconds without traffic in either direction before a session is closed, 0 = never
+	int drainTimeout; // Seconds a draining server lets sessions finish before closing them
+	string handoverPath; // Unix socket the listening socket is passed over to a new process, empty = off
+
+	// SNI routing
+	bool sniRouting; // Pick the backend from the TLS ClientHello's server name instead of always using proxyHost
+	vector<string> sniRoutes; // "name [alpn] host:port" entries, one per sni_route line
+	string sniDefault; // "host:port" for hellos without a matching route, empty uses proxyHost:proxyPort
+
+	// Traffic mirroring
+	string mirror; // "host:port" of a shadow backend that gets a copy of what clients send, empty = off
+	int mirrorSample; // Percentage of sessions mirrored
+	size_t mirrorQueue; // Bytes a session's mirror connection may lag behind before it is cut off
+	size_t mirrorMemory; // Budget for all mirror queues in bytes, 0 = unlimited
+
+	// Proxy to proxy tunnels
+	int tunnelMode; // TUNNEL_*
+	int tunnelConnections; // Tunnel connections each event loop keeps to the peer (client end)
+	int tunnelWindow; // Bytes a stream may have in flight before the receiving end credits them back
+	int tunnelCompression; // COMPRESS_* applied to the data this end sends into the tunnel
+
+	// Event tracing
+	int traceEvents; // Events kept in each event loop's trace ring, 0 = tracing off
+	string tracePath; // SIGUSR1 writes each loop's ring to tracePath.<loop>
+
+	// Access log
+	string accessLog; // Binary file every closed session is appended to, empty = off
+	int accessLogBlocks; // Record blocks shared by the event loops and the writer thread
+
+	// Shared memory stats
+	string statsShm; // POSIX shared memory name the event loops publish counters into, empty = off
+
+	// Memory
+	int relayBufferSize; // Bytes read from a socket per recv()
+	size_t memoryLimit; // Budget for all relay buffers and send queues in bytes, 0 = unlimited
+	size_t memorySessionLimit; // Budget for a single session in bytes, 0 = unlimited
+	int memoryShedDelay; // Milliseconds under memory pressure before the largest session is shed
+	size_t bufferArena; // Bytes of the huge page region buffers are carved from, 0 = buffers come from malloc()
+	bool bufferArenaLock; // mlock() the arena
+
+	// Event loop lag and overload admission control
+	int lagProbeInterval; // Milliseconds between lag probes of each event loop, 0 = lag isn't measured
+	int overloadLag; // Smoothed lag in milliseconds at which an event loop stops admitting sessions, 0 = admission control off
+	int overloadDefer; // Milliseconds new connections are left in the listen queue before they are rejected
+	bool overloadRst; // Reject with a RST instead of a normal close
+	int overloadPassEvents; // Ready descriptors an overloaded event loop services per pass
+
+	// Fair I/O scheduling (deficit round robin)
+	int ioQuantum; // Bytes a session may read and flush per scheduling round, 0 = one relay buffer per readiness, unbounded flushes
+	int ioPassBudget; // Bytes an event loop moves per pass before leaving the backlogged sessions for the next pass
+
+	// Zerocopy transmit
+	int zerocopyThreshold; // Smallest send of relayed data that uses MSG_ZEROCOPY, 0 = off
+
+	// UDP relay
+	int udpBatch; // Datagrams per recvmmsg()/sendmmsg() call
+	int udpIdleTimeout; // Seconds without traffic before a flow is expired
+	bool udpOffload; // UDP_GRO/UDP_SEGMENT segmentation offload
+
+	// Proxy Client
+	string proxyHost;
+	int proxyPort;
+
+	// Socket tuning. A value of 0 leaves the kernel default in place
+	bool tcpNoDelay; // Disable Nagle on accepted and upstream sockets
+	int sndBuf; // SO_SNDBUF size in bytes
+	int rcvBuf; // SO_RCVBUF size in bytes
+	int deferAccept; // TCP_DEFER_ACCEPT timeout in seconds (listener only)
+	int fastOpenQueue; // TCP_FASTOPEN pending queue length (listener)
+	bool fastOpenConnect; // TCP_FASTOPEN_CONNECT (upstream)
+	int notSentLowat; // TCP_NOTSENT_LOWAT in bytes
+	bool keepAlive; // SO_KEEPALIVE on accepted and upstream sockets
+	int keepIdle; // TCP_KEEPIDLE in seconds
+	int keepIntvl; // TCP_KEEPINTVL in seconds
+	int keepCnt; // TCP_KEEPCNT probes
+	bool reusePort; // SO_REUSEPORT on the listener
+
+public:
+	Config();
+	~Config();
+
+	bool load(string path);
+	bool set(string key, string value);
+	bool validate();
+};
+
+#endif
@@ -0,0 +1,183 @@
+/**
+   tcp_proxy
+   CoroSession.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "CoroSession.h"
+
+/**
+ * CoroSession Constructor
+ *
+ * @param r Reactor of the owning event loop
+ * @param c Runtime configuration
+ * @param b Memory budget queued data is charged to
+ * @param buf Event loop's relay buffer, cfg->relayBufferSize bytes
+ * @param active Event loop's session counter
+ * @param clfd Accepted client socket descriptor (non blocking)
+ * @param clientAddr Address structure of the client's socket
+ * @param up Resolved target host addresses, must outlive the session
+ */
+CoroSession::CoroSession(Reactor* r, Config* c, MemoryBudget* b, uint8_t* buf, atomic<int>* active, SOCKET clfd, sockaddr_in clientAddr,
+		Upstream* up) {
+	reactor = r;
+	cfg = c;
+	budget = b;
+	relayBuf = buf;
+	activeSessions = active;
+	clientSocket = clfd;
+	upstreamSocket = INVALID_SOCKET;
+	inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, sizeof(clientIP));
+	memUsage = 0;
+	toClient = new SendQueue();
+	toUpstream = new SendQueue();
+	pumps = 0;
+	closing = false;
+	lastActive = Reactor::nowMs();
+	upstream = up;
+	(*activeSessions)++;
+}
+
+/**
+ * CoroSession Destructor
+ * Only run once no coroutine of the session is suspended, so no waiter refers to the descriptors being closed
+ */
+CoroSession::~CoroSession() {
+	toClient->clear(budget, &memUsage);
+	toUpstream->clear(budget, &memUsage);
+	delete toClient;
+	delete toUpstream;
+	if(upstreamSocket != INVALID_SOCKET)
+		close(upstreamSocket);
+	close(clientSocket);
+	(*activeSessions)--;
+}
+
+/**
+ * Run
+ * Connect to the target host without blocking the event loop, then start relaying in both directions. The target's addresses are
+ * tried one after the other in Upstream::order(). An address that doesn't answer is given up on after four connect attempt delays
+ * unless it is the last one, which gets whatever is left of connectTimeout
+ */
+Task CoroSession::run() {
+	uint8_t order[UPSTREAM_MAX_ADDRS];
+	long now = Reactor::nowMs();
+	unsigned int n = upstream->order(order, now);
+	long deadline = (cfg->connectTimeout > 0) ? now + cfg->connectTimeout : 0;
+	int err = ENETUNREACH;
+
+	for(unsigned int i = 0; i < n; i++) {
+		long timeout = 0;
+		if(deadline > 0) {
+			timeout = deadline - Reactor::nowMs();
+			if(timeout <= 0) {
+				err = ETIMEDOUT;
+				break;
+			}
+		}
+		if(i + 1 < n && (timeout == 0 || timeout > cfg->connectAttemptDelay * 4L))
+			timeout = cfg->connectAttemptDelay * 4L;
+
+		upstreamSocket = socket(upstream->getAddr(order[i])->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(upstreamSocket == INVALID_SOCKET || upstreamSocket >= FD_SETSIZE) {
+			printf("CoroSession: Could not create the upstream socket, booting client %s\n", clientIP);
+			if(upstreamSocket != INVALID_SOCKET)
+				close(upstreamSocket);
+			upstreamSocket = INVALID_SOCKET;
+			delete this;
+			co_return;
+		}
+		SocketOptions::applyUpstream(upstreamSocket, cfg);
+
+		uint64_t started = Upstream::nowUs();
+		err = co_await reactor->connect(upstreamSocket, upstream->getAddr(order[i]), upstream->getAddrLen(order[i]), timeout);
+		if(err == 0) {
+			upstream->succeeded(order[i], Upstream::nowUs() - started);
+			break;
+		}
+		upstream->failed(order[i], Reactor::nowMs());
+		close(upstreamSocket);
+		upstreamSocket = INVALID_SOCKET;
+	}
+
+	if(err != 0) {
+		printf("CoroSession: Could not connect to %s (%s), booting client %s\n", upstream->getTarget().c_str(), strerror(err), clientIP);
+		delete this;
+		co_return;
+	}
+
+	printf("ProxyServer: %s has connected\n", clientIP);
+
+	pumps = 2;
+	pump(clientSocket, upstreamSocket, toUpstream);
+	pump(upstreamSocket, clientSocket, toClient);
+}
+
+/**
+ * Pump
+ * Relay one direction of the session until either side closes, fails or the session has been idle for cfg->idleTimeout seconds
+ *
+ * @param from Socket to read from
+ * @param to Socket to write to
+ * @param out Send queue of the to socket
+ */
+Task CoroSession::pump(SOCKET from, SOCKET to, SendQueue* out) {
+	long idleMs = cfg->idleTimeout * 1000L;
+
+	while(!closing) {
+		ssize_t n = co_await reactor->read(from, relayBuf, cfg->relayBufferSize, idleMs);
+		if(closing)
+			break;
+
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+
+			// The timeout is per direction, the session is only idle if the other direction has been quiet as well
+			if(errno == ETIMEDOUT) {
+				if(Reactor::nowMs() - lastActive < idleMs)
+					continue;
+				printf("CoroSession: Client[%s] has been idle for %i seconds\n", clientIP, cfg->idleTimeout);
+			}
+			break;
+		}
+
+		// Closed by the peer
+		if(n == 0)
+			break;
+
+		lastActive = Reactor::nowMs();
+		if(!co_await reactor->write(to, out, budget, &memUsage, relayBuf, (unsigned int)n, idleMs))
+			break;
+	}
+
+	finish();
+}
+
+/**
+ * Finish
+ * Called as each pump ends. The first one stops the other, the last one frees the session
+ */
+void CoroSession::finish() {
+	if(!closing) {
+		closing = true;
+		printf("ProxyServer: Client[%s] has disconnected\n", clientIP);
+		reactor->cancel(clientSocket);
+		reactor->cancel(upstreamSocket);
+	}
+
+	if(--pumps == 0)
+		delete this;
+}
@@ -0,0 +1,81 @@
+/**
+   tcp_proxy
+   CoroSession.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef COROSESSION_H_
+#define COROSESSION_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+#include "Config.h"
+#include "SocketOptions.h"
+#include "MemoryBudget.h"
+#include "SendQueue.h"
+#include "Coroutine.h"
+#include "Reactor.h"
+#include "Upstream.h"
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+using namespace std;
+
+/**
+ * Coroutine Session
+ * A client connection and its upstream connection relayed by coroutines on a Reactor instead of the Session handlers.
+ * run() connects the upstream, then one pump() per direction loops read -> write. A pump doesn't read again until its previous data
+ * has been sent, so each direction holds at most one relay buffer's worth of queued data. The session deletes itself once both pumps
+ * have finished
+ */
+class CoroSession {
+private:
+	Reactor* reactor; // Reactor of the event loop that owns the session (not owned)
+	Config* cfg;
+	MemoryBudget* budget;
+	uint8_t* relayBuf; // The event loop's receive buffer. Only used between suspensions so every session can share it
+	atomic<int>* activeSessions; // Event loop's session count
+	SOCKET clientSocket;
+	SOCKET upstreamSocket;
+	char clientIP[INET_ADDRSTRLEN];
+	size_t memUsage; // Bytes queued in both directions
+	SendQueue* toClient;
+	SendQueue* toUpstream;
+	int pumps; // Running pump() coroutines
+	bool closing; // Set by the first pump to finish, stops the other one
+	long lastActive; // nowMs() of the last data read in either direction
+	Upstream* upstream; // Resolved target host (owned by the ProxyServer)
+
+private:
+	Task pump(SOCKET from, SOCKET to, SendQueue* out);
+	void finish();
+
+public:
+	CoroSession(Reactor* r, Config* c, MemoryBudget* b, uint8_t* buf, atomic<int>* active, SOCKET clfd, sockaddr_in clientAddr,
+		Upstream* up);
+	~CoroSession();
+
+	Task run();
+};
+
+#endif
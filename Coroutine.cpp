@@ -0,0 +1,91 @@
+/**
+   tcp_proxy
+   Coroutine.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Coroutine.h"
+
+/**
+ * FramePool Constructor
+ */
+FramePool::FramePool() {
+	for(int i = 0; i < FRAME_POOL_CLASSES; i++)
+		freeLists[i] = NULL;
+	live = 0;
+}
+
+/**
+ * FramePool Destructor
+ * Run at thread exit, returns every cached frame to the heap
+ */
+FramePool::~FramePool() {
+	for(int i = 0; i < FRAME_POOL_CLASSES; i++) {
+		while(freeLists[i] != NULL) {
+			FreeFrame* f = freeLists[i];
+			freeLists[i] = f->next;
+			::operator delete(f);
+		}
+	}
+}
+
+/**
+ * Allocate
+ * Pop a frame from the free list of n's size class, or allocate a new one of the full class size so it can be reused by any frame in the class
+ *
+ * @param n Frame size requested by the compiler
+ * @return Pointer to at least n bytes
+ */
+void* FramePool::allocate(size_t n) {
+	size_t cls = (n + FRAME_POOL_GRAIN - 1) / FRAME_POOL_GRAIN;
+	live++;
+	if(cls == 0 || cls > FRAME_POOL_CLASSES)
+		return ::operator new(n);
+
+	FreeFrame* f = freeLists[cls - 1];
+	if(f == NULL)
+		return ::operator new(cls * FRAME_POOL_GRAIN);
+	freeLists[cls - 1] = f->next;
+	return f;
+}
+
+/**
+ * Deallocate
+ * Return a frame to its size class free list
+ *
+ * @param p Frame from allocate()
+ * @param n Size passed to allocate()
+ */
+void FramePool::deallocate(void* p, size_t n) {
+	size_t cls = (n + FRAME_POOL_GRAIN - 1) / FRAME_POOL_GRAIN;
+	live--;
+	if(cls == 0 || cls > FRAME_POOL_CLASSES) {
+		::operator delete(p);
+		return;
+	}
+
+	FreeFrame* f = (FreeFrame*)p;
+	f->next = freeLists[cls - 1];
+	freeLists[cls - 1] = f;
+}
+
+/**
+ * Local
+ * The calling thread's pool
+ */
+FramePool* FramePool::local() {
+	static thread_local FramePool pool;
+	return &pool;
+}
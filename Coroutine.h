@@ -0,0 +1,93 @@
+/**
+   tcp_proxy
+   Coroutine.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef COROUTINE_H_
+#define COROUTINE_H_
+
+#include <stdlib.h>
+#include <new>
+#include <coroutine>
+
+using namespace std;
+
+// Frames up to FRAME_POOL_CLASSES * FRAME_POOL_GRAIN bytes are recycled by the pool, larger ones go to operator new
+#define FRAME_POOL_GRAIN 64
+#define FRAME_POOL_CLASSES 16
+
+/**
+ * Frame Pool
+ * Per thread free lists of coroutine frames, one list per 64 byte size class. Every event loop runs on its own thread and a session's
+ * coroutines never migrate, so frames are allocated and freed on the same thread without locking
+ */
+class FramePool {
+private:
+	struct FreeFrame {
+		FreeFrame* next;
+	};
+
+	FreeFrame* freeLists[FRAME_POOL_CLASSES];
+	unsigned int live; // Frames handed out and not yet returned
+
+public:
+	FramePool();
+	~FramePool();
+
+	void* allocate(size_t n);
+	void deallocate(void* p, size_t n);
+
+	unsigned int getLive() {
+		return live;
+	}
+
+	static FramePool* local();
+};
+
+/**
+ * Task
+ * Fire and forget coroutine. The body starts running as soon as it is called and the frame is freed when it finishes, so the caller
+ * never holds a handle. A Task is only ever resumed by the Reactor of the thread that started it
+ */
+class Task {
+public:
+	struct promise_type {
+		Task get_return_object() {
+			return Task();
+		}
+		suspend_never initial_suspend() noexcept {
+			return suspend_never();
+		}
+		suspend_never final_suspend() noexcept {
+			return suspend_never();
+		}
+		void return_void() {
+		}
+		void unhandled_exception() {
+			abort();
+		}
+
+		// Frames come from the calling thread's pool
+		static void* operator new(size_t n) {
+			return FramePool::local()->allocate(n);
+		}
+		static void operator delete(void* p, size_t n) {
+			FramePool::local()->deallocate(p, n);
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,117 @@
+/**
+   tcp_proxy
+   HandoffBench.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// HandoffQueue latency benchmark: the time from the acceptor's push() to the worker holding the entry, with the worker parked in
+// select() on the wake eventfd as it is between events. The producer sleeps between pushes (-g) so each one finds the worker asleep,
+// or sends them back to back (-g 0) to show the coalesced wakeups of a burst.
+// Usage: handoffbench [-n handoffs] [-g gap in microseconds] [-b burst size]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "HandoffQueue.h"
+
+using namespace std;
+
+static HandoffQueue* queue;
+static vector<double> pushed; // Push time of each handoff, microseconds
+static vector<double> latency;
+static int total = 20000, gapUs = 50, burst = 1;
+static atomic<unsigned long long> wakeups(0);
+
+static double nowUs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// The worker side: select() on the eventfd, clear it, drain
+static void* consumerThread(void* arg) {
+	int fd = queue->getWakeFd();
+	int got = 0;
+	while(got < total) {
+		fd_set rd;
+		FD_ZERO(&rd);
+		FD_SET(fd, &rd);
+		if(select(fd + 1, &rd, NULL, NULL, NULL) <= 0)
+			continue;
+		wakeups++;
+		queue->clearWake();
+		HandoffEntry e;
+		while(queue->pop(&e)) {
+			latency[e.fd] = nowUs() - pushed[e.fd];
+			got++;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, const char* argv[]) {
+	bool usage = false;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			total = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+			gapUs = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			burst = atoi(argv[++i]);
+		else
+			usage = true;
+	}
+	if(usage || total <= 0 || gapUs < 0 || burst <= 0) {
+		printf("Usage: %s [-n handoffs] [-g gap in microseconds] [-b burst size]\n", argv[0]);
+		return 1;
+	}
+
+	queue = new HandoffQueue(4096);
+	pushed.resize(total);
+	latency.resize(total);
+	pthread_t consumer;
+	pthread_create(&consumer, NULL, consumerThread, NULL);
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	double start = nowUs();
+	for(int i = 0; i < total; i++) {
+		pushed[i] = nowUs();
+		while(!queue->push(i, addr))
+			sched_yield();
+		if(gapUs > 0 && (i + 1) % burst == 0)
+			usleep(gapUs);
+	}
+	pthread_join(consumer, NULL);
+	double sec = (nowUs() - start) / 1e6;
+	delete queue;
+
+	sort(latency.begin(), latency.end());
+	size_t n = latency.size();
+	printf("handoffbench: %i handoffs, bursts of %i, %i us apart, %.2f s, %llu wakeups\n", total, burst, gapUs, sec,
+		(unsigned long long)wakeups);
+	printf("latency     p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", latency[n / 2], latency[n * 9 / 10],
+		latency[n * 99 / 100], latency[n - 1]);
+	return 0;
+}
@@ -0,0 +1,143 @@
+/**
+   tcp_proxy
+   HandoffQueue.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "HandoffQueue.h"
+
+/**
+ * HandoffQueue Constructor
+ *
+ * @param capacity Number of entries, rounded up to a power of two
+ */
+HandoffQueue::HandoffQueue(unsigned int capacity) {
+	size_t cap = 2;
+	while(cap < capacity)
+		cap <<= 1;
+
+	cells = new Cell[cap];
+	mask = cap - 1;
+	for(size_t i = 0; i < cap; i++)
+		cells[i].seq.store(i, memory_order_relaxed);
+
+	enqueuePos.store(0, memory_order_relaxed);
+	dequeuePos.store(0, memory_order_relaxed);
+	signalled.store(false, memory_order_relaxed);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+/**
+ * HandoffQueue Destructor
+ * Connections still in the queue were never adopted by a worker, close them
+ */
+HandoffQueue::~HandoffQueue() {
+	HandoffEntry e;
+	while(pop(&e))
+		close(e.fd);
+
+	if(wakeFd != INVALID_SOCKET)
+		close(wakeFd);
+	delete [] cells;
+}
+
+/**
+ * Push
+ * Enqueue an accepted connection and wake the consumer. Safe to call from multiple threads
+ *
+ * @param fd Accepted socket descriptor
+ * @param addr Address structure of the accepted socket
+ * @return True if the entry was queued. False if the queue is full
+ */
+bool HandoffQueue::push(SOCKET fd, sockaddr_in addr) {
+	size_t pos = enqueuePos.load(memory_order_relaxed);
+	Cell* cell;
+
+	for(;;) {
+		cell = &cells[pos & mask];
+		size_t seq = cell->seq.load(memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if(diff == 0) {
+			// Cell is free for this position, claim it
+			if(enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				break;
+		} else if(diff < 0) {
+			// Consumer hasn't released this cell yet, the queue is full
+			return false;
+		} else {
+			// Another producer claimed this position first
+			pos = enqueuePos.load(memory_order_relaxed);
+		}
+	}
+
+	cell->entry.fd = fd;
+	cell->entry.addr = addr;
+	cell->seq.store(pos + 1, memory_order_release);
+
+	// Only the first push after the consumer drained needs to write the eventfd. seq_cst pairs with the fence in clearWake(): either
+	// this exchange sees the consumer's clear and wakes it, or the consumer's next pop sees the entry published above
+	if(!signalled.exchange(true, memory_order_seq_cst))
+		wake();
+
+	return true;
+}
+
+/**
+ * Pop
+ * Dequeue the oldest entry. Must only be called from the consumer (worker) thread
+ *
+ * @param out Receives the entry
+ * @return True if an entry was dequeued. False if the queue is empty
+ */
+bool HandoffQueue::pop(HandoffEntry* out) {
+	size_t pos = dequeuePos.load(memory_order_relaxed);
+	Cell* cell = &cells[pos & mask];
+	size_t seq = cell->seq.load(memory_order_acquire);
+
+	// Producer hasn't published this position yet
+	if((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+		return false;
+
+	*out = cell->entry;
+	cell->seq.store(pos + mask + 1, memory_order_release);
+	dequeuePos.store(pos + 1, memory_order_relaxed);
+	return true;
+}
+
+/**
+ * Wake
+ * Make the eventfd readable so the consumer's select() returns
+ */
+void HandoffQueue::wake() {
+	uint64_t one = 1;
+	ssize_t n = write(wakeFd, &one, sizeof(one));
+	(void)n;
+}
+
+/**
+ * Clear Wake
+ * Consume the eventfd counter. Call before draining the queue so a push racing with the drain signals again
+ */
+void HandoffQueue::clearWake() {
+	uint64_t count;
+	ssize_t n = read(wakeFd, &count, sizeof(count));
+	(void)n;
+	signalled.store(false, memory_order_release);
+
+	// The clear must be visible before pop() reads any cell. Without the fence the store can sit in the store buffer while pop()
+	// loads a stale empty cell, and a push that still sees signalled == true skips the wake: the entry waits for an unrelated event
+	atomic_thread_fence(memory_order_seq_cst);
+}
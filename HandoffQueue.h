@@ -0,0 +1,84 @@
+/**
+   tcp_proxy
+   HandoffQueue.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef HANDOFFQUEUE_H_
+#define HANDOFFQUEUE_H_
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <atomic>
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+using namespace std;
+
+/**
+ * Handoff Entry
+ * A freshly accepted connection on its way from the acceptor to a worker
+ */
+struct HandoffEntry {
+	SOCKET fd;
+	sockaddr_in addr;
+};
+
+/**
+ * Handoff Queue
+ * Bounded lock free multi producer / single consumer ring (sequence numbered cells) that moves accepted connections into a
+ * worker's event loop. An eventfd wakes the worker's select(); wakeups are coalesced so a burst of handoffs costs one write()
+ */
+class HandoffQueue {
+private:
+	struct Cell {
+		atomic<size_t> seq;
+		HandoffEntry entry;
+	};
+
+	// The producer and consumer positions are padded onto separate cache lines so they don't false share
+	Cell* cells;
+	size_t mask;
+	int wakeFd;
+	char pad0[64];
+	atomic<size_t> enqueuePos; // Shared by producers
+	char pad1[64 - sizeof(atomic<size_t>)];
+	atomic<size_t> dequeuePos; // Written by the consumer only, read by producers for size()
+	char pad2[64 - sizeof(atomic<size_t>)];
+	atomic<bool> signalled; // True while a wakeup is pending on wakeFd
+
+public:
+	HandoffQueue(unsigned int capacity);
+	~HandoffQueue();
+
+	bool push(SOCKET fd, sockaddr_in addr);
+	bool pop(HandoffEntry* out);
+	void wake();
+	void clearWake();
+
+	int getWakeFd() {
+		return wakeFd;
+	}
+
+	// Approximate number of entries waiting, safe to call from any thread
+	unsigned int size() {
+		return (unsigned int)(enqueuePos.load(memory_order_relaxed) - dequeuePos.load(memory_order_relaxed));
+	}
+};
+
+#endif
@@ -0,0 +1,252 @@
+/**
+   tcp_proxy
+   HandoffTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// HandoffQueue stress test. Several producers push tagged entries into one queue while a consumer drains it the way a worker does:
+// wait for the eventfd, clearWake(), pop until empty. Every entry must arrive exactly once and in order per producer, and the
+// consumer must never sleep through a push (a lost wakeup shows up as a poll() timeout with entries still outstanding).
+// Small capacities keep the queue full and wrapping so the full and claim race paths run as well. A last lockstep run aims single
+// pushes at the consumer while it is inside clearWake() and the pop that follows it: that is where a push that sees the wakeup
+// still pending can race with the consumer clearing it and finding the queue empty.
+// Usage: handofftest [-p producers] [-n entries per producer] [-r lockstep rounds]
+// Exits non-zero on the first failed check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+#include "HandoffQueue.h"
+
+using namespace std;
+
+// An entry's fd carries its producer in the high byte and its sequence number below
+#define TAG_SHIFT 24
+#define SEQ_MASK ((1 << TAG_SHIFT) - 1)
+
+struct Producer {
+	HandoffQueue* queue;
+	int id;
+	int count;
+	unsigned long long full; // Pushes refused because the queue was full
+};
+
+static void* producerThread(void* arg) {
+	Producer* p = (Producer*)arg;
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	for(int seq = 0; seq < p->count; seq++) {
+		addr.sin_port = (in_port_t)seq;
+		while(!p->queue->push((p->id << TAG_SHIFT) | seq, addr)) {
+			p->full++;
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static bool run(unsigned int capacity, int producers, int count) {
+	HandoffQueue queue(capacity);
+	vector<Producer> prod(producers);
+	vector<pthread_t> threads(producers);
+	for(int i = 0; i < producers; i++) {
+		prod[i].queue = &queue;
+		prod[i].id = i;
+		prod[i].count = count;
+		prod[i].full = 0;
+		pthread_create(&threads[i], NULL, producerThread, &prod[i]);
+	}
+
+	vector<int> next(producers, 0); // Next sequence number expected from each producer
+	vector<bool> seen((size_t)producers * count, false);
+	long long outstanding = (long long)producers * count;
+	unsigned long long wakeups = 0;
+	bool ok = true;
+	pollfd pfd = { queue.getWakeFd(), POLLIN, 0 };
+	while(ok && outstanding > 0) {
+		if(poll(&pfd, 1, 2000) <= 0) {
+			printf("handofftest: capacity %u, no wakeup in 2s with %lld entries outstanding, %u queued\n", capacity, outstanding,
+				queue.size());
+			ok = false;
+			break;
+		}
+		wakeups++;
+		queue.clearWake();
+
+		HandoffEntry e;
+		while(queue.pop(&e)) {
+			int id = e.fd >> TAG_SHIFT, seq = e.fd & SEQ_MASK;
+			if(id < 0 || id >= producers || seq >= count) {
+				printf("handofftest: capacity %u, corrupt entry fd %#x\n", capacity, e.fd);
+				ok = false;
+				break;
+			}
+			size_t slot = (size_t)id * count + seq;
+			if(seen[slot]) {
+				printf("handofftest: capacity %u, producer %i entry %i delivered twice\n", capacity, id, seq);
+				ok = false;
+				break;
+			}
+			if(seq != next[id] || e.addr.sin_port != (in_port_t)seq) {
+				printf("handofftest: capacity %u, producer %i entry %i arrived when %i was expected\n", capacity, id, seq, next[id]);
+				ok = false;
+				break;
+			}
+			seen[slot] = true;
+			next[id]++;
+			outstanding--;
+		}
+	}
+
+	// On failure the producers may be stuck on a full queue, give them room to finish
+	HandoffEntry e;
+	for(int i = 0; i < producers; i++) {
+		while(!ok && pthread_tryjoin_np(threads[i], NULL) != 0)
+			queue.pop(&e);
+		if(ok)
+			pthread_join(threads[i], NULL);
+	}
+
+	if(ok && queue.pop(&e)) {
+		printf("handofftest: capacity %u, entry fd %#x left over after every entry arrived\n", capacity, e.fd);
+		ok = false;
+	}
+
+	unsigned long long full = 0;
+	for(int i = 0; i < producers; i++)
+		full += prod[i].full;
+	printf("handofftest: capacity %5u, %i producers x %i entries, %llu wakeups, %llu full pushes retried: %s\n", capacity, producers,
+		count, wakeups, full, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+struct Lockstep {
+	HandoffQueue* queue;
+	int rounds;
+	atomic<int> clearing; // Bumped by the consumer just before each clearWake()
+	atomic<int> popped; // Entries the consumer has taken
+	atomic<bool> stop; // Consumer gave up, the producer stops waiting
+};
+
+static void* lockstepThread(void* arg) {
+	Lockstep* l = (Lockstep*)arg;
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	unsigned int rnd = 12345;
+	int seen = l->clearing.load(memory_order_acquire);
+	for(int i = 0; i < l->rounds && !l->stop.load(memory_order_relaxed); i++) {
+		// Push the next entry as soon as the consumer starts clearing the last wakeup, or once it has drained everything
+		int c;
+		while((c = l->clearing.load(memory_order_acquire)) == seen && l->popped.load(memory_order_acquire) != i) {
+			if(l->stop.load(memory_order_relaxed))
+				return NULL;
+			sched_yield();
+		}
+		seen = c;
+
+		// Land anywhere from the eventfd read() to the pops after it
+		rnd = rnd * 1103515245 + 12345;
+		for(unsigned int spin = (rnd >> 16) % 2048; spin > 0; spin--)
+			atomic_signal_fence(memory_order_seq_cst); // Keeps the delay loop from being optimized away
+		while(!l->queue->push(i, addr))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static bool runLockstep(int rounds) {
+	HandoffQueue queue(2);
+	Lockstep l;
+	l.queue = &queue;
+	l.rounds = rounds;
+	l.clearing.store(0, memory_order_relaxed);
+	l.popped.store(0, memory_order_relaxed);
+	l.stop.store(false, memory_order_relaxed);
+	pthread_t thread;
+	pthread_create(&thread, NULL, lockstepThread, &l);
+
+	unsigned long long wakeups = 0, doubles = 0;
+	int next = 0;
+	bool ok = true;
+	pollfd pfd = { queue.getWakeFd(), POLLIN, 0 };
+	while(ok && next < rounds) {
+		if(poll(&pfd, 1, 1000) <= 0) {
+			// Nothing pushed yet is fine, the producer is about to. An entry sitting in the queue was pushed without a wakeup
+			if(queue.size() > 0) {
+				printf("handofftest: lockstep round %i, lost wakeup with %u queued\n", next, queue.size());
+				ok = false;
+			}
+			continue;
+		}
+		wakeups++;
+		l.clearing.fetch_add(1, memory_order_release);
+		queue.clearWake();
+
+		HandoffEntry e;
+		int n = 0;
+		while(queue.pop(&e)) {
+			if(e.fd != next) {
+				printf("handofftest: lockstep entry %i arrived when %i was expected\n", e.fd, next);
+				ok = false;
+				break;
+			}
+			next++;
+			n++;
+			l.popped.store(next, memory_order_release);
+		}
+		if(n > 1)
+			doubles++;
+	}
+
+	// Entries are sequence numbers rather than sockets, don't let the destructor close them
+	l.stop.store(true, memory_order_relaxed);
+	pthread_join(thread, NULL);
+	HandoffEntry e;
+	while(queue.pop(&e))
+		;
+	printf("handofftest: lockstep, %i rounds, %llu wakeups, %llu drains took a push that raced clearWake(): %s\n", rounds, wakeups,
+		doubles, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int main(int argc, const char* argv[]) {
+	int producers = 4, count = 50000, rounds = 20000;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			producers = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			count = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			rounds = atoi(argv[++i]);
+		else
+			producers = 0;
+	}
+	if(producers <= 0 || producers > 127 || count <= 0 || count > SEQ_MASK || rounds < 0) {
+		printf("Usage: %s [-p producers, 1-127] [-n entries per producer, 1-%i] [-r lockstep rounds]\n", argv[0], SEQ_MASK);
+		return 1;
+	}
+
+	unsigned int capacities[] = { 2, 8, 64, 4096 };
+	for(unsigned int i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+		if(!run(capacities[i], producers, count))
+			return 1;
+	}
+	return runLockstep(rounds) ? 0 : 1;
+}
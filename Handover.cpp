@@ -0,0 +1,138 @@
+/**
+   tcp_proxy
+   Handover.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Handover.h"
+
+/**
+ * Listen Path
+ * Bind a non blocking Unix stream socket at path for successors to connect to. A stale socket file left by a previous process is
+ * replaced
+ *
+ * @param path Filesystem path of the socket
+ * @return Listening descriptor. INVALID_SOCKET on failure
+ */
+SOCKET Handover::listenPath(string path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path)) {
+		printf("Handover: Path %s is too long\n", path.c_str());
+		return INVALID_SOCKET;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	SOCKET sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(sd == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	unlink(path.c_str());
+	if(bind(sd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sd, 4) != 0) {
+		printf("Handover: Could not listen on %s: %s\n", path.c_str(), strerror(errno));
+		close(sd);
+		return INVALID_SOCKET;
+	}
+	return sd;
+}
+
+/**
+ * Receive
+ * Ask a running process for its listening socket
+ *
+ * @param path Filesystem path the running process listens on
+ * @return The inherited listening descriptor. INVALID_SOCKET if no process answered
+ */
+SOCKET Handover::receive(string path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path))
+		return INVALID_SOCKET;
+	strcpy(addr.sun_path, path.c_str());
+
+	SOCKET sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sd == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	// Nobody is listening (first start, or a stale socket file)
+	if(connect(sd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(sd);
+		return INVALID_SOCKET;
+	}
+
+	char req = HANDOVER_REQUEST;
+	pollfd pfd = { sd, POLLIN, 0 };
+	if(::send(sd, &req, 1, MSG_NOSIGNAL) != 1 || poll(&pfd, 1, HANDOVER_TIMEOUT) != 1) {
+		printf("Handover: No answer from the running process on %s\n", path.c_str());
+		close(sd);
+		return INVALID_SOCKET;
+	}
+
+	char data;
+	char ctl[CMSG_SPACE(sizeof(int))];
+	iovec iov = { &data, 1 };
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	SOCKET fd = INVALID_SOCKET;
+	if(recvmsg(sd, &msg, MSG_CMSG_CLOEXEC) == 1) {
+		cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+		if(cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	}
+	close(sd);
+	return fd;
+}
+
+/**
+ * Send
+ * Answer a successor's request with the listening socket
+ *
+ * @param conn Accepted connection from the successor
+ * @param fd Listening descriptor to pass
+ * @return True if the descriptor was sent. False if otherwise
+ */
+bool Handover::send(SOCKET conn, SOCKET fd) {
+	// The request was sent right after connect(), give it a moment to arrive on the accepted socket
+	char req = 0;
+	pollfd pfd = { conn, POLLIN, 0 };
+	if(poll(&pfd, 1, HANDOVER_TIMEOUT) != 1 || recv(conn, &req, 1, 0) != 1 || req != HANDOVER_REQUEST)
+		return false;
+
+	char data = HANDOVER_REQUEST;
+	char ctl[CMSG_SPACE(sizeof(int))];
+	memset(ctl, 0, sizeof(ctl));
+	iovec iov = { &data, 1 };
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+	return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1;
+}
@@ -0,0 +1,56 @@
+/**
+   tcp_proxy
+   Handover.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef HANDOVER_H_
+#define HANDOVER_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+// Request byte a starting process sends to ask for the listening socket
+#define HANDOVER_REQUEST 'L'
+// Milliseconds to wait for the running process to answer
+#define HANDOVER_TIMEOUT 2000
+
+using namespace std;
+
+/**
+ * Handover
+ * Passes the listening socket from a running proxy to its replacement over a Unix socket (SCM_RIGHTS). The running process listens
+ * on the configured path; a starting process connects, asks for the listener and receives the descriptor. Both then share the same
+ * socket and its accept queue, so no connection is refused while the old process drains
+ */
+class Handover {
+public:
+	static SOCKET listenPath(string path);
+	static SOCKET receive(string path);
+	static bool send(SOCKET conn, SOCKET fd);
+};
+
+#endif
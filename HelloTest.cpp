@@ -0,0 +1,326 @@
+/**
+   tcp_proxy
+   HelloTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// ClientHello parser test. Generated hellos with and without SNI and ALPN must parse to what they carry. Every prefix of a hello must
+// ask for more data, hellos split over several records and oversized ones must be rejected, and a hello with any single byte
+// corrupted must neither crash the parser nor hand back a name outside the buffer. Each case is parsed from a buffer of exactly its
+// length, built with AddressSanitizer (see the Makefile) so a read past the end fails the test.
+// Usage: hellotest
+// Exits non-zero if any case failed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "ClientHello.h"
+
+using namespace std;
+
+static int cases = 0, failed = 0;
+
+static void check(bool ok, const char* what) {
+	cases++;
+	if(!ok) {
+		failed++;
+		printf("hellotest: FAILED %s\n", what);
+	}
+}
+
+/**
+ * Hello Spec
+ * What a generated hello carries
+ */
+struct HelloSpec {
+	const char* sni; // NULL for no server_name extension
+	vector<string> alpn; // Empty for no ALPN extension
+	bool extensions; // False for a hello with no extensions block at all
+	unsigned int padding; // Bytes of a padding extension, 0 for none
+};
+
+static void put8(vector<uint8_t>& b, unsigned int v) {
+	b.push_back((uint8_t)v);
+}
+
+static void put16(vector<uint8_t>& b, unsigned int v) {
+	size_t at = b.size();
+	b.resize(at + 2);
+	BigEndian::put<uint16_t>(&b[at], (uint16_t)v);
+}
+
+static void put24(vector<uint8_t>& b, unsigned int v) {
+	size_t at = b.size();
+	b.resize(at + 3);
+	BigEndian::put<uint32_t, 3>(&b[at], v);
+}
+
+static void append(vector<uint8_t>& b, const vector<uint8_t>& v) {
+	b.insert(b.end(), v.begin(), v.end());
+}
+
+static void appendExtension(vector<uint8_t>& exts, unsigned int type, const vector<uint8_t>& body) {
+	put16(exts, type);
+	put16(exts, body.size());
+	append(exts, body);
+}
+
+// The handshake message: header and ClientHello body, without the record header
+static vector<uint8_t> buildHandshake(const HelloSpec& spec) {
+	vector<uint8_t> body;
+	put16(body, 0x0303); // client_version
+	for(int i = 0; i < 32; i++) // random
+		put8(body, i);
+	put8(body, 32); // session_id
+	for(int i = 0; i < 32; i++)
+		put8(body, 0xa0 + i);
+	put16(body, 8); // cipher_suites
+	put16(body, 0x1301);
+	put16(body, 0x1302);
+	put16(body, 0xc02b);
+	put16(body, 0xc02f);
+	put8(body, 1); // compression_methods
+	put8(body, 0);
+
+	if(spec.extensions) {
+		vector<uint8_t> exts, e;
+
+		// supported_versions ahead of the interesting ones, so the parser has to skip an extension
+		put8(e, 2);
+		put16(e, 0x0304);
+		appendExtension(exts, 43, e);
+
+		if(spec.sni != NULL) {
+			// A name of a type the parser doesn't know comes first, the host_name entry after it
+			vector<uint8_t> list;
+			put8(list, 7);
+			put16(list, 3);
+			list.push_back('x');
+			list.push_back('y');
+			list.push_back('z');
+			put8(list, 0);
+			put16(list, strlen(spec.sni));
+			list.insert(list.end(), spec.sni, spec.sni + strlen(spec.sni));
+			e.clear();
+			put16(e, list.size());
+			append(e, list);
+			appendExtension(exts, 0, e);
+		}
+
+		if(!spec.alpn.empty()) {
+			vector<uint8_t> list;
+			for(unsigned int i = 0; i < spec.alpn.size(); i++) {
+				put8(list, spec.alpn[i].size());
+				list.insert(list.end(), spec.alpn[i].begin(), spec.alpn[i].end());
+			}
+			e.clear();
+			put16(e, list.size());
+			append(e, list);
+			appendExtension(exts, 16, e);
+		}
+
+		if(spec.padding > 0)
+			appendExtension(exts, 21, vector<uint8_t>(spec.padding, 0));
+
+		put16(body, exts.size());
+		append(body, exts);
+	}
+
+	vector<uint8_t> hs;
+	put8(hs, 1); // client_hello
+	put24(hs, body.size());
+	append(hs, body);
+	return hs;
+}
+
+// One record carrying the whole handshake
+static vector<uint8_t> buildHello(const HelloSpec& spec) {
+	vector<uint8_t> hs = buildHandshake(spec);
+	vector<uint8_t> rec;
+	put8(rec, 22);
+	put16(rec, 0x0301);
+	put16(rec, hs.size());
+	append(rec, hs);
+	return rec;
+}
+
+// Parse from a heap buffer of exactly len bytes so AddressSanitizer catches any read past the end
+static int parseExact(ClientHello* h, const uint8_t* data, unsigned int len) {
+	uint8_t* copy = new uint8_t[len];
+	memcpy(copy, data, len);
+	int res = h->parse(copy, len);
+	// The names point into the buffer, keep them within it before it goes away
+	bool inside = (h->sni == NULL || (h->sni >= (const char*)copy && h->sni + h->sniLen <= (const char*)copy + len))
+		&& (h->alpn == NULL || (h->alpn >= (const char*)copy && h->alpn + h->alpnLen <= (const char*)copy + len));
+	check(inside, "a name points outside the buffer");
+	h->sni = h->alpn = NULL;
+	delete [] copy;
+	return res;
+}
+
+static bool equals(const char* p, unsigned int len, const string& s) {
+	return p != NULL && len == s.size() && memcmp(p, s.data(), len) == 0;
+}
+
+static void testContents() {
+	ClientHello h;
+	HelloSpec spec = { "www.example.com", { "h2", "http/1.1" }, true, 0 };
+	vector<uint8_t> rec = buildHello(spec);
+
+	int res = h.parse(rec.data(), rec.size());
+	check(res == HELLO_OK, "hello with SNI and ALPN didn't parse");
+	check(equals(h.sni, h.sniLen, "www.example.com"), "wrong SNI");
+	check(equals(h.alpn, h.alpnLen, "h2"), "ALPN isn't the first protocol");
+
+	spec = { "api.example.com", {}, true, 0 };
+	rec = buildHello(spec);
+	check(h.parse(rec.data(), rec.size()) == HELLO_OK && equals(h.sni, h.sniLen, "api.example.com") && h.alpn == NULL,
+		"hello with SNI only");
+
+	spec = { NULL, { "http/1.1" }, true, 0 };
+	rec = buildHello(spec);
+	check(h.parse(rec.data(), rec.size()) == HELLO_OK && h.sni == NULL && equals(h.alpn, h.alpnLen, "http/1.1"),
+		"hello with ALPN only");
+
+	spec = { NULL, {}, true, 0 };
+	rec = buildHello(spec);
+	check(h.parse(rec.data(), rec.size()) == HELLO_OK && h.sni == NULL && h.alpn == NULL, "hello without SNI");
+
+	spec = { NULL, {}, false, 0 };
+	rec = buildHello(spec);
+	check(h.parse(rec.data(), rec.size()) == HELLO_OK && h.sni == NULL && h.alpn == NULL, "hello without extensions");
+
+	// Data following the hello (the rest of the client's first flight) doesn't matter
+	spec = { "www.example.com", {}, true, 0 };
+	rec = buildHello(spec);
+	rec.resize(rec.size() + 100, 0x17);
+	check(h.parse(rec.data(), rec.size()) == HELLO_OK && equals(h.sni, h.sniLen, "www.example.com"), "hello followed by more data");
+
+	const char* http = "GET / HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+	check(h.parse((const uint8_t*)http, strlen(http)) == HELLO_INVALID, "plain HTTP accepted as a hello");
+}
+
+// Every prefix of a hello is incomplete and says how much is needed
+static void testTruncated() {
+	HelloSpec spec = { "www.example.com", { "h2" }, true, 0 };
+	vector<uint8_t> rec = buildHello(spec);
+	ClientHello h;
+	int bad = 0;
+	for(unsigned int len = 0; len < rec.size(); len++) {
+		int res = parseExact(&h, rec.data(), len);
+		unsigned int want = (len < 5) ? 5 : rec.size();
+		if(res != HELLO_NEED_MORE || h.needed != want) {
+			printf("hellotest: truncated at %u of %zu bytes: result %i, needed %u\n", len, rec.size(), res, h.needed);
+			bad++;
+		}
+	}
+	check(bad == 0, "truncated hellos");
+	check(parseExact(&h, rec.data(), rec.size()) == HELLO_OK, "untruncated hello");
+}
+
+// A handshake spread over two records is rejected wherever it is split
+static void testSplit() {
+	HelloSpec spec = { "www.example.com", { "h2" }, true, 0 };
+	vector<uint8_t> hs = buildHandshake(spec);
+	ClientHello h;
+	int bad = 0;
+	for(unsigned int at = 1; at < hs.size(); at++) {
+		vector<uint8_t> recs;
+		put8(recs, 22);
+		put16(recs, 0x0301);
+		put16(recs, at);
+		recs.insert(recs.end(), hs.begin(), hs.begin() + at);
+		put8(recs, 22);
+		put16(recs, 0x0301);
+		put16(recs, hs.size() - at);
+		recs.insert(recs.end(), hs.begin() + at, hs.end());
+		if(parseExact(&h, recs.data(), recs.size()) != HELLO_INVALID) {
+			printf("hellotest: hello split after %u of %zu bytes wasn't rejected\n", at, hs.size());
+			bad++;
+		}
+	}
+	check(bad == 0, "hellos split over two records");
+}
+
+// The largest record is accepted, anything over it rejected before it is waited for
+static void testOversized() {
+	HelloSpec spec = { "www.example.com", {}, true, 0 };
+	unsigned int base = buildHandshake(spec).size();
+	spec.padding = HELLO_MAX_RECORD - base - 4;
+	vector<uint8_t> rec = buildHello(spec);
+	ClientHello h;
+	check(rec.size() == 5 + HELLO_MAX_RECORD, "padding arithmetic");
+	check(parseExact(&h, rec.data(), rec.size()) == HELLO_OK, "hello filling the largest record");
+
+	spec.padding++;
+	rec = buildHello(spec);
+	check(parseExact(&h, rec.data(), rec.size()) == HELLO_INVALID, "hello one byte over the largest record");
+	check(parseExact(&h, rec.data(), 5) == HELLO_INVALID, "oversized record header alone");
+
+	// Lengths claiming more than their enclosing structure holds
+	spec.padding = 0;
+	rec = buildHello(spec);
+	vector<uint8_t> bad = rec;
+	BigEndian::put<uint32_t, 3>(&bad[6], rec.size() - 5); // handshake longer than the record
+	check(parseExact(&h, bad.data(), bad.size()) == HELLO_INVALID, "handshake length past the record");
+
+	bad = rec;
+	BigEndian::put<uint16_t>(&bad[3], 3); // record too short for a handshake header
+	check(parseExact(&h, bad.data(), bad.size()) == HELLO_INVALID, "record shorter than a handshake header");
+
+	spec = { "www.example.com", {}, true, 0 };
+	rec = buildHello(spec);
+	bad = rec;
+	// The host_name entry's length is the last 16 bits before the name
+	size_t name = bad.size() - strlen("www.example.com");
+	BigEndian::put<uint16_t>(&bad[name - 2], 0xffff);
+	check(parseExact(&h, bad.data(), bad.size()) == HELLO_INVALID, "SNI name length past the extension");
+}
+
+// Corrupt one byte at a time, to 0x00 and to 0xff. Whatever the result, nothing may be read outside the buffer
+static void testCorrupted() {
+	HelloSpec spec = { "www.example.com", { "h2", "http/1.1" }, true, 0 };
+	vector<uint8_t> rec = buildHello(spec);
+	ClientHello h;
+	int before = failed;
+	for(unsigned int i = 0; i < rec.size(); i++) {
+		uint8_t values[] = { 0x00, 0xff };
+		for(int v = 0; v < 2; v++) {
+			vector<uint8_t> bad = rec;
+			bad[i] = values[v];
+			int res = parseExact(&h, bad.data(), bad.size());
+			if(res != HELLO_OK && res != HELLO_NEED_MORE && res != HELLO_INVALID) {
+				printf("hellotest: byte %u set to %#x gave result %i\n", i, values[v], res);
+				failed++;
+			}
+		}
+	}
+	if(failed > before)
+		printf("hellotest: corrupted hellos failed\n");
+}
+
+int main(int argc, const char* argv[]) {
+	testContents();
+	testTruncated();
+	testSplit();
+	testOversized();
+	testCorrupted();
+
+	printf("hellotest: %i checks, %i failed\n", cases, failed);
+	return (failed == 0) ? 0 : 1;
+}
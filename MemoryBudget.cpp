@@ -0,0 +1,117 @@
+/**
+   tcp_proxy
+   MemoryBudget.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "MemoryBudget.h"
+
+/**
+ * MemoryBudget Constructor
+ *
+ * @param global Limit on the sum of all accounted bytes, 0 for unlimited
+ * @param session Limit on the accounted bytes of a single session, 0 for unlimited
+ */
+MemoryBudget::MemoryBudget(size_t global, size_t session) {
+	globalLimit = global;
+	sessionLimit = session;
+	current.store(0);
+	peak.store(0);
+	rejected.store(0);
+}
+
+/**
+ * MemoryBudget Destructor
+ */
+MemoryBudget::~MemoryBudget() {
+}
+
+/**
+ * Charge
+ * Account for n bytes about to be allocated on behalf of a session
+ *
+ * @param usage The session's usage counter (may be NULL for memory not owned by a session)
+ * @param n Number of bytes
+ * @param force Account for the bytes even if a limit is exceeded (data that was already read off the wire and has to be kept)
+ * @return True if the bytes were charged. False if a limit would be exceeded, nothing is charged in that case
+ */
+bool MemoryBudget::charge(size_t* usage, size_t n, bool force) {
+	if(!force) {
+		if(sessionLimit > 0 && usage != NULL && *usage + n > sessionLimit) {
+			rejected++;
+			return false;
+		}
+		if(globalLimit > 0 && current.load(memory_order_relaxed) + n > globalLimit) {
+			rejected++;
+			return false;
+		}
+	}
+
+	size_t now = current.fetch_add(n, memory_order_relaxed) + n;
+	size_t p = peak.load(memory_order_relaxed);
+	while(now > p && !peak.compare_exchange_weak(p, now, memory_order_relaxed))
+		;
+
+	if(usage != NULL)
+		*usage += n;
+	return true;
+}
+
+/**
+ * Fits
+ * Check whether n more bytes could be charged right now without charging them, for callers that drop data instead of keeping it
+ * past the limits. A miss counts as a rejection
+ *
+ * @param usage The account's current usage
+ * @param n Number of bytes
+ * @return True if both limits have room for n bytes. False if otherwise
+ */
+bool MemoryBudget::fits(size_t usage, size_t n) {
+	if((sessionLimit > 0 && usage + n > sessionLimit) || (globalLimit > 0 && current.load(memory_order_relaxed) + n > globalLimit)) {
+		rejected++;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Release
+ * Return bytes previously charged
+ *
+ * @param usage The session's usage counter (may be NULL)
+ * @param n Number of bytes
+ */
+void MemoryBudget::release(size_t* usage, size_t n) {
+	current.fetch_sub(n, memory_order_relaxed);
+	if(usage != NULL)
+		*usage -= n;
+}
+
+/**
+ * Under Pressure
+ * True once accounted memory reaches 90% of the global limit. Event loops stop reading new data until it drops again
+ */
+bool MemoryBudget::underPressure() {
+	return globalLimit > 0 && current.load(memory_order_relaxed) >= (globalLimit / 10) * 9;
+}
+
+/**
+ * Report
+ * Print the current, peak and rejected counters
+ */
+void MemoryBudget::report() {
+	printf("MemoryBudget: current %zu bytes, peak %zu bytes, %llu allocations rejected (limit %zu, per session %zu)\n",
+		getCurrent(), getPeak(), getRejected(), globalLimit, sessionLimit);
+}
@@ -0,0 +1,68 @@
+/**
+   tcp_proxy
+   MemoryBudget.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef MEMORYBUDGET_H_
+#define MEMORYBUDGET_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <atomic>
+
+using namespace std;
+
+/**
+ * Memory Budget
+ * Accounts for every relay buffer and send queue byte, shared by all worker threads. Each session keeps its own usage counter
+ * which is checked against the per session cap, the sum of all sessions is checked against the global limit
+ */
+class MemoryBudget {
+private:
+	size_t globalLimit; // 0 = unlimited
+	size_t sessionLimit; // 0 = unlimited
+	atomic<size_t> current;
+	atomic<size_t> peak;
+	atomic<unsigned long long> rejected; // Allocations refused because a limit would have been exceeded
+
+public:
+	MemoryBudget(size_t global, size_t session);
+	~MemoryBudget();
+
+	bool charge(size_t* usage, size_t n, bool force = false);
+	bool fits(size_t usage, size_t n);
+	void release(size_t* usage, size_t n);
+	bool underPressure();
+	void report();
+
+	size_t getCurrent() {
+		return current.load(memory_order_relaxed);
+	}
+
+	size_t getPeak() {
+		return peak.load(memory_order_relaxed);
+	}
+
+	unsigned long long getRejected() {
+		return rejected.load(memory_order_relaxed);
+	}
+
+	size_t getSessionLimit() {
+		return sessionLimit;
+	}
+};
+
+#endif
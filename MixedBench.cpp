@@ -0,0 +1,297 @@
+/**
+   tcp_proxy
+   MixedBench.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Mixed workload benchmark: bulk transfers and interactive request/response sessions through the proxy at the same time.
+// The benchmark is also the target host, an echo server on the backend port, so the proxy must be pointed at it:
+//   proxy_host = 127.0.0.1, proxy_port = <backend port>
+// Usage: mixedbench [-b bulk sessions] [-i interactive sessions] [-c storm threads] [-t seconds] [-s message size] proxy_port backend_port
+// Bulk sessions write as fast as the proxy takes the data and read the echo. Interactive sessions send a small message every
+// 10ms and time the echo. Reported: bulk throughput and the interactive round trip percentiles
+// -c runs a connect storm instead: every thread opens a session, sends one byte, waits up to a second for the echo and closes, over
+// and over. Reported: sessions completed per second, and those the proxy closed or reset (shed), refused or left hanging
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static atomic<bool> running(true);
+static atomic<bool> measuring(false);
+static atomic<unsigned long long> bulkBytes(0);
+static pthread_mutex_t rttLock = PTHREAD_MUTEX_INITIALIZER;
+static vector<double> rtts; // Microseconds
+static int proxyPort, backendPort, msgSize = 64;
+static atomic<unsigned long long> stormDone(0), stormShed(0), stormRefused(0), stormTimeouts(0);
+
+static double nowUs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int connectProxy() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(proxyPort);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(connect(fd, (sockaddr*)&a, sizeof(a)) != 0) {
+		close(fd);
+		return -1;
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
+// Backend side of one connection: echo everything back
+static void* echoThread(void* arg) {
+	int fd = (int)(long)arg;
+	char buf[65536];
+	for(;;) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if(n <= 0)
+			break;
+		for(ssize_t off = 0; off < n; ) {
+			ssize_t w = send(fd, buf + off, n - off, MSG_NOSIGNAL);
+			if(w <= 0)
+				goto done;
+			off += w;
+		}
+	}
+done:
+	close(fd);
+	return NULL;
+}
+
+static void* backendThread(void* arg) {
+	int lfd = (int)(long)arg;
+	for(;;) {
+		int fd = accept(lfd, NULL, NULL);
+		if(fd < 0)
+			break;
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		pthread_t t;
+		pthread_create(&t, NULL, echoThread, (void*)(long)fd);
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+static void* bulkReader(void* arg) {
+	int fd = (int)(long)arg;
+	char buf[65536];
+	for(;;) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if(n <= 0)
+			break;
+		if(measuring)
+			bulkBytes += n;
+	}
+	return NULL;
+}
+
+static void* bulkThread(void* arg) {
+	int fd = connectProxy();
+	if(fd < 0) {
+		printf("mixedbench: Bulk session could not connect\n");
+		return NULL;
+	}
+	pthread_t reader;
+	pthread_create(&reader, NULL, bulkReader, (void*)(long)fd);
+
+	char buf[65536];
+	memset(buf, 'b', sizeof(buf));
+	while(running) {
+		if(send(fd, buf, sizeof(buf), MSG_NOSIGNAL) <= 0)
+			break;
+	}
+	shutdown(fd, SHUT_RDWR);
+	pthread_join(reader, NULL);
+	close(fd);
+	return NULL;
+}
+
+static void* interactiveThread(void* arg) {
+	int fd = connectProxy();
+	if(fd < 0) {
+		printf("mixedbench: Interactive session could not connect\n");
+		return NULL;
+	}
+	vector<char> msg(msgSize, 'i'), reply(msgSize);
+	vector<double> mine;
+	while(running) {
+		double start = nowUs();
+		if(send(fd, msg.data(), msgSize, MSG_NOSIGNAL) != msgSize)
+			break;
+		int got = 0;
+		while(got < msgSize) {
+			ssize_t n = recv(fd, reply.data() + got, msgSize - got, 0);
+			if(n <= 0)
+				goto done;
+			got += n;
+		}
+		if(measuring)
+			mine.push_back(nowUs() - start);
+		usleep(10000);
+	}
+done:
+	close(fd);
+	pthread_mutex_lock(&rttLock);
+	rtts.insert(rtts.end(), mine.begin(), mine.end());
+	pthread_mutex_unlock(&rttLock);
+	return NULL;
+}
+
+// Connect storm: short sessions back to back
+static void* stormThread(void* arg) {
+	while(running) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		timeval tv = { 1, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		sockaddr_in a;
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_port = htons(proxyPort);
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		char c = 'c';
+		if(connect(fd, (sockaddr*)&a, sizeof(a)) != 0) {
+			if(measuring)
+				((errno == ETIMEDOUT || errno == EINPROGRESS) ? stormTimeouts : stormRefused)++;
+			close(fd);
+			// Don't spin on a refusing listener
+			usleep(1000);
+			continue;
+		}
+		ssize_t n = -1;
+		if(send(fd, &c, 1, MSG_NOSIGNAL) == 1)
+			n = recv(fd, &c, 1, 0);
+		if(measuring) {
+			if(n == 1)
+				stormDone++;
+			else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				stormTimeouts++;
+			else
+				stormShed++;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+int main(int argc, const char* argv[]) {
+	int bulk = 8, interactive = 8, storm = 0, seconds = 5;
+	int pos = 0;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			bulk = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+			interactive = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			storm = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			seconds = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			msgSize = atoi(argv[++i]);
+		else if(pos == 0 && ++pos)
+			proxyPort = atoi(argv[i]);
+		else if(pos == 1 && ++pos)
+			backendPort = atoi(argv[i]);
+		else
+			pos = -1;
+	}
+	if(pos != 2 || msgSize <= 0 || seconds <= 0) {
+		printf("Usage: %s [-b bulk sessions] [-i interactive sessions] [-c storm threads] [-t seconds] [-s message size] proxy_port "
+			"backend_port\n", argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(backendPort);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(lfd, (sockaddr*)&a, sizeof(a)) != 0 || listen(lfd, 128) != 0) {
+		printf("mixedbench: Could not listen on backend port %i\n", backendPort);
+		return 1;
+	}
+	pthread_t backend;
+	pthread_create(&backend, NULL, backendThread, (void*)(long)lfd);
+
+	// The storm replaces the mixed workload
+	if(storm > 0)
+		bulk = interactive = 0;
+	vector<pthread_t> threads;
+	for(int i = 0; i < bulk + interactive + storm; i++) {
+		pthread_t t;
+		pthread_create(&t, NULL, (i < bulk) ? bulkThread : (i < bulk + interactive) ? interactiveThread : stormThread, NULL);
+		threads.push_back(t);
+	}
+
+	// Let the bulk transfers ramp up before measuring
+	usleep(500000);
+	measuring = true;
+	double start = nowUs();
+	sleep(seconds);
+	measuring = false;
+	double sec = (nowUs() - start) / 1e6;
+	running = false;
+	for(unsigned int i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	if(storm > 0) {
+		printf("mixedbench: connect storm, %i threads, %.1f s\n", storm, sec);
+		printf("storm       %.0f sessions/s, %.0f/s closed or reset by the proxy, %.0f/s refused, %.0f/s timed out\n", stormDone / sec,
+			stormShed / sec, stormRefused / sec, stormTimeouts / sec);
+		return (stormDone > 0) ? 0 : 1;
+	}
+
+	printf("mixedbench: %i bulk, %i interactive sessions, %.1f s\n", bulk, interactive, sec);
+	printf("bulk        %.1f MB/s echoed\n", bulkBytes / (1024.0 * 1024.0) / sec);
+	if(rtts.empty()) {
+		printf("interactive no round trips completed\n");
+		return 1;
+	}
+	sort(rtts.begin(), rtts.end());
+	size_t n = rtts.size();
+	printf("interactive %zu round trips, p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us\n", n, rtts[n / 2], rtts[n * 9 / 10],
+		rtts[n * 99 / 100], rtts[n - 1]);
+	return 0;
+}
@@ -21,28 +21,86 @@
 /**
  * Server Constructor
  * Initialize state and server variables
+ *
+ * @param c Runtime configuration, must outlive the server
  */
-ProxyServer::ProxyServer() {
+ProxyServer::ProxyServer(Config* c) {
+	cfg = c;
 	canRun = false;
     listenSocket = INVALID_SOCKET;
+    reserveFd = INVALID_SOCKET;
+    fdmax = 0;
+    workerId = -1;
+    cpu = -1;
+    handoff = NULL;
+    nextWorker = 0;
+    activeSessions.store(0);
     memset(&serverAddr, 0, sizeof(serverAddr)); // Clear the address struct
     
     // Zero the file descriptor sets
     FD_ZERO(&fd_master);
     FD_ZERO(&fd_read);
-    
-	// Instance the clientMap, relates Socket Descriptor to pointer to Client object
-    clientMap = new map<SOCKET, Client*>();
+    FD_ZERO(&fd_write_master);
+    FD_ZERO(&fd_write);
+
+    budget = NULL;
+    relayBuf = NULL;
+    pressureSince = 0;
+    loopNow = nowMs();
+    lastIdleSweep = loopNow;
+
+    reactor = new Reactor(&fd_master, &fd_write_master, &fdmax);
+
+    tunnelFds = NULL;
+    if(cfg->tunnelMode != TUNNEL_OFF) {
+        tunnelFds = new Tunnel*[FD_SETSIZE];
+        memset(tunnelFds, 0, sizeof(Tunnel*) * FD_SETSIZE);
+    }
+
+    drainRequested = false;
+    draining = false;
+    drainDeadline = 0;
+    handoverSocket = INVALID_SOCKET;
+    handedOver = false;
+
+    traceRequested = false;
+    traceBytes = 0;
+    accessLogBytes = 0;
+
+    statsSegment = NULL;
+    statsSlot = NULL;
+    memset(&counters, 0, sizeof(counters));
+
+    lagProbeAt = nowUs();
+    lagAvgUs = 0;
+    overloaded.store(false);
+    deferredSince = 0;
+    rejecting = false;
+    passCursor = 0;
+    sigemptyset(&loopMask);
+
+    ioRound = 0;
+    passBytes = 0;
+
+    // The session slab is allocated by the thread that runs the event loop
+    sessions = NULL;
+    upstream = NULL;
+    router = NULL;
+    mirror = NULL;
+    mirrorBudget = NULL;
+    mirrorSeed = 2463534242u;
 }
 
 /**
  * Server Destructor
- * Closes all active connections and deletes the clientMap
+ * Closes all active connections
  */
 ProxyServer::~ProxyServer() {
 	if(listenSocket != INVALID_SOCKET)
 		closeSockets();
-    delete clientMap;
+    delete handoff;
+    delete reactor;
+    delete [] tunnelFds;
 }
 
 /**
@@ -54,12 +112,22 @@ ProxyServer::~ProxyServer() {
  */
 bool ProxyServer::initSocket(int port) {
     // Request a handle for the listening socket, TCP
-    listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    // Non blocking so acceptConnection() can drain the backlog until it would block
+    listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
     if(listenSocket == INVALID_SOCKET){
         printf("ProxyServer: Could not create socket.\n");
         return false;
     }
- 
+
+    // Apply the configured listener options, these have to be in place before bind() and listen()
+    SocketOptions::applyListener(listenSocket, cfg);
+
+    // Worker listeners share the port as one SO_REUSEPORT group
+    if(reuseportSteering()) {
+        int on = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
     // Populate the server address structure
     serverAddr.sin_family = AF_INET; // Family: IP protocol
     serverAddr.sin_port = htons(port); // Set the port (convert from host to netbyte order
@@ -68,6 +136,8 @@ bool ProxyServer::initSocket(int port) {
     // Bind: assign the address to the socket
     if(bind(listenSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) != 0){
         printf("ProxyServer: Failed to bind to the address\n");
+        close(listenSocket);
+        listenSocket = INVALID_SOCKET;
         return false;
     }
     
@@ -75,8 +145,14 @@ bool ProxyServer::initSocket(int port) {
     // (SOMAXCONN) Accept a backlog of the OS Maximum connections in the queue
     if(listen(listenSocket, SOMAXCONN) != 0){
         printf("ProxyServer: Failed to put the socket in a listening state\n");
+        close(listenSocket);
+        listenSocket = INVALID_SOCKET;
         return false;
     }
+
+    // Hold a spare descriptor in reserve so pending connections can still be shed when descriptors run out
+    if(cfg->reserveFd && !openReserveFd())
+        printf("ProxyServer: Could not open the reserve descriptor, connections won't be shed on descriptor exhaustion\n");
     
     // Add the listenSocket to the master fd list
     FD_SET(listenSocket, &fd_master);
@@ -88,281 +164,2004 @@ bool ProxyServer::initSocket(int port) {
     return true;
 }
 
+/**
+ * Inherit Socket
+ * Ask a running proxy on cfg->handoverPath for its listening socket and use it instead of binding a new one
+ *
+ * @return True if a listening socket was taken over. False if otherwise
+ */
+bool ProxyServer::inheritSocket() {
+	if(cfg->handoverPath.empty())
+		return false;
+
+	SOCKET fd = Handover::receive(cfg->handoverPath);
+	if(fd == INVALID_SOCKET)
+		return false;
+
+	listenSocket = fd;
+	fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK);
+	if(cfg->reserveFd && !openReserveFd())
+		printf("ProxyServer: Could not open the reserve descriptor, connections won't be shed on descriptor exhaustion\n");
+
+	FD_SET(listenSocket, &fd_master);
+	fdmax = listenSocket;
+	canRun = true;
+
+	printf("ProxyServer: Took over the listening socket from the running process\n");
+	return true;
+}
+
+/**
+ * Open Handover
+ * Listen on cfg->handoverPath so a newly started process can take over the listening socket
+ */
+void ProxyServer::openHandover() {
+	if(cfg->handoverPath.empty())
+		return;
+
+	if(reuseportSteering()) {
+		printf("ProxyServer: Listener handover isn't supported with reuseport_cbpf steering\n");
+		return;
+	}
+
+	handoverSocket = Handover::listenPath(cfg->handoverPath);
+	if(handoverSocket == INVALID_SOCKET)
+		return;
+	FD_SET(handoverSocket, &fd_master);
+	if(handoverSocket > fdmax)
+		fdmax = handoverSocket;
+}
+
+/**
+ * Handle Handover
+ * A new process is asking for the listening socket. Pass it over, then drain: both processes share the socket and its accept queue
+ * until this one stops accepting, so no connection is refused
+ */
+void ProxyServer::handleHandover() {
+	SOCKET conn = accept4(handoverSocket, NULL, NULL, SOCK_CLOEXEC);
+	if(conn == INVALID_SOCKET)
+		return;
+
+	bool sent = (listenSocket != INVALID_SOCKET) && Handover::send(conn, listenSocket);
+	close(conn);
+	if(!sent) {
+		printf("ProxyServer: Listener handover failed\n");
+		return;
+	}
+
+	printf("ProxyServer: Passed the listening socket to the new process\n");
+	startDrain(true);
+}
+
+/**
+ * Start Drain
+ * Stop accepting and let the open sessions run until they finish or cfg->drainTimeout seconds pass. The acceptor passes the request
+ * on to its workers
+ *
+ * @param handed True if the listening socket was handed to a successor that keeps using it
+ */
+void ProxyServer::startDrain(bool handed) {
+	draining = true;
+	handedOver = handed;
+	drainDeadline = nowMs() + cfg->drainTimeout * 1000L;
+
+	// Stop accepting. A handed over listener is still in use by the successor, only this process's reference is dropped
+	if(listenSocket != INVALID_SOCKET) {
+		FD_CLR(listenSocket, &fd_master);
+		if(!handed)
+			shutdown(listenSocket, SHUT_RDWR);
+		close(listenSocket);
+		listenSocket = INVALID_SOCKET;
+	}
+
+	// After a handover the successor has bound its own socket at the path
+	if(handoverSocket != INVALID_SOCKET) {
+		FD_CLR(handoverSocket, &fd_master);
+		close(handoverSocket);
+		if(!handed)
+			unlink(cfg->handoverPath.c_str());
+		handoverSocket = INVALID_SOCKET;
+	}
+
+	for(unsigned int i = 0; i < workers.size(); i++) {
+		workers[i]->drainRequested = true;
+		workers[i]->handoff->wake();
+	}
+
+	if(workerId < 0)
+		printf("ProxyServer: Draining, sessions have %i seconds to finish\n", cfg->drainTimeout);
+}
+
+/**
+ * Drain Finished
+ * Checked by the acceptor after every event loop pass while draining
+ *
+ * @return True once no session is left in this loop or any worker, or the drain deadline has passed. False if otherwise
+ */
+bool ProxyServer::drainFinished() {
+	if(nowMs() >= drainDeadline) {
+		printf("ProxyServer: Drain deadline reached, closing the remaining sessions\n");
+		return true;
+	}
+
+	if(activeSessions.load() > 0)
+		return false;
+	for(unsigned int i = 0; i < workers.size(); i++) {
+		if(workers[i]->getLoad() > 0)
+			return false;
+	}
+
+	printf("ProxyServer: All sessions have finished\n");
+	return true;
+}
+
 /**
  * Accept Connection
- * When a new connection is detected in runServer() this function is called. This attempts to accept the pending connection, instance a Client object, and add to the client Map
+ * When a new connection is detected in runServer() this function is called. Pending connections are drained from the listen
+ * queue with accept4() until it would block or cfg->acceptBatch connections have been accepted in this wakeup
  */
 void ProxyServer::acceptConnection() {
-	// Setup new client variables
-    sockaddr_in clientAddr;
-    int clientAddrLen = sizeof(clientAddr);
-    SOCKET clfd = INVALID_SOCKET;
-    
-    // Accept pending connection and retrieve the client socket descriptor.  Bail if accept failed.
-    clfd = accept(listenSocket, (sockaddr*)&clientAddr, (socklen_t*)&clientAddrLen);
-    if (clfd == INVALID_SOCKET)
-        return;
-    
-    // Create a new Client object
-    Client *cl = new Client(clfd, clientAddr);
+	for(int accepted = 0; accepted < cfg->acceptBatch; accepted++) {
+		// Setup new client variables
+		sockaddr_in clientAddr;
+		socklen_t clientAddrLen = sizeof(clientAddr);
+
+		// Accept pending connection and retrieve the client socket descriptor
+		SOCKET clfd = accept4(listenSocket, (sockaddr*)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(clfd == INVALID_SOCKET) {
+			// The connection was reset while still in the queue or the call was interrupted, move on to the next one
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// Out of descriptors: shed the pending connection so the listener doesn't stay readable and spin
+			if(errno == EMFILE || errno == ENFILE) {
+				if(shedConnection())
+					continue;
+			}
+
+			// EAGAIN (queue drained) or an unrecoverable error, wait for the next wakeup
+			return;
+		}
+
+		if(rejecting) {
+			rejectConnection(clfd);
+			continue;
+		}
+		dispatchClient(clfd, clientAddr);
+	}
+}
 
-	// Initiate the Proxy connection
-	// If the ProxyClient failed to connect, reject this client's connection
-	if(!cl->proxyConnect(PROXYCLIENT_HOST, PROXYCLIENT_PORT)) {
-		printf("ProxyServer: New Client's ClientProxy couldn't connect to target host, booting client\n");
+/**
+ * Add Client
+ * Take a Session from the slab for a freshly accepted socket, connect it to the target host and add both sockets to the master FD set
+ *
+ * @param clfd Accepted client socket descriptor
+ * @param clientAddr Address structure of the client's socket
+ */
+void ProxyServer::addClient(SOCKET clfd, sockaddr_in clientAddr) {
+	counters.accepted++;
+
+	// select() can't track descriptors past FD_SETSIZE
+	if(clfd >= FD_SETSIZE) {
+		printf("ProxyServer: Descriptor %i exceeds FD_SETSIZE, booting client\n", clfd);
 		close(clfd);
-		delete cl;
 		return;
 	}
-    
-    // Add the client's socket and the proxyclient's socket to the master FD set
+
+    // Apply the configured per connection options
+    SocketOptions::applyAccepted(clfd, cfg);
+
+    // Server end of a tunnel: the connection is a peer proxy, its streams arrive as frames
+    if(cfg->tunnelMode == TUNNEL_SERVER) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, ip, sizeof(ip));
+        tunnels.push_back(new Tunnel(cfg, budget, &fd_master, &fd_write_master, &fdmax, tunnelFds, relayBuf, &activeSessions, clfd,
+            upstream));
+        printf("ProxyServer: Tunnel from %s has connected\n", ip);
+        return;
+    }
+
+    // Client end of a tunnel: the session becomes a stream on one of the tunnel connections
+    if(cfg->tunnelMode == TUNNEL_CLIENT) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, ip, sizeof(ip));
+        Tunnel* t = pickTunnel();
+        if(t == NULL || !t->openStream(clfd, ip)) {
+            printf("ProxyServer: No tunnel to the peer, booting client %s\n", ip);
+            if(t == NULL)
+                close(clfd);
+            else
+                removeTunnel(t);
+            return;
+        }
+        printf("ProxyServer: %s has connected\n", ip);
+        return;
+    }
+
+    // Coroutine sessions connect the upstream and relay on their own, the Reactor resumes them from this loop
+    if(cfg->sessionEngine == ENGINE_COROUTINE && router == NULL) {
+        CoroSession* cs = new CoroSession(reactor, cfg, budget, relayBuf, &activeSessions, clfd, clientAddr, upstream);
+        cs->run();
+        return;
+    }
+
+    // Take a free slot from the slab
+    Session* s = sessions->acquire();
+    if(s == NULL) {
+        printf("ProxyServer: All %u sessions are in use, booting client\n", sessions->getCapacity());
+        close(clfd);
+        return;
+    }
+    s->open(clfd, clientAddr, nowMs());
+    Trace::event(TRACE_ACCEPT, s->getTraceId(), clientAddr.sin_addr.s_addr, clfd);
+
+    // Add the client's socket to the master FD set
     FD_SET(clfd, &fd_master);
-	FD_SET(cl->getProxySocket(), &fd_master);
     
     // If the client's handle is greater than the max, set the new max
     if(clfd > fdmax)
         fdmax = clfd;
+    sessions->track(clfd, s);
+    activeSessions++;
+
+    if(cfg->zerocopyThreshold > 0)
+        s->getSendQueue()->enableZerocopy(clfd, cfg->zerocopyThreshold, budget, &counters);
+
+    if(mirror != NULL)
+        startMirror(s);
+
+    // With SNI routing the backend is only known once the ClientHello has arrived
+    if(router != NULL) {
+        s->setHelloPending(true);
+        printf("ProxyServer: %s has connected\n", s->getClientIP());
+        return;
+    }
 
-    // If the proxyclient's handle is greater than the max, set the new max
-    if(cl->getProxySocket() > fdmax)
-        fdmax = cl->getProxySocket();
-    
-    // Add the client object to the client map
-    clientMap->insert(pair<int, Client*>(clfd, cl));
-    
     // Print connection message
-    printf("ProxyServer: %s has connected\n", cl->getClientIP());
+    printf("ProxyServer: %s has connected\n", s->getClientIP());
+
+	// Initiate the Proxy connection. If every address of the target host fails the client's connection is rejected
+	startConnect(s, upstream);
 }
 
 /**
- * Run Server
- * Main server loop where the socket is initialized and the loop is started, checking for new messages or clients to be read with select()
- * and handling them appropriately
+ * Start Connect
+ * Start racing connects to the backend's addresses. The client isn't read until the race is won, its data would have nowhere to go
+ *
+ * @param s Session with an open client socket
+ * @param up Backend addresses
  */
-void ProxyServer::runServer() {
-    //Initializing the socket
-    if (!initSocket(PROXYSERVER_PORT)) {
-        printf("ProxyServer: Failed to set up the server\n");
-        return;
-    }
+void ProxyServer::startConnect(Session* s, Upstream* up) {
+	ConnectRace* race = new ConnectRace(up, cfg, loopNow);
+	race->slot = connecting.size();
+	connecting.push_back(s);
+	s->setRace(race);
+	FD_CLR(s->getSocket(), &fd_master);
+	advanceConnect(s);
+}
 
-	printf("ProxyServer: ProxyServer has started successfully!\n\n");
+/**
+ * Advance Connect
+ * Start the connect attempts that are due and watch them for writability. Gives up on the session once every address has failed
+ * or connectTimeout has passed
+ *
+ * @param s Session with a connect race
+ * @return True if the race goes on. False if it was lost and the session disconnected
+ */
+bool ProxyServer::advanceConnect(Session* s) {
+	ConnectRace* race = s->getRace();
+	while(race->due(loopNow) && !race->lost(loopNow)) {
+		SOCKET fd = race->launch(loopNow);
+		if(fd == INVALID_SOCKET)
+			break;
 
-    while(canRun) {
-		usleep(1000);
+		// Attempts resolve to the session like its proxy socket will
+		FD_SET(fd, &fd_write_master);
+		if(fd > fdmax)
+			fdmax = fd;
+		sessions->track(fd, s);
+	}
 
-        // Copy the master set into fd_read for processing
-        fd_read = fd_master;
-        
-        // Populate fd_read with client & clientProxy descriptors that are ready to be read
-        // timeout param is NULL, select will block until there is data to be read
-        if(select(fdmax+1, &fd_read, NULL, NULL, NULL) < 0)
-            continue; // Nothing to be read
-        
-        // Loop through all the descriptors in both fd_read and fd_proxy_read sets and check to see if data needs to be processed
-        for(int i=0; i <= fdmax; i++) {
-            // Socket isnt in the read set, continue
-            if(!FD_ISSET(i, &fd_read))
-				continue;
+	if(!race->lost(loopNow))
+		return true;
 
-			// If a socket is within the fd_read set, it's determine the type (client or proxyclient) and handle:
+	if(race->getInFlight() > 0)
+		race->expire(loopNow);
+	int err = race->getLastError();
+	Trace::event(TRACE_CONNECT, s->getTraceId(), err, 0);
+	printf("ProxyServer: Session[%s] couldn't connect to %s (%s), booting client\n", s->getClientIP(), race->getUpstream()->getTarget().c_str(),
+		strerror(err));
+	disconnectClient(s, TRACE_CLOSE_CONNECT);
+	return false;
+}
 
-			// A new client is waiting to be accepted on the listenSocket
-			if(i == listenSocket) {
-				acceptConnection();
-				continue;
-			} 
-				
-			// If it's in the client map, handleClient. Otherwise it's a ProxyClient
-			Client *cl = getClient(i);
-			if(cl != NULL) {
-				handleClient(getClient(i));
-			} else {
-				Client* cl = getProxyClientOwner(i);
-				if(cl == NULL)
-					continue; // Shouldn't ever happen...but just in case
-				ProxyClient* pCl = cl->getProxyClient();
-
-				// Run the ProxyClient processing method, if there is a returned ByteBuffer, forward that to the Client
-				ByteBuffer* bfor = pCl->clientProcess();
-
-				// Proxy Client is no longer connected, disconnect the Client
-				if(!pCl->isClientRunning()) {
-					disconnectClient(cl);
-					continue;
-				}
+/**
+ * Finish Connect
+ * A connect attempt completed. The first to succeed becomes the session's proxy socket and the others are cancelled, a failure
+ * makes the next attempt due right away
+ *
+ * @param s Session with a connect race
+ * @param fd Attempt descriptor that turned writable
+ */
+void ProxyServer::finishConnect(Session* s, SOCKET fd) {
+	ConnectRace* race = s->getRace();
+	if(!race->finish(fd, loopNow)) {
+		FD_CLR(fd, &fd_write_master);
+		sessions->untrack(fd);
+		Trace::event(TRACE_CONNECT, s->getTraceId(), race->getLastError(), fd);
+		advanceConnect(s);
+		return;
+	}
 
-				// Data was recieved by the ProxyClient and needs to be passed onto the Client
-				if(bfor != NULL) {
-					sendData(cl, bfor);
-					delete bfor;
-				}
-			}
-        }
-    }
+	printf("ProxyServer: Session[%s] connected to %s\n", s->getClientIP(), race->getUpstream()->getTarget().c_str());
+	s->setProxySocket(fd);
+	s->connected(race->getWinner());
+	endRace(s);
+	Trace::event(TRACE_CONNECT, s->getTraceId(), 0, fd);
+	if(cfg->zerocopyThreshold > 0)
+		s->getProxySendQueue()->enableZerocopy(fd, cfg->zerocopyThreshold, budget, &counters);
 
-    closeSockets(); //Closes all connections to the server
+	// Both descriptors resolve to the session, updateInterest() puts them in the read set
+	FD_CLR(fd, &fd_write_master);
+	updateInterest(s);
 }
 
 /**
- * Handle Client
- * Recieve data from a client that has indicated (via select()) that it has data waiting. Pass recv'd data to handleData()
- * Also detect any errors in the state of the socket
+ * End Race
+ * Cancel the attempts still in flight and forget the race
  *
- * @param cl Pointer to Client that sent the data
+ * @param s Session with a connect race
  */
-void ProxyServer::handleClient(Client *cl) {
-    if (cl == NULL)
-        return;
-    
-    size_t dataLen = SO_RCVBUF;
-    char *pData = new char[dataLen];
-    
-    // Receive data on the wire into pData
-    /* TODO: Figure out what flags need to be set */
-    int flags = 0; 
-    ssize_t lenRecv = recv(cl->getSocket(), pData, dataLen, flags);
-    
-    // Determine state of client socket and act on it
-    if(lenRecv == 0) {
-        // Client closed the connection
-        printf("ProxyServer: Client[%s] has disconnected\n", cl->getClientIP());
-        disconnectClient(cl);
-    } else if(lenRecv < 0) {
-        // Some error occured
-        disconnectClient(cl);
-    } else {
-		printf("ProxyServer: Recieved data of size %u\n", lenRecv);
-        ByteBuffer *buf = new ByteBuffer((byte *)pData, (unsigned int)lenRecv);
-        handleData(cl, buf);
-        delete buf;
-    }
-    
-    delete [] pData;
+void ProxyServer::endRace(Session* s) {
+	ConnectRace* race = s->getRace();
+	for(unsigned int i = 0; i < race->getInFlight(); i++) {
+		FD_CLR(race->getAttempt(i), &fd_write_master);
+		sessions->untrack(race->getAttempt(i));
+	}
+
+	Session* last = connecting.back();
+	connecting[race->slot] = last;
+	last->getRace()->slot = race->slot;
+	connecting.pop_back();
+
+	s->setRace(NULL);
+	delete race;
 }
 
 /**
- * Handle Data
- * Handle a Packet from a Client recv'd over the wire. Called from handleClient()
+ * Start Mirror
+ * Pick about cfg->mirrorSample percent of the sessions and open a connection of their own to the shadow backend. The connect doesn't
+ * block, what the client sends in the meantime waits in the mirror queue
  *
- * @param cl Pointer to Client that sent the Packet
- * @param buf Pointer to ByteBuffer containing data recv'd
+ * @param s Freshly opened session
  */
-void ProxyServer::handleData(Client *cl, ByteBuffer *buf) {
-	// Simply forward the recieved data to the ProxyClient
-	ProxyClient* pCl = cl->getProxyClient();
-	pCl->sendData(buf);
+void ProxyServer::startMirror(Session* s) {
+	mirrorSeed ^= mirrorSeed << 13;
+	mirrorSeed ^= mirrorSeed >> 17;
+	mirrorSeed ^= mirrorSeed << 5;
+	if(mirrorSeed % 100 >= (uint32_t)cfg->mirrorSample)
+		return;
+
+	const sockaddr* addr = mirror->getAddr(0);
+	SOCKET fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd == INVALID_SOCKET)
+		return;
+	SocketOptions::applyUpstream(fd, cfg);
+	if(fd >= FD_SETSIZE || (connect(fd, addr, mirror->getAddrLen(0)) < 0 && errno != EINPROGRESS)) {
+		close(fd);
+		return;
+	}
+
+	s->setMirrorSocket(fd);
+	s->setMirrorState(MIRROR_CONNECTING);
+	s->setMirrorBudget(mirrorBudget);
+	FD_SET(fd, &fd_write_master);
+	if(fd > fdmax)
+		fdmax = fd;
+	sessions->track(fd, s);
 }
 
 /**
- * Send Data
- * Send Packet data to a paricular Client
+ * Mirror Data
+ * Copy client data to the session's mirror. A mirror that can't keep up is cut off rather than queueing without bound: the
+ * shadow backend would only see a stream with a hole in it, and the session never waits for it
  *
- * @param cl Client to send data to
- * @param buf ByteBuffer containing data to be sent
+ * @param s Mirrored session
+ * @param data Data the client sent
+ * @param len Length of data
+ * @param shared Copy of data shared with the session's own queue, see SendQueue::send()
  */
-void ProxyServer::sendData(Client* cl, ByteBuffer* buf) {
-	size_t totalSent = 0, bytesLeft = buf->size(), dataLen = buf->size();
-    ssize_t n = 0;
+void ProxyServer::mirrorData(Session* s, uint8_t* data, unsigned int len, ByteBuffer* shared) {
+	if(s->getMirrorState() == MIRROR_CUT) {
+		counters.mirrorDropped += len;
+		return;
+	}
 
-	// Get raw data
-	byte* pData = new byte[dataLen];
-	buf->getBytes(pData, dataLen);
+	if(!mirrorBudget->fits(*s->getMirrorUsage(), len)) {
+		printf("ProxyServer: Mirror of Client[%s] fell behind, cutting it off\n", s->getClientIP());
+		stopMirror(s, true);
+		counters.mirrorDropped += len;
+		return;
+	}
 
-	// Solution to deal with partials sends...loop till totalSent matches dataLen
-	while(totalSent < dataLen) {
-		n = send(cl->getSocket(), pData+totalSent, bytesLeft, 0);
+	SendQueue* q = s->getMirrorQueue();
+	if(s->getMirrorState() == MIRROR_CONNECTING) {
+		if(shared->size() == 0)
+			shared->putBytes(data, len);
+		q->append(mirrorBudget, s->getMirrorUsage(), *shared, 0, len);
+	} else if(!q->send(s->getMirrorSocket(), mirrorBudget, s->getMirrorUsage(), data, len, shared)) {
+		stopMirror(s, true);
+		counters.mirrorDropped += len;
+		return;
+	}
+	counters.mirrorBytes += len;
 
-		// Client closed the connection
-		if(n < 0) {
-			printf("ProxyServer: Client[%s] has disconnected\n", cl->getClientIP());
-			disconnectClient(cl);
-			break;
+	if(!q->empty())
+		FD_SET(s->getMirrorSocket(), &fd_write_master);
+}
+
+/**
+ * Handle Mirror
+ * The shadow backend responded, read and throw the response away. If it closes the connection the rest of the session isn't mirrored
+ *
+ * @param s Mirrored session
+ */
+void ProxyServer::handleMirror(Session* s) {
+	ssize_t lenRecv = recv(s->getMirrorSocket(), relayBuf, cfg->relayBufferSize, 0);
+	if(lenRecv > 0 || (lenRecv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)))
+		return;
+	stopMirror(s, true);
+}
+
+/**
+ * Flush Mirror
+ * The mirror socket turned writable: its connect completed, or the kernel has room for more of its queue
+ *
+ * @param s Mirrored session
+ */
+void ProxyServer::flushMirror(Session* s) {
+	SOCKET fd = s->getMirrorSocket();
+	if(s->getMirrorState() == MIRROR_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+		if(err != 0) {
+			printf("ProxyServer: Mirror connect for Client[%s] failed: %s\n", s->getClientIP(), strerror(err));
+			stopMirror(s, true);
+			return;
 		}
+		s->setMirrorState(MIRROR_UP);
+		FD_SET(fd, &fd_master);
+	}
 
-		// Adjust byte count after a successful send
-		totalSent += n;
-		bytesLeft -= n;
+	SendQueue* q = s->getMirrorQueue();
+	if(!q->flush(fd, mirrorBudget, s->getMirrorUsage())) {
+		stopMirror(s, true);
+		return;
 	}
+	if(q->empty())
+		FD_CLR(fd, &fd_write_master);
 }
 
 /**
- * Disconnect Client
- * Close the client's socket descriptor and release it from the FD map, client map, and memory
+ * Stop Mirror
+ * Close a session's mirror connection. Whatever was still queued for it counts as dropped
  *
- * @param cl Pointer to Client object
+ * @param s Mirrored session
+ * @param cut True if the mirror failed or fell behind and the session goes on without it. False if the session is closing
  */
-void ProxyServer::disconnectClient(Client *cl) {
-    if (cl == NULL)
-        return;
-    
-	// Close the socket descriptor
-    close(cl->getSocket());
-	// Remove from the FD set (used in select())
-    FD_CLR(cl->getSocket(), &fd_master);
-	FD_CLR(cl->getProxySocket(), &fd_master);
-	// Remove from the clientMap
-    clientMap->erase(cl->getSocket());
-    
-	// Free client object from memory
-    delete cl;
+void ProxyServer::stopMirror(Session* s, bool cut) {
+	SOCKET fd = s->getMirrorSocket();
+	FD_CLR(fd, &fd_master);
+	FD_CLR(fd, &fd_write_master);
+	sessions->untrack(fd);
+	close(fd);
+	s->setMirrorSocket(INVALID_SOCKET);
+
+	SendQueue* q = s->getMirrorQueue();
+	counters.mirrorBytes -= q->size();
+	counters.mirrorDropped += q->size();
+	q->clear(mirrorBudget, s->getMirrorUsage());
+
+	s->setMirrorState(cut ? MIRROR_CUT : MIRROR_OFF);
+	if(cut)
+		counters.mirrorCut++;
 }
 
 /**
- * Get Client
- * Lookup client based on the socket descriptor number in the clientMap
+ * Pick Tunnel
+ * Client end. Choose the tunnel connection for a new stream: open connections to the peer until there are cfg->tunnelConnections,
+ * then use the one carrying the fewest streams
  *
- * @param clfd Client Descriptor
- * @return Pointer to Client object if found. NULL otherwise
+ * @return Tunnel to open the stream on, NULL if the peer can't be reached
  */
-Client* ProxyServer::getClient(SOCKET clfd) {
-	// Lookup in map
-    map<int, Client*>::const_iterator it;
-    it = clientMap->find(clfd);
-    
-    // Client wasn't found, return NULL
-    if (it == clientMap->end())
-        return NULL;
-    
-    // Return a pointer to the Client corresponding to the SOCKET that was found in clientMap
-    return it->second;
+Tunnel* ProxyServer::pickTunnel() {
+	Tunnel* best = NULL;
+	for(unsigned int i = 0; i < tunnels.size(); i++) {
+		if(best == NULL || tunnels[i]->getStreams() < best->getStreams())
+			best = tunnels[i];
+	}
+	if(best != NULL && (best->getStreams() == 0 || (int)tunnels.size() >= cfg->tunnelConnections))
+		return best;
+
+	// Connect another tunnel. The connect races the peer's addresses like a session's, streams opened meanwhile are queued
+	printf("ProxyServer: Opening tunnel to %s...\n", upstream->getTarget().c_str());
+	Tunnel* t = new Tunnel(cfg, budget, &fd_master, &fd_write_master, &fdmax, tunnelFds, relayBuf, &activeSessions, INVALID_SOCKET, NULL);
+	if(!t->connect(upstream, loopNow)) {
+		printf("ProxyServer: Tunnel connect failed!\n");
+		delete t;
+		return best;
+	}
+	tunnels.push_back(t);
+	return t;
 }
 
 /**
- * Get Proxy Client Owner
- * Given a Proxy Client's FD, grab the Client associated with it
+ * Service Tunnel
+ * Pass a ready descriptor to the tunnel that owns it, and drop the tunnel if its connection failed
  *
- * @param fd ProxyClient Descriptor
- * @return Pointer to Client object if found. NULL otherwise
+ * @param fd Ready descriptor
+ * @param writable True if fd is writable, false if readable
  */
-Client* ProxyServer::getProxyClientOwner(SOCKET fd) {
-    map<int, Client*>::const_iterator it;
-	Client* cl = NULL;
-    for (it = clientMap->begin(); it != clientMap->end(); it++) {
-        cl = it->second;
-		if((cl != NULL) && (cl->getProxySocket() == fd))
-			return cl;
-    }
-	return NULL;
+void ProxyServer::serviceTunnel(SOCKET fd, bool writable) {
+	Tunnel* t = tunnelFds[fd];
+	if(writable)
+		t->handleWritable(fd);
+	else
+		t->handleReadable(fd);
+
+	if(t->isDead())
+		removeTunnel(t);
 }
 
 /**
- * Close Sockets
- * Close all sockets found in the client map. Called on server shutdown
+ * Remove Tunnel
+ * Close a tunnel connection along with every stream it carries
+ *
+ * @param t Tunnel to remove
  */
-void ProxyServer::closeSockets() {
-	printf("ProxyServer: Closing all connections and shutting down the listening socket..\n");
+void ProxyServer::removeTunnel(Tunnel* t) {
+	printf("ProxyServer: Tunnel closed, %u streams dropped\n", t->getStreams());
+	for(unsigned int i = 0; i < tunnels.size(); i++) {
+		if(tunnels[i] == t) {
+			tunnels.erase(tunnels.begin() + i);
+			break;
+		}
+	}
+	delete t;
+}
+
+/**
+ * Open Reserve FD
+ * Open a spare descriptor that is held purely so it can be released when accept() fails with EMFILE/ENFILE
+ *
+ * @return True if the reserve descriptor is open. False if otherwise
+ */
+bool ProxyServer::openReserveFd() {
+	if(reserveFd == INVALID_SOCKET)
+		reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return reserveFd != INVALID_SOCKET;
+}
+
+/**
+ * Shed Connection
+ * Called when the process is out of descriptors. Releases the reserve descriptor, accepts and immediately closes the pending
+ * connection so the client sees a clean close rather than a hang, then reclaims the reserve
+ *
+ * @return True if a connection was shed and the reserve was reclaimed. False if otherwise
+ */
+bool ProxyServer::shedConnection() {
+	if(reserveFd == INVALID_SOCKET)
+		return false;
+
+	close(reserveFd);
+	reserveFd = INVALID_SOCKET;
+
+	SOCKET fd = accept(listenSocket, NULL, NULL);
+	if(fd != INVALID_SOCKET) {
+		close(fd);
+		printf("ProxyServer: Out of descriptors, shed a pending connection\n");
+	}
+
+	return openReserveFd() && (fd != INVALID_SOCKET);
+}
+
+/**
+ * Resolve Upstream
+ * Look up the target host once so accepting a session doesn't have to. Every address returned is kept, sessions race them
+ *
+ * @return True if the target host was resolved. False if otherwise
+ */
+bool ProxyServer::resolveUpstream() {
+	char portstr[8];
+	sprintf(portstr, "%i", cfg->proxyPort);
+	upstream = new Upstream();
+	if(!upstream->resolve(cfg->proxyHost, portstr)) {
+		printf("ProxyServer: Could not resolve the target host %s\n", cfg->proxyHost.c_str());
+		delete upstream;
+		upstream = NULL;
+		return false;
+	}
+	return true;
+}
 
-	// Loop through all client's in the map and disconnect them
-    map<int, Client*>::const_iterator it;
-    for (it = clientMap->begin(); it != clientMap->end(); it++) {
-        Client *cl = it->second;
-        disconnectClient(cl);
+/**
+ * Run Server
+ * Main server loop where the socket is initialized and the loop is started, checking for new messages or clients to be read with select()
+ * and handling them appropriately
+ */
+void ProxyServer::runServer() {
+    // Datagram services are handled by the UDP relay
+    if(cfg->udpMode) {
+        runUdpServer();
+        return;
     }
-    
-    // Clear the map
-    clientMap->clear();
-    
+
+    if(cfg->acceptorCpu >= 0)
+        Affinity::pinCurrentThread(cfg->acceptorCpu);
+
+    // Every session connects to the same target, look it up once
+    if(!resolveUpstream()) {
+        printf("ProxyServer: Failed to set up the server\n");
+        return;
+    }
+
+    // SNI routes are resolved up front as well
+    if(cfg->sniRouting) {
+        router = new SniRouter();
+        if(!router->load(cfg)) {
+            printf("ProxyServer: Failed to set up the SNI routes\n");
+            releaseServer(false);
+            return;
+        }
+    }
+
+    // So is the shadow backend. Its queues get a budget of their own so mirroring can never put the relay under memory pressure
+    if(!cfg->mirror.empty()) {
+        mirror = new Upstream();
+        if(!mirror->resolve(cfg->mirror)) {
+            printf("ProxyServer: Failed to set up the mirror\n");
+            releaseServer(false);
+            return;
+        }
+        mirrorBudget = new MemoryBudget(cfg->mirrorMemory, cfg->mirrorQueue);
+    }
+
+    // Every relay buffer and send queue is charged to this budget. A session must always be able to afford one relay buffer
+    size_t sessionLimit = cfg->memorySessionLimit;
+    if(sessionLimit > 0 && sessionLimit < (size_t)cfg->relayBufferSize * 2)
+        sessionLimit = cfg->relayBufferSize * 2;
+    budget = new MemoryBudget(cfg->memoryLimit, sessionLimit);
+    if(cfg->bufferArena > 0)
+        BufferArena::open(cfg->bufferArena, cfg->bufferArenaLock);
+    allocRelayBuffer();
+    sessions = new SessionPool(SessionPool::capacityFromLimit(), budget);
+
+    //Initializing the socket. With reuseport steering there is no shared listener, each worker accepts on its own
+    // Otherwise take over the listener of a running process when there is one
+    if(reuseportSteering()) {
+        canRun = true;
+    } else if (!inheritSocket() && !initSocket(cfg->serverPort)) {
+        printf("ProxyServer: Failed to set up the server\n");
+        releaseServer(false);
+        return;
+    }
+
+    // The stats segment has a slot for every event loop, it must exist before the workers start. So must the access log
+    openStats();
+    if(!cfg->accessLog.empty()) {
+        accessLogBytes = AccessLog::open(cfg->accessLog, cfg->accessLogBlocks);
+        budget->charge(NULL, accessLogBytes, true);
+    }
+
+    // Start the worker threads, from here on this thread only accepts and hands connections off
+    if(cfg->workers > 0 && !startWorkers()) {
+        printf("ProxyServer: Failed to start the worker threads\n");
+        releaseServer(false);
+        return;
+    }
+
+    // From here on a successor may take the listener over
+    openHandover();
+    openTrace();
+    AccessLog::attach(0);
+
+	printf("ProxyServer: ProxyServer has started successfully!\n\n");
+
+    // The stop and drain signals are let through only while the loop waits in pselect()
+    sigset_t loopSignals;
+    sigemptyset(&loopSignals);
+    sigaddset(&loopSignals, SIGINT);
+    sigaddset(&loopSignals, SIGTERM);
+    sigaddset(&loopSignals, SIGUSR1);
+    sigaddset(&loopSignals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &loopSignals, &loopMask);
+
+    while(canRun) {
+        serviceSockets();
+        if(draining && drainFinished())
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &loopMask, NULL);
+
+    releaseServer(true);
+}
+
+/**
+ * Release Server
+ * Undo everything runServer() set up, in reverse order. Safe at any point of the startup, whatever wasn't set up yet is NULL or
+ * empty and skipped
+ *
+ * @param ran True if the event loop ran, the memory reports are printed
+ */
+void ProxyServer::releaseServer(bool ran) {
+	stopWorkers();
+
+	// Closes all connections to the server. Nothing to close if startup failed before the listener was opened
+	if(ran || listenSocket != INVALID_SOCKET)
+		closeSockets();
+	closeTrace();
+	AccessLog::detach();
+	AccessLog::close();
+	if(accessLogBytes > 0) {
+		budget->release(NULL, accessLogBytes);
+		accessLogBytes = 0;
+	}
+
+	delete sessions;
+	sessions = NULL;
+	if(budget != NULL) {
+		freeRelayBuffer();
+		if(ran) {
+			budget->report();
+			BufferArena::report();
+		}
+		delete budget;
+		budget = NULL;
+	}
+	if(ran && mirrorBudget != NULL) {
+		printf("ProxyServer: Mirror queues:\n");
+		mirrorBudget->report();
+	}
+	delete router;
+	router = NULL;
+	delete upstream;
+	upstream = NULL;
+	delete mirror;
+	mirror = NULL;
+	delete mirrorBudget;
+	mirrorBudget = NULL;
+	statsSlot = NULL;
+	delete statsSegment;
+	statsSegment = NULL;
+}
+
+/**
+ * Service Sockets
+ * Run a single pass of the event loop: wait with pselect() for readable descriptors and handle each one (new connections on the
+ * listenSocket, handoffs from the acceptor, client and proxy socket data). The stop and drain signals are only unblocked inside
+ * pselect(), so one that arrives while the pass runs interrupts the next wait instead of being missed until something else wakes
+ * the loop
+ */
+void ProxyServer::serviceSockets() {
+		// SIGUSR2 or the acceptor asked this loop to drain
+		if(drainRequested && !draining)
+			startDrain(false);
+
+		// SIGUSR1 or the acceptor asked for the trace rings
+		if(traceRequested)
+			writeTrace();
+
+		// Hand the access log records of the last second to the writer
+		AccessLog::tick(loopNow);
+
+		// Under memory pressure stop reading client and proxy socket data. Keep accepting and flushing queued output (which frees memory)
+		// and wake up periodically to check whether the pressure has eased
+		bool paused = checkMemoryPressure();
+
+		// Block until a descriptor is ready or the next coroutine timer is due, at most 10ms while paused
+		int wait = reactor->nextTimeout(nowMs());
+		if(paused && (wait < 0 || wait > 10))
+			wait = 10;
+
+		// While draining wake up regularly to check whether the sessions have finished, and the lingering zerocopy sockets
+		if((draining || !lingering.empty()) && (wait < 0 || wait > 100))
+			wait = 100;
+
+		// Idle sessions are swept once a second, access log records held by the loop are handed off
+		if((cfg->idleTimeout > 0 || AccessLog::holding()) && (wait < 0 || wait > 1000))
+			wait = 1000;
+
+		// Connect races wake the loop when their next attempt is due or they run out of time
+		long now = nowMs();
+		for(unsigned int i = 0; i < connecting.size(); i++) {
+			long at = connecting[i]->getRace()->wakeAt();
+			if(at >= 0 && (wait < 0 || at - now < wait))
+				wait = (at > now) ? at - now : 0;
+		}
+		for(unsigned int i = 0; i < tunnels.size(); i++) {
+			long at = tunnels[i]->wakeAt();
+			if(at >= 0 && (wait < 0 || at - now < wait))
+				wait = (at > now) ? at - now : 0;
+		}
+
+		// So does the lag probe, rounded up so the loop never wakes before it is due
+		if(cfg->lagProbeInterval > 0) {
+			uint64_t us = nowUs();
+			long probe = (lagProbeAt > us) ? (long)((lagProbeAt - us + 999) / 1000) : 0;
+			if(wait < 0 || probe < wait)
+				wait = probe;
+		}
+		timespec ts = { wait / 1000, (wait % 1000) * 1000000 };
+
+		// Overloaded: leave new connections in the listen queue, where they cost nothing, for overloadDefer ms. After that accept
+		// them only to reject them, a quick refusal beats a connect timeout and keeps the queue from filling with stale SYNs
+		bool deferring = false;
+		if(listenSocket != INVALID_SOCKET && !admitting()) {
+			if(deferredSince == 0) {
+				deferredSince = now;
+				printf("ProxyServer: Event loop%s overloaded, deferring new connections\n", workers.empty() ? "" : "s");
+			}
+			if(now - deferredSince < cfg->overloadDefer) {
+				deferring = true;
+			} else if(!rejecting) {
+				printf("ProxyServer: Still overloaded after %i ms, rejecting new connections\n", cfg->overloadDefer);
+				rejecting = true;
+			}
+		} else if(deferredSince != 0) {
+			printf("ProxyServer: Admitting new connections again after %li ms\n", now - deferredSince);
+			deferredSince = 0;
+			rejecting = false;
+		}
+
+        // Copy the master set into fd_read for processing
+        if(paused) {
+            FD_ZERO(&fd_read);
+            if(listenSocket != INVALID_SOCKET)
+                FD_SET(listenSocket, &fd_read);
+            if(handoff != NULL)
+                FD_SET(handoff->getWakeFd(), &fd_read);
+        } else {
+            fd_read = fd_master;
+        }
+        if(deferring)
+            FD_CLR(listenSocket, &fd_read);
+        fd_write = fd_write_master;
+        
+        // Populate fd_read with client & clientProxy descriptors that are ready to be read, fd_write with sockets that can take queued data
+        // Without a timeout pselect will block until there is data to be read
+        if(pselect(fdmax+1, &fd_read, &fd_write, NULL, (wait < 0) ? NULL : &ts, &loopMask) < 0)
+            return; // Nothing to be read, or a signal arrived
+        long prevNow = loopNow;
+        loopNow = nowMs();
+        uint64_t passStart = (statsSlot != NULL) ? StatsSegment::nowNs() : 0;
+        if(deferring)
+            counters.acceptDeferredMs += loopNow - prevNow;
+        if(cfg->lagProbeInterval > 0)
+            probeLag();
+        ioRound++;
+        passBytes = 0;
+
+        // An overloaded loop services a bounded number of ready descriptors per pass, starting where the last capped pass stopped. The
+        // rest stay ready and are serviced next pass, after the timers and connect races have had their turn
+        int cap = overloaded.load(memory_order_relaxed) ? cfg->overloadPassEvents : 0;
+        int first = (cap > 0 && passCursor <= fdmax) ? passCursor : 0;
+        int serviced = 0;
+        
+        // Loop through all the descriptors in both fd_read and fd_proxy_read sets and check to see if data needs to be processed
+        for(int n = 0; n <= fdmax; n++) {
+            int i = (first + n) % (fdmax + 1);
+            if(cap > 0 && (FD_ISSET(i, &fd_write) || FD_ISSET(i, &fd_read)) && serviced++ == cap) {
+                passCursor = i;
+                counters.passesCapped++;
+                break;
+            }
+
+            // Flush queued output first, it may unblock reading from the other side
+            if(FD_ISSET(i, &fd_write)) {
+                if(reactor->isWaiting(i, IO_WRITE))
+                    reactor->fire(i, IO_WRITE);
+                else if(tunnelFds != NULL && tunnelFds[i] != NULL)
+                    serviceTunnel(i, true);
+                else
+                    handleWritable(i);
+            }
+
+            // Socket isnt in the read set, continue
+            if(!FD_ISSET(i, &fd_read))
+				continue;
+
+			// If a socket is within the fd_read set, it's determine the type (client or proxyclient) and handle:
+
+			// A new client is waiting to be accepted on the listenSocket
+			if(i == listenSocket) {
+				acceptConnection();
+				continue;
+			} 
+
+			// A new process wants the listening socket
+			if(i == handoverSocket) {
+				handleHandover();
+				continue;
+			}
+
+			// The acceptor has handed connections off to this worker
+			if(handoff != NULL && i == handoff->getWakeFd()) {
+				drainHandoff();
+				continue;
+			}
+
+			// A coroutine session is waiting on this descriptor
+			if(reactor->isWaiting(i, IO_READ)) {
+				reactor->fire(i, IO_READ);
+				continue;
+			}
+
+			// A tunnel connection or the local socket of one of its streams
+			if(tunnelFds != NULL && tunnelFds[i] != NULL) {
+				serviceTunnel(i, false);
+				continue;
+			}
+				
+			// Resolve the session, then handle whichever of its sockets this is
+			Session* s = sessions->lookup(i);
+			if(s == NULL)
+				continue;
+			if(i == s->getSocket())
+				handleClient(s);
+			else if(i == s->getMirrorSocket())
+				handleMirror(s);
+			else
+				handleProxyClient(s);
+        }
+
+        // Sessions that used their whole quantum get more rounds while the pass budget lasts
+        if(!backlog.empty())
+            serviceBacklog(paused);
+
+        // Start the connect attempts that have become due. A race that is lost is removed from connecting, back to front keeps the
+        // ones not yet looked at in place
+        for(unsigned int i = connecting.size(); i-- > 0; ) {
+            if(i < connecting.size() && connecting[i]->getRace()->due(loopNow))
+                advanceConnect(connecting[i]);
+        }
+
+        // Same for the tunnels' connects, to the peer on the client end and to the backend for each stream on the server end
+        for(unsigned int i = tunnels.size(); i-- > 0; ) {
+            tunnels[i]->tick(loopNow);
+            if(tunnels[i]->isDead())
+                removeTunnel(tunnels[i]);
+        }
+
+        if(!lingering.empty())
+            reapLingering();
+
+        // Resume coroutines whose timers are due and those cancelled while handling this pass
+        reactor->fireTimers(nowMs());
+        reactor->runReady();
+
+        if(cfg->idleTimeout > 0 && loopNow - lastIdleSweep >= 1000) {
+            sweepIdleSessions();
+            lastIdleSweep = loopNow;
+        }
+
+        if(statsSlot != NULL)
+            publishStats(passStart);
+}
+
+/**
+ * Start Workers
+ * Instance cfg->workers worker ProxyServers, each with its own handoff queue, client map and select() loop, and start a thread for each.
+ * Signals are blocked in the worker threads so stopServer() is always run on the acceptor thread
+ *
+ * @return True if every worker thread started. False if otherwise
+ */
+bool ProxyServer::startWorkers() {
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	bool ok = true;
+	for(int i = 0; i < cfg->workers; i++) {
+		ProxyServer* w = new ProxyServer(cfg);
+		w->workerId = i;
+		w->handoff = new HandoffQueue(cfg->handoffQueueSize);
+		w->budget = budget;
+		w->upstream = upstream;
+		w->mirror = mirror;
+		w->mirrorBudget = mirrorBudget;
+		w->mirrorSeed = (mirrorSeed + (i + 1) * 0x9E3779B9u) | 1;
+		w->router = router;
+		if(statsSegment != NULL)
+			w->statsSlot = statsSegment->slot(i + 1);
+		w->canRun = true;
+		if(!cfg->workerCpus.empty())
+			w->cpu = cfg->workerCpus[i % cfg->workerCpus.size()];
+
+		// Listeners join the reuseport group in worker order, that order is the index the steering program returns
+		if(reuseportSteering() && !w->initSocket(cfg->serverPort)) {
+			printf("ProxyServer: Could not set up the listener for worker %i\n", i);
+			delete w;
+			ok = false;
+			break;
+		}
+
+		if(w->handoff->getWakeFd() == INVALID_SOCKET || pthread_create(&w->thread, NULL, &ProxyServer::workerThread, w) != 0) {
+			printf("ProxyServer: Could not start worker %i\n", i);
+			delete w;
+			ok = false;
+			break;
+		}
+		workers.push_back(w);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	// Steer each SYN to the listener of the worker pinned to the CPU that received it
+	if(ok && reuseportSteering()) {
+		vector<int> cpus;
+		for(unsigned int i = 0; i < workers.size(); i++)
+			cpus.push_back(workers[i]->cpu);
+		Affinity::attachCpuSteering(workers[0]->listenSocket, cpus);
+	}
+
+	return ok;
+}
+
+/**
+ * Stop Workers
+ * Ask every worker to stop, wake it, and wait for its thread to close its connections and exit
+ */
+void ProxyServer::stopWorkers() {
+	for(unsigned int i = 0; i < workers.size(); i++) {
+		workers[i]->canRun = false;
+		workers[i]->handoff->wake();
+	}
+
+	for(unsigned int i = 0; i < workers.size(); i++) {
+		pthread_join(workers[i]->thread, NULL);
+		delete workers[i];
+	}
+	workers.clear();
+}
+
+/**
+ * Worker Thread
+ * pthread entry point for a worker ProxyServer
+ */
+void* ProxyServer::workerThread(void* arg) {
+	((ProxyServer*)arg)->runWorker();
+	return NULL;
+}
+
+/**
+ * Run Worker
+ * Worker event loop. New connections arrive through the handoff queue, or with reuseport steering on the worker's own listenSocket.
+ * The worker is pinned first so its session slab and relay buffer are allocated from this thread, on the local NUMA node when
+ * numaLocal is set
+ */
+void ProxyServer::runWorker() {
+	if(cpu >= 0) {
+		Affinity::pinCurrentThread(cpu);
+		if(cfg->numaLocal)
+			Affinity::preferLocalMemory();
+	}
+	allocRelayBuffer();
+	sessions = new SessionPool(SessionPool::capacityFromLimit(), budget);
+
+	FD_SET(handoff->getWakeFd(), &fd_master);
+	if(handoff->getWakeFd() > fdmax)
+		fdmax = handoff->getWakeFd();
+	openTrace();
+	AccessLog::attach(workerId + 1);
+
+	// Workers run with every signal blocked, pselect() keeps it that way
+	pthread_sigmask(SIG_BLOCK, NULL, &loopMask);
+
+	while(canRun)
+		serviceSockets();
+
+	closeSockets();
+	closeTrace();
+	AccessLog::detach();
+	delete sessions;
+	sessions = NULL;
+	freeRelayBuffer();
+}
+
+/**
+ * Dispatch Client
+ * Called by the acceptor for each accepted connection. With no workers the connection is set up in this loop, otherwise it is handed
+ * off to the least loaded worker
+ *
+ * @param clfd Accepted client socket descriptor
+ * @param clientAddr Address structure of the client's socket
+ */
+void ProxyServer::dispatchClient(SOCKET clfd, sockaddr_in clientAddr) {
+	if(workers.empty()) {
+		addClient(clfd, clientAddr);
+		return;
+	}
+
+	// Keep the session on the CPU that is servicing its NIC queue
+	if(cfg->steering == STEER_INCOMING_CPU) {
+		int incoming = Affinity::incomingCpu(clfd);
+		for(unsigned int i = 0; incoming >= 0 && i < workers.size(); i++) {
+			if(workers[i]->cpu == incoming && workers[i]->handoff->push(clfd, clientAddr))
+				return;
+		}
+	}
+
+	// Pick the worker with the least active and queued sessions. Start the scan after the last pick so ties are spread out. An
+	// overloaded worker is only picked if they all are
+	unsigned int n = workers.size();
+	unsigned int best = nextWorker % n;
+	unsigned int bestLoad = workers[best]->getLoad() + (workers[best]->overloaded.load(memory_order_relaxed) ? 0x40000000 : 0);
+	for(unsigned int k = 1; k < n && bestLoad > 0; k++) {
+		unsigned int idx = (nextWorker + k) % n;
+		unsigned int load = workers[idx]->getLoad() + (workers[idx]->overloaded.load(memory_order_relaxed) ? 0x40000000 : 0);
+		if(load < bestLoad) {
+			best = idx;
+			bestLoad = load;
+		}
+	}
+	nextWorker = best + 1;
+
+	if(!workers[best]->handoff->push(clfd, clientAddr)) {
+		printf("ProxyServer: Worker %i handoff queue is full, booting client\n", best);
+		close(clfd);
+	}
+}
+
+/**
+ * Drain Handoff
+ * Worker side of the handoff: adopt every connection waiting in the queue
+ */
+void ProxyServer::drainHandoff() {
+	handoff->clearWake();
+
+	HandoffEntry e;
+	while(handoff->pop(&e))
+		addClient(e.fd, e.addr);
+}
+
+/**
+ * Run UDP Server
+ * Main loop for UDP mode. The UdpRelay keeps its own client address to upstream socket flow table and is run until stopServer()
+ */
+void ProxyServer::runUdpServer() {
+	UdpRelay* relay = new UdpRelay(cfg);
+	if(!relay->init()) {
+		printf("ProxyServer: Failed to set up the UDP relay\n");
+		delete relay;
+		return;
+	}
+
+	canRun = true;
+	printf("ProxyServer: ProxyServer has started successfully in UDP mode!\n\n");
+
+	while(canRun)
+		relay->process();
+
+	relay->closeSockets();
+	delete relay;
+}
+
+/**
+ * Handle Client
+ * Recieve data from a client that has indicated (via select()) that it has data waiting. Pass recv'd data to handleData()
+ * Also detect any errors in the state of the socket
+ *
+ * @param s Session whose client sent the data
+ */
+void ProxyServer::handleClient(Session* s) {
+    // SNI routing: nothing is relayed until the backend has been picked
+    if(s->isHelloPending()) {
+        handleHello(s);
+        return;
+    }
+
+    // Completions of zerocopy sends to the client also make its socket readable
+    s->getSendQueue()->reap();
+
+    // Without an I/O quantum one relay buffer is read per readiness. With one, reading goes on until the direction's deficit is spent,
+    // the socket is drained or the target host stops taking the data as fast
+    for(;;) {
+        unsigned int allow = allowance(s, FLOW_UP);
+        if(allow == 0) {
+            queueBacklog(s, BACKLOG_READ_CLIENT);
+            return;
+        }
+
+        // Reserve a relay buffer's worth of the session's budget. If it can't be afforded leave the data in the kernel for now. While
+        // the queue the data goes to is empty it is sent straight through, the buffer then counts against the global budget only:
+        // otherwise a session whose other direction filled its budget could stop reading the very replies that would drain it
+        size_t dataLen = cfg->relayBufferSize;
+        if(dataLen > allow)
+            dataLen = allow;
+        size_t* usage = s->getProxySendQueue()->empty() ? NULL : s->getMemUsage();
+        if(!budget->charge(usage, dataLen))
+            return;
+
+        // Receive data on the wire into relayBuf. With zerocopy to the target host the data gets a buffer of its own instead, the
+        // kernel sends from it and holds on to it until the send completes
+        /* TODO: Figure out what flags need to be set */
+        int flags = 0;
+        ByteBuffer held(0);
+        uint8_t* buf = s->getProxySendQueue()->zerocopy() ? held.fill(dataLen) : relayBuf;
+        ssize_t lenRecv = recv(s->getSocket(), buf, dataLen, flags);
+
+        // Determine state of client socket and act on it
+        if(lenRecv == 0) {
+            // Client closed the connection
+            budget->release(usage, dataLen);
+            printf("ProxyServer: Client[%s] has disconnected\n", s->getClientIP());
+            disconnectClient(s, TRACE_CLOSE_CLIENT);
+            return;
+        } else if(lenRecv < 0) {
+            budget->release(usage, dataLen);
+
+            // Client sockets are non blocking, nothing to read yet
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+
+            // Some error occured
+            disconnectClient(s, TRACE_CLOSE_CLIENT_ERROR);
+            return;
+        }
+
+        s->touch(loopNow);
+        counters.bytesClient += lenRecv;
+        s->countClient(lenRecv);
+        if(buf != relayBuf)
+            held.resize(lenRecv);
+        bool ok = handleData(s, buf, (unsigned int)lenRecv, (buf != relayBuf) ? &held : NULL);
+        budget->release(usage, dataLen);
+
+        // The send to the target host failed, it is gone
+        if(!ok) {
+            printf("ProxyServer: Error in sending data to the target host, disconnecting Client[%s]\n", s->getClientIP());
+            disconnectClient(s, TRACE_CLOSE_PROXY_ERROR);
+            return;
+        }
+        Trace::event(TRACE_READ_CLIENT, s->getTraceId(), lenRecv, s->getProxySendQueue()->size());
+        updateInterest(s);
+        spend(s, FLOW_UP, lenRecv);
+
+        if(cfg->ioQuantum <= 0 || (size_t)lenRecv < dataLen || !s->getProxySendQueue()->empty() || !FD_ISSET(s->getSocket(), &fd_master))
+            return;
+    }
+}
+
+/**
+ * Handle Hello
+ * SNI routing. Peek at what the client has sent so far and parse it as a ClientHello. While the record is incomplete SO_RCVLOWAT is
+ * raised to its full size so select() doesn't report the socket again until it has arrived. Once parsed, the backend is picked and
+ * connected; the hello itself was never consumed and is relayed from the socket like any other data
+ *
+ * @param s Session waiting for its ClientHello
+ */
+void ProxyServer::handleHello(Session* s) {
+	SOCKET csd = s->getSocket();
+	ssize_t lenRecv = recv(csd, relayBuf, cfg->relayBufferSize, MSG_PEEK);
+	if(lenRecv == 0) {
+		printf("ProxyServer: Client[%s] has disconnected\n", s->getClientIP());
+		disconnectClient(s, TRACE_CLOSE_CLIENT);
+		return;
+	} else if(lenRecv < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		disconnectClient(s, TRACE_CLOSE_CLIENT_ERROR);
+		return;
+	}
+
+	ClientHello hello;
+	int res = hello.parse(relayBuf, (unsigned int)lenRecv);
+	if(res == HELLO_NEED_MORE && hello.needed <= (unsigned int)cfg->relayBufferSize) {
+		int lowat = hello.needed;
+		setsockopt(csd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+		return;
+	}
+
+	// Back to waking up for every byte, then route. Anything that isn't a complete hello goes to the default route
+	int one = 1;
+	setsockopt(csd, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+	const SniRoute* route = router->lookup((res == HELLO_OK) ? &hello : NULL);
+	s->touch(loopNow);
+	s->setHelloPending(false);
+
+	printf("ProxyServer: Client[%s] SNI '%.*s' ALPN '%.*s' routed to %s\n", s->getClientIP(), (int)hello.sniLen, (hello.sni != NULL) ? hello.sni : "",
+		(int)hello.alpnLen, (hello.alpn != NULL) ? hello.alpn : "", route->target.c_str());
+
+	startConnect(s, route->upstream);
+}
+
+/**
+ * Handle Proxy Client
+ * Recieve data from the target host on a session's proxy socket that has indicated (via select()) that it has data waiting and
+ * forward it to the client
+ *
+ * @param s Session whose proxy socket is readable
+ */
+void ProxyServer::handleProxyClient(Session* s) {
+	s->getProxySendQueue()->reap();
+
+	// Read like handleClient(), as far as the session's quantum allows
+	for(;;) {
+		unsigned int allow = allowance(s, FLOW_DOWN);
+		if(allow == 0) {
+			queueBacklog(s, BACKLOG_READ_PROXY);
+			return;
+		}
+
+		// Reserve a relay buffer's worth of the session's budget as in handleClient()
+		size_t dataLen = cfg->relayBufferSize;
+		if(dataLen > allow)
+			dataLen = allow;
+		size_t* usage = s->getSendQueue()->empty() ? NULL : s->getMemUsage();
+		if(!budget->charge(usage, dataLen))
+			return;
+
+		ByteBuffer held(0);
+		uint8_t* buf = s->getSendQueue()->zerocopy() ? held.fill(dataLen) : relayBuf;
+		ssize_t lenRecv = recv(s->getProxySocket(), buf, dataLen, 0);
+
+		// Act on return of recv. 0 = disconnect, -1 = no data or an error, else the size recv'd
+		if(lenRecv == 0) {
+			budget->release(usage, dataLen);
+			printf("ProxyServer: Socket closed by the target host, disconnecting Client[%s]\n", s->getClientIP());
+			disconnectClient(s, TRACE_CLOSE_PROXY);
+			return;
+		} else if(lenRecv < 0) {
+			budget->release(usage, dataLen);
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			disconnectClient(s, TRACE_CLOSE_PROXY_ERROR);
+			return;
+		}
+
+		// Data was recieved from the target host and needs to be passed onto the Client
+		s->touch(loopNow);
+		counters.bytesProxy += lenRecv;
+		s->countProxy(lenRecv);
+		if(buf != relayBuf)
+			held.resize(lenRecv);
+		bool ok = sendData(s, buf, (unsigned int)lenRecv, (buf != relayBuf) ? &held : NULL);
+		budget->release(usage, dataLen);
+
+		// Client closed the connection
+		if(!ok) {
+			printf("ProxyServer: Client[%s] has disconnected\n", s->getClientIP());
+			disconnectClient(s, TRACE_CLOSE_CLIENT_ERROR);
+			return;
+		}
+		Trace::event(TRACE_READ_PROXY, s->getTraceId(), lenRecv, s->getSendQueue()->size());
+		updateInterest(s);
+		spend(s, FLOW_DOWN, lenRecv);
+
+		if(cfg->ioQuantum <= 0 || (size_t)lenRecv < dataLen || !s->getSendQueue()->empty() || !FD_ISSET(s->getProxySocket(), &fd_master))
+			return;
+	}
+}
+
+/**
+ * Handle Data
+ * Handle data from a Client recv'd over the wire. Called from handleClient()
+ *
+ * @param s Session whose client sent the data
+ * @param data Data recv'd
+ * @param len Length of data
+ * @param held Buffer holding exactly data if it was read into one of its own (zerocopy), NULL if data is in relayBuf
+ * @return False if the target host's socket failed. True if otherwise
+ */
+bool ProxyServer::handleData(Session* s, uint8_t* data, unsigned int len, ByteBuffer* held) {
+	// Simply forward the recieved data to the target host. What the socket doesn't take now is queued
+	if(s->getMirrorState() == MIRROR_OFF)
+		return s->getProxySendQueue()->send(s->getProxySocket(), budget, s->getMemUsage(), data, len, held);
+
+	// The mirror only ever gets a copy, whatever happens to it doesn't affect the session. If both queues have to keep some of the
+	// data they hold the same copy
+	ByteBuffer shared = (held != NULL) ? *held : ByteBuffer(0);
+	bool ok = s->getProxySendQueue()->send(s->getProxySocket(), budget, s->getMemUsage(), data, len, &shared);
+	mirrorData(s, data, len, &shared);
+	return ok;
+}
+
+/**
+ * Send Data
+ * Send data to a session's client
+ *
+ * @param s Session to send data to
+ * @param data Data to be sent
+ * @param len Length of data
+ * @param held Buffer holding exactly data if it was read into one of its own (zerocopy), NULL if otherwise
+ * @return False if the client's socket failed. True if otherwise
+ */
+bool ProxyServer::sendData(Session* s, uint8_t* data, unsigned int len, ByteBuffer* held) {
+	// Send what the socket will take now, the rest is queued and flushed when the socket becomes writable
+	return s->getSendQueue()->send(s->getSocket(), budget, s->getMemUsage(), data, len, held);
+}
+
+/**
+ * Handle Writable
+ * A socket with queued output has room in its send buffer, flush its queue
+ *
+ * @param fd Client or proxy socket descriptor
+ */
+void ProxyServer::handleWritable(SOCKET fd) {
+	Session* s = sessions->lookup(fd);
+	if(s == NULL)
+		return;
+
+	// The mirror connection has connected or has room for its queue
+	if(fd == s->getMirrorSocket()) {
+		flushMirror(s);
+		return;
+	}
+
+	// One of the session's connect attempts has completed
+	if(s->getRace() != NULL) {
+		finishConnect(s, fd);
+		return;
+	}
+
+	bool client = (fd == s->getSocket());
+	SendQueue* q = client ? s->getSendQueue() : s->getProxySendQueue();
+	int flow = client ? FLOW_DOWN : FLOW_UP;
+	unsigned int allow = allowance(s, flow);
+	if(allow == 0) {
+		queueBacklog(s, client ? BACKLOG_WRITE_CLIENT : BACKLOG_WRITE_PROXY);
+		return;
+	}
+	unsigned int before = q->size();
+	if(!q->flush(fd, budget, s->getMemUsage(), allow)) {
+		printf("ProxyServer: Client[%s] has disconnected\n", s->getClientIP());
+		disconnectClient(s, client ? TRACE_CLOSE_CLIENT_ERROR : TRACE_CLOSE_PROXY_ERROR);
+		return;
+	}
+	unsigned int sent = before - q->size();
+	Trace::event(client ? TRACE_FLUSH_CLIENT : TRACE_FLUSH_PROXY, s->getTraceId(), sent, q->size());
+	updateInterest(s);
+	spend(s, flow, sent);
+	if(sent == allow && !q->empty())
+		queueBacklog(s, client ? BACKLOG_WRITE_CLIENT : BACKLOG_WRITE_PROXY);
+}
+
+/**
+ * Allowance
+ * Bytes a session may still read or flush in one direction in the current scheduling round. Its first turn in a round tops the
+ * deficits up by a quantum. The directions are scheduled apart so a busy upload can't hold back the replies, which with a per
+ * session memory cap could leave both sides waiting on each other
+ *
+ * @param s Session about to do I/O
+ * @param flow FLOW_UP or FLOW_DOWN
+ * @return Bytes left in the direction's deficit, UINT_MAX without an I/O quantum
+ */
+unsigned int ProxyServer::allowance(Session* s, int flow) {
+	if(cfg->ioQuantum <= 0)
+		return UINT_MAX;
+	s->topUp(ioRound, cfg->ioQuantum);
+	return s->getDeficit(flow);
+}
+
+/**
+ * Spend
+ * Charge bytes a session read or flushed to the direction's deficit and to the pass
+ *
+ * @param s Session
+ * @param flow FLOW_UP or FLOW_DOWN
+ * @param n Bytes moved
+ */
+void ProxyServer::spend(Session* s, int flow, unsigned int n) {
+	if(cfg->ioQuantum <= 0)
+		return;
+	s->spend(flow, n);
+	passBytes += n;
+}
+
+/**
+ * Queue Backlog
+ * A session used its whole quantum in one direction and may have data left there. Queue it for another round
+ *
+ * @param s Session
+ * @param dir BACKLOG_* direction
+ */
+void ProxyServer::queueBacklog(Session* s, uint8_t dir) {
+	if(s->getBacklog() == 0)
+		backlog.push_back(s);
+	s->addBacklog(dir);
+}
+
+/**
+ * Service Backlog
+ * Deficit round robin over the sessions that used their whole quantum this pass. Every round gives each of them, in the order they
+ * ran out, one more quantum for the directions it was held back in. A session that uses it all again queues itself for the round
+ * after. Rounds go on until no session is left or the pass has moved cfg->ioPassBudget bytes, the rest is still ready in the kernel
+ * or the send queues and is picked up next pass, after the timers and connect races. A session with a little data is done in the
+ * first round, a bulk transfer that always has more gets the same share of the rest of the pass as every other one
+ *
+ * @param paused Reading is paused under memory pressure, only flush
+ */
+void ProxyServer::serviceBacklog(bool paused) {
+	vector<Session*> round;
+	while(!backlog.empty() && passBytes < (size_t)cfg->ioPassBudget) {
+		ioRound++;
+		counters.ioRounds++;
+		round.swap(backlog);
+		for(unsigned int i = 0; i < round.size(); i++) {
+			Session* s = round[i];
+			uint8_t dirs = s->takeBacklog();
+
+			// Flush before reading, as in the event loop. Any step may have closed the session
+			if((dirs & BACKLOG_WRITE_CLIENT) && s->isOpen())
+				handleWritable(s->getSocket());
+			if((dirs & BACKLOG_WRITE_PROXY) && s->isOpen())
+				handleWritable(s->getProxySocket());
+			if((dirs & BACKLOG_READ_CLIENT) && s->isOpen() && !paused && FD_ISSET(s->getSocket(), &fd_master))
+				handleClient(s);
+			if((dirs & BACKLOG_READ_PROXY) && s->isOpen() && !paused && FD_ISSET(s->getProxySocket(), &fd_master))
+				handleProxyClient(s);
+		}
+		round.clear();
+	}
+
+	// Out of budget. The sockets are still ready, select() reports them again right away
+	for(unsigned int i = 0; i < backlog.size(); i++) {
+		if(backlog[i]->takeBacklog() != 0)
+			counters.ioCarried++;
+	}
+	backlog.clear();
+}
+
+/**
+ * Update Interest
+ * Recompute which of a session's sockets select() should watch. A socket with queued output is watched for writability, and the
+ * side feeding a queue stops being read once the session can't afford another relay buffer, so a slow reader pushes back on its
+ * sender through TCP instead of growing the queue
+ *
+ * @param s Session to update
+ */
+void ProxyServer::updateInterest(Session* s) {
+	SOCKET csd = s->getSocket();
+	SOCKET psd = s->getProxySocket();
+	SendQueue* toClient = s->getSendQueue();
+	SendQueue* toProxy = s->getProxySendQueue();
+	size_t limit = budget->getSessionLimit();
+	bool full = (limit > 0) && (*s->getMemUsage() + cfg->relayBufferSize > limit);
+
+	if(toClient->empty())
+		FD_CLR(csd, &fd_write_master);
+	else
+		FD_SET(csd, &fd_write_master);
+
+	if(toProxy->empty())
+		FD_CLR(psd, &fd_write_master);
+	else
+		FD_SET(psd, &fd_write_master);
+
+	// Stalls and resumes are traced on the transition only
+	bool readProxy = !(full && !toClient->empty());
+	if(readProxy != (bool)FD_ISSET(psd, &fd_master))
+		Trace::event(readProxy ? TRACE_RESUME : TRACE_STALL, s->getTraceId(), 1, *s->getMemUsage());
+	if(readProxy)
+		FD_SET(psd, &fd_master);
+	else
+		FD_CLR(psd, &fd_master);
+
+	bool readClient = !(full && !toProxy->empty());
+	if(readClient != (bool)FD_ISSET(csd, &fd_master))
+		Trace::event(readClient ? TRACE_RESUME : TRACE_STALL, s->getTraceId(), 0, *s->getMemUsage());
+	if(readClient)
+		FD_SET(csd, &fd_master);
+	else
+		FD_CLR(csd, &fd_master);
+}
+
+/**
+ * Check Memory Pressure
+ * Called once per event loop pass. Reports when memory pressure starts and ends, and sheds this loop's largest session every
+ * memoryShedDelay milliseconds the pressure lasts
+ *
+ * @return True if reading should be paused. False if otherwise
+ */
+bool ProxyServer::checkMemoryPressure() {
+	if(!budget->underPressure()) {
+		if(pressureSince != 0) {
+			printf("ProxyServer: Memory pressure relieved, resuming reads\n");
+			pressureSince = 0;
+		}
+		return false;
+	}
+
+	long now = nowMs();
+	if(pressureSince == 0) {
+		printf("ProxyServer: Memory pressure, pausing reads\n");
+		budget->report();
+		pressureSince = now;
+	} else if(now - pressureSince >= cfg->memoryShedDelay) {
+		shedLargestSession();
+		pressureSince = now;
+	}
+	return true;
+}
+
+/**
+ * Shed Largest Session
+ * Disconnect the session in this event loop with the most memory charged to it
+ */
+void ProxyServer::shedLargestSession() {
+	Session* largest = NULL;
+	for(unsigned int i = 0; i < sessions->getCapacity(); i++) {
+		Session* s = sessions->at(i);
+		if(s->isOpen() && (largest == NULL || *s->getMemUsage() > *largest->getMemUsage()))
+			largest = s;
+	}
+
+	if(largest == NULL || *largest->getMemUsage() == 0)
+		return;
+
+	printf("ProxyServer: Shedding Client[%s] holding %zu bytes\n", largest->getClientIP(), *largest->getMemUsage());
+	disconnectClient(largest, TRACE_CLOSE_SHED);
+}
+
+/**
+ * Sweep Idle Sessions
+ * Disconnect every session that has seen no data in either direction for cfg->idleTimeout seconds. Catches peers that disappeared
+ * without a FIN or RST and would otherwise hold their slot forever
+ */
+void ProxyServer::sweepIdleSessions() {
+	long limit = cfg->idleTimeout * 1000L;
+	for(unsigned int i = 0; sessions != NULL && i < sessions->getCapacity(); i++) {
+		Session* s = sessions->at(i);
+		if(!s->isOpen() || loopNow - s->getLastActive() < limit)
+			continue;
+		printf("ProxyServer: Client[%s] has been idle for %i seconds\n", s->getClientIP(), cfg->idleTimeout);
+		disconnectClient(s, TRACE_CLOSE_IDLE);
+	}
+}
+
+/**
+ * Alloc Relay Buffer
+ * Allocate this event loop's receive buffer. Called from the thread that runs the loop so the memory is local to it, unless it
+ * comes from the buffer arena
+ */
+void ProxyServer::allocRelayBuffer() {
+	budget->charge(NULL, cfg->relayBufferSize, true);
+	relayBuf = (uint8_t*)BufferArena::alloc(cfg->relayBufferSize);
+	if(relayBuf == NULL)
+		relayBuf = new uint8_t[cfg->relayBufferSize];
+}
+
+/**
+ * Free Relay Buffer
+ */
+void ProxyServer::freeRelayBuffer() {
+	if(relayBuf == NULL)
+		return;
+	if(BufferArena::owns(relayBuf))
+		BufferArena::free(relayBuf, cfg->relayBufferSize);
+	else
+		delete [] relayBuf;
+	relayBuf = NULL;
+	budget->release(NULL, cfg->relayBufferSize);
+}
+
+/**
+ * Open Trace
+ * Give this event loop's thread its trace ring when tracing is on. Called from the thread that runs the loop
+ */
+void ProxyServer::openTrace() {
+	if(cfg->traceEvents <= 0)
+		return;
+	traceBytes = Trace::open(cfg->traceEvents, workerId + 1);
+	budget->charge(NULL, traceBytes, true);
+}
+
+/**
+ * Close Trace
+ */
+void ProxyServer::closeTrace() {
+	if(traceBytes == 0)
+		return;
+	Trace::close();
+	budget->release(NULL, traceBytes);
+	traceBytes = 0;
+}
+
+/**
+ * Write Trace
+ * Write this loop's ring to cfg->tracePath.<loop>. The acceptor passes the request on to its workers, each writes its own ring from
+ * its own thread so no ring is read while it is being written
+ */
+void ProxyServer::writeTrace() {
+	traceRequested = false;
+
+	for(unsigned int i = 0; i < workers.size(); i++) {
+		workers[i]->traceRequested = true;
+		workers[i]->handoff->wake();
+	}
+
+	if(traceBytes == 0) {
+		if(workerId < 0)
+			printf("ProxyServer: Tracing is off, set trace_events to record a trace\n");
+		return;
+	}
+
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), ".%i", workerId + 1);
+	Trace::dump(cfg->tracePath + suffix);
+}
+
+/**
+ * Open Stats
+ * Create the shared memory stats segment when statsShm is set, with slot 0 for the acceptor and a slot for each worker. A segment
+ * that can't be created only turns the stats off
+ */
+void ProxyServer::openStats() {
+	if(cfg->statsShm.empty())
+		return;
+
+	statsSegment = new StatsSegment();
+	if(!statsSegment->create(cfg->statsShm, cfg->workers + 1)) {
+		printf("ProxyServer: Could not create the stats segment %s, stats are off\n", cfg->statsShm.c_str());
+		delete statsSegment;
+		statsSegment = NULL;
+		return;
+	}
+	statsSlot = statsSegment->slot(0);
+}
+
+/**
+ * Publish Stats
+ * Close out this pass's timings, take the gauges and copy the counters into this loop's slot. Readers never block the loop, a
+ * reader that overlaps a publish retries on its side
+ *
+ * @param passStart StatsSegment::nowNs() taken when select() returned
+ */
+void ProxyServer::publishStats(uint64_t passStart) {
+	uint64_t now = StatsSegment::nowNs();
+	uint64_t pass = now - passStart;
+
+	counters.updatedNs = now;
+	counters.iterations++;
+	counters.busyNs += pass;
+	counters.lastPassNs = pass;
+	if(pass > counters.maxPassNs)
+		counters.maxPassNs = pass;
+	counters.sessions = activeSessions.load(memory_order_relaxed);
+	counters.memoryUsed = budget->getCurrent();
+	counters.memoryPeak = budget->getPeak();
+	counters.memoryRejected = budget->getRejected();
+	counters.arenaSize = BufferArena::getSize();
+	counters.arenaCarved = BufferArena::getCarved();
+	counters.arenaUsed = BufferArena::getUsed();
+
+	StatsSegment::publish(statsSlot, &counters);
+}
+
+/**
+ * Probe Lag
+ * Called after every wakeup. Once the probe is due, record how late the loop got to it: a probe scheduled for a time the loop
+ * spent in a long pass runs late by the rest of that pass, which is also how long a descriptor that became ready then waited.
+ * The smoothed lag decides whether the loop is overloaded, with hysteresis: it recovers below half of cfg->overloadLag
+ */
+void ProxyServer::probeLag() {
+	uint64_t now = nowUs();
+	if(now < lagProbeAt)
+		return;
+
+	uint64_t lag = now - lagProbeAt;
+	counters.lagHist[StatsSegment::lagBucket(lag)]++;
+	if(lag > counters.lagMaxUs)
+		counters.lagMaxUs = lag;
+	lagAvgUs = lagAvgUs - lagAvgUs / 4 + lag / 4;
+	lagProbeAt = now + cfg->lagProbeInterval * 1000ULL;
+
+	if(cfg->overloadLag <= 0)
+		return;
+	uint64_t limit = cfg->overloadLag * 1000ULL;
+	if(!overloaded.load(memory_order_relaxed) && lagAvgUs >= limit) {
+		printf("ProxyServer: Event loop lag is %.1f ms, overloaded\n", lagAvgUs / 1000.0);
+		overloaded.store(true, memory_order_relaxed);
+	} else if(overloaded.load(memory_order_relaxed) && lagAvgUs < limit / 2) {
+		printf("ProxyServer: Event loop lag is down to %.1f ms\n", lagAvgUs / 1000.0);
+		overloaded.store(false, memory_order_relaxed);
+	}
+	counters.overloaded = overloaded.load(memory_order_relaxed) ? 1 : 0;
+}
+
+/**
+ * Admitting
+ * Whether the listener should take on new sessions. Without workers that is this loop's call, with workers the acceptor holds
+ * back only while every worker is overloaded
+ *
+ * @return False if new connections should be deferred or rejected. True if otherwise
+ */
+bool ProxyServer::admitting() {
+	if(cfg->overloadLag <= 0 || cfg->lagProbeInterval <= 0)
+		return true;
+	if(workers.empty())
+		return !overloaded.load(memory_order_relaxed);
+	for(unsigned int i = 0; i < workers.size(); i++) {
+		if(!workers[i]->overloaded.load(memory_order_relaxed))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Reject Connection
+ * Close a connection accepted while overloaded. With overloadRst a zero linger makes close() send a RST, so the client sees
+ * the refusal at once and no TIME_WAIT is left behind
+ *
+ * @param clfd Accepted client socket descriptor
+ */
+void ProxyServer::rejectConnection(SOCKET clfd) {
+	if(cfg->overloadRst) {
+		linger lg = { 1, 0 };
+		setsockopt(clfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	}
+	close(clfd);
+	counters.sessionsRejected++;
+}
+
+/**
+ * Report Lag
+ * Log this loop's lag percentiles and what overload control did, at shutdown
+ */
+void ProxyServer::reportLag() {
+	char p50[16], p99[16];
+	StatsSegment::lagLabel(p50, sizeof(p50), StatsSegment::lagPercentile(counters.lagHist, 0.5));
+	StatsSegment::lagLabel(p99, sizeof(p99), StatsSegment::lagPercentile(counters.lagHist, 0.99));
+	printf("ProxyServer: Event loop lag p50 %s, p99 %s, max %.1f ms\n", p50, p99, counters.lagMaxUs / 1000.0);
+	if(cfg->overloadLag > 0) {
+		printf("ProxyServer: Accepts deferred for %llu ms, %llu connections rejected, %llu passes capped\n",
+			(unsigned long long)counters.acceptDeferredMs, (unsigned long long)counters.sessionsRejected, (unsigned long long)counters.passesCapped);
+	}
+}
+
+/**
+ * Disconnect Client
+ * Close the session's client and proxy sockets, remove them from the FD sets and return the session to the slab
+ *
+ * @param s Session to disconnect
+ * @param reason TRACE_CLOSE_* reason, recorded in the trace
+ */
+void ProxyServer::disconnectClient(Session* s, int reason) {
+    if (s == NULL)
+        return;
+    int err = (reason == TRACE_CLOSE_CLIENT_ERROR || reason == TRACE_CLOSE_PROXY_ERROR) ? errno : 0;
+    Trace::event(TRACE_CLOSE, s->getTraceId(), reason, err);
+    s->logAccess(reason, err);
+    
+	// Remove from the FD sets (used in select()) and the descriptor table
+    FD_CLR(s->getSocket(), &fd_master);
+	FD_CLR(s->getSocket(), &fd_write_master);
+	sessions->untrack(s->getSocket());
+
+	// A session that never got its backend connected has no proxy socket, it may still have connect attempts in flight
+	if(s->getRace() != NULL)
+		endRace(s);
+	if(s->getMirrorSocket() != INVALID_SOCKET)
+		stopMirror(s, false);
+	if(s->getProxySocket() != INVALID_SOCKET) {
+		FD_CLR(s->getProxySocket(), &fd_master);
+		FD_CLR(s->getProxySocket(), &fd_write_master);
+		sessions->untrack(s->getProxySocket());
+	}
+
+	// Sockets whose zerocopy sends haven't all completed outlive the session
+	lingerZerocopy(s->getSendQueue()->takeZerocopy());
+	lingerZerocopy(s->getProxySendQueue()->takeZerocopy());
+
+	// Close the socket descriptors and free the slot
+	s->close();
+	sessions->release(s);
+    activeSessions--;
+}
+
+/**
+ * Linger Zerocopy
+ * A session is closing. If the kernel may still be sending from the buffers of one of its sockets, keep the socket open until
+ * the completions arrive so the buffers aren't reused under it
+ *
+ * @param zc Zerocopy state taken from one of the session's queues, may be NULL
+ */
+void ProxyServer::lingerZerocopy(ZeroCopy* zc) {
+	if(zc == NULL)
+		return;
+	zc->reap();
+	if(zc->idle()) {
+		delete zc;
+		return;
+	}
+	zc->linger(loopNow);
+	lingering.push_back(zc);
+}
+
+/**
+ * Reap Lingering
+ * Called once per pass while sockets are lingering. Close the ones that are done, reset the ones that have taken too long
+ */
+void ProxyServer::reapLingering() {
+	for(list<ZeroCopy*>::iterator it = lingering.begin(); it != lingering.end(); ) {
+		ZeroCopy* zc = *it;
+		zc->reap();
+		if(zc->idle() || zc->expired(loopNow)) {
+			delete zc;
+			it = lingering.erase(it);
+		} else {
+			it++;
+		}
+	}
+}
+
+/**
+ * Close Sockets
+ * Close all open sessions. Called on server shutdown
+ */
+void ProxyServer::closeSockets() {
+	printf("ProxyServer: Closing all connections and shutting down the listening socket..\n");
+
+	// Unwind the coroutine sessions, each one closes its own sockets
+	reactor->stop();
+
+	// Loop through the slab and disconnect every open session. Queued output gets a last non blocking flush first
+	for(unsigned int i = 0; sessions != NULL && i < sessions->getCapacity(); i++) {
+		Session* s = sessions->at(i);
+		if(!s->isOpen())
+			continue;
+		s->getSendQueue()->flush(s->getSocket(), budget, s->getMemUsage());
+		s->getProxySendQueue()->flush(s->getProxySocket(), budget, s->getMemUsage());
+		disconnectClient(s, TRACE_CLOSE_SHUTDOWN);
+	}
+
+	// The process is going away, the kernel keeps the pages it still sends from
+	while(!lingering.empty()) {
+		delete lingering.front();
+		lingering.pop_front();
+	}
+
+	// Closing a tunnel closes the streams it carries
+	while(!tunnels.empty()) {
+		delete tunnels.back();
+		tunnels.pop_back();
+	}
+
+	// Every slot, coroutine session and descriptor pair should be back by now
+	if(sessions != NULL && sessions->getUsed() != 0)
+		printf("ProxyServer: %u sessions were not returned to the slab\n", sessions->getUsed());
+	if(activeSessions.load() != 0)
+		printf("ProxyServer: Session count is %i after closing every session\n", activeSessions.load());
+
+	if(cfg->lagProbeInterval > 0)
+		reportLag();
+	if(cfg->zerocopyThreshold > 0)
+		printf("ProxyServer: Sent %llu bytes zerocopy, %llu sends copied by the kernel anyway, %llu sockets fell back to plain sends\n",
+			(unsigned long long)counters.zerocopyBytes, (unsigned long long)counters.zerocopyCopied, (unsigned long long)counters.zerocopyFallbacks);
+	if(mirror != NULL)
+		printf("ProxyServer: Mirrored %llu bytes, dropped %llu bytes, %llu mirror connections cut off\n", (unsigned long long)counters.mirrorBytes,
+			(unsigned long long)counters.mirrorDropped, (unsigned long long)counters.mirrorCut);
+    
+    // Release the reserve descriptor
+    if(reserveFd != INVALID_SOCKET) {
+        close(reserveFd);
+        reserveFd = INVALID_SOCKET;
+    }
+
+    // Stop answering successors. The path is left alone if a successor took the listener, it has bound its own socket there
+    if(handoverSocket != INVALID_SOCKET) {
+        close(handoverSocket);
+        handoverSocket = INVALID_SOCKET;
+        if(!handedOver)
+            unlink(cfg->handoverPath.c_str());
+    }
+
+    // Workers and drained servers have no listening socket
+    if(listenSocket == INVALID_SOCKET)
+        return;
+
     // Shutdown the listening socket
     shutdown(listenSocket, SHUT_RDWR);
     
@@ -29,13 +29,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
 #include <list>
 #include <map>
+#include <vector>
+#include <atomic>
 
 #include "config.h"
+#include "Config.h"
+#include "SocketOptions.h"
 #include "ByteBuffer.h"
-#include "Client.h"
-#include "ProxyClient.h"
+#include "Session.h"
+#include "SessionPool.h"
+#include "Handover.h"
+#include "ClientHello.h"
+#include "SniRouter.h"
+#include "UdpRelay.h"
+#include "HandoffQueue.h"
+#include "Affinity.h"
+#include "MemoryBudget.h"
+#include "SendQueue.h"
+#include "Reactor.h"
+#include "CoroSession.h"
+#include "Tunnel.h"
+#include "Trace.h"
+#include "AccessLog.h"
+#include "Stats.h"
+#include "Upstream.h"
+#include "ZeroCopy.h"
+#include "BufferArena.h"
+#include <time.h>
 
 #define SOCKET int
 #define INVALID_SOCKET -1
@@ -45,32 +73,176 @@ using namespace std;
 class ProxyServer {
     
 private:
-	bool canRun;
+	Config* cfg; // Runtime configuration (not owned)
+	atomic<bool> canRun; // Cleared from the signal handler, or by the acceptor for its workers
     SOCKET listenSocket; // Descriptor for the listening socket
-    map<SOCKET, Client*> *clientMap; // Maps a Socket descriptor to a pointer to a Client object (connected clients only)
+    int reserveFd; // Spare descriptor released to shed connections when the process runs out of descriptors
+    SessionPool* sessions; // Slab of this event loop's sessions, indexed by client and proxy descriptor
+    Upstream* upstream; // Every address of the target host, resolved once at startup. Owned by the acceptor, shared with the workers
+    vector<Session*> connecting; // Sessions racing connects to their backend's addresses, indexed by ConnectRace::slot
+    SniRouter* router; // SNI routes, NULL unless sniRouting. Owned by the acceptor, shared read only with the workers
+    Upstream* mirror; // Shadow backend, NULL unless cfg->mirror is set. Owned by the acceptor like upstream
+    MemoryBudget* mirrorBudget; // Mirror queues are charged here, apart from the relay's budget. Owned by the acceptor
+    uint32_t mirrorSeed; // xorshift state used to sample the mirrored sessions
     struct sockaddr_in serverAddr; // Structure for the server address
     fd_set fd_master; // Master file descriptor set (listening socket + client sockets)
     fd_set fd_read; // FD set of sockets being read/operated on
+    fd_set fd_write_master; // Sockets with queued output waiting for the kernel to take it
+    fd_set fd_write; // FD set of sockets being written
     int fdmax; // Max FD number (max sockets handle)
+
+    // Worker threads. The acceptor owns the workers, each worker is a ProxyServer with no listenSocket and its own handoff queue
+    vector<ProxyServer*> workers;
+    unsigned int nextWorker; // Where the acceptor's next least loaded scan starts
+    int workerId; // -1 for the acceptor
+    int cpu; // CPU this worker is pinned to, -1 if unpinned
+    pthread_t thread;
+    HandoffQueue* handoff; // Accepted connections waiting to be adopted by this worker
+    atomic<int> activeSessions; // Sessions open in this event loop, read by the acceptor
+
+    // Memory accounting. The acceptor owns the budget, workers share it
+    MemoryBudget* budget;
+    uint8_t* relayBuf; // Receive buffer for this event loop, relayBufferSize bytes
+    long pressureSince; // Milliseconds timestamp memory pressure started, 0 if not under pressure
+    long loopNow; // nowMs() taken once per event loop pass, after select() returns
+    long lastIdleSweep; // loopNow of the last idle session sweep
+
+    Reactor* reactor; // Resumes the coroutine sessions (ENGINE_COROUTINE) from this event loop
+
+    // Tunnel mode
+    vector<Tunnel*> tunnels; // This event loop's tunnel connections
+    Tunnel** tunnelFds; // Tunnel owning each descriptor, FD_SETSIZE entries. NULL unless tunnelMode is set
+
+    // Drain and listener handover
+    atomic<bool> drainRequested; // Set from the SIGUSR2 handler, or by the acceptor for its workers
+    bool draining;
+    long drainDeadline; // nowMs() after which the remaining sessions are closed
+    SOCKET handoverSocket; // Unix socket a successor asks for the listener on, INVALID_SOCKET if off
+    bool handedOver; // The listener went to a successor, which now owns the handover path
+
+    // Event tracing
+    atomic<bool> traceRequested; // Set from the SIGUSR1 handler, or by the acceptor for its workers
+    size_t traceBytes; // Size of this loop's trace ring, 0 if tracing is off
+
+    // Access log. The acceptor opens it, every loop fills its own blocks
+    size_t accessLogBytes; // Blocks allocated by the acceptor, 0 if the access log is off
+
+    // Shared memory stats. The acceptor owns the segment, every loop publishes its counters into its own slot
+    StatsSegment* statsSegment;
+    StatsSlot* statsSlot; // NULL if statsShm is off
+    StatsCounters counters; // This loop's counters, copied into statsSlot once per pass
+
+    // Event loop lag and overload admission control
+    uint64_t lagProbeAt; // nowUs() the next lag probe is due
+    uint64_t lagAvgUs; // Smoothed lag, weight 1/4 per probe
+    atomic<bool> overloaded; // Set while lagAvgUs is over cfg->overloadLag, read by the acceptor
+    long deferredSince; // loopNow accepts started being held back, 0 while admitting
+    bool rejecting; // This pass accepts pending connections only to reject them
+    int passCursor; // Descriptor the next capped pass starts at
+    sigset_t loopMask; // Signal mask while waiting in pselect(), the stop and drain signals are blocked the rest of the time
+
+    // Fair I/O scheduling (deficit round robin)
+    uint32_t ioRound; // Current scheduling round, the ready descriptors of a pass are serviced in one round
+    size_t passBytes; // Bytes moved so far this pass
+    vector<Session*> backlog; // Sessions that used their whole quantum with data left, in the order they did
+
+    // Closed sockets the kernel may still be sending zerocopy data from, kept open with their buffers until it is done
+    list<ZeroCopy*> lingering;
     
 private:
     bool initSocket(int port);
+    bool inheritSocket();
+    void openHandover();
+    void handleHandover();
+    void startDrain(bool handed);
+    bool drainFinished();
     void closeSockets();
     void acceptConnection();
-    void disconnectClient(Client*);
-    void handleClient(Client*);
-    void sendData(Client*, ByteBuffer*);
-    Client* getClient(SOCKET);
-	Client* getProxyClientOwner(SOCKET);
-    void handleData(Client*, ByteBuffer*);
+    void dispatchClient(SOCKET, sockaddr_in);
+    void addClient(SOCKET, sockaddr_in);
+    bool openReserveFd();
+    bool shedConnection();
+    bool resolveUpstream();
+    void disconnectClient(Session*, int);
+    void startConnect(Session*, Upstream*);
+    bool advanceConnect(Session*);
+    void finishConnect(Session*, SOCKET);
+    void endRace(Session*);
+    void startMirror(Session*);
+    void mirrorData(Session*, uint8_t*, unsigned int, ByteBuffer*);
+    void handleMirror(Session*);
+    void flushMirror(Session*);
+    void stopMirror(Session*, bool);
+    Tunnel* pickTunnel();
+    void serviceTunnel(SOCKET, bool);
+    void removeTunnel(Tunnel*);
+    void handleClient(Session*);
+    void handleHello(Session*);
+    bool sendData(Session*, uint8_t*, unsigned int, ByteBuffer*);
+    void handleProxyClient(Session*);
+    void handleWritable(SOCKET);
+    unsigned int allowance(Session*, int);
+    void spend(Session*, int, unsigned int);
+    void queueBacklog(Session*, uint8_t);
+    void serviceBacklog(bool);
+    void lingerZerocopy(ZeroCopy*);
+    void reapLingering();
+    void updateInterest(Session*);
+    bool checkMemoryPressure();
+    void shedLargestSession();
+    void sweepIdleSessions();
+    void allocRelayBuffer();
+    void freeRelayBuffer();
+    void openTrace();
+    void closeTrace();
+    void writeTrace();
+    void openStats();
+    void publishStats(uint64_t);
+    void probeLag();
+    bool admitting();
+    void rejectConnection(SOCKET);
+    void reportLag();
+    void runUdpServer();
+    void serviceSockets();
+    void releaseServer(bool);
+    bool startWorkers();
+    void stopWorkers();
+    static void* workerThread(void*);
+    void runWorker();
+    void drainHandoff();
+    bool reuseportSteering() {
+        return cfg->workers > 0 && cfg->steering == STEER_REUSEPORT_CBPF;
+    }
+    bool handleData(Session*, uint8_t*, unsigned int, ByteBuffer*);
     
 public:
-    ProxyServer();
+    ProxyServer(Config* c);
     ~ProxyServer();
     void runServer();
     void stopServer() {
     	canRun = false;
     }
+    void drainServer() {
+        drainRequested = true;
+    }
+    void dumpTrace() {
+        traceRequested = true;
+    }
+
+    static long nowMs() {
+        return Reactor::nowMs();
+    }
+
+    static uint64_t nowUs() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    }
+
+    // Load used to pick a worker: active sessions plus connections still waiting in the handoff queue
+    unsigned int getLoad() {
+        return activeSessions.load(memory_order_relaxed) + (handoff != NULL ? handoff->size() : 0);
+    }
 
 };
 
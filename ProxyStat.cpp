@@ -0,0 +1,186 @@
+/**
+   tcp_proxy
+   ProxyStat.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Reader for the shared memory stats segment. Samples every event loop's slot and prints rates over each interval
+// Usage: proxystat [-i interval ms] [-n samples] [segment name]
+// in = bytes read from clients, out = bytes read from target hosts, maxpass = longest event loop pass in microseconds
+// lag = how late the event loops ran their lag probes, "overloaded" = loops whose lag is over overload_lag right now
+// arena = buffer arena usage, fragmented = carved bytes sitting on the free lists of one block size
+// zerocopy = bytes sent with MSG_ZEROCOPY, sends the kernel had to copy anyway and sockets that fell back to plain sends
+// io = scheduling rounds for sessions that used their whole io_quantum, and those left over when io_pass_budget ran out
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Stats.h"
+
+using namespace std;
+
+/**
+ * Print Row
+ * One line of rates between two samples of a slot (or of the totals)
+ */
+static void printRow(const char* label, const StatsCounters& a, const StatsCounters& b, double sec) {
+	double mb = 1024.0 * 1024.0;
+	long closed = (long)((b.accepted - a.accepted) - (b.sessions - a.sessions));
+	printf("%5s %9llu %9.1f %9.1f %9.2f %9.2f %9.0f %6.1f %9.1f\n", label, (unsigned long long)b.sessions,
+		(b.accepted - a.accepted) / sec, closed / sec, (b.bytesClient - a.bytesClient) / mb / sec, (b.bytesProxy - a.bytesProxy) / mb / sec,
+		(b.iterations - a.iterations) / sec, (b.busyNs - a.busyNs) / (sec * 1e9) * 100.0, b.maxPassNs / 1000.0);
+}
+
+/**
+ * Sum
+ * Add a slot's counters into the totals
+ */
+static void sum(StatsCounters* total, const StatsCounters& c) {
+	total->iterations += c.iterations;
+	total->busyNs += c.busyNs;
+	if(c.maxPassNs > total->maxPassNs)
+		total->maxPassNs = c.maxPassNs;
+	total->accepted += c.accepted;
+	total->bytesClient += c.bytesClient;
+	total->bytesProxy += c.bytesProxy;
+	total->sessions += c.sessions;
+	total->mirrorBytes += c.mirrorBytes;
+	total->mirrorDropped += c.mirrorDropped;
+	total->mirrorCut += c.mirrorCut;
+	for(int b = 0; b < STATS_LAG_BUCKETS; b++)
+		total->lagHist[b] += c.lagHist[b];
+	if(c.lagMaxUs > total->lagMaxUs)
+		total->lagMaxUs = c.lagMaxUs;
+	total->acceptDeferredMs += c.acceptDeferredMs;
+	total->sessionsRejected += c.sessionsRejected;
+	total->passesCapped += c.passesCapped;
+	total->overloaded += c.overloaded;
+	total->ioRounds += c.ioRounds;
+	total->ioCarried += c.ioCarried;
+	total->zerocopyBytes += c.zerocopyBytes;
+	total->zerocopyCopied += c.zerocopyCopied;
+	total->zerocopyFallbacks += c.zerocopyFallbacks;
+}
+
+int main(int argc, const char* argv[]) {
+	int interval = 1000;
+	long samples = 0;
+	const char* name = "/tcp_proxy";
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+			interval = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			samples = atol(argv[++i]);
+		else if(argv[i][0] == '/')
+			name = argv[i];
+		else {
+			printf("Usage: %s [-i interval ms] [-n samples] [segment name]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(interval <= 0)
+		interval = 1000;
+
+	StatsSegment seg;
+	if(!seg.attach(name)) {
+		printf("proxystat: Could not open %s, is stats_shm set in the proxy's configuration?\n", name);
+		return 1;
+	}
+
+	unsigned int loops = seg.getLoops();
+	vector<StatsCounters> prev(loops), cur(loops);
+	for(unsigned int i = 0; i < loops; i++)
+		StatsSegment::read(seg.slot(i), &prev[i]);
+	uint64_t prevNs = StatsSegment::nowNs();
+
+	printf("proxystat: %s, pid %llu, %u event loops\n", name, (unsigned long long)seg.getHeader()->pid, loops);
+	for(long n = 0; samples == 0 || n < samples; n++) {
+		usleep(interval * 1000);
+
+		for(unsigned int i = 0; i < loops; i++) {
+			if(!StatsSegment::read(seg.slot(i), &cur[i]))
+				cur[i] = prev[i];
+		}
+		uint64_t nowNs = StatsSegment::nowNs();
+		double sec = (nowNs - prevNs) / 1e9;
+
+		if(kill((pid_t)seg.getHeader()->pid, 0) != 0) {
+			printf("proxystat: The proxy has exited\n");
+			return 0;
+		}
+
+		printf("\n%5s %9s %9s %9s %9s %9s %9s %6s %9s\n", "loop", "sessions", "accept/s", "close/s", "in MB/s", "out MB/s", "passes/s",
+			"busy%", "maxpass");
+		StatsCounters totalPrev, totalCur;
+		memset(&totalPrev, 0, sizeof(totalPrev));
+		memset(&totalCur, 0, sizeof(totalCur));
+		for(unsigned int i = 0; i < loops; i++) {
+			char label[16];
+			snprintf(label, sizeof(label), "%u", i);
+			printRow(label, prev[i], cur[i], sec);
+			sum(&totalPrev, prev[i]);
+			sum(&totalCur, cur[i]);
+		}
+		if(loops > 1)
+			printRow("all", totalPrev, totalCur, sec);
+
+		// The memory gauges are the shared budget's, every loop publishes the same values. Take the freshest
+		StatsCounters* fresh = &cur[0];
+		for(unsigned int i = 1; i < loops; i++) {
+			if(cur[i].updatedNs > fresh->updatedNs)
+				fresh = &cur[i];
+		}
+		printf("memory %.2f MB (peak %.2f MB), %llu allocations rejected\n", fresh->memoryUsed / (1024.0 * 1024.0),
+			fresh->memoryPeak / (1024.0 * 1024.0), (unsigned long long)fresh->memoryRejected);
+		if(fresh->arenaSize > 0) {
+			printf("arena %.2f MB used, %.2f MB carved of %.0f MB, %.1f%% fragmented\n", fresh->arenaUsed / (1024.0 * 1024.0),
+				fresh->arenaCarved / (1024.0 * 1024.0), fresh->arenaSize / (1024.0 * 1024.0),
+				(fresh->arenaCarved > 0) ? (fresh->arenaCarved - fresh->arenaUsed) * 100.0 / fresh->arenaCarved : 0.0);
+		}
+		// Lag percentiles of the probes taken during the interval, across all loops
+		uint64_t lag[STATS_LAG_BUCKETS];
+		for(int b = 0; b < STATS_LAG_BUCKETS; b++)
+			lag[b] = totalCur.lagHist[b] - totalPrev.lagHist[b];
+		if(StatsSegment::lagPercentile(lag, 0.5) >= 0) {
+			char p50[16], p99[16];
+			StatsSegment::lagLabel(p50, sizeof(p50), StatsSegment::lagPercentile(lag, 0.5));
+			StatsSegment::lagLabel(p99, sizeof(p99), StatsSegment::lagPercentile(lag, 0.99));
+			printf("lag p50 %s, p99 %s, max %.1f ms, %llu overloaded, deferred %.0f ms/s, rejected %.1f/s, capped %.1f passes/s\n", p50, p99,
+				totalCur.lagMaxUs / 1000.0, (unsigned long long)totalCur.overloaded, (totalCur.acceptDeferredMs - totalPrev.acceptDeferredMs) / sec,
+				(totalCur.sessionsRejected - totalPrev.sessionsRejected) / sec, (totalCur.passesCapped - totalPrev.passesCapped) / sec);
+		}
+		if(totalCur.ioRounds > 0) {
+			printf("io %.1f extra rounds/s, %.1f backlogged sessions/s carried to the next pass\n", (totalCur.ioRounds - totalPrev.ioRounds) / sec,
+				(totalCur.ioCarried - totalPrev.ioCarried) / sec);
+		}
+		if(totalCur.zerocopyBytes > 0) {
+			printf("zerocopy %.2f MB/s, %.1f sends/s copied anyway, %llu sockets fell back\n", (totalCur.zerocopyBytes - totalPrev.zerocopyBytes) /
+				(1024.0 * 1024.0) / sec, (totalCur.zerocopyCopied - totalPrev.zerocopyCopied) / sec, (unsigned long long)totalCur.zerocopyFallbacks);
+		}
+		if(totalCur.mirrorBytes + totalCur.mirrorDropped > 0) {
+			printf("mirror %.2f MB/s, dropped %.2f MB/s, %llu connections cut off\n", (totalCur.mirrorBytes - totalPrev.mirrorBytes) / (1024.0 * 1024.0) / sec,
+				(totalCur.mirrorDropped - totalPrev.mirrorDropped) / (1024.0 * 1024.0) / sec, (unsigned long long)totalCur.mirrorCut);
+		}
+
+		prev = cur;
+		prevNs = nowNs;
+	}
+	return 0;
+}
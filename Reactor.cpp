@@ -0,0 +1,342 @@
+/**
+   tcp_proxy
+   Reactor.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Reactor.h"
+
+/**
+ * IoWaiter Constructor
+ *
+ * @param r Reactor that resumes the waiting coroutine
+ * @param f Descriptor to wait on, INVALID_SOCKET for timers
+ * @param d IO_READ, IO_WRITE or IO_TIMER
+ * @param t Timeout in milliseconds, 0 waits forever
+ */
+IoWaiter::IoWaiter(Reactor* r, SOCKET f, int d, long t) {
+	reactor = r;
+	fd = f;
+	dir = d;
+	timeoutMs = t;
+	result = IO_READY;
+	timed = false;
+}
+
+/**
+ * Await Ready
+ * A stopping Reactor completes every new wait right away so sessions unwind instead of suspending again
+ */
+bool IoWaiter::await_ready() {
+	if(!reactor->isStopping())
+		return false;
+	result = IO_CANCELLED;
+	return true;
+}
+
+/**
+ * Await Suspend
+ * Register with the Reactor, the coroutine is resumed from the event loop
+ */
+void IoWaiter::await_suspend(coroutine_handle<> h) {
+	handle = h;
+	reactor->add(this);
+}
+
+ReadAwait::ReadAwait(Reactor* r, SOCKET f, uint8_t* b, size_t l, long t) : IoWaiter(r, f, IO_READ, t) {
+	buf = b;
+	len = l;
+}
+
+ssize_t ReadAwait::await_resume() {
+	if(result != IO_READY) {
+		errno = (result == IO_TIMEOUT) ? ETIMEDOUT : ECANCELED;
+		return -1;
+	}
+	return recv(fd, buf, len, 0);
+}
+
+WriteAwait::WriteAwait(Reactor* r, SOCKET f, SendQueue* q, MemoryBudget* b, size_t* u, uint8_t* d, unsigned int l, long t)
+	: IoWaiter(r, f, IO_WRITE, t) {
+	queue = q;
+	budget = b;
+	usage = u;
+	data = d;
+	len = l;
+	failed = false;
+}
+
+/**
+ * Await Ready
+ * Try the send first, only suspend if part of the data had to be queued. The queue copies the data so the caller's buffer may be
+ * reused while the coroutine is suspended
+ */
+bool WriteAwait::await_ready() {
+	if(IoWaiter::await_ready())
+		return true;
+	if(!queue->send(fd, budget, usage, data, len))
+		failed = true;
+	return failed || queue->empty();
+}
+
+/**
+ * Poll
+ * The socket is writable, flush the queue. Keep waiting until it has drained
+ */
+bool WriteAwait::poll() {
+	if(!queue->flush(fd, budget, usage))
+		failed = true;
+	return failed || queue->empty();
+}
+
+bool WriteAwait::await_resume() {
+	return result == IO_READY && !failed;
+}
+
+ConnectAwait::ConnectAwait(Reactor* r, SOCKET f, const sockaddr* a, socklen_t al, long t) : IoWaiter(r, f, IO_WRITE, t) {
+	addr = a;
+	addrLen = al;
+	err = 0;
+}
+
+/**
+ * Await Ready
+ * Start the connect. Only suspend while it is in progress
+ */
+bool ConnectAwait::await_ready() {
+	if(IoWaiter::await_ready()) {
+		err = ECANCELED;
+		return true;
+	}
+
+	if(::connect(fd, addr, addrLen) == 0)
+		return true;
+	if(errno == EINPROGRESS)
+		return false;
+	err = errno;
+	return true;
+}
+
+/**
+ * Await Resume
+ * The socket turned writable, the outcome of the connect is in SO_ERROR
+ */
+int ConnectAwait::await_resume() {
+	if(err != 0)
+		return err;
+	if(result == IO_TIMEOUT)
+		return ETIMEDOUT;
+	if(result == IO_CANCELLED)
+		return ECANCELED;
+
+	socklen_t errLen = sizeof(err);
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) != 0)
+		err = errno;
+	return err;
+}
+
+TimerAwait::TimerAwait(Reactor* r, long ms) : IoWaiter(r, INVALID_SOCKET, IO_TIMER, ms) {
+}
+
+/**
+ * Reactor Constructor
+ *
+ * @param r Master read set of the event loop
+ * @param w Master write set of the event loop
+ * @param max Highest descriptor of the event loop, raised when a waiter registers a higher one
+ */
+Reactor::Reactor(fd_set* r, fd_set* w, int* max) {
+	readSet = r;
+	writeSet = w;
+	fdmax = max;
+	for(int i = 0; i < FD_SETSIZE; i++) {
+		readers[i] = NULL;
+		writers[i] = NULL;
+	}
+	waiting = 0;
+	stopping = false;
+}
+
+/**
+ * Reactor Destructor
+ * stop() has to have been called first so no coroutine is left suspended
+ */
+Reactor::~Reactor() {
+}
+
+/**
+ * Add
+ * Register a suspended waiter by descriptor and, if it has a timeout, by deadline
+ *
+ * @param w Waiter, stays owned by its coroutine frame
+ */
+void Reactor::add(IoWaiter* w) {
+	if(w->dir == IO_READ) {
+		readers[w->fd] = w;
+		FD_SET(w->fd, readSet);
+	} else if(w->dir == IO_WRITE) {
+		writers[w->fd] = w;
+		FD_SET(w->fd, writeSet);
+	}
+	if(w->fd > *fdmax)
+		*fdmax = w->fd;
+
+	if(w->timeoutMs > 0 || w->dir == IO_TIMER) {
+		w->timer = timers.insert(pair<long, IoWaiter*>(nowMs() + w->timeoutMs, w));
+		w->timed = true;
+	}
+	waiting++;
+}
+
+/**
+ * Unregister
+ * Remove a waiter from the descriptor tables, the loop's sets and the timer map
+ */
+void Reactor::unregister(IoWaiter* w) {
+	if(w->dir == IO_READ) {
+		readers[w->fd] = NULL;
+		FD_CLR(w->fd, readSet);
+	} else if(w->dir == IO_WRITE) {
+		writers[w->fd] = NULL;
+		FD_CLR(w->fd, writeSet);
+	}
+
+	if(w->timed) {
+		timers.erase(w->timer);
+		w->timed = false;
+	}
+	waiting--;
+}
+
+/**
+ * Complete
+ * Unregister a waiter and resume its coroutine
+ */
+void Reactor::complete(IoWaiter* w, int result) {
+	unregister(w);
+	w->result = result;
+	w->handle.resume();
+}
+
+/**
+ * Is Waiting
+ *
+ * @param fd Descriptor select() reported
+ * @param dir IO_READ or IO_WRITE
+ * @return True if a coroutine is waiting on the descriptor in that direction. False if the descriptor belongs to a callback session
+ */
+bool Reactor::isWaiting(SOCKET fd, int dir) {
+	if(dir == IO_READ)
+		return readers[fd] != NULL;
+	return writers[fd] != NULL;
+}
+
+/**
+ * Fire
+ * select() reported the descriptor ready, let the waiter complete its operation and resume the coroutine if it is done
+ *
+ * @param fd Ready descriptor
+ * @param dir IO_READ or IO_WRITE
+ */
+void Reactor::fire(SOCKET fd, int dir) {
+	IoWaiter* w = (dir == IO_READ) ? readers[fd] : writers[fd];
+	if(w == NULL || !w->poll())
+		return;
+	complete(w, IO_READY);
+}
+
+/**
+ * Fire Timers
+ * Resume every waiter whose deadline has passed. Timers complete with IO_READY, descriptor waits with IO_TIMEOUT
+ *
+ * @param now Current nowMs()
+ */
+void Reactor::fireTimers(long now) {
+	while(!timers.empty() && timers.begin()->first <= now) {
+		IoWaiter* w = timers.begin()->second;
+		complete(w, (w->dir == IO_TIMER) ? IO_READY : IO_TIMEOUT);
+	}
+}
+
+/**
+ * Next Timeout
+ * How long the event loop may block in select() before a timer is due
+ *
+ * @param now Current nowMs()
+ * @return Milliseconds until the earliest deadline, 0 if cancelled waiters still have to be resumed, -1 if nothing is scheduled
+ */
+int Reactor::nextTimeout(long now) {
+	if(!ready.empty())
+		return 0;
+	if(timers.empty())
+		return -1;
+
+	long due = timers.begin()->first - now;
+	return (due < 0) ? 0 : (int)due;
+}
+
+/**
+ * Cancel
+ * End any wait on the descriptor with IO_CANCELLED. The coroutines are resumed later by runReady(), never from inside the caller,
+ * so a session can cancel its other half and keep running
+ *
+ * @param fd Descriptor
+ */
+void Reactor::cancel(SOCKET fd) {
+	if(fd == INVALID_SOCKET)
+		return;
+
+	IoWaiter* ws[2] = { readers[fd], writers[fd] };
+	for(int i = 0; i < 2; i++) {
+		if(ws[i] == NULL)
+			continue;
+		unregister(ws[i]);
+		ws[i]->result = IO_CANCELLED;
+		ready.push_back(ws[i]);
+	}
+}
+
+/**
+ * Run Ready
+ * Resume the cancelled waiters. Called once per event loop pass
+ */
+void Reactor::runReady() {
+	while(!ready.empty()) {
+		vector<IoWaiter*> batch;
+		batch.swap(ready);
+		for(unsigned int i = 0; i < batch.size(); i++)
+			batch[i]->handle.resume();
+	}
+}
+
+/**
+ * Stop
+ * Cancel every wait and resume the coroutines until all of them have finished. Waits started after this complete immediately
+ */
+void Reactor::stop() {
+	stopping = true;
+
+	for(int fd = 0; fd < FD_SETSIZE; fd++)
+		cancel(fd);
+
+	while(!timers.empty()) {
+		IoWaiter* w = timers.begin()->second;
+		unregister(w);
+		w->result = IO_CANCELLED;
+		ready.push_back(w);
+	}
+
+	runReady();
+}
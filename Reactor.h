@@ -0,0 +1,211 @@
+/**
+   tcp_proxy
+   Reactor.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <coroutine>
+#include <map>
+#include <vector>
+
+#include "Coroutine.h"
+#include "SendQueue.h"
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+// What an IoWaiter is waiting for
+#define IO_READ 0
+#define IO_WRITE 1
+#define IO_TIMER 2
+
+// How the wait ended (IoWaiter::result)
+#define IO_READY 0 // The descriptor became ready or the timer expired
+#define IO_TIMEOUT 1 // The descriptor didn't become ready within the timeout
+#define IO_CANCELLED 2 // Reactor::cancel() or Reactor::stop()
+
+using namespace std;
+
+class Reactor;
+
+/**
+ * IO Waiter
+ * Base of the awaitables. While its coroutine is suspended the waiter lives in the coroutine frame and is registered with the Reactor
+ * by descriptor and direction, plus by deadline if it has a timeout
+ */
+class IoWaiter {
+public:
+	Reactor* reactor;
+	SOCKET fd;
+	int dir; // IO_READ, IO_WRITE or IO_TIMER
+	long timeoutMs; // 0 waits forever. For IO_TIMER the delay
+	int result; // IO_READY, IO_TIMEOUT or IO_CANCELLED
+	coroutine_handle<> handle;
+	bool timed; // True while the deadline is in the Reactor's timer map
+	multimap<long, IoWaiter*>::iterator timer;
+
+	IoWaiter(Reactor* r, SOCKET f, int d, long t);
+	virtual ~IoWaiter() {
+	}
+
+	// Called when select() reports the descriptor ready. Returning false keeps the coroutine suspended
+	virtual bool poll() {
+		return true;
+	}
+
+	bool await_ready();
+	void await_suspend(coroutine_handle<> h);
+};
+
+/**
+ * Read Await
+ * Wait for the descriptor to be readable, then recv() into the buffer
+ * Resumes with the recv() result. -1 with errno ETIMEDOUT or ECANCELED if the wait didn't complete
+ */
+class ReadAwait : public IoWaiter {
+public:
+	uint8_t* buf;
+	size_t len;
+
+	ReadAwait(Reactor* r, SOCKET f, uint8_t* b, size_t l, long t);
+	ssize_t await_resume();
+};
+
+/**
+ * Write Await
+ * Send data through a SendQueue and stay suspended until the queue has drained, flushing each time the descriptor is writable.
+ * Doesn't suspend at all when the kernel takes everything right away
+ * Resumes with true once everything was sent, false if the socket failed, timed out or was cancelled
+ */
+class WriteAwait : public IoWaiter {
+public:
+	SendQueue* queue;
+	MemoryBudget* budget;
+	size_t* usage;
+	uint8_t* data;
+	unsigned int len;
+	bool failed;
+
+	WriteAwait(Reactor* r, SOCKET f, SendQueue* q, MemoryBudget* b, size_t* u, uint8_t* d, unsigned int l, long t);
+	bool await_ready();
+	bool poll();
+	bool await_resume();
+};
+
+/**
+ * Connect Await
+ * Non blocking connect(). Suspends until the connection completes or fails
+ * Resumes with 0 on success, otherwise the errno value (ETIMEDOUT or ECANCELED if the wait didn't complete)
+ */
+class ConnectAwait : public IoWaiter {
+public:
+	const sockaddr* addr;
+	socklen_t addrLen;
+	int err;
+
+	ConnectAwait(Reactor* r, SOCKET f, const sockaddr* a, socklen_t al, long t);
+	bool await_ready();
+	int await_resume();
+};
+
+/**
+ * Timer Await
+ * Suspend for a number of milliseconds
+ * Resumes with true if the full delay passed, false if cancelled
+ */
+class TimerAwait : public IoWaiter {
+public:
+	TimerAwait(Reactor* r, long ms);
+	bool await_resume() {
+		return result == IO_READY;
+	}
+};
+
+/**
+ * Reactor
+ * Drives coroutines from a ProxyServer's select() loop. Waiters are indexed by descriptor so resuming one costs an array lookup, the
+ * same as the handler dispatch of the callback sessions. Registering a read adds the descriptor to the loop's read set, a write to
+ * its write set, and both are removed again as soon as the wait ends
+ */
+class Reactor {
+private:
+	fd_set* readSet; // The loop's master read set (not owned)
+	fd_set* writeSet; // The loop's master write set (not owned)
+	int* fdmax; // The loop's highest descriptor (not owned)
+	IoWaiter* readers[FD_SETSIZE];
+	IoWaiter* writers[FD_SETSIZE];
+	multimap<long, IoWaiter*> timers; // Waiters with a deadline, by deadline
+	vector<IoWaiter*> ready; // Cancelled waiters, resumed by runReady()
+	unsigned int waiting; // Registered waiters
+	bool stopping;
+
+private:
+	void unregister(IoWaiter* w);
+	void complete(IoWaiter* w, int result);
+
+public:
+	Reactor(fd_set* r, fd_set* w, int* max);
+	~Reactor();
+
+	void add(IoWaiter* w);
+	bool isWaiting(SOCKET fd, int dir);
+	void fire(SOCKET fd, int dir);
+	void fireTimers(long now);
+	int nextTimeout(long now);
+	void cancel(SOCKET fd);
+	void runReady();
+	void stop();
+
+	bool isStopping() {
+		return stopping;
+	}
+
+	unsigned int getWaiting() {
+		return waiting;
+	}
+
+	static long nowMs() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	// Awaitables
+	ReadAwait read(SOCKET fd, uint8_t* buf, size_t len, long timeoutMs = 0) {
+		return ReadAwait(this, fd, buf, len, timeoutMs);
+	}
+	WriteAwait write(SOCKET fd, SendQueue* queue, MemoryBudget* budget, size_t* usage, uint8_t* data, unsigned int len,
+		long timeoutMs = 0) {
+		return WriteAwait(this, fd, queue, budget, usage, data, len, timeoutMs);
+	}
+	ConnectAwait connect(SOCKET fd, const sockaddr* addr, socklen_t addrLen, long timeoutMs = 0) {
+		return ConnectAwait(this, fd, addr, addrLen, timeoutMs);
+	}
+	TimerAwait sleep(long ms) {
+		return TimerAwait(this, ms);
+	}
+};
+
+#endif
@@ -0,0 +1,40 @@
+/**
+   tcp_proxy
+   RelayCore.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "RelayCore.h"
+
+/**
+ * Create
+ * Pick the RelayCore instantiation for the configuration. Only policies something in the configuration asks for are compiled in:
+ * the budget allocator with memory_limit, the stats metrics with stats_shm. Without either this is the pass-through build
+ *
+ * @param cfg Runtime configuration
+ * @return New relay server, owned by the caller
+ */
+RelayServer* RelayServer::create(Config* cfg) {
+	bool budgeted = cfg->memoryLimit > 0;
+	bool stats = !cfg->statsShm.empty();
+
+	if(budgeted && stats)
+		return new RelayCore<SelectLoop, BudgetAllocator, NullFilter, StatsMetrics>(cfg);
+	if(budgeted)
+		return new RelayCore<SelectLoop, BudgetAllocator>(cfg);
+	if(stats)
+		return new RelayCore<SelectLoop, HeapAllocator, NullFilter, StatsMetrics>(cfg);
+	return new RelayCore<>(cfg);
+}
@@ -0,0 +1,605 @@
+/**
+   tcp_proxy
+   RelayCore.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef RELAYCORE_H_
+#define RELAYCORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+#include "Config.h"
+#include "SocketOptions.h"
+#include "MemoryBudget.h"
+#include "Stats.h"
+#include "Upstream.h"
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+// Relay directions, also the index of the leg the data was read from
+#define RELAY_CLIENT 0 // Client to target host
+#define RELAY_TARGET 1 // Target host to client
+
+using namespace std;
+
+/**
+ * Select Loop
+ * Event loop policy: the readiness sets and select() call the ProxyServer loop uses
+ */
+class SelectLoop {
+private:
+	fd_set readMaster, writeMaster;
+	fd_set readSet, writeSet; // Result of the last wait()
+	int fdmax;
+
+public:
+	SelectLoop() {
+		FD_ZERO(&readMaster);
+		FD_ZERO(&writeMaster);
+		FD_ZERO(&readSet);
+		FD_ZERO(&writeSet);
+		fdmax = -1;
+	}
+
+	void watch(SOCKET fd, bool read, bool write) {
+		if(read)
+			FD_SET(fd, &readMaster);
+		else
+			FD_CLR(fd, &readMaster);
+		if(write)
+			FD_SET(fd, &writeMaster);
+		else
+			FD_CLR(fd, &writeMaster);
+		if(fd > fdmax)
+			fdmax = fd;
+	}
+
+	// Also drops readiness already reported for fd, its number may be reused before the pass is over
+	void forget(SOCKET fd) {
+		FD_CLR(fd, &readMaster);
+		FD_CLR(fd, &writeMaster);
+		FD_CLR(fd, &readSet);
+		FD_CLR(fd, &writeSet);
+	}
+
+	int wait(long timeoutMs) {
+		readSet = readMaster;
+		writeSet = writeMaster;
+		timeval tv;
+		tv.tv_sec = timeoutMs / 1000;
+		tv.tv_usec = (timeoutMs % 1000) * 1000;
+		return select(fdmax + 1, &readSet, &writeSet, NULL, &tv);
+	}
+
+	int getMaxFd() {
+		return fdmax;
+	}
+
+	bool readable(SOCKET fd) {
+		return FD_ISSET(fd, &readSet);
+	}
+
+	bool writable(SOCKET fd) {
+		return FD_ISSET(fd, &writeSet);
+	}
+};
+
+/**
+ * Heap Allocator
+ * Null buffer allocator policy: plain new/delete, nothing is accounted for
+ */
+class HeapAllocator {
+public:
+	bool open(Config* cfg) {
+		return true;
+	}
+
+	uint8_t* get(size_t* usage, unsigned int len) {
+		return new uint8_t[len];
+	}
+
+	void put(size_t* usage, uint8_t* data, unsigned int len) {
+		delete [] data;
+	}
+};
+
+/**
+ * Budget Allocator
+ * Buffer allocator policy charging every buffer to a MemoryBudget with the memory_limit and memory_session_limit caps. get() returns
+ * NULL when a cap would be exceeded
+ */
+class BudgetAllocator {
+private:
+	MemoryBudget* budget;
+
+public:
+	BudgetAllocator() {
+		budget = NULL;
+	}
+
+	~BudgetAllocator() {
+		if(budget != NULL) {
+			budget->report();
+			delete budget;
+		}
+	}
+
+	bool open(Config* cfg) {
+		budget = new MemoryBudget(cfg->memoryLimit, cfg->memorySessionLimit);
+		return true;
+	}
+
+	uint8_t* get(size_t* usage, unsigned int len) {
+		if(!budget->charge(usage, len))
+			return NULL;
+		return new uint8_t[len];
+	}
+
+	void put(size_t* usage, uint8_t* data, unsigned int len) {
+		budget->release(usage, len);
+		delete [] data;
+	}
+};
+
+/**
+ * Null Filter
+ * Filter policy that passes the data through untouched. A filter may rewrite the data in place and shorten it, never lengthen it.
+ * Its `active` constant lets the relay drop the call entirely
+ */
+class NullFilter {
+public:
+	static const bool active = false;
+
+	unsigned int apply(int dir, uint8_t* data, unsigned int len) {
+		return len;
+	}
+};
+
+/**
+ * Filter Chain
+ * Run two filter policies one after the other. Chains nest: FilterChain<A, FilterChain<B, C> >
+ */
+template <class First, class Second>
+class FilterChain {
+private:
+	First first;
+	Second second;
+
+public:
+	static const bool active = First::active || Second::active;
+
+	unsigned int apply(int dir, uint8_t* data, unsigned int len) {
+		if constexpr(First::active)
+			len = first.apply(dir, data, len);
+		if constexpr(Second::active)
+			len = second.apply(dir, data, len);
+		return len;
+	}
+};
+
+/**
+ * Null Metrics
+ * Metrics policy that records nothing. Like a filter's, its `active` constant lets the relay drop the hooks entirely, the Makefile
+ * doesn't optimize so an empty inline function would still be called
+ */
+class NullMetrics {
+public:
+	static const bool active = false;
+
+	bool open(Config* cfg) {
+		return true;
+	}
+
+	uint64_t passStart() {
+		return 0;
+	}
+
+	void passEnd(uint64_t start) {
+	}
+
+	void accepted() {
+	}
+
+	void closed() {
+	}
+
+	void bytes(int dir, unsigned int n) {
+	}
+};
+
+/**
+ * Stats Metrics
+ * Metrics policy publishing the counters into a one slot stats segment, readable with proxystat like ProxyServer's
+ */
+class StatsMetrics {
+private:
+	StatsSegment segment;
+	StatsSlot* slot;
+	StatsCounters c;
+
+public:
+	static const bool active = true;
+
+	StatsMetrics() {
+		slot = NULL;
+		memset(&c, 0, sizeof(c));
+	}
+
+	bool open(Config* cfg) {
+		if(!segment.create(cfg->statsShm, 1))
+			return false;
+		slot = segment.slot(0);
+		return true;
+	}
+
+	uint64_t passStart() {
+		return StatsSegment::nowNs();
+	}
+
+	void passEnd(uint64_t start) {
+		uint64_t now = StatsSegment::nowNs();
+		c.iterations++;
+		c.lastPassNs = now - start;
+		c.busyNs += c.lastPassNs;
+		if(c.lastPassNs > c.maxPassNs)
+			c.maxPassNs = c.lastPassNs;
+		c.updatedNs = now;
+		StatsSegment::publish(slot, &c);
+	}
+
+	void accepted() {
+		c.accepted++;
+		c.sessions++;
+	}
+
+	void closed() {
+		c.sessions--;
+	}
+
+	void bytes(int dir, unsigned int n) {
+		if(dir == RELAY_CLIENT)
+			c.bytesClient += n;
+		else
+			c.bytesProxy += n;
+	}
+};
+
+/**
+ * Relay Server
+ * What main() runs when session_engine is "policy". runServer() is the only virtual call, made once per process
+ */
+class RelayServer {
+protected:
+	Config* cfg; // Not owned
+	atomic<bool> canRun; // Cleared from the signal handler
+
+public:
+	RelayServer(Config* c) {
+		cfg = c;
+		canRun = true;
+	}
+
+	virtual ~RelayServer() {
+	}
+
+	virtual void runServer() = 0;
+
+	void stopServer() {
+		canRun = false;
+	}
+
+	static RelayServer* create(Config* cfg);
+};
+
+/**
+ * Relay Core
+ * A single threaded TCP relay with its event loop, buffer allocator, filter chain and metrics chosen at compile time. Everything
+ * is resolved statically, so with the null policies the relay loop is recv() and send() with nothing in between. It stands next
+ * to ProxyServer so the cost of ProxyServer's runtime features can be measured against it, and only does what every build needs:
+ * accept, connect the first address the target resolves to without blocking, relay, close both ends when either side does.
+ * Data the destination doesn't take right away is held in one pending buffer per direction and the source isn't read again until
+ * it has been written
+ */
+template <class EventLoop = SelectLoop, class Allocator = HeapAllocator, class Filter = NullFilter, class Metrics = NullMetrics>
+class RelayCore : public RelayServer {
+private:
+	struct Leg {
+		SOCKET fd;
+		uint8_t* pending; // Data waiting to be written to fd, NULL if none
+		unsigned int pendingLen;
+		unsigned int pendingOff; // Bytes of pending already written
+	};
+
+	struct Pair {
+		Leg leg[2]; // Indexed by RELAY_CLIENT (client socket) and RELAY_TARGET (target socket)
+		bool connecting; // The target connect hasn't completed yet
+		size_t usage; // Bytes charged to the allocator
+	};
+
+	EventLoop loop;
+	Allocator alloc;
+	Filter filter;
+	Metrics metrics;
+	Upstream upstream;
+	SOCKET listenSocket;
+	Pair* pairs[FD_SETSIZE]; // Pair owning each descriptor
+	uint8_t* relayBuf;
+	size_t relayUsage;
+
+	bool initSocket() {
+		listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+		if(listenSocket == INVALID_SOCKET) {
+			printf("RelayCore: Could not create socket.\n");
+			return false;
+		}
+		SocketOptions::applyListener(listenSocket, cfg);
+
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(cfg->serverPort);
+		addr.sin_addr.s_addr = INADDR_ANY;
+		if(bind(listenSocket, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenSocket, SOMAXCONN) != 0) {
+			printf("RelayCore: Failed to listen on port %i\n", cfg->serverPort);
+			return false;
+		}
+		loop.watch(listenSocket, true, false);
+		return true;
+	}
+
+	void acceptConnections() {
+		for(;;) {
+			sockaddr_in clientAddr;
+			socklen_t addrLen = sizeof(clientAddr);
+			SOCKET clfd = accept4(listenSocket, (sockaddr*)&clientAddr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(clfd == INVALID_SOCKET)
+				return;
+			if(clfd >= FD_SETSIZE) {
+				close(clfd);
+				continue;
+			}
+			SocketOptions::applyAccepted(clfd, cfg);
+
+			// Connect the address that has answered best so far
+			uint8_t order[UPSTREAM_MAX_ADDRS];
+			upstream.order(order, Upstream::nowUs() / 1000);
+			const sockaddr* target = upstream.getAddr(order[0]);
+			SOCKET pfd = socket(target->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if(pfd != INVALID_SOCKET && pfd >= FD_SETSIZE) {
+				close(pfd);
+				pfd = INVALID_SOCKET;
+			}
+			if(pfd != INVALID_SOCKET) {
+				SocketOptions::applyUpstream(pfd, cfg);
+				if(connect(pfd, target, upstream.getAddrLen(order[0])) < 0 && errno != EINPROGRESS) {
+					upstream.failed(order[0], Upstream::nowUs() / 1000);
+					close(pfd);
+					pfd = INVALID_SOCKET;
+				}
+			}
+			if(pfd == INVALID_SOCKET) {
+				printf("RelayCore: Could not connect to %s, booting client\n", upstream.getTarget().c_str());
+				close(clfd);
+				continue;
+			}
+
+			Pair* p = new Pair();
+			p->leg[RELAY_CLIENT].fd = clfd;
+			p->leg[RELAY_TARGET].fd = pfd;
+			p->connecting = true;
+			p->usage = 0;
+			pairs[clfd] = p;
+			pairs[pfd] = p;
+			update(p);
+			if constexpr(Metrics::active)
+				metrics.accepted();
+		}
+	}
+
+	// Read a side only while the other has nothing pending, write a side only while it has. Until the connect completes only the
+	// target socket is watched, for writability
+	void update(Pair* p) {
+		for(int i = 0; i < 2; i++) {
+			if(p->connecting)
+				loop.watch(p->leg[i].fd, false, i == RELAY_TARGET);
+			else
+				loop.watch(p->leg[i].fd, p->leg[i ^ 1].pending == NULL, p->leg[i].pending != NULL);
+		}
+	}
+
+	void closePair(Pair* p) {
+		for(int i = 0; i < 2; i++) {
+			Leg* l = &p->leg[i];
+			loop.forget(l->fd);
+			pairs[l->fd] = NULL;
+			close(l->fd);
+			if(l->pending != NULL)
+				alloc.put(&p->usage, l->pending, l->pendingLen);
+		}
+		delete p;
+		if constexpr(Metrics::active)
+			metrics.closed();
+	}
+
+	// Write out a leg's pending data. Returns false if the socket failed
+	bool flush(Leg* l) {
+		while(l->pendingOff < l->pendingLen) {
+			ssize_t n = send(l->fd, l->pending + l->pendingOff, l->pendingLen - l->pendingOff, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(n < 0) {
+				if(errno == EINTR)
+					continue;
+				return errno == EAGAIN || errno == EWOULDBLOCK;
+			}
+			l->pendingOff += n;
+		}
+		return true;
+	}
+
+	// The target socket turned writable: the connect completed, or pending data can go out
+	void handleWritable(Pair* p, int to) {
+		Leg* l = &p->leg[to];
+		if(p->connecting) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if(getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+				printf("RelayCore: Connect to %s failed: %s\n", upstream.getTarget().c_str(), strerror(err != 0 ? err : errno));
+				closePair(p);
+				return;
+			}
+			p->connecting = false;
+			update(p);
+			return;
+		}
+
+		if(!flush(l)) {
+			closePair(p);
+			return;
+		}
+		if(l->pendingOff < l->pendingLen)
+			return;
+
+		// Drained, go back to reading the other side
+		alloc.put(&p->usage, l->pending, l->pendingLen);
+		l->pending = NULL;
+		update(p);
+	}
+
+	void handleReadable(Pair* p, int from) {
+		Leg* src = &p->leg[from];
+		Leg* dst = &p->leg[from ^ 1];
+		ssize_t n = recv(src->fd, relayBuf, cfg->relayBufferSize, 0);
+		if(n <= 0) {
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				return;
+			closePair(p);
+			return;
+		}
+		if constexpr(Metrics::active)
+			metrics.bytes(from, n);
+
+		unsigned int len = n;
+		if constexpr(Filter::active)
+			len = filter.apply(from, relayBuf, len);
+
+		unsigned int sent = 0;
+		while(sent < len) {
+			ssize_t w = send(dst->fd, relayBuf + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(w < 0) {
+				if(errno == EINTR)
+					continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				closePair(p);
+				return;
+			}
+			sent += w;
+		}
+		if(sent == len)
+			return;
+
+		// Hold the rest and stop reading the source until the destination has taken it
+		dst->pending = alloc.get(&p->usage, len - sent);
+		if(dst->pending == NULL) {
+			printf("RelayCore: Memory budget exceeded, closing session\n");
+			closePair(p);
+			return;
+		}
+		memcpy(dst->pending, relayBuf + sent, len - sent);
+		dst->pendingLen = len - sent;
+		dst->pendingOff = 0;
+		update(p);
+	}
+
+public:
+	RelayCore(Config* c) : RelayServer(c) {
+		listenSocket = INVALID_SOCKET;
+		memset(pairs, 0, sizeof(pairs));
+		relayBuf = NULL;
+		relayUsage = 0;
+	}
+
+	~RelayCore() {
+		for(int fd = 0; fd < FD_SETSIZE; fd++) {
+			if(pairs[fd] != NULL)
+				closePair(pairs[fd]);
+		}
+		if(relayBuf != NULL)
+			alloc.put(&relayUsage, relayBuf, cfg->relayBufferSize);
+		if(listenSocket != INVALID_SOCKET)
+			close(listenSocket);
+	}
+
+	void runServer() {
+		char port[16];
+		snprintf(port, sizeof(port), "%i", cfg->proxyPort);
+		if(!upstream.resolve(cfg->proxyHost, port) || !alloc.open(cfg) || !metrics.open(cfg) || !initSocket())
+			return;
+		relayBuf = alloc.get(&relayUsage, cfg->relayBufferSize);
+		if(relayBuf == NULL)
+			return;
+		printf("RelayCore: Relaying port %i to %s\n", cfg->serverPort, upstream.getTarget().c_str());
+
+		while(canRun) {
+			if(loop.wait(1000) < 0) {
+				if(errno == EINTR)
+					continue;
+				printf("RelayCore: select() failed: %s\n", strerror(errno));
+				break;
+			}
+			uint64_t start = 0;
+			if constexpr(Metrics::active)
+				start = metrics.passStart();
+
+			int fdmax = loop.getMaxFd();
+			for(int fd = 0; fd <= fdmax; fd++) {
+				if(fd == listenSocket) {
+					if(loop.readable(fd))
+						acceptConnections();
+					continue;
+				}
+				Pair* p = pairs[fd];
+				if(p == NULL)
+					continue;
+				int dir = (p->leg[RELAY_CLIENT].fd == fd) ? RELAY_CLIENT : RELAY_TARGET;
+				if(loop.writable(fd)) {
+					handleWritable(p, dir);
+					if(pairs[fd] != p)
+						continue;
+				}
+				if(loop.readable(fd))
+					handleReadable(p, dir);
+			}
+
+			if constexpr(Metrics::active)
+				metrics.passEnd(start);
+		}
+		printf("RelayCore: Shutting down\n");
+	}
+};
+
+#endif
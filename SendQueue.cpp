@@ -0,0 +1,237 @@
+/**
+   tcp_proxy
+   SendQueue.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "SendQueue.h"
+
+/**
+ * SendQueue Constructor
+ */
+SendQueue::SendQueue() {
+	head = NULL;
+	tail = NULL;
+	queued = 0;
+	zc = NULL;
+}
+
+/**
+ * SendQueue Destructor
+ * Frees data that was never sent. Its charge can't be released here, the owner clear()s the queue first
+ */
+SendQueue::~SendQueue() {
+	while(head != NULL) {
+		Chunk* c = head;
+		head = c->next;
+		delete c;
+	}
+	delete zc;
+}
+
+/**
+ * Push
+ * Link a chunk in at the back
+ *
+ * @param c Chunk, already charged
+ */
+void SendQueue::push(Chunk* c) {
+	if(tail == NULL)
+		head = c;
+	else
+		tail->next = c;
+	tail = c;
+	queued += c->data.size();
+}
+
+/**
+ * Pop
+ * Unlink the front chunk, free it and release its charge. Its unsent bytes must already be off queued
+ *
+ * @param budget Memory budget the chunk was charged to
+ * @param usage Owner's usage counter
+ */
+void SendQueue::pop(MemoryBudget* budget, size_t* usage) {
+	Chunk* c = head;
+	head = c->next;
+	if(head == NULL)
+		tail = NULL;
+	budget->release(usage, c->data.size());
+	delete c;
+}
+
+/**
+ * Send
+ * Write data to the socket. If data is already queued the new data goes behind it to preserve ordering, otherwise it is sent
+ * directly and only the part the kernel didn't take is queued
+ *
+ * @param sd Non blocking socket descriptor
+ * @param budget Memory budget queued bytes are charged to
+ * @param usage Owner's usage counter
+ * @param data Data to send
+ * @param len Length of data
+ * @param shared Optional. When the same data goes to several queues, a buffer they share: the first queue that has to keep some of
+ * the data copies all of it in, the others queue slices of that copy. Must be empty or hold exactly data. If it holds the data the
+ * send can be zerocopy
+ * @return False if the socket failed (peer closed or reset). True if otherwise
+ */
+bool SendQueue::send(SOCKET sd, MemoryBudget* budget, size_t* usage, uint8_t* data, unsigned int len, ByteBuffer* shared) {
+	unsigned int sent = 0;
+
+	if(queued == 0) {
+		reap();
+		bool held = (shared != NULL && shared->size() == len);
+		while(sent < len) {
+			ssize_t n;
+			if(held && zc != NULL && zc->wants(len - sent))
+				n = zc->send(*shared, sent, len - sent);
+			else
+				n = ::send(sd, data + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(n < 0) {
+				if(errno == EINTR)
+					continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				return false;
+			}
+			sent += n;
+		}
+	}
+
+	if(sent < len) {
+		if(shared == NULL) {
+			append(budget, usage, data + sent, len - sent);
+		} else {
+			if(shared->size() == 0)
+				shared->putBytes(data, len);
+			append(budget, usage, *shared, sent, len - sent);
+		}
+	}
+	return true;
+}
+
+/**
+ * Flush
+ * Send as much queued data as the socket will take. Called when select() reports the socket writable
+ *
+ * @param sd Non blocking socket descriptor
+ * @param budget Memory budget the queued bytes are charged to
+ * @param usage Owner's usage counter
+ * @param limit Send at most this many bytes
+ * @return False if the socket failed (peer closed or reset). True if otherwise
+ */
+bool SendQueue::flush(SOCKET sd, MemoryBudget* budget, size_t* usage, unsigned int limit) {
+	reap();
+	while(head != NULL && limit > 0) {
+		Chunk& c = *head;
+		unsigned int len = c.data.size() - c.off;
+		if(len > limit)
+			len = limit;
+		ssize_t n;
+		if(zc != NULL && zc->wants(len))
+			n = zc->send(c.data, c.off, len);
+		else
+			n = ::send(sd, c.data.getData() + c.off, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			return false;
+		}
+
+		c.off += n;
+		queued -= n;
+		limit -= n;
+		if(c.off == c.data.size())
+			pop(budget, usage);
+	}
+	return true;
+}
+
+/**
+ * Append
+ * Copy data to the back of the queue. The data was already read off the wire so the charge is forced even past the limits,
+ * the caller stops reading from the source once the session is over its cap
+ *
+ * @param budget Memory budget to charge
+ * @param usage Owner's usage counter
+ * @param data Data to queue
+ * @param len Length of data
+ */
+void SendQueue::append(MemoryBudget* budget, size_t* usage, uint8_t* data, unsigned int len) {
+	budget->charge(usage, len, true);
+	push(new Chunk(data, len));
+}
+
+/**
+ * Append
+ * Queue a slice of a ByteBuffer without copying it. The queue holds a reference to the buffer's storage until the slice is sent, and
+ * is charged for the slice like for a copy
+ *
+ * @param budget Memory budget to charge
+ * @param usage Owner's usage counter
+ * @param src Buffer holding the data
+ * @param start Index in src of the first byte to queue
+ * @param len Number of bytes to queue
+ */
+void SendQueue::append(MemoryBudget* budget, size_t* usage, const ByteBuffer& src, unsigned int start, unsigned int len) {
+	budget->charge(usage, len, true);
+	push(new Chunk(src, start, len));
+}
+
+/**
+ * Clear
+ * Drop all queued data and release its charge. Zerocopy state still in the queue goes with it, the owner takes it out first with
+ * takeZerocopy() if the kernel may still be using its buffers
+ *
+ * @param budget Memory budget the queued bytes are charged to
+ * @param usage Owner's usage counter
+ */
+void SendQueue::clear(MemoryBudget* budget, size_t* usage) {
+	while(head != NULL)
+		pop(budget, usage);
+	queued = 0;
+	delete zc;
+	zc = NULL;
+}
+
+/**
+ * Enable Zerocopy
+ * Send chunks of at least threshold bytes with MSG_ZEROCOPY from now on
+ *
+ * @param sd The queue's socket
+ * @param threshold Smallest send that is zerocopy
+ * @param budget Memory budget pinned bytes are charged to until the kernel is done with them
+ * @param stats Event loop counters
+ * @return False if the kernel doesn't support it, the queue then sends normally. True if otherwise
+ */
+bool SendQueue::enableZerocopy(SOCKET sd, unsigned int threshold, MemoryBudget* budget, StatsCounters* stats) {
+	delete zc;
+	zc = ZeroCopy::enable(sd, threshold, budget, stats);
+	return zc != NULL;
+}
+
+/**
+ * Take Zerocopy
+ * Remove the zerocopy state from the queue, for a socket that is closing
+ *
+ * @return The state, NULL if zerocopy is off. The caller deletes it
+ */
+ZeroCopy* SendQueue::takeZerocopy() {
+	ZeroCopy* z = zc;
+	zc = NULL;
+	return z;
+}
@@ -0,0 +1,99 @@
+/**
+   tcp_proxy
+   SendQueue.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SENDQUEUE_H_
+#define SENDQUEUE_H_
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ByteBuffer.h"
+#include "MemoryBudget.h"
+#include "ZeroCopy.h"
+
+#define SOCKET int
+
+using namespace std;
+
+/**
+ * Send Queue
+ * Data waiting to be written to a non blocking socket. Whatever send() doesn't take immediately is queued here and flushed once
+ * select() reports the socket writable. Chunks are ByteBuffer slices, so queues fed the same data can share one copy of it.
+ * Every queued byte is charged to the owner's memory account. The owner passes its budget and usage counter to each call that
+ * queues or drops data, a session's queues sit in its hot cache lines and don't keep pointers back to it. With zerocopy on, large
+ * sends hand the ByteBuffers themselves to the kernel
+ */
+class SendQueue {
+private:
+	struct Chunk {
+		Chunk* next;
+		ByteBuffer data;
+		unsigned int off; // Bytes of data already sent
+
+		Chunk(uint8_t* d, unsigned int len) : next(NULL), data(d, len), off(0) {}
+		Chunk(const ByteBuffer& src, unsigned int start, unsigned int len) : next(NULL), data(src, start, len), off(0) {}
+	};
+
+	Chunk* head; // Oldest chunk, NULL when the queue is empty
+	Chunk* tail;
+	unsigned int queued; // Unsent bytes across all chunks
+	ZeroCopy* zc; // MSG_ZEROCOPY state of the socket, NULL if off
+
+	void push(Chunk* c);
+	void pop(MemoryBudget* budget, size_t* usage);
+
+public:
+	SendQueue();
+	~SendQueue();
+
+	SendQueue(const SendQueue&) = delete;
+	SendQueue& operator=(const SendQueue&) = delete;
+
+	bool send(SOCKET sd, MemoryBudget* budget, size_t* usage, uint8_t* data, unsigned int len, ByteBuffer* shared = NULL);
+	bool flush(SOCKET sd, MemoryBudget* budget, size_t* usage, unsigned int limit = UINT_MAX);
+	void append(MemoryBudget* budget, size_t* usage, uint8_t* data, unsigned int len);
+	void append(MemoryBudget* budget, size_t* usage, const ByteBuffer& src, unsigned int start, unsigned int len);
+	void clear(MemoryBudget* budget, size_t* usage);
+
+	bool enableZerocopy(SOCKET sd, unsigned int threshold, MemoryBudget* budget, StatsCounters* stats);
+	ZeroCopy* takeZerocopy();
+
+	// True if data for this queue's socket should be read into a ByteBuffer of its own, so it can be sent without a copy
+	bool zerocopy() {
+		return zc != NULL && zc->active();
+	}
+
+	// Drop the buffers whose zerocopy sends have completed
+	void reap() {
+		if(zc != NULL)
+			zc->reap();
+	}
+
+	unsigned int size() {
+		return queued;
+	}
+
+	bool empty() {
+		return queued == 0;
+	}
+};
+
+#endif
@@ -0,0 +1,153 @@
+/**
+   tcp_proxy
+   Session.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Session.h"
+
+/**
+ * Session Constructor
+ * Slots start out free, SessionPool sets the budget their send queues are charged to
+ */
+Session::Session() {
+	clientSocket = INVALID_SOCKET;
+	proxySocket = INVALID_SOCKET;
+	memUsage = 0;
+	budget = NULL;
+	mirrorBudget = NULL;
+	nextFree = NULL;
+	lastActive = 0;
+	helloPending = false;
+	race = NULL;
+	traceId = 0;
+	bytesClient = 0;
+	bytesProxy = 0;
+	openedUs = 0;
+	connectUs = 0;
+	memset(&client, 0, sizeof(client));
+	memset(&backend, 0, sizeof(backend));
+	mirrorSocket = INVALID_SOCKET;
+	mirrorState = MIRROR_OFF;
+	mirrorUsage = 0;
+	clientIP[0] = '\0';
+}
+
+/**
+ * Session Destructor
+ */
+Session::~Session() {
+	close();
+}
+
+/**
+ * Open
+ * Take over a freshly accepted client socket
+ *
+ * @param clfd Accepted client socket descriptor
+ * @param addr Address structure of the client's socket
+ * @param now Current event loop time
+ */
+void Session::open(SOCKET clfd, sockaddr_in addr, long now) {
+	clientSocket = clfd;
+	proxySocket = INVALID_SOCKET;
+	memUsage = 0;
+	lastActive = now;
+	helloPending = false;
+	race = NULL;
+	mirrorState = MIRROR_OFF;
+	mirrorUsage = 0;
+	deficit[FLOW_UP] = 0;
+	deficit[FLOW_DOWN] = 0;
+	round = 0;
+	backlog = 0;
+	traceId = Trace::newSession();
+	inet_ntop(AF_INET, &addr.sin_addr, clientIP, sizeof(clientIP));
+
+	bytesClient = 0;
+	bytesProxy = 0;
+	connectUs = 0;
+	openedUs = 0;
+	if(AccessLog::isOpen()) {
+		openedUs = Upstream::nowUs();
+		AccessLog::endpoint((sockaddr*)&addr, &client);
+		memset(&backend, 0, sizeof(backend));
+	}
+}
+
+/**
+ * Connected
+ * The backend connection is up, note where to and how long it took for the access log
+ *
+ * @param addr Address the proxy socket connected to
+ */
+void Session::connected(const sockaddr* addr) {
+	if(openedUs == 0)
+		return;
+	uint64_t us = Upstream::nowUs() - openedUs;
+	connectUs = (us == 0) ? 1 : (uint32_t)us;
+	AccessLog::endpoint(addr, &backend);
+}
+
+/**
+ * Log Access
+ * Append the session's record to the access log. Called as the session closes, does nothing if the access log is off
+ *
+ * @param reason TRACE_CLOSE_* reason
+ * @param err errno when the session closed on a socket error, otherwise 0
+ */
+void Session::logAccess(int reason, int err) {
+	if(openedUs == 0)
+		return;
+	AccessRecord* r = AccessLog::next(openedUs);
+	if(r == NULL)
+		return;
+	r->durationUs = Upstream::nowUs() - openedUs;
+	r->bytesClient = bytesClient;
+	r->bytesProxy = bytesProxy;
+	r->connectUs = connectUs;
+	r->session = traceId;
+	r->error = err;
+	r->reason = reason;
+	r->client = client;
+	r->backend = backend;
+}
+
+/**
+ * Close
+ * Drop any queued data and close both sockets. The slot can then be reused
+ */
+void Session::close() {
+	backlog = 0;
+	toClient.clear(budget, &memUsage);
+	toProxy.clear(budget, &memUsage);
+	toMirror.clear(mirrorBudget, &mirrorUsage);
+
+	if(mirrorSocket != INVALID_SOCKET) {
+		::close(mirrorSocket);
+		mirrorSocket = INVALID_SOCKET;
+	}
+
+	if(proxySocket != INVALID_SOCKET) {
+		shutdown(proxySocket, SHUT_RDWR);
+		::close(proxySocket);
+		proxySocket = INVALID_SOCKET;
+	}
+
+	if(clientSocket != INVALID_SOCKET) {
+		::close(clientSocket);
+		clientSocket = INVALID_SOCKET;
+	}
+}
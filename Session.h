@@ -0,0 +1,244 @@
+/**
+   tcp_proxy
+   Session.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Config.h"
+#include "SocketOptions.h"
+#include "MemoryBudget.h"
+#include "SendQueue.h"
+#include "Trace.h"
+#include "AccessLog.h"
+#include "Upstream.h"
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+// Mirror states
+#define MIRROR_OFF 0 // Session isn't mirrored
+#define MIRROR_CONNECTING 1
+#define MIRROR_UP 2
+#define MIRROR_CUT 3 // The mirror fell behind or failed, the rest of the session's data is dropped
+
+// Directions a session used its whole I/O quantum in, with data possibly left (deficit round robin)
+#define BACKLOG_READ_CLIENT 1
+#define BACKLOG_READ_PROXY 2
+#define BACKLOG_WRITE_CLIENT 4
+#define BACKLOG_WRITE_PROXY 8
+
+// The two directions data flows in, each has its own deficit
+#define FLOW_UP 0 // Client to target host: reading the client, flushing the proxy socket's queue
+#define FLOW_DOWN 1 // Target host to client
+
+using namespace std;
+
+class SessionPool;
+
+/**
+ * Session
+ * A relayed connection: the client socket, the socket to the target host and the data queued for each. Sessions live in a SessionPool
+ * slab and are reused, nothing is allocated to open or close one. What every event touches comes first and fits the record's first
+ * two cache lines (128 bytes): the sockets, the accounting, both send queues, the scheduler's deficits and the byte counters. The
+ * connect race and mirroring follow, and the fields only read when the session opens or closes come last
+ */
+class alignas(64) Session {
+	friend class SessionPool;
+
+private:
+	SOCKET clientSocket; // INVALID_SOCKET while the slot is free
+	SOCKET proxySocket;
+	size_t memUsage; // Bytes currently charged to this session (both directions)
+	long lastActive; // Event loop time of the last data read in either direction
+	SendQueue toClient; // Data waiting to be sent to the client, charged to budget and memUsage
+	SendQueue toProxy; // Data waiting to be sent to the target host
+	unsigned int deficit[2]; // Bytes each FLOW_* direction may still move in the current scheduling round
+	uint32_t round; // Scheduling round the deficits belong to
+	uint32_t traceId; // Identifies the session's trace events, 0 when tracing is off
+	uint64_t bytesClient; // Bytes read from the client, for the access log
+	uint64_t bytesProxy; // Bytes read from the target host
+	uint8_t backlog; // BACKLOG_* directions waiting for another round
+	bool helloPending; // SNI routing: waiting for the ClientHello, there is no proxy socket yet
+
+	ConnectRace* race; // Connect attempts in flight, NULL once the proxy socket is connected (owned by the ProxyServer)
+	MemoryBudget* budget; // The pool's, the send queues are charged to it
+
+	// Mirroring. The mirror queue is charged to the mirror budget, never to the session's own account
+	SOCKET mirrorSocket; // Connection to the shadow backend, INVALID_SOCKET unless MIRROR_CONNECTING or MIRROR_UP
+	int mirrorState;
+	size_t mirrorUsage;
+	MemoryBudget* mirrorBudget; // Set when the mirror connects
+	SendQueue toMirror;
+
+	Session* nextFree; // Free list link while the slot is unused
+	char clientIP[INET_ADDRSTRLEN];
+
+	// Access log, only read when the session closes
+	uint64_t openedUs; // Upstream::nowUs() of the accept, 0 when the access log is off
+	uint32_t connectUs; // Accept to backend connected
+	AccessEndpoint client;
+	AccessEndpoint backend;
+
+public:
+	Session();
+	~Session();
+
+	void open(SOCKET clfd, sockaddr_in addr, long now);
+	void close();
+	void connected(const sockaddr* addr);
+	void logAccess(int reason, int err);
+
+	bool isOpen() {
+		return clientSocket != INVALID_SOCKET;
+	}
+
+	SOCKET getSocket() {
+		return clientSocket;
+	}
+
+	SOCKET getProxySocket() {
+		return proxySocket;
+	}
+
+	void setProxySocket(SOCKET psd) {
+		proxySocket = psd;
+	}
+
+	const char* getClientIP() {
+		return clientIP;
+	}
+
+	SendQueue* getSendQueue() {
+		return &toClient;
+	}
+
+	SendQueue* getProxySendQueue() {
+		return &toProxy;
+	}
+
+	size_t* getMemUsage() {
+		return &memUsage;
+	}
+
+	void touch(long now) {
+		lastActive = now;
+	}
+
+	void countClient(unsigned int n) {
+		bytesClient += n;
+	}
+
+	void countProxy(unsigned int n) {
+		bytesProxy += n;
+	}
+
+	long getLastActive() {
+		return lastActive;
+	}
+
+	bool isHelloPending() {
+		return helloPending;
+	}
+
+	void setHelloPending(bool p) {
+		helloPending = p;
+	}
+
+	SOCKET getMirrorSocket() {
+		return mirrorSocket;
+	}
+
+	void setMirrorSocket(SOCKET fd) {
+		mirrorSocket = fd;
+	}
+
+	int getMirrorState() {
+		return mirrorState;
+	}
+
+	void setMirrorState(int st) {
+		mirrorState = st;
+	}
+
+	SendQueue* getMirrorQueue() {
+		return &toMirror;
+	}
+
+	size_t* getMirrorUsage() {
+		return &mirrorUsage;
+	}
+
+	void setMirrorBudget(MemoryBudget* b) {
+		mirrorBudget = b;
+	}
+
+	ConnectRace* getRace() {
+		return race;
+	}
+
+	void setRace(ConnectRace* r) {
+		race = r;
+	}
+
+	uint32_t getTraceId() {
+		return traceId;
+	}
+
+	// First visit in a scheduling round: top the deficits up by a quantum. Spending is exact, so a deficit is only left over when
+	// the direction ran out of data, and deficit round robin resets it then. The top up is a plain assignment
+	void topUp(uint32_t r, unsigned int quantum) {
+		if(round != r) {
+			round = r;
+			deficit[FLOW_UP] = quantum;
+			deficit[FLOW_DOWN] = quantum;
+		}
+	}
+
+	unsigned int getDeficit(int flow) {
+		return deficit[flow];
+	}
+
+	void spend(int flow, unsigned int n) {
+		deficit[flow] = (n < deficit[flow]) ? deficit[flow] - n : 0;
+	}
+
+	uint8_t getBacklog() {
+		return backlog;
+	}
+
+	void addBacklog(uint8_t dir) {
+		backlog |= dir;
+	}
+
+	uint8_t takeBacklog() {
+		uint8_t b = backlog;
+		backlog = 0;
+		return b;
+	}
+};
+
+#endif
@@ -0,0 +1,95 @@
+/**
+   tcp_proxy
+   SessionPool.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "SessionPool.h"
+
+/**
+ * SessionPool Constructor
+ * Allocate the slab and chain every slot onto the free list. Called from the thread that runs the event loop so the slab is local to it.
+ * The slab is charged to the budget up front
+ *
+ * @param cap Number of sessions
+ * @param b Memory budget the slab and the sessions' queues are charged to
+ */
+SessionPool::SessionPool(unsigned int cap, MemoryBudget* b) {
+	capacity = cap;
+	used = 0;
+	budget = b;
+
+	budget->charge(NULL, sizeof(Session) * capacity, true);
+	slab = new Session[capacity];
+
+	freeList = NULL;
+	for(unsigned int i = capacity; i > 0; i--) {
+		Session* s = &slab[i - 1];
+		s->budget = budget;
+		s->nextFree = freeList;
+		freeList = s;
+	}
+
+	for(int i = 0; i < FD_SETSIZE; i++)
+		byFd[i] = NULL;
+}
+
+/**
+ * SessionPool Destructor
+ * Every session has to have been released
+ */
+SessionPool::~SessionPool() {
+	delete [] slab;
+	budget->release(NULL, sizeof(Session) * capacity);
+}
+
+/**
+ * Capacity From Limit
+ * Each session holds two descriptors, and select() can't watch descriptors past FD_SETSIZE
+ *
+ * @return Number of sessions the process can have open at once
+ */
+unsigned int SessionPool::capacityFromLimit() {
+	rlim_t fds = FD_SETSIZE;
+	rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < fds)
+		fds = rl.rlim_cur;
+	return (unsigned int)(fds / 2);
+}
+
+/**
+ * Acquire
+ *
+ * @return A free Session, NULL if the slab is exhausted
+ */
+Session* SessionPool::acquire() {
+	Session* s = freeList;
+	if(s == NULL)
+		return NULL;
+	freeList = s->nextFree;
+	s->nextFree = NULL;
+	used++;
+	return s;
+}
+
+/**
+ * Release
+ * Return a closed Session to the free list
+ */
+void SessionPool::release(Session* s) {
+	s->nextFree = freeList;
+	freeList = s;
+	used--;
+}
@@ -0,0 +1,85 @@
+/**
+   tcp_proxy
+   SessionPool.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SESSIONPOOL_H_
+#define SESSIONPOOL_H_
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+
+#include "MemoryBudget.h"
+#include "Session.h"
+
+#define SOCKET int
+
+using namespace std;
+
+/**
+ * Session Pool
+ * Preallocated slab of Sessions for one event loop with a free list, and a descriptor indexed table mapping both the client and the
+ * proxy socket to their Session so a ready descriptor is resolved with one array lookup. Only used from the owning event loop's thread
+ */
+class SessionPool {
+private:
+	Session* slab;
+	unsigned int capacity;
+	unsigned int used;
+	Session* freeList;
+	Session* byFd[FD_SETSIZE];
+	MemoryBudget* budget;
+
+public:
+	SessionPool(unsigned int cap, MemoryBudget* b);
+	~SessionPool();
+
+	static unsigned int capacityFromLimit();
+
+	Session* acquire();
+	void release(Session* s);
+
+	void track(SOCKET fd, Session* s) {
+		byFd[fd] = s;
+	}
+
+	void untrack(SOCKET fd) {
+		if(fd >= 0 && fd < FD_SETSIZE)
+			byFd[fd] = NULL;
+	}
+
+	Session* lookup(SOCKET fd) {
+		if(fd < 0 || fd >= FD_SETSIZE)
+			return NULL;
+		return byFd[fd];
+	}
+
+	// Slot i of the slab, check isOpen() before use
+	Session* at(unsigned int i) {
+		return &slab[i];
+	}
+
+	unsigned int getCapacity() {
+		return capacity;
+	}
+
+	unsigned int getUsed() {
+		return used;
+	}
+};
+
+#endif
@@ -0,0 +1,221 @@
+/**
+   tcp_proxy
+   SniRouter.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "SniRouter.h"
+
+/**
+ * SniRouter Constructor
+ */
+SniRouter::SniRouter() {
+	mask = 0;
+	fallback.hash = 0;
+	fallback.upstream = NULL;
+}
+
+/**
+ * SniRouter Destructor
+ */
+SniRouter::~SniRouter() {
+	for(unsigned int i = 0; i < routes.size(); i++)
+		delete routes[i].upstream;
+	delete fallback.upstream;
+}
+
+/**
+ * Hash
+ * Case insensitive FNV-1a over the concatenation of the parts
+ */
+uint32_t SniRouter::hash(const Part* parts, int n) {
+	uint32_t h = 2166136261u;
+	for(int i = 0; i < n; i++) {
+		for(unsigned int j = 0; j < parts[i].n; j++) {
+			char c = parts[i].p[j];
+			if(c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			h = (h ^ (uint8_t)c) * 16777619u;
+		}
+	}
+	return h;
+}
+
+/**
+ * Resolve
+ * Look up a "host:port" target
+ *
+ * @param target Target string
+ * @param route Route to store the resolved addresses in
+ * @return True if the target resolved. False if otherwise
+ */
+bool SniRouter::resolve(string target, SniRoute* route) {
+	route->target = target;
+	route->upstream = new Upstream();
+	if(!route->upstream->resolve(target)) {
+		delete route->upstream;
+		route->upstream = NULL;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Load
+ * Build the table from the sni_route entries ("name [alpn] host:port") and resolve every backend. Called once at startup
+ *
+ * @param cfg Configuration holding the routes
+ * @return True if every route was understood and resolved. False if otherwise
+ */
+bool SniRouter::load(Config* cfg) {
+	// No SNI or no matching route: sni_default, or the regular target host
+	string def = cfg->sniDefault;
+	if(def.empty()) {
+		char port[8];
+		sprintf(port, "%i", cfg->proxyPort);
+		def = cfg->proxyHost + ":" + port;
+	}
+	if(!resolve(def, &fallback))
+		return false;
+	fallback.key = "";
+
+	for(unsigned int i = 0; i < cfg->sniRoutes.size(); i++) {
+		// Split the entry on whitespace
+		vector<string> tok;
+		string s = cfg->sniRoutes[i];
+		size_t pos = 0;
+		while(pos < s.size()) {
+			size_t start = s.find_first_not_of(" \t", pos);
+			if(start == string::npos)
+				break;
+			size_t stop = s.find_first_of(" \t", start);
+			if(stop == string::npos)
+				stop = s.size();
+			tok.push_back(s.substr(start, stop - start));
+			pos = stop;
+		}
+		if(tok.size() != 2 && tok.size() != 3) {
+			printf("SniRouter: Route '%s' should be: name [alpn] host:port\n", s.c_str());
+			return false;
+		}
+
+		SniRoute r;
+		r.key = tok[0];
+		for(unsigned int j = 0; j < r.key.size(); j++) {
+			if(r.key[j] >= 'A' && r.key[j] <= 'Z')
+				r.key[j] += 'a' - 'A';
+		}
+		if(tok.size() == 3)
+			r.key += "|" + tok[1];
+		if(!resolve(tok[tok.size() - 1], &r))
+			return false;
+		Part whole = { r.key.c_str(), (unsigned int)r.key.size() };
+		r.hash = hash(&whole, 1);
+		routes.push_back(r);
+	}
+
+	// Keep the table at most half full so probe sequences stay short
+	unsigned int cap = 16;
+	while(cap < routes.size() * 2)
+		cap <<= 1;
+	table.assign(cap, -1);
+	mask = cap - 1;
+
+	for(unsigned int i = 0; i < routes.size(); i++) {
+		Part whole = { routes[i].key.c_str(), (unsigned int)routes[i].key.size() };
+		if(find(&whole, 1) != NULL) {
+			printf("SniRouter: Duplicate route for %s, keeping the first\n", routes[i].key.c_str());
+			continue;
+		}
+		unsigned int slot = routes[i].hash & mask;
+		while(table[slot] != -1)
+			slot = (slot + 1) & mask;
+		table[slot] = i;
+	}
+
+	printf("SniRouter: %u routes, default %s\n", (unsigned int)routes.size(), fallback.target.c_str());
+	return true;
+}
+
+/**
+ * Find
+ * Probe the table for the key made of the parts
+ *
+ * @return Matching route, NULL if there is none
+ */
+const SniRoute* SniRouter::find(const Part* parts, int n) {
+	uint32_t h = hash(parts, n);
+	unsigned int total = 0;
+	for(int i = 0; i < n; i++)
+		total += parts[i].n;
+
+	for(unsigned int slot = h & mask; table[slot] != -1; slot = (slot + 1) & mask) {
+		const SniRoute* r = &routes[table[slot]];
+		if(r->hash != h || r->key.size() != total)
+			continue;
+
+		const char* k = r->key.c_str();
+		bool match = true;
+		for(int i = 0; i < n && match; i++) {
+			match = (strncasecmp(k, parts[i].p, parts[i].n) == 0);
+			k += parts[i].n;
+		}
+		if(match)
+			return r;
+	}
+	return NULL;
+}
+
+/**
+ * Lookup
+ * Pick the backend for a parsed hello. Tries "name|alpn", then "name", then the same two with the first label replaced by "*",
+ * then falls back to the default route
+ *
+ * @param hello Parsed ClientHello (HELLO_OK), or NULL if the connection didn't start with one
+ * @return Route to connect to, never NULL
+ */
+const SniRoute* SniRouter::lookup(ClientHello* hello) {
+	if(hello == NULL || hello->sni == NULL || hello->sniLen == 0)
+		return &fallback;
+
+	const SniRoute* r;
+	Part bar = { "|", 1 };
+	Part alpn = { hello->alpn, hello->alpnLen };
+	Part name = { hello->sni, hello->sniLen };
+
+	if(hello->alpn != NULL) {
+		Part key[3] = { name, bar, alpn };
+		if((r = find(key, 3)) != NULL)
+			return r;
+	}
+	if((r = find(&name, 1)) != NULL)
+		return r;
+
+	const char* dot = (const char*)memchr(hello->sni, '.', hello->sniLen);
+	if(dot != NULL) {
+		Part star = { "*", 1 };
+		Part domain = { dot, (unsigned int)(hello->sniLen - (dot - hello->sni)) };
+		if(hello->alpn != NULL) {
+			Part key[4] = { star, domain, bar, alpn };
+			if((r = find(key, 4)) != NULL)
+				return r;
+		}
+		Part key[2] = { star, domain };
+		if((r = find(key, 2)) != NULL)
+			return r;
+	}
+
+	return &fallback;
+}
@@ -0,0 +1,84 @@
+/**
+   tcp_proxy
+   SniRouter.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SNIROUTER_H_
+#define SNIROUTER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+#include "Config.h"
+#include "ClientHello.h"
+#include "Upstream.h"
+
+using namespace std;
+
+/**
+ * SNI Route
+ * A server name (optionally qualified by an ALPN protocol) and the resolved backend it is relayed to
+ */
+struct SniRoute {
+	string key; // Lower case "name" or "name|alpn". "*.domain" matches any single label under domain
+	string target; // "host:port" as configured, for logging
+	uint32_t hash;
+	Upstream* upstream; // Every address of the target, owned by the router
+};
+
+/**
+ * SNI Router
+ * Open addressing hash table of name routes, built and resolved once at startup and read by every event loop without locking.
+ * Lookups hash the name straight out of the received hello, nothing is copied or allocated
+ */
+class SniRouter {
+private:
+	// A piece of a lookup key, keys are matched piecewise so they never have to be assembled
+	struct Part {
+		const char* p;
+		unsigned int n;
+	};
+
+	vector<SniRoute> routes;
+	vector<int> table; // Index into routes, -1 for an empty slot. Size is a power of two
+	unsigned int mask;
+	SniRoute fallback; // Used when no route matches or the client sent no SNI
+
+private:
+	static uint32_t hash(const Part* parts, int n);
+	static bool resolve(string target, SniRoute* route);
+	const SniRoute* find(const Part* parts, int n);
+
+public:
+	SniRouter();
+	~SniRouter();
+
+	bool load(Config* cfg);
+	const SniRoute* lookup(ClientHello* hello);
+
+	unsigned int size() {
+		return routes.size();
+	}
+};
+
+#endif
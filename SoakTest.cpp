@@ -0,0 +1,577 @@
+/**
+   tcp_proxy
+   SoakTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Soak and fault injection test. Starts bin/proxy against a stand-in target host run by the test itself, then drives it through
+// the sessions that tend to leak: thousands of short sessions, slow readers, peers that stop reading (stalled writes), RSTs from
+// either side in the middle of a transfer and connects the target host refuses. After every phase the proxy must settle back to
+// where it started: the same number of open descriptors (/proc/<pid>/fd), no open sessions and the memory budget back at its
+// idle charge (both from the stats_shm segment). Resident memory is compared between the first and the last round.
+// Usage: soaktest [-x proxy binary] [-e session engine] [-w workers] [-r rounds] [-n short sessions] [-v] proxy_port backend_port
+// Exits non-zero if the proxy died or anything failed to settle
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "Stats.h"
+
+using namespace std;
+
+// How the stand-in target host treats a new connection
+#define BACKEND_ECHO 0 // Echo everything back
+#define BACKEND_STALL 1 // Never read, the proxy's writes to it back up
+#define BACKEND_RST 2 // Read a little, then reset the connection
+
+static int proxyPort, backendPort;
+static pid_t proxyPid = -1;
+static StatsSegment stats;
+static atomic<int> backendMode(BACKEND_ECHO);
+static int backendListener = -1;
+static pthread_t backendThread;
+static pthread_mutex_t stalledLock = PTHREAD_MUTEX_INITIALIZER;
+static vector<int> stalled; // Connections held open by BACKEND_STALL
+
+static double nowMs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void setTimeouts(int fd, int ms) {
+	timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Close with SO_LINGER 0 so the peer gets a RST instead of a FIN
+static void resetClose(int fd) {
+	struct linger l = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	close(fd);
+}
+
+static int connectProxy() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(proxyPort);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setTimeouts(fd, 5000);
+	if(connect(fd, (sockaddr*)&a, sizeof(a)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Stand-in target host
+ */
+
+static void* backendConnection(void* arg) {
+	int fd = (int)(long)arg;
+	int mode = backendMode;
+	char buf[65536];
+
+	if(mode == BACKEND_STALL) {
+		pthread_mutex_lock(&stalledLock);
+		stalled.push_back(fd);
+		pthread_mutex_unlock(&stalledLock);
+		return NULL;
+	}
+
+	size_t total = 0;
+	for(;;) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if(n <= 0)
+			break;
+		total += n;
+		if(mode == BACKEND_RST && total >= 65536) {
+			resetClose(fd);
+			return NULL;
+		}
+		if(mode == BACKEND_ECHO && send(fd, buf, n, MSG_NOSIGNAL) != n)
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void* backendAccept(void* arg) {
+	for(;;) {
+		int fd = accept(backendListener, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		pthread_t t;
+		pthread_create(&t, NULL, backendConnection, (void*)(long)fd);
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+static bool startBackend() {
+	backendListener = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(backendListener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(backendPort);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(backendListener, (sockaddr*)&a, sizeof(a)) != 0 || listen(backendListener, SOMAXCONN) != 0) {
+		printf("soaktest: Could not listen on backend port %i\n", backendPort);
+		close(backendListener);
+		backendListener = -1;
+		return false;
+	}
+	pthread_create(&backendThread, NULL, backendAccept, NULL);
+	return true;
+}
+
+// Connections to the backend port are refused until startBackend() again
+static void stopBackend() {
+	shutdown(backendListener, SHUT_RDWR);
+	pthread_join(backendThread, NULL);
+	close(backendListener);
+	backendListener = -1;
+}
+
+static void releaseStalled() {
+	pthread_mutex_lock(&stalledLock);
+	for(unsigned int i = 0; i < stalled.size(); i++)
+		close(stalled[i]);
+	stalled.clear();
+	pthread_mutex_unlock(&stalledLock);
+}
+
+/*
+ * The proxy under test
+ */
+
+struct Snapshot {
+	int fds;
+	uint64_t sessions;
+	uint64_t memoryUsed;
+	long rssKb;
+};
+
+static bool proxyAlive() {
+	int status;
+	if(waitpid(proxyPid, &status, WNOHANG) == 0)
+		return true;
+	printf("soaktest: The proxy exited (status %#x)\n", status);
+	proxyPid = -1;
+	return false;
+}
+
+static Snapshot snapshot() {
+	Snapshot s;
+	memset(&s, 0, sizeof(s));
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%i/fd", proxyPid);
+	DIR* d = opendir(path);
+	if(d != NULL) {
+		while(dirent* e = readdir(d)) {
+			if(e->d_name[0] != '.')
+				s.fds++;
+		}
+		closedir(d);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%i/status", proxyPid);
+	FILE* f = fopen(path, "r");
+	if(f != NULL) {
+		char line[256];
+		while(fgets(line, sizeof(line), f) != NULL) {
+			if(strncmp(line, "VmRSS:", 6) == 0)
+				s.rssKb = atol(line + 6);
+		}
+		fclose(f);
+	}
+
+	// Sessions are per event loop. The budget is shared, the loop that published last has the current charge
+	uint64_t latest = 0;
+	for(unsigned int i = 0; i < stats.getLoops(); i++) {
+		StatsCounters c;
+		if(!StatsSegment::read(stats.slot(i), &c))
+			continue;
+		s.sessions += c.sessions;
+		if(c.updatedNs >= latest) {
+			latest = c.updatedNs;
+			s.memoryUsed = c.memoryUsed;
+		}
+	}
+	return s;
+}
+
+static bool startProxy(const char* binary, const char* engine, int workers, bool verbose) {
+	char conf[64], shm[64];
+	snprintf(conf, sizeof(conf), "/tmp/soaktest.%i.conf", getpid());
+	snprintf(shm, sizeof(shm), "/soaktest.%i", getpid());
+	FILE* f = fopen(conf, "w");
+	if(f == NULL) {
+		printf("soaktest: Could not write %s\n", conf);
+		return false;
+	}
+	// The lag probe wakes every loop regularly, so the stats segment is fresh even when the loops are idle
+	fprintf(f, "server_port = %i\nproxy_host = 127.0.0.1\nproxy_port = %i\nworkers = %i\nsession_engine = %s\nstats_shm = %s\n"
+		"lag_probe_interval = 100\nconnect_timeout = 2000\n", proxyPort, backendPort, workers, engine, shm);
+	fclose(f);
+
+	proxyPid = fork();
+	if(proxyPid == 0) {
+		if(!verbose) {
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			close(null);
+		}
+		execl(binary, binary, conf, (char*)NULL);
+		_exit(127);
+	}
+
+	// Wait for the segment, then for the proxy to settle into its idle state
+	bool attached = false;
+	for(int i = 0; i < 100 && !attached && proxyAlive(); i++) {
+		usleep(50000);
+		attached = stats.attach(shm);
+	}
+	unlink(conf);
+	if(!attached) {
+		printf("soaktest: The proxy's stats segment %s never appeared\n", shm);
+		return false;
+	}
+	usleep(300000);
+	return proxyAlive();
+}
+
+static bool stopProxy() {
+	if(proxyPid < 0)
+		return false;
+	kill(proxyPid, SIGTERM);
+	int status;
+	waitpid(proxyPid, &status, 0);
+	proxyPid = -1;
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("soaktest: The proxy didn't shut down cleanly (status %#x)\n", status);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Settle
+ * Wait up to ten seconds for the proxy to return to the baseline
+ *
+ * @param phase Name printed with the result
+ * @param base Idle snapshot taken at startup
+ * @return True if descriptors, sessions and the memory budget all came back. False if otherwise
+ */
+static bool settle(const char* phase, const Snapshot& base, double started) {
+	Snapshot s;
+	double deadline = nowMs() + 10000;
+	do {
+		if(!proxyAlive()) {
+			printf("soaktest: %-12s FAILED, the proxy died\n", phase);
+			return false;
+		}
+		s = snapshot();
+		if(s.fds == base.fds && s.sessions == 0 && s.memoryUsed == base.memoryUsed) {
+			printf("soaktest: %-12s ok, settled in %.0f ms (rss %ld kB)\n", phase, nowMs() - started, s.rssKb);
+			return true;
+		}
+		usleep(50000);
+	} while(nowMs() < deadline);
+
+	printf("soaktest: %-12s FAILED to settle: %i descriptors (started with %i), %llu sessions, %llu bytes charged (started with %llu)\n",
+		phase, s.fds, base.fds, (unsigned long long)s.sessions, (unsigned long long)s.memoryUsed,
+		(unsigned long long)base.memoryUsed);
+	return false;
+}
+
+/*
+ * Client behaviours. Each phase runs its client function on several threads and returns once they are all done
+ */
+
+static atomic<int> remaining(0); // Sessions left in the current phase
+static atomic<int> failures(0); // Sessions that didn't behave as the phase expects
+
+static void runThreads(int threads, void* (*fn)(void*)) {
+	vector<pthread_t> t(threads);
+	for(int i = 0; i < threads; i++)
+		pthread_create(&t[i], NULL, fn, NULL);
+	for(int i = 0; i < threads; i++)
+		pthread_join(t[i], NULL);
+}
+
+// Connect, one small round trip, close
+static void* shortClient(void* arg) {
+	while(remaining.fetch_sub(1) > 0) {
+		int fd = connectProxy();
+		char buf[16];
+		memset(buf, 's', sizeof(buf));
+		bool ok = fd >= 0 && send(fd, buf, sizeof(buf), MSG_NOSIGNAL) == sizeof(buf);
+		for(size_t got = 0; ok && got < sizeof(buf); ) {
+			ssize_t n = recv(fd, buf + got, sizeof(buf) - got, 0);
+			ok = n > 0;
+			got += (n > 0) ? n : 0;
+		}
+		if(!ok)
+			failures++;
+		if(fd >= 0)
+			close(fd);
+	}
+	return NULL;
+}
+
+// Write as fast as the proxy takes it while reading the echo a trickle at a time, then close with the echo unread
+static void* slowReader(void* arg) {
+	int fd = connectProxy();
+	if(fd < 0) {
+		failures++;
+		return NULL;
+	}
+	char buf[65536];
+	memset(buf, 'r', sizeof(buf));
+	double end = nowMs() + 1000;
+	while(nowMs() < end) {
+		send(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+		recv(fd, buf, 4096, MSG_DONTWAIT);
+		usleep(5000);
+	}
+	close(fd);
+	return NULL;
+}
+
+// Against BACKEND_STALL: write until the proxy stops taking data, hold the session a moment, close
+static void* stalledWriter(void* arg) {
+	int fd = connectProxy();
+	if(fd < 0) {
+		failures++;
+		return NULL;
+	}
+	char buf[65536];
+	memset(buf, 'w', sizeof(buf));
+	double lastSent = nowMs();
+	while(nowMs() - lastSent < 200) {
+		if(send(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL) > 0)
+			lastSent = nowMs();
+		else
+			usleep(10000);
+	}
+	close(fd);
+	return NULL;
+}
+
+// Against BACKEND_RST: stream until the reset comes through the proxy
+static void* resetByBackend(void* arg) {
+	while(remaining.fetch_sub(1) > 0) {
+		int fd = connectProxy();
+		if(fd < 0) {
+			failures++;
+			continue;
+		}
+		char buf[65536];
+		memset(buf, 'x', sizeof(buf));
+		// Loopback socket buffers soak up several MB before the reset reaches the sender, so bound the wait by time
+		bool closed = false;
+		double end = nowMs() + 3000;
+		while(!closed && nowMs() < end) {
+			if(send(fd, buf, sizeof(buf), MSG_NOSIGNAL) <= 0)
+				closed = true;
+			while(!closed) {
+				ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+				if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+					closed = true;
+				if(n <= 0)
+					break;
+			}
+		}
+		// The reset never came through the proxy
+		if(!closed)
+			failures++;
+		close(fd);
+	}
+	return NULL;
+}
+
+// Send a burst and reset the connection while the echo is still in flight
+static void* resetByClient(void* arg) {
+	while(remaining.fetch_sub(1) > 0) {
+		int fd = connectProxy();
+		if(fd < 0) {
+			failures++;
+			continue;
+		}
+		char buf[65536];
+		memset(buf, 'c', sizeof(buf));
+		for(int i = 0; i < 4; i++)
+			send(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+		resetClose(fd);
+	}
+	return NULL;
+}
+
+// With the backend down: the proxy must close the session rather than leave it hanging
+static void* refusedClient(void* arg) {
+	while(remaining.fetch_sub(1) > 0) {
+		int fd = connectProxy();
+		if(fd < 0) {
+			failures++;
+			continue;
+		}
+		char c = 'f';
+		send(fd, &c, 1, MSG_NOSIGNAL);
+		ssize_t n = recv(fd, &c, 1, 0);
+		if(n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+			failures++;
+		close(fd);
+	}
+	return NULL;
+}
+
+/**
+ * Phase
+ * Run one client behaviour and check that the proxy settles afterwards
+ *
+ * @param sessions Sessions shared out between the threads, for the looping behaviours
+ * @param expectAll True if every session must behave as expected
+ */
+static bool phase(const char* name, const Snapshot& base, int threads, int sessions, void* (*fn)(void*), bool expectAll) {
+	double started = nowMs();
+	remaining = sessions;
+	failures = 0;
+	runThreads(threads, fn);
+	if(expectAll && failures > 0) {
+		printf("soaktest: %-12s FAILED, %i sessions didn't behave as expected\n", name, failures.load());
+		settle(name, base, started);
+		return false;
+	}
+	return settle(name, base, started);
+}
+
+int main(int argc, const char* argv[]) {
+	const char* binary = "bin/proxy";
+	const char* engine = "callback";
+	int workers = 2, rounds = 2, shortSessions = 5000;
+	bool verbose = false;
+	int pos = 0;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+			binary = argv[++i];
+		else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+			engine = argv[++i];
+		else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			workers = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			rounds = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			shortSessions = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-v") == 0)
+			verbose = true;
+		else if(pos == 0 && ++pos)
+			proxyPort = atoi(argv[i]);
+		else if(pos == 1 && ++pos)
+			backendPort = atoi(argv[i]);
+		else
+			pos = -1;
+	}
+	if(pos != 2 || workers < 0 || rounds <= 0 || shortSessions <= 0) {
+		printf("Usage: %s [-x proxy binary] [-e session engine] [-w workers] [-r rounds] [-n short sessions] [-v] proxy_port "
+			"backend_port\n", argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if(!startBackend())
+		return 1;
+	if(!startProxy(binary, engine, workers, verbose)) {
+		if(proxyPid > 0)
+			stopProxy();
+		return 1;
+	}
+	Snapshot base = snapshot();
+	printf("soaktest: %s engine, %i workers, idle at %i descriptors, %llu bytes charged, rss %ld kB\n", engine, workers, base.fds,
+		(unsigned long long)base.memoryUsed, base.rssKb);
+
+	bool ok = true;
+	long firstRss = 0;
+	for(int r = 0; r < rounds && ok; r++) {
+		printf("soaktest: round %i\n", r + 1);
+		ok = phase("short", base, 8, shortSessions, shortClient, true);
+
+		ok = ok && phase("slow reader", base, 8, 0, slowReader, true);
+
+		backendMode = BACKEND_STALL;
+		if(ok) {
+			double started = nowMs();
+			runThreads(8, stalledWriter);
+			releaseStalled();
+			ok = failures == 0 && settle("stalled", base, started);
+		}
+
+		backendMode = BACKEND_RST;
+		ok = ok && phase("backend rst", base, 8, 32, resetByBackend, true);
+		backendMode = BACKEND_ECHO;
+		ok = ok && phase("client rst", base, 8, 256, resetByClient, false);
+
+		stopBackend();
+		ok = ok && phase("refused", base, 4, 256, refusedClient, true);
+		if(!startBackend())
+			ok = false;
+
+		if(r == 0)
+			firstRss = snapshot().rssKb;
+	}
+
+	// Allocator caches may keep some of what the first round touched, steady growth after that is a leak
+	if(ok && rounds > 1) {
+		long lastRss = snapshot().rssKb;
+		if(lastRss > firstRss + firstRss / 4 + 8192) {
+			printf("soaktest: FAILED, rss grew from %ld kB after the first round to %ld kB\n", firstRss, lastRss);
+			ok = false;
+		}
+	}
+
+	if(!stopProxy())
+		ok = false;
+	printf("soaktest: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+/**
+   tcp_proxy
+   SocketOptions.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "SocketOptions.h"
+
+/**
+ * Set Int
+ * setsockopt() wrapper for integer options that logs failures
+ *
+ * @return True if the option was set. False if otherwise
+ */
+bool SocketOptions::setInt(SOCKET sd, int level, int opt, int value, const char* name) {
+	if(setsockopt(sd, level, opt, &value, sizeof(value)) != 0) {
+		printf("SocketOptions: Failed to set %s=%i: %s\n", name, value, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Apply Listener
+ * Options for the listening socket. Must be called before bind()/listen(). Buffer sizes set here are inherited by accepted sockets
+ * and, for SO_RCVBUF, are what the window scale is negotiated against
+ *
+ * @param sd Listening socket descriptor
+ * @param cfg Configuration to apply
+ */
+void SocketOptions::applyListener(SOCKET sd, Config* cfg) {
+	setInt(sd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+	if(cfg->reusePort)
+		setInt(sd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+	if(cfg->sndBuf > 0)
+		setInt(sd, SOL_SOCKET, SO_SNDBUF, cfg->sndBuf, "SO_SNDBUF");
+	if(cfg->rcvBuf > 0)
+		setInt(sd, SOL_SOCKET, SO_RCVBUF, cfg->rcvBuf, "SO_RCVBUF");
+	if(cfg->deferAccept > 0)
+		setInt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, cfg->deferAccept, "TCP_DEFER_ACCEPT");
+	if(cfg->fastOpenQueue > 0)
+		setInt(sd, IPPROTO_TCP, TCP_FASTOPEN, cfg->fastOpenQueue, "TCP_FASTOPEN");
+}
+
+/**
+ * Apply Accepted
+ * Per connection options for a socket returned by accept()
+ *
+ * @param sd Accepted client socket descriptor
+ * @param cfg Configuration to apply
+ */
+void SocketOptions::applyAccepted(SOCKET sd, Config* cfg) {
+	if(cfg->tcpNoDelay)
+		setInt(sd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	if(cfg->notSentLowat > 0)
+		setInt(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, cfg->notSentLowat, "TCP_NOTSENT_LOWAT");
+	if(cfg->keepAlive) {
+		setInt(sd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		if(cfg->keepIdle > 0)
+			setInt(sd, IPPROTO_TCP, TCP_KEEPIDLE, cfg->keepIdle, "TCP_KEEPIDLE");
+		if(cfg->keepIntvl > 0)
+			setInt(sd, IPPROTO_TCP, TCP_KEEPINTVL, cfg->keepIntvl, "TCP_KEEPINTVL");
+		if(cfg->keepCnt > 0)
+			setInt(sd, IPPROTO_TCP, TCP_KEEPCNT, cfg->keepCnt, "TCP_KEEPCNT");
+	}
+}
+
+/**
+ * Apply Upstream
+ * Options for a socket connecting to the target host. Must be called before connect()
+ *
+ * @param sd Upstream socket descriptor
+ * @param cfg Configuration to apply
+ */
+void SocketOptions::applyUpstream(SOCKET sd, Config* cfg) {
+	if(cfg->sndBuf > 0)
+		setInt(sd, SOL_SOCKET, SO_SNDBUF, cfg->sndBuf, "SO_SNDBUF");
+	if(cfg->rcvBuf > 0)
+		setInt(sd, SOL_SOCKET, SO_RCVBUF, cfg->rcvBuf, "SO_RCVBUF");
+	if(cfg->fastOpenConnect)
+		setInt(sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+
+	// The remaining options are the same as for an accepted socket
+	applyAccepted(sd, cfg);
+}
+
+/**
+ * Apply Datagram
+ * Options for the UDP relay's sockets. Only the buffer sizes (and SO_REUSEPORT on the listener) apply to datagram sockets
+ *
+ * @param sd UDP socket descriptor
+ * @param cfg Configuration to apply
+ * @param listener True for the client facing socket, must be called before bind()
+ */
+void SocketOptions::applyDatagram(SOCKET sd, Config* cfg, bool listener) {
+	if(listener && cfg->reusePort)
+		setInt(sd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+	if(cfg->sndBuf > 0)
+		setInt(sd, SOL_SOCKET, SO_SNDBUF, cfg->sndBuf, "SO_SNDBUF");
+	if(cfg->rcvBuf > 0)
+		setInt(sd, SOL_SOCKET, SO_RCVBUF, cfg->rcvBuf, "SO_RCVBUF");
+}
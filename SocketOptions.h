@@ -0,0 +1,50 @@
+/**
+   tcp_proxy
+   SocketOptions.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SOCKETOPTIONS_H_
+#define SOCKETOPTIONS_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "Config.h"
+
+#define SOCKET int
+
+/**
+ * Socket Options
+ * Applies the socket tuning values from Config to the listening, accepted and upstream sockets
+ */
+class SocketOptions {
+private:
+	static bool setInt(SOCKET sd, int level, int opt, int value, const char* name);
+
+public:
+	static void applyListener(SOCKET sd, Config* cfg);
+	static void applyAccepted(SOCKET sd, Config* cfg);
+	static void applyUpstream(SOCKET sd, Config* cfg);
+	static void applyDatagram(SOCKET sd, Config* cfg, bool listener);
+};
+
+#endif
@@ -0,0 +1,149 @@
+/**
+   tcp_proxy
+   Stats.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Stats.h"
+
+/**
+ * StatsSegment Constructor
+ */
+StatsSegment::StatsSegment() {
+	dev = 0;
+	ino = 0;
+	base = NULL;
+	size = 0;
+	header = NULL;
+}
+
+/**
+ * StatsSegment Destructor
+ * Unmaps the segment. The creator also removes its name unless a successor (a handover) has put its own segment there since,
+ * readers that still have it mapped keep their view
+ */
+StatsSegment::~StatsSegment() {
+	if(base == NULL)
+		return;
+	munmap(base, size);
+	if(name.empty())
+		return;
+
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(fd < 0)
+		return;
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_dev == dev && st.st_ino == ino)
+		shm_unlink(name.c_str());
+	close(fd);
+}
+
+/**
+ * Create
+ * Create (or replace) the named segment with a slot for each event loop. The segment is built under a name of its own ("n.pid") and
+ * renamed over n once it is complete, so a previous proxy still publishing into n during a handover keeps its object untouched
+ * (it is never truncated under a live mapping) and readers see either the old segment or the whole new one
+ *
+ * @param n Segment name, "/tcp_proxy" style
+ * @param loops Number of event loops
+ * @return True if the segment is mapped. False if otherwise
+ */
+bool StatsSegment::create(string n, unsigned int loops) {
+	size = sizeof(StatsHeader) + loops * sizeof(StatsSlot);
+
+	// A leftover under the temporary name belonged to a dead process with our pid
+	string tmp = n + "." + to_string(getpid());
+	shm_unlink(tmp.c_str());
+	int fd = shm_open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0) {
+		printf("StatsSegment: Could not create %s\n", tmp.c_str());
+		return false;
+	}
+	struct stat st;
+	if(ftruncate(fd, size) != 0 || fstat(fd, &st) != 0) {
+		printf("StatsSegment: Could not size %s\n", tmp.c_str());
+		close(fd);
+		shm_unlink(tmp.c_str());
+		return false;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) {
+		base = NULL;
+		shm_unlink(tmp.c_str());
+		return false;
+	}
+
+	// The slots start out zeroed by ftruncate, the header is filled in last so readers never see a partial one
+	header = (StatsHeader*)base;
+	header->version = STATS_VERSION;
+	header->headerSize = sizeof(StatsHeader);
+	header->slotSize = sizeof(StatsSlot);
+	header->loops = loops;
+	header->pid = getpid();
+	header->startNs = nowNs();
+	atomic_thread_fence(memory_order_release);
+	memcpy(header->magic, STATS_MAGIC, sizeof(header->magic));
+
+	if(rename((STATS_SHM_DIR + tmp).c_str(), (STATS_SHM_DIR + n).c_str()) != 0) {
+		printf("StatsSegment: Could not move %s to %s\n", tmp.c_str(), n.c_str());
+		munmap(base, size);
+		base = NULL;
+		header = NULL;
+		shm_unlink(tmp.c_str());
+		return false;
+	}
+	name = n;
+	dev = st.st_dev;
+	ino = st.st_ino;
+	return true;
+}
+
+/**
+ * Attach
+ * Map an existing segment read only, for readers
+ *
+ * @param n Segment name
+ * @return True if the segment is mapped and its layout understood. False if otherwise
+ */
+bool StatsSegment::attach(string n) {
+	int fd = shm_open(n.c_str(), O_RDONLY, 0);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StatsHeader)) {
+		close(fd);
+		return false;
+	}
+	size = st.st_size;
+	base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) {
+		base = NULL;
+		return false;
+	}
+
+	header = (StatsHeader*)base;
+	if(memcmp(header->magic, STATS_MAGIC, sizeof(header->magic)) != 0 || header->version != STATS_VERSION
+		|| header->headerSize + (size_t)header->loops * header->slotSize > size || header->slotSize < sizeof(StatsSlot)) {
+		printf("StatsSegment: %s has an unknown layout\n", n.c_str());
+		munmap(base, size);
+		base = NULL;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,198 @@
+/**
+   tcp_proxy
+   Stats.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+// Segment layout: a StatsHeader, then `loops` StatsSlots (0 = acceptor, n = worker n - 1). Native byte order
+#define STATS_MAGIC "TCPSTATS"
+#define STATS_VERSION 1
+#define STATS_LAG_BUCKETS 16 // Lag histogram: bucket b counts lags under 250us << b, the last bucket everything longer
+#define STATS_SHM_DIR "/dev/shm" // Where Linux keeps shm_open() objects, a segment is renamed into place here
+
+/**
+ * Stats Counters
+ * What one event loop publishes. Counters only grow, readers take deltas. Gauges are the value at the last publish
+ */
+struct StatsCounters {
+	uint64_t updatedNs; // CLOCK_MONOTONIC time of the publish
+	uint64_t iterations; // Event loop passes
+	uint64_t busyNs; // Time spent handling ready descriptors, excluding the wait in select()
+	uint64_t lastPassNs; // Duration of the last pass
+	uint64_t maxPassNs; // Longest pass so far
+	uint64_t accepted; // Connections this loop took on. Closed sessions = accepted - sessions
+	uint64_t bytesClient; // Bytes read from clients
+	uint64_t bytesProxy; // Bytes read from target hosts
+	uint64_t sessions; // Gauge: open sessions
+	uint64_t memoryUsed; // Gauge: bytes charged to the shared memory budget
+	uint64_t memoryPeak; // Gauge
+	uint64_t memoryRejected; // Allocations refused by the memory budget
+	uint64_t mirrorBytes; // Client bytes copied to the shadow backend
+	uint64_t mirrorDropped; // Client bytes of mirrored sessions that never reached the shadow backend
+	uint64_t mirrorCut; // Mirror connections closed because they fell behind or failed
+	uint64_t lagHist[STATS_LAG_BUCKETS]; // Event loop lag probes by how late they ran, see StatsSegment::lagBucket()
+	uint64_t lagMaxUs; // Latest any lag probe ran so far
+	uint64_t acceptDeferredMs; // Time the listener was left alone because the event loops were overloaded
+	uint64_t sessionsRejected; // Connections closed right after accept because the event loops were overloaded
+	uint64_t passesCapped; // Overloaded passes that stopped at overloadPassEvents descriptors
+	uint64_t overloaded; // Gauge: 1 while the loop is overloaded
+	uint64_t ioRounds; // Extra scheduling rounds given to sessions that used their whole I/O quantum
+	uint64_t ioCarried; // Backlogged sessions left for the next pass because the pass budget ran out
+	uint64_t zerocopyBytes; // Bytes sent with MSG_ZEROCOPY
+	uint64_t zerocopyCopied; // MSG_ZEROCOPY sends the kernel ended up copying
+	uint64_t zerocopyFallbacks; // Sockets that went back to plain sends because the kernel kept copying
+	uint64_t arenaSize; // Gauge: bytes of the buffer arena's region, 0 if it is off
+	uint64_t arenaCarved; // Gauge: bytes cut into blocks so far
+	uint64_t arenaUsed; // Gauge: bytes in blocks handed out, the rest of the carved bytes is on the free lists
+};
+
+/**
+ * Stats Slot
+ * One event loop's counters behind a seqlock. Only the loop's own thread writes the slot, so the writer never waits. The sequence is
+ * odd while a publish is in progress, a reader retries if it saw an odd sequence or the sequence changed under it
+ */
+struct alignas(64) StatsSlot {
+	atomic<uint32_t> seq;
+	uint32_t reserved;
+	StatsCounters c;
+};
+
+/**
+ * Stats Header
+ */
+struct alignas(64) StatsHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize; // sizeof(StatsHeader), readers find the first slot here
+	uint32_t slotSize; // sizeof(StatsSlot)
+	uint32_t loops;
+	uint64_t pid;
+	uint64_t startNs; // CLOCK_MONOTONIC time the segment was created
+};
+
+/**
+ * Stats Segment
+ * POSIX shared memory segment the event loops publish their counters into once per pass. External tools map it read only and sample
+ * it as often as they like without a syscall on the proxy's side
+ */
+class StatsSegment {
+private:
+	string name; // Set on the creator only
+	dev_t dev; // Identity of the object the creator made, to tell it apart from a successor's under the same name
+	ino_t ino;
+	void* base;
+	size_t size;
+	StatsHeader* header;
+
+public:
+	StatsSegment();
+	~StatsSegment();
+
+	bool create(string n, unsigned int loops);
+	bool attach(string n);
+
+	unsigned int getLoops() {
+		return header->loops;
+	}
+
+	StatsHeader* getHeader() {
+		return header;
+	}
+
+	StatsSlot* slot(unsigned int loop) {
+		return (StatsSlot*)((char*)base + header->headerSize + loop * header->slotSize);
+	}
+
+	static uint64_t nowNs() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	// Histogram bucket of a lag
+	static unsigned int lagBucket(uint64_t us) {
+		unsigned int b = 0;
+		while(b < STATS_LAG_BUCKETS - 1 && us >= (250ULL << b))
+			b++;
+		return b;
+	}
+
+	// Bucket holding the p quantile (0 - 1) of a lag histogram, -1 if it is empty
+	static int lagPercentile(const uint64_t* hist, double p) {
+		uint64_t total = 0;
+		for(int b = 0; b < STATS_LAG_BUCKETS; b++)
+			total += hist[b];
+		if(total == 0)
+			return -1;
+		uint64_t seen = 0;
+		for(int b = 0; b < STATS_LAG_BUCKETS; b++) {
+			seen += hist[b];
+			if(seen >= p * total)
+				return b;
+		}
+		return STATS_LAG_BUCKETS - 1;
+	}
+
+	// "<2ms" style label of a bucket
+	static void lagLabel(char* out, size_t n, int b) {
+		if(b < 0)
+			snprintf(out, n, "-");
+		else if(b == STATS_LAG_BUCKETS - 1)
+			snprintf(out, n, ">=%gms", (250ULL << (b - 1)) / 1000.0);
+		else
+			snprintf(out, n, "<%gms", (250ULL << b) / 1000.0);
+	}
+
+	// Writer side, called only by the slot's own thread
+	static void publish(StatsSlot* s, const StatsCounters* c) {
+		uint32_t seq = s->seq.load(memory_order_relaxed);
+		s->seq.store(seq + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		memcpy(&s->c, c, sizeof(StatsCounters));
+		s->seq.store(seq + 2, memory_order_release);
+	}
+
+	// Reader side. Returns false if the writer kept publishing through every attempt
+	static bool read(StatsSlot* s, StatsCounters* c) {
+		for(int attempt = 0; attempt < 1000; attempt++) {
+			uint32_t before = s->seq.load(memory_order_acquire);
+			if(before & 1)
+				continue;
+			memcpy(c, &s->c, sizeof(StatsCounters));
+			atomic_thread_fence(memory_order_acquire);
+			if(s->seq.load(memory_order_relaxed) == before)
+				return true;
+		}
+		return false;
+	}
+};
+
+#endif
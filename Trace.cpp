@@ -0,0 +1,123 @@
+/**
+   tcp_proxy
+   Trace.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Trace.h"
+
+thread_local TraceRing* Trace::ring = NULL;
+atomic<uint32_t> Trace::nextSession(1);
+
+/**
+ * Realtime Ns
+ */
+static uint64_t realtimeNs() {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Open
+ * Give the calling thread a ring. The capacity is rounded up to a power of two
+ *
+ * @param events Minimum number of events the ring holds
+ * @param loop Event loop number recorded with every event
+ * @return Bytes allocated for the ring, for the caller's memory accounting
+ */
+size_t Trace::open(unsigned int events, int loop) {
+	close();
+
+	uint64_t cap = 1;
+	while(cap < events)
+		cap <<= 1;
+
+	TraceRing* r = new TraceRing();
+	r->events = new TraceEvent[cap];
+	memset(r->events, 0, sizeof(TraceEvent) * cap);
+	r->mask = cap - 1;
+	r->head = 0;
+	r->loop = loop;
+	r->tscOpen = tsc();
+	r->nsOpen = realtimeNs();
+	ring = r;
+	return sizeof(TraceEvent) * cap;
+}
+
+/**
+ * Close
+ * Release the calling thread's ring
+ */
+void Trace::close() {
+	if(ring == NULL)
+		return;
+	delete [] ring->events;
+	delete ring;
+	ring = NULL;
+}
+
+/**
+ * Dump
+ * Write the calling thread's ring to a file, oldest event first. Runs on the ring's own thread between event loop passes, so the ring
+ * is not being written to
+ *
+ * @param path File to write
+ * @return True if the ring was written. False if tracing is off or the file couldn't be written
+ */
+bool Trace::dump(string path) {
+	TraceRing* r = ring;
+	if(r == NULL)
+		return false;
+
+	FILE* f = fopen(path.c_str(), "wb");
+	if(f == NULL) {
+		printf("Trace: Could not open %s\n", path.c_str());
+		return false;
+	}
+
+	TraceHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	h.loop = r->loop;
+	h.tscOpen = r->tscOpen;
+	h.nsOpen = r->nsOpen;
+	h.tscDump = tsc();
+	h.nsDump = realtimeNs();
+	h.recorded = r->head;
+
+	uint64_t cap = r->mask + 1;
+	uint64_t first = (r->head > cap) ? r->head - cap : 0;
+	h.count = r->head - first;
+
+	bool ok = (fwrite(&h, sizeof(h), 1, f) == 1);
+
+	// The ring wraps at most once between first and head
+	uint64_t start = first & r->mask;
+	uint64_t n1 = (start + h.count > cap) ? cap - start : h.count;
+	if(ok && n1 > 0)
+		ok = (fwrite(&r->events[start], sizeof(TraceEvent), n1, f) == n1);
+	if(ok && h.count > n1)
+		ok = (fwrite(&r->events[0], sizeof(TraceEvent), h.count - n1, f) == h.count - n1);
+
+	if(fclose(f) != 0)
+		ok = false;
+	if(ok)
+		printf("Trace: Wrote %llu events to %s\n", (unsigned long long)h.count, path.c_str());
+	else
+		printf("Trace: Could not write %s\n", path.c_str());
+	return ok;
+}
@@ -0,0 +1,149 @@
+/**
+   tcp_proxy
+   Trace.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// Event types (TraceEvent::type) and what a and b hold
+#define TRACE_ACCEPT 1 // a: client IPv4 address (network order), b: client descriptor
+#define TRACE_CONNECT 2 // a: 0 or errno, b: proxy descriptor
+#define TRACE_READ_CLIENT 3 // a: bytes read from the client, b: bytes queued for the target host afterwards
+#define TRACE_READ_PROXY 4 // a: bytes read from the target host, b: bytes queued for the client afterwards
+#define TRACE_FLUSH_CLIENT 5 // a: queued bytes the client took, b: bytes still queued
+#define TRACE_FLUSH_PROXY 6 // a: queued bytes the target host took, b: bytes still queued
+#define TRACE_STALL 7 // Reading stopped, the session is over its memory cap. a: 0 client side, 1 proxy side, b: session memory
+#define TRACE_RESUME 8 // Reading resumed. a, b as TRACE_STALL
+#define TRACE_CLOSE 9 // a: TRACE_CLOSE_* reason, b: errno at the time
+#define TRACE_TYPES 10
+
+// Close reasons (TRACE_CLOSE a)
+#define TRACE_CLOSE_CLIENT 1 // The client closed the connection
+#define TRACE_CLOSE_PROXY 2 // The target host closed the connection
+#define TRACE_CLOSE_CLIENT_ERROR 3
+#define TRACE_CLOSE_PROXY_ERROR 4
+#define TRACE_CLOSE_CONNECT 5 // The target host couldn't be reached
+#define TRACE_CLOSE_IDLE 6
+#define TRACE_CLOSE_SHED 7 // Memory pressure
+#define TRACE_CLOSE_SHUTDOWN 8
+#define TRACE_CLOSE_REASONS 9
+
+// Dump file layout: a TraceHeader, then `count` TraceEvents oldest first. Native byte order, decoded on the same machine
+#define TRACE_MAGIC "TCPTRACE"
+#define TRACE_VERSION 1
+
+/**
+ * Trace Event
+ * 24 bytes. Timestamps are raw TSC ticks (CLOCK_MONOTONIC nanoseconds where there is no TSC), the header converts them
+ */
+struct TraceEvent {
+	uint64_t tsc;
+	uint32_t session; // Trace id of the session, unique across event loops
+	uint16_t type; // TRACE_*
+	uint16_t loop; // Event loop that recorded it, 0 for the acceptor, worker + 1
+	uint32_t a;
+	uint32_t b;
+};
+
+/**
+ * Trace Header
+ * Two (tsc, ns) pairs taken when the ring was opened and when it was dumped, so the decoder can convert ticks to time
+ */
+struct TraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t loop;
+	uint64_t tscOpen;
+	uint64_t nsOpen; // CLOCK_REALTIME
+	uint64_t tscDump;
+	uint64_t nsDump;
+	uint64_t recorded; // Events recorded since the ring was opened, older ones than count were overwritten
+	uint64_t count; // Events in the file
+};
+
+/**
+ * Trace Ring
+ * Fixed size ring of events, written only by the thread that owns it
+ */
+struct TraceRing {
+	TraceEvent* events;
+	uint64_t mask; // Capacity - 1, capacity is a power of two
+	uint64_t head; // Events recorded
+	uint16_t loop;
+	uint64_t tscOpen;
+	uint64_t nsOpen;
+};
+
+/**
+ * Trace
+ * Per thread event tracing. Every event loop thread opens its own ring, recording into it is a TLS load, a timestamp read and five
+ * stores, with no locking and no allocation. When no ring is open (trace_events = 0) recording is a single branch
+ */
+class Trace {
+private:
+	static thread_local TraceRing* ring; // This thread's ring, NULL if tracing is off
+	static atomic<uint32_t> nextSession;
+
+public:
+	static size_t open(unsigned int events, int loop);
+	static void close();
+	static bool dump(string path);
+
+	static uint32_t newSession() {
+		if(ring == NULL)
+			return 0;
+		return nextSession.fetch_add(1, memory_order_relaxed);
+	}
+
+	static uint64_t tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+	}
+
+	static void event(int type, uint32_t session, uint32_t a, uint32_t b) {
+		TraceRing* r = ring;
+		if(r == NULL)
+			return;
+		TraceEvent* e = &r->events[r->head++ & r->mask];
+		e->tsc = tsc();
+		e->session = session;
+		e->type = type;
+		e->loop = r->loop;
+		e->a = a;
+		e->b = b;
+	}
+};
+
+#endif
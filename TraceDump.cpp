@@ -0,0 +1,168 @@
+/**
+   tcp_proxy
+   TraceDump.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Offline decoder for the trace files written on SIGUSR1. Merges the rings of every event loop and prints one timeline per session
+// Usage: tracedump [-s session] file...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "Trace.h"
+
+using namespace std;
+
+// An event with its timestamp converted to wall clock nanoseconds
+struct Decoded {
+	uint64_t ns;
+	TraceEvent e;
+};
+
+static const char* typeNames[TRACE_TYPES] = { "?", "accept", "connect", "read client", "read proxy", "flush client", "flush proxy",
+	"stall", "resume", "close" };
+static const char* reasonNames[TRACE_CLOSE_REASONS] = { "?", "client closed", "target closed", "client error", "target error",
+	"connect failed", "idle", "shed", "shutdown" };
+
+/**
+ * Load
+ * Read one dump file and convert its timestamps using the two clock pairs in its header
+ *
+ * @param path Dump file
+ * @param out Events are appended here
+ * @return True if the file was read. False if otherwise
+ */
+static bool load(const char* path, vector<Decoded>* out) {
+	FILE* f = fopen(path, "rb");
+	if(f == NULL) {
+		printf("tracedump: Could not open %s\n", path);
+		return false;
+	}
+
+	TraceHeader h;
+	if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 || h.version != TRACE_VERSION) {
+		printf("tracedump: %s is not a trace file\n", path);
+		fclose(f);
+		return false;
+	}
+
+	// Ticks per nanosecond over the life of the ring
+	double rate = 1.0;
+	if(h.nsDump > h.nsOpen && h.tscDump > h.tscOpen)
+		rate = (double)(h.tscDump - h.tscOpen) / (double)(h.nsDump - h.nsOpen);
+
+	printf("tracedump: %s: loop %u, %llu events (%llu recorded), %.3f ticks/ns\n", path, h.loop, (unsigned long long)h.count,
+		(unsigned long long)h.recorded, rate);
+
+	TraceEvent e;
+	for(uint64_t i = 0; i < h.count && fread(&e, sizeof(e), 1, f) == 1; i++) {
+		Decoded d;
+		d.ns = h.nsOpen + (uint64_t)((double)(e.tsc - h.tscOpen) / rate);
+		d.e = e;
+		out->push_back(d);
+	}
+	fclose(f);
+	return true;
+}
+
+/**
+ * Describe
+ * Print what an event's a and b fields mean
+ */
+static void describe(const TraceEvent& e) {
+	char ip[INET_ADDRSTRLEN];
+	switch(e.type) {
+	case TRACE_ACCEPT:
+		inet_ntop(AF_INET, &e.a, ip, sizeof(ip));
+		printf("%s fd %u", ip, e.b);
+		break;
+	case TRACE_CONNECT:
+		if(e.a == 0)
+			printf("ok fd %u", e.b);
+		else
+			printf("failed: %s", strerror(e.a));
+		break;
+	case TRACE_READ_CLIENT:
+	case TRACE_READ_PROXY:
+		printf("%u bytes, %u queued", e.a, e.b);
+		break;
+	case TRACE_FLUSH_CLIENT:
+	case TRACE_FLUSH_PROXY:
+		printf("%u bytes, %u still queued", e.a, e.b);
+		break;
+	case TRACE_STALL:
+	case TRACE_RESUME:
+		printf("%s side, %u bytes held", (e.a == 0) ? "client" : "proxy", e.b);
+		break;
+	case TRACE_CLOSE:
+		printf("%s", (e.a < TRACE_CLOSE_REASONS) ? reasonNames[e.a] : "?");
+		if(e.b != 0)
+			printf(" (%s)", strerror(e.b));
+		break;
+	}
+}
+
+int main(int argc, const char* argv[]) {
+	long only = -1;
+	vector<Decoded> events;
+	int files = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			only = atol(argv[++i]);
+			continue;
+		}
+		if(load(argv[i], &events))
+			files++;
+	}
+	if(files == 0) {
+		printf("Usage: %s [-s session] file...\n", argv[0]);
+		return 1;
+	}
+
+	// Group by session, each timeline in time order. Session 0 holds events that didn't belong to a session
+	map<uint32_t, vector<Decoded> > sessions;
+	for(unsigned int i = 0; i < events.size(); i++) {
+		if(only < 0 || events[i].e.session == (uint32_t)only)
+			sessions[events[i].e.session].push_back(events[i]);
+	}
+
+	for(map<uint32_t, vector<Decoded> >::iterator it = sessions.begin(); it != sessions.end(); it++) {
+		vector<Decoded>& tl = it->second;
+		stable_sort(tl.begin(), tl.end(), [](const Decoded& x, const Decoded& y) { return x.ns < y.ns; });
+
+		printf("\nSession %u (loop %u, %zu events)\n", it->first, tl[0].e.loop, tl.size());
+		for(unsigned int i = 0; i < tl.size(); i++) {
+			time_t sec = tl[i].ns / 1000000000ULL;
+			struct tm t;
+			localtime_r(&sec, &t);
+			char when[32];
+			strftime(when, sizeof(when), "%H:%M:%S", &t);
+
+			printf("  %s.%09llu %+12.3f us  %-13s ", when, (unsigned long long)(tl[i].ns % 1000000000ULL),
+				(tl[i].ns - tl[0].ns) / 1000.0, (tl[i].e.type < TRACE_TYPES) ? typeNames[tl[i].e.type] : "?");
+			describe(tl[i].e);
+			printf("\n");
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,823 @@
+/**
+   tcp_proxy
+   Tunnel.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Tunnel.h"
+
+/**
+ * Put Header
+ * Write a frame header in network byte order
+ */
+static void putHeader(uint8_t* p, uint32_t id, int type, int flags, unsigned int len) {
+	TunnelHeader h = { id, (uint8_t)type, (uint8_t)flags, (uint16_t)len };
+	TunnelHeaderLayout::encode(h, p);
+}
+
+/**
+ * Tunnel Constructor
+ * Take over a connected, non blocking socket to the peer proxy and start watching it. The client end passes no socket and calls
+ * connect() instead
+ *
+ * @param c Runtime configuration
+ * @param b Memory budget the queues are charged to
+ * @param r The event loop's master read set
+ * @param w The event loop's master write set
+ * @param max The event loop's highest descriptor
+ * @param own The event loop's descriptor to tunnel table
+ * @param buf The event loop's relay buffer, cfg->relayBufferSize bytes
+ * @param act The event loop's session count
+ * @param s Socket connected to the peer, INVALID_SOCKET if connect() follows
+ * @param back Backend the peer's streams are connected to on the server end. NULL on the client end
+ */
+Tunnel::Tunnel(Config* c, MemoryBudget* b, fd_set* r, fd_set* w, int* max, Tunnel** own, uint8_t* buf, atomic<int>* act, SOCKET s,
+	Upstream* back) {
+	cfg = c;
+	budget = b;
+	readSet = r;
+	writeSet = w;
+	fdmax = max;
+	owners = own;
+	relayBuf = buf;
+	active = act;
+
+	sock = s;
+	race = NULL;
+	server = (back != NULL);
+	backend = back;
+	dead = false;
+	connecting = 0;
+	nextId = 1;
+	memUsage = 0;
+
+	// A DATA frame is read into the relay buffer behind its header
+	quantum = cfg->relayBufferSize - TUNNEL_HEADER;
+	if(quantum > TUNNEL_FRAME_MAX)
+		quantum = TUNNEL_FRAME_MAX;
+
+	budget->charge(&memUsage, TUNNEL_HEADER + TUNNEL_PAYLOAD_MAX, true);
+	zbuf = new uint8_t[TUNNEL_HEADER + TUNNEL_PAYLOAD_MAX];
+	zIn = zOut = zRaw = 0;
+
+	if(sock != INVALID_SOCKET)
+		track(sock);
+}
+
+/**
+ * Tunnel Destructor
+ * Close every stream and the connection to the peer. The peer closes its ends of the streams when it sees the connection go
+ */
+Tunnel::~Tunnel() {
+	while(!streams.empty())
+		closeStream(streams.begin()->second, false);
+
+	if(zIn + zRaw > 0) {
+		printf("Tunnel: Compressed %llu of %llu bytes sent into %llu (%.1f%%)\n", zIn, zIn + zRaw, zOut,
+			(zIn > 0) ? zOut * 100.0 / zIn : 0.0);
+	}
+
+	// The race cancels the connect attempts still in flight
+	if(race != NULL) {
+		for(unsigned int i = 0; i < race->getInFlight(); i++)
+			untrack(race->getAttempt(i));
+		delete race;
+	}
+
+	out.clear(budget, &memUsage);
+	budget->release(&memUsage, partial.size());
+	delete [] zbuf;
+	budget->release(&memUsage, TUNNEL_HEADER + TUNNEL_PAYLOAD_MAX);
+	if(sock != INVALID_SOCKET) {
+		untrack(sock);
+		close(sock);
+	}
+}
+
+/**
+ * Track
+ * Watch a descriptor for reading and route it to this tunnel
+ */
+void Tunnel::track(SOCKET fd) {
+	owners[fd] = this;
+	FD_SET(fd, readSet);
+	if(fd > *fdmax)
+		*fdmax = fd;
+}
+
+/**
+ * Untrack
+ * Stop watching a descriptor
+ */
+void Tunnel::untrack(SOCKET fd) {
+	FD_CLR(fd, readSet);
+	FD_CLR(fd, writeSet);
+	owners[fd] = NULL;
+}
+
+/**
+ * Watch Attempt
+ * Watch a connect attempt for writability, which is when it completes
+ */
+void Tunnel::watchAttempt(SOCKET fd) {
+	owners[fd] = this;
+	FD_SET(fd, writeSet);
+	if(fd > *fdmax)
+		*fdmax = fd;
+}
+
+/**
+ * Update Out
+ * Watch the tunnel socket for writability while frames are queued on it
+ */
+void Tunnel::updateOut() {
+	if(sock == INVALID_SOCKET)
+		return;
+	if(out.empty())
+		FD_CLR(sock, writeSet);
+	else
+		FD_SET(sock, writeSet);
+}
+
+/**
+ * Send Frame
+ * Queue a control frame (OPEN, CLOSE, WINDOW). Control frames are small and always sent, regardless of TUNNEL_OUT_HIGH
+ *
+ * @param id Stream id
+ * @param type TUNNEL_* frame type
+ * @param payload Frame payload, at most 64 bytes
+ * @param len Length of payload
+ */
+void Tunnel::sendFrame(uint32_t id, int type, const uint8_t* payload, unsigned int len) {
+	if(dead)
+		return;
+
+	uint8_t frame[TUNNEL_HEADER + 64];
+	if(len > 64)
+		len = 64;
+	putHeader(frame, id, type, 0, len);
+	if(len > 0)
+		memcpy(frame + TUNNEL_HEADER, payload, len);
+
+	if(!sendOut(frame, TUNNEL_HEADER + len)) {
+		dead = true;
+		return;
+	}
+	updateOut();
+}
+
+/**
+ * Send Out
+ * Send frames to the peer, or queue them while the connect to the peer is still in progress
+ *
+ * @param data Whole frames
+ * @param len Length of data
+ * @return False if the tunnel socket failed. True if otherwise
+ */
+bool Tunnel::sendOut(uint8_t* data, unsigned int len) {
+	if(sock == INVALID_SOCKET) {
+		out.append(budget, &memUsage, data, len);
+		return true;
+	}
+	return out.send(sock, budget, &memUsage, data, len);
+}
+
+/**
+ * Connect
+ * Client end. Start racing connects to the peer's addresses. Streams can be opened right away, their frames are queued until the
+ * connect completes
+ *
+ * @param peer The peer proxy's addresses
+ * @param now nowMs()
+ * @return False if every address failed on the spot. True if the race is on
+ */
+bool Tunnel::connect(Upstream* peer, long now) {
+	race = new ConnectRace(peer, cfg, now);
+	return advancePeer(now);
+}
+
+/**
+ * Advance Peer
+ * Start the connect attempts to the peer that are due. The tunnel is dead once every address has failed or connectTimeout passed
+ *
+ * @param now nowMs()
+ * @return True if the race goes on. False if it was lost
+ */
+bool Tunnel::advancePeer(long now) {
+	while(race->due(now) && !race->lost(now)) {
+		SOCKET fd = race->launch(now);
+		if(fd == INVALID_SOCKET)
+			break;
+		watchAttempt(fd);
+	}
+
+	if(!race->lost(now))
+		return true;
+
+	if(race->getInFlight() > 0)
+		race->expire(now);
+	printf("Tunnel: Couldn't connect to the peer %s (%s)\n", race->getUpstream()->getTarget().c_str(), strerror(race->getLastError()));
+	dead = true;
+	return false;
+}
+
+/**
+ * Finish Peer
+ * A connect attempt to the peer completed. The first to succeed becomes the tunnel socket and the frames queued so far are sent
+ *
+ * @param fd Attempt descriptor that turned writable
+ * @param now nowMs()
+ */
+void Tunnel::finishPeer(SOCKET fd, long now) {
+	if(!race->finish(fd, now)) {
+		untrack(fd);
+		advancePeer(now);
+		return;
+	}
+
+	untrack(fd);
+	for(unsigned int i = 0; i < race->getInFlight(); i++)
+		untrack(race->getAttempt(i));
+	printf("Tunnel: Connected to the peer %s\n", race->getUpstream()->getTarget().c_str());
+	delete race;
+	race = NULL;
+
+	sock = fd;
+	track(sock);
+	if(!out.flush(sock, budget, &memUsage)) {
+		dead = true;
+		return;
+	}
+	pump();
+}
+
+/**
+ * Open Stream
+ * Client end. Carry a freshly accepted client connection over this tunnel. The client may start sending right away, the peer
+ * connects the backend before it sees the stream's first DATA frame
+ *
+ * @param clfd Accepted client socket descriptor
+ * @param clientIP Client's address, passed on to the peer for logging
+ * @return False if the tunnel failed. True if otherwise
+ */
+bool Tunnel::openStream(SOCKET clfd, const char* clientIP) {
+	if(dead)
+		return false;
+
+	uint32_t id = nextId++;
+	if(nextId == 0)
+		nextId = 1;
+	addStream(id, clfd);
+	sendFrame(id, TUNNEL_OPEN, (const uint8_t*)clientIP, strlen(clientIP));
+	return !dead;
+}
+
+/**
+ * Add Stream
+ * Set up the state for a stream and start reading from its local socket
+ *
+ * @param id Stream id
+ * @param fd Local socket, INVALID_SOCKET if its connect hasn't completed yet
+ * @return The new stream
+ */
+TunnelStream* Tunnel::addStream(uint32_t id, SOCKET fd) {
+	TunnelStream* st = new TunnelStream();
+	st->id = id;
+	st->fd = fd;
+	st->race = NULL;
+	st->credit = cfg->tunnelWindow;
+	st->consumed = 0;
+	st->queued = false;
+	st->closing = false;
+	st->memUsage = 0;
+	st->deflater = NULL;
+	st->inflater = NULL;
+	if(cfg->tunnelCompression != COMPRESS_OFF)
+		st->deflater = new Compressor(cfg->tunnelCompression, budget, &st->memUsage);
+
+	streams[id] = st;
+	if(fd != INVALID_SOCKET) {
+		locals[fd] = st;
+		track(fd);
+	}
+	(*active)++;
+	return st;
+}
+
+/**
+ * Open Remote
+ * Server end. The peer opened a stream, start racing connects to the backend's addresses. DATA arriving before the connect
+ * completes is queued, the stream's credit window bounds it
+ *
+ * @param id Stream id chosen by the peer
+ * @param payload Client's address as sent by the peer
+ * @param len Length of payload
+ */
+void Tunnel::openRemote(uint32_t id, const uint8_t* payload, unsigned int len) {
+	long now = Upstream::nowUs() / 1000;
+	TunnelStream* st = addStream(id, INVALID_SOCKET);
+	st->clientIP.assign((const char*)payload, len);
+	st->race = new ConnectRace(backend, cfg, now);
+	connecting++;
+	advanceStream(st, now);
+}
+
+/**
+ * Advance Stream
+ * Start the stream's backend connect attempts that are due. Once every address has failed or connectTimeout has passed the stream
+ * is closed and the peer told with a CLOSE frame
+ *
+ * @param st Stream with a connect race
+ * @param now nowMs()
+ * @return True if the race goes on. False if it was lost and the stream closed
+ */
+bool Tunnel::advanceStream(TunnelStream* st, long now) {
+	ConnectRace* r = st->race;
+	while(r->due(now) && !r->lost(now)) {
+		SOCKET fd = r->launch(now);
+		if(fd == INVALID_SOCKET)
+			break;
+		attempts[fd] = st;
+		watchAttempt(fd);
+	}
+
+	if(!r->lost(now))
+		return true;
+
+	if(r->getInFlight() > 0)
+		r->expire(now);
+	printf("Tunnel: Stream %u from %s couldn't connect to %s (%s)\n", st->id, st->clientIP.c_str(), backend->getTarget().c_str(),
+		strerror(r->getLastError()));
+	closeStream(st, true);
+	return false;
+}
+
+/**
+ * Finish Stream
+ * One of the stream's backend connect attempts completed. The first to succeed becomes the stream's local socket, what the peer
+ * sent in the meantime is passed on
+ *
+ * @param st Stream with a connect race
+ * @param fd Attempt descriptor that turned writable
+ * @param now nowMs()
+ */
+void Tunnel::finishStream(TunnelStream* st, SOCKET fd, long now) {
+	if(!st->race->finish(fd, now)) {
+		attempts.erase(fd);
+		untrack(fd);
+		advanceStream(st, now);
+		return;
+	}
+
+	attempts.erase(fd);
+	untrack(fd);
+	endStreamRace(st);
+	printf("Tunnel: Stream %u from %s has connected\n", st->id, st->clientIP.c_str());
+
+	// Not read once the peer has closed it, only flushed
+	st->fd = fd;
+	locals[fd] = st;
+	track(fd);
+	if(st->closing)
+		FD_CLR(fd, readSet);
+
+	unsigned int pending = st->toLocal.size();
+	if(!st->toLocal.flush(fd, budget, &st->memUsage)) {
+		closeStream(st, !st->closing);
+		return;
+	}
+	if(!st->toLocal.empty())
+		FD_SET(fd, writeSet);
+	else if(st->closing) {
+		closeStream(st, false);
+		return;
+	}
+	if(!st->closing)
+		credit(st, pending);
+}
+
+/**
+ * End Stream Race
+ * Cancel the stream's connect attempts still in flight and forget the race
+ *
+ * @param st Stream with a connect race
+ */
+void Tunnel::endStreamRace(TunnelStream* st) {
+	for(unsigned int i = 0; i < st->race->getInFlight(); i++) {
+		attempts.erase(st->race->getAttempt(i));
+		untrack(st->race->getAttempt(i));
+	}
+	delete st->race;
+	st->race = NULL;
+	connecting--;
+}
+
+/**
+ * Close Stream
+ * Close the stream's local socket and forget the stream
+ *
+ * @param st Stream to close
+ * @param notify True to tell the peer with a CLOSE frame. False if the peer closed it or the tunnel is going away
+ */
+void Tunnel::closeStream(TunnelStream* st, bool notify) {
+	if(notify)
+		sendFrame(st->id, TUNNEL_CLOSE, NULL, 0);
+	if(st->queued)
+		ready.remove(st);
+
+	if(st->race != NULL)
+		endStreamRace(st);
+	if(st->fd != INVALID_SOCKET) {
+		untrack(st->fd);
+		close(st->fd);
+		locals.erase(st->fd);
+	}
+	st->toLocal.clear(budget, &st->memUsage);
+
+	if(st->deflater != NULL) {
+		zIn += st->deflater->bytesIn;
+		zOut += st->deflater->bytesOut;
+		zRaw += st->deflater->bytesRaw;
+		delete st->deflater;
+	}
+	if(st->inflater != NULL)
+		delete st->inflater;
+
+	streams.erase(st->id);
+	delete st;
+	(*active)--;
+}
+
+/**
+ * Handle Readable
+ * Called by the event loop when the tunnel socket or one of the streams' local sockets is readable. A local socket isn't read here,
+ * the stream joins the ready ring and stops being watched until pump() gets to it
+ *
+ * @param fd Readable descriptor
+ */
+void Tunnel::handleReadable(SOCKET fd) {
+	if(fd != sock) {
+		map<SOCKET, TunnelStream*>::iterator it = locals.find(fd);
+		if(it == locals.end())
+			return;
+		FD_CLR(fd, readSet);
+		schedule(it->second);
+		pump();
+		return;
+	}
+
+	ssize_t n = recv(sock, relayBuf, cfg->relayBufferSize, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if(n <= 0) {
+		dead = true;
+		return;
+	}
+
+	// Frames are parsed straight out of the relay buffer, only an incomplete frame at the end is copied aside
+	if(partial.empty()) {
+		unsigned int used = process(relayBuf, n);
+		if(!dead && used < (unsigned int)n) {
+			partial.assign(relayBuf + used, relayBuf + n);
+			budget->charge(&memUsage, partial.size(), true);
+		}
+	} else {
+		budget->release(&memUsage, partial.size());
+		partial.insert(partial.end(), relayBuf, relayBuf + n);
+		unsigned int used = process(&partial[0], partial.size());
+		partial.erase(partial.begin(), partial.begin() + used);
+		budget->charge(&memUsage, partial.size(), true);
+	}
+
+	// WINDOW frames may have made streams ready, the relay buffer is free again
+	pump();
+}
+
+/**
+ * Process
+ * Handle every complete frame in data
+ *
+ * @param data Bytes received from the peer
+ * @param len Length of data
+ * @return Bytes consumed. The rest is the start of a frame that hasn't fully arrived
+ */
+unsigned int Tunnel::process(const uint8_t* data, unsigned int len) {
+	unsigned int off = 0;
+	TunnelHeader h;
+	while(!dead && TunnelHeaderLayout::decode(data + off, len - off, &h)) {
+		unsigned int plen = h.len;
+		if(plen > TUNNEL_PAYLOAD_MAX) {
+			printf("Tunnel: Oversized frame from the peer, closing the tunnel\n");
+			dead = true;
+			break;
+		}
+		if(len - off < TUNNEL_HEADER + plen)
+			break;
+
+		handleFrame(h.id, h.type, h.flags, data + off + TUNNEL_HEADER, plen);
+		off += TUNNEL_HEADER + plen;
+	}
+	return off;
+}
+
+/**
+ * Handle Frame
+ * Act on one frame from the peer. Frames for unknown streams are dropped, they crossed a CLOSE sent from this end
+ *
+ * @param id Stream id
+ * @param type TUNNEL_* frame type
+ * @param flags TUNNEL_FLAG_* bits
+ * @param payload Frame payload
+ * @param len Length of payload
+ */
+void Tunnel::handleFrame(uint32_t id, int type, int flags, const uint8_t* payload, unsigned int len) {
+	if(type == TUNNEL_OPEN) {
+		if(!server || streams.count(id) > 0) {
+			printf("Tunnel: Unexpected OPEN for stream %u, closing the tunnel\n", id);
+			dead = true;
+			return;
+		}
+		openRemote(id, payload, len);
+		return;
+	}
+
+	map<uint32_t, TunnelStream*>::iterator it = streams.find(id);
+	if(it == streams.end())
+		return;
+	TunnelStream* st = it->second;
+
+	if(type == TUNNEL_DATA) {
+		if(st->closing)
+			return;
+		if(flags & TUNNEL_FLAG_DEFLATE)
+			inflateData(st, payload, len);
+		else
+			deliver(st, payload, len);
+	} else if(type == TUNNEL_CLOSE) {
+		// Nothing more is read from the local socket, what the peer sent is still passed on
+		st->closing = true;
+		if(st->queued) {
+			ready.remove(st);
+			st->queued = false;
+		}
+		if(st->fd != INVALID_SOCKET)
+			FD_CLR(st->fd, readSet);
+		if(st->toLocal.empty())
+			closeStream(st, false);
+	} else if(type == TUNNEL_WINDOW && len == 4) {
+		bool starved = (st->credit <= 0);
+		st->credit += BigEndian::get<uint32_t>(payload);
+		if(starved && st->credit > 0 && !st->closing)
+			schedule(st);
+	} else {
+		printf("Tunnel: Bad frame type %i, closing the tunnel\n", type);
+		dead = true;
+	}
+}
+
+/**
+ * Deliver
+ * Pass DATA from the peer on to the stream's local socket
+ *
+ * @param st Receiving stream
+ * @param data Payload
+ * @param len Length of data
+ * @return False if the local socket failed and the stream was closed. True if otherwise
+ */
+bool Tunnel::deliver(TunnelStream* st, const uint8_t* data, unsigned int len) {
+	// Held until the backend connect completes, credit is returned once it has been passed on
+	if(st->race != NULL) {
+		st->toLocal.append(budget, &st->memUsage, (uint8_t*)data, len);
+		return true;
+	}
+
+	unsigned int pending = st->toLocal.size() + len;
+	if(!st->toLocal.send(st->fd, budget, &st->memUsage, (uint8_t*)data, len)) {
+		closeStream(st, true);
+		return false;
+	}
+
+	if(!st->toLocal.empty())
+		FD_SET(st->fd, writeSet);
+	credit(st, pending);
+	return true;
+}
+
+/**
+ * Inflate Data
+ * Decompress a TUNNEL_FLAG_DEFLATE payload and deliver it piece by piece through the scratch buffer
+ *
+ * @param st Receiving stream
+ * @param data Compressed payload
+ * @param len Length of data
+ */
+void Tunnel::inflateData(TunnelStream* st, const uint8_t* data, unsigned int len) {
+	if(st->inflater == NULL)
+		st->inflater = new Decompressor(budget, &st->memUsage);
+
+	st->inflater->begin(data, len);
+	int n;
+	while((n = st->inflater->next(zbuf, TUNNEL_PAYLOAD_MAX)) > 0) {
+		if(!deliver(st, zbuf, n))
+			return;
+	}
+
+	if(n < 0) {
+		printf("Tunnel: Corrupt compressed data on stream %u\n", st->id);
+		closeStream(st, true);
+	}
+}
+
+/**
+ * Credit
+ * Count what the local socket took since pending bytes were waiting for it, and return it to the peer once a quarter of the window
+ * has been passed on. Batching keeps WINDOW frames rare while the peer never runs dry
+ *
+ * @param st Stream
+ * @param pending Bytes that were waiting for the local socket before the last send or flush
+ */
+void Tunnel::credit(TunnelStream* st, unsigned int pending) {
+	st->consumed += pending - st->toLocal.size();
+	if(st->consumed < (unsigned int)cfg->tunnelWindow / 4)
+		return;
+
+	uint8_t inc[4];
+	BigEndian::put<uint32_t>(inc, st->consumed);
+	sendFrame(st->id, TUNNEL_WINDOW, inc, 4);
+	st->consumed = 0;
+}
+
+/**
+ * Schedule
+ * Put a stream at the back of the ready ring. A stream still connecting has nothing to read, it is watched once connected
+ */
+void Tunnel::schedule(TunnelStream* st) {
+	if(st->queued || st->race != NULL)
+		return;
+	st->queued = true;
+	ready.push_back(st);
+}
+
+/**
+ * Pump
+ * Serve the ready ring round robin: each stream gets one read of up to a quantum (and its credit), sent as a DATA frame. Stops while
+ * TUNNEL_OUT_HIGH bytes are queued on the tunnel socket and continues once it has been flushed. A stream that filled its quantum
+ * goes to the back of the ring, one that came up short is watched by select() again
+ */
+void Tunnel::pump() {
+	while(!dead && !ready.empty() && out.size() < TUNNEL_OUT_HIGH) {
+		TunnelStream* st = ready.front();
+		ready.pop_front();
+		st->queued = false;
+
+		// Out of credit, the next WINDOW frame schedules it again
+		unsigned int want = quantum;
+		if(st->credit < (long)want)
+			want = (st->credit > 0) ? st->credit : 0;
+		if(want == 0)
+			continue;
+
+		ssize_t n = recv(st->fd, relayBuf + TUNNEL_HEADER, want, 0);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				FD_SET(st->fd, readSet);
+			else
+				closeStream(st, true);
+			continue;
+		} else if(n == 0) {
+			closeStream(st, true);
+			continue;
+		}
+
+		st->credit -= n;
+
+		// Compressed into the scratch buffer when it pays off, otherwise sent as read
+		unsigned int z = 0;
+		if(st->deflater != NULL)
+			z = st->deflater->compress(relayBuf + TUNNEL_HEADER, n, zbuf + TUNNEL_HEADER, TUNNEL_PAYLOAD_MAX);
+
+		bool sent;
+		if(z > 0) {
+			putHeader(zbuf, st->id, TUNNEL_DATA, TUNNEL_FLAG_DEFLATE, z);
+			sent = sendOut(zbuf, TUNNEL_HEADER + z);
+		} else {
+			putHeader(relayBuf, st->id, TUNNEL_DATA, 0, n);
+			sent = sendOut(relayBuf, TUNNEL_HEADER + n);
+		}
+		if(!sent) {
+			dead = true;
+			break;
+		}
+
+		if((unsigned int)n == want && st->credit > 0)
+			schedule(st);
+		else if(st->credit > 0)
+			FD_SET(st->fd, readSet);
+	}
+	updateOut();
+}
+
+/**
+ * Handle Writable
+ * Called by the event loop when the tunnel socket or a stream's local socket can take more of its queued data, or a connect attempt
+ * has completed
+ *
+ * @param fd Writable descriptor
+ */
+void Tunnel::handleWritable(SOCKET fd) {
+	long now = Upstream::nowUs() / 1000;
+	if(race != NULL && locals.count(fd) == 0) {
+		finishPeer(fd, now);
+		return;
+	}
+
+	map<SOCKET, TunnelStream*>::iterator at = attempts.find(fd);
+	if(at != attempts.end()) {
+		finishStream(at->second, fd, now);
+		return;
+	}
+
+	if(fd == sock) {
+		if(!out.flush(sock, budget, &memUsage)) {
+			dead = true;
+			return;
+		}
+		pump();
+		return;
+	}
+
+	map<SOCKET, TunnelStream*>::iterator it = locals.find(fd);
+	if(it == locals.end())
+		return;
+	TunnelStream* st = it->second;
+
+	unsigned int pending = st->toLocal.size();
+	if(!st->toLocal.flush(fd, budget, &st->memUsage)) {
+		closeStream(st, !st->closing);
+		return;
+	}
+
+	if(st->toLocal.empty()) {
+		FD_CLR(fd, writeSet);
+		if(st->closing) {
+			closeStream(st, false);
+			return;
+		}
+	}
+	if(!st->closing)
+		credit(st, pending);
+}
+
+/**
+ * Tick
+ * Called by the event loop every pass. Starts the connect attempts that have come due and gives up on the races that ran out of time
+ *
+ * @param now nowMs()
+ */
+void Tunnel::tick(long now) {
+	if(race != NULL && race->due(now))
+		advancePeer(now);
+	if(connecting == 0)
+		return;
+
+	// advanceStream() may close the stream, collect the due ones first
+	vector<TunnelStream*> due;
+	for(map<uint32_t, TunnelStream*>::iterator it = streams.begin(); it != streams.end(); it++) {
+		if(it->second->race != NULL && it->second->race->due(now))
+			due.push_back(it->second);
+	}
+	for(unsigned int i = 0; i < due.size(); i++)
+		advanceStream(due[i], now);
+}
+
+/**
+ * Wake At
+ * When tick() has to run next
+ *
+ * @return nowMs() of the earliest connect attempt or timeout due, -1 if only a descriptor becoming ready can change anything
+ */
+long Tunnel::wakeAt() {
+	long at = (race != NULL) ? race->wakeAt() : -1;
+	if(connecting == 0)
+		return at;
+	for(map<uint32_t, TunnelStream*>::iterator it = streams.begin(); it != streams.end(); it++) {
+		if(it->second->race == NULL)
+			continue;
+		long w = it->second->race->wakeAt();
+		if(w >= 0 && (at < 0 || w < at))
+			at = w;
+	}
+	return at;
+}
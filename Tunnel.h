@@ -0,0 +1,189 @@
+/**
+   tcp_proxy
+   Tunnel.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TUNNEL_H_
+#define TUNNEL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <list>
+#include <map>
+#include <vector>
+#include <string>
+#include <atomic>
+
+#include "Config.h"
+#include "SocketOptions.h"
+#include "MemoryBudget.h"
+#include "SendQueue.h"
+#include "Compression.h"
+#include "Upstream.h"
+#include "ByteCodec.h"
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+// Frame header, network byte order: stream id (32 bits), type (8), flags (8), payload length (16)
+#define TUNNEL_HEADER 8
+#define TUNNEL_FRAME_MAX 16384 // Most a stream gets to send per scheduling turn
+#define TUNNEL_PAYLOAD_MAX (TUNNEL_FRAME_MAX + 1024) // Largest payload accepted, a compressed turn that didn't shrink is a little larger
+
+// Frame types
+#define TUNNEL_OPEN 1 // New stream. Payload is the client's address, for logging
+#define TUNNEL_DATA 2
+#define TUNNEL_CLOSE 3 // The sender's side of the stream is gone. The receiver flushes what it has queued, then closes
+#define TUNNEL_WINDOW 4 // Payload is a 32 bit credit increment: the receiver has passed that many more bytes on
+
+// Frame flags
+#define TUNNEL_FLAG_DEFLATE 1 // DATA payload is the stream's Compressor output. Credits always count uncompressed bytes
+
+// Streams stop being read while this much is queued on the tunnel socket
+#define TUNNEL_OUT_HIGH (256 * 1024)
+
+using namespace std;
+
+/**
+ * Tunnel Header
+ * A frame header decoded
+ */
+struct TunnelHeader {
+	uint32_t id; // Stream id
+	uint8_t type; // TUNNEL_* frame type
+	uint8_t flags; // TUNNEL_FLAG_* bits
+	uint16_t len; // Payload length
+};
+
+typedef Layout<Field<&TunnelHeader::id, BigEndian, 0>, Field<&TunnelHeader::type, BigEndian, 4>, Field<&TunnelHeader::flags, BigEndian, 5>,
+	Field<&TunnelHeader::len, BigEndian, 6> > TunnelHeaderLayout;
+static_assert(TunnelHeaderLayout::size == TUNNEL_HEADER, "Tunnel: header layout doesn't match TUNNEL_HEADER");
+
+/**
+ * Tunnel Stream
+ * One client session carried over a tunnel. On the client end the local socket is the client, on the server end it is the backend
+ */
+struct TunnelStream {
+	uint32_t id;
+	SOCKET fd; // Local socket, INVALID_SOCKET while the backend connect is in progress
+	ConnectRace* race; // Server end: the backend connect, NULL once fd is connected
+	string clientIP; // Server end: the client's address as sent by the peer, for logging
+	long credit; // Bytes the peer will still accept on this stream
+	unsigned int consumed; // Bytes passed on to the local socket that haven't been credited back to the peer yet
+	bool queued; // In the ready ring
+	bool closing; // The peer closed the stream, close once toLocal has drained
+	size_t memUsage; // Bytes charged for toLocal and the compression state
+	SendQueue toLocal; // Data from the peer the local socket hasn't taken yet
+	Compressor* deflater; // Compresses what is sent to the peer, NULL unless tunnelCompression is set
+	Decompressor* inflater; // Created on the first compressed frame from the peer
+};
+
+/**
+ * Tunnel
+ * One long lived connection between two proxies that carries many client sessions as streams. Each stream has a credit window, so a
+ * slow client only ever stalls its own stream. Streams with data to send are served round robin, TUNNEL_FRAME_MAX bytes per turn, and
+ * only while the tunnel socket keeps up, so a single busy stream can't monopolize the connection
+ *
+ * The tunnel registers its descriptors in the owning event loop's FD sets and descriptor table, like the Reactor does. Connects never
+ * block the loop: the client end races its connect to the peer and queues frames until it completes, the server end races each
+ * stream's backend connect and queues the stream's data until it completes. The loop calls tick() for the attempts that come due
+ */
+class Tunnel {
+private:
+	Config* cfg; // Runtime configuration (not owned)
+	MemoryBudget* budget; // (not owned)
+	fd_set* readSet; // The loop's master read set (not owned)
+	fd_set* writeSet; // The loop's master write set (not owned)
+	int* fdmax; // The loop's highest descriptor (not owned)
+	Tunnel** owners; // The loop's descriptor to tunnel table, FD_SETSIZE entries (not owned)
+	uint8_t* relayBuf; // The loop's receive buffer (not owned)
+	atomic<int>* active; // The loop's session count, every stream counts as a session (not owned)
+
+	SOCKET sock; // Connection to the peer proxy, INVALID_SOCKET while race is in progress
+	ConnectRace* race; // Client end: the connect to the peer, NULL once sock is connected
+	bool server; // Server end: streams are opened by the peer and connected to the backend
+	Upstream* backend; // Server end: where streams are connected to (not owned)
+	bool dead; // The connection failed or the peer broke the protocol
+	map<SOCKET, TunnelStream*> attempts; // Server end: backend connect attempts in flight, by descriptor
+	unsigned int connecting; // Server end: streams whose backend connect is in progress
+
+	map<uint32_t, TunnelStream*> streams;
+	map<SOCKET, TunnelStream*> locals;
+	list<TunnelStream*> ready; // Streams whose local socket may have data, served round robin
+	uint32_t nextId;
+	size_t memUsage; // Bytes charged for out and partial
+	SendQueue out; // Frames the tunnel socket hasn't taken yet
+	vector<uint8_t> partial; // Start of a frame whose remainder hasn't arrived yet
+	unsigned int quantum; // Payload read per scheduling turn
+	uint8_t* zbuf; // Compression output and decompression scratch, TUNNEL_HEADER + TUNNEL_PAYLOAD_MAX bytes
+
+	// Compression totals of the closed streams, reported when the tunnel closes
+	unsigned long long zIn;
+	unsigned long long zOut;
+	unsigned long long zRaw;
+
+private:
+	void track(SOCKET fd);
+	void untrack(SOCKET fd);
+	void watchAttempt(SOCKET fd);
+	bool sendOut(uint8_t* data, unsigned int len);
+	void sendFrame(uint32_t id, int type, const uint8_t* payload, unsigned int len);
+	unsigned int process(const uint8_t* data, unsigned int len);
+	void handleFrame(uint32_t id, int type, int flags, const uint8_t* payload, unsigned int len);
+	TunnelStream* addStream(uint32_t id, SOCKET fd);
+	void openRemote(uint32_t id, const uint8_t* payload, unsigned int len);
+	bool advancePeer(long now);
+	void finishPeer(SOCKET fd, long now);
+	bool advanceStream(TunnelStream* st, long now);
+	void finishStream(TunnelStream* st, SOCKET fd, long now);
+	void endStreamRace(TunnelStream* st);
+	bool deliver(TunnelStream* st, const uint8_t* data, unsigned int len);
+	void inflateData(TunnelStream* st, const uint8_t* data, unsigned int len);
+	void credit(TunnelStream* st, unsigned int before);
+	void schedule(TunnelStream* st);
+	void pump();
+	void closeStream(TunnelStream* st, bool notify);
+	void updateOut();
+
+public:
+	Tunnel(Config* c, MemoryBudget* b, fd_set* r, fd_set* w, int* max, Tunnel** own, uint8_t* buf, atomic<int>* act, SOCKET s,
+		Upstream* back);
+	~Tunnel();
+
+	bool connect(Upstream* peer, long now);
+	bool openStream(SOCKET clfd, const char* clientIP);
+	void handleReadable(SOCKET fd);
+	void handleWritable(SOCKET fd);
+	void tick(long now);
+	long wakeAt();
+
+	bool isDead() {
+		return dead;
+	}
+
+	unsigned int getStreams() {
+		return streams.size();
+	}
+};
+
+#endif
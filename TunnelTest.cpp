@@ -0,0 +1,466 @@
+/**
+   tcp_proxy
+   TunnelTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Tunnel test. Runs a client end and a server end proxy with the test's own echo server as the target host behind them:
+//   client -> client end (proxy_port) -> tunnel -> server end (peer_port) -> echo server (backend_port)
+// Checks that data comes back intact, that a stream whose backend connect hangs is closed once connect_timeout passes while the other
+// streams on the tunnel carry on, that a refused backend connect closes the stream and that the client end reconnects its tunnels
+// once an unreachable peer comes back. Connects are stalled by a listener that never accepts: once its queue is full the kernel
+// drops new SYNs.
+// Usage: tunneltest [-x proxy binary] [-v] proxy_port peer_port backend_port
+// Exits non-zero if any check failed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+#define CONNECT_TIMEOUT 1000 // Server end's connect_timeout in ms
+
+static int proxyPort, peerPort, backendPort;
+static const char* binary = "bin/proxy";
+static bool verbose = false;
+static pid_t clientEnd = -1, serverEnd = -1;
+static int backendListener = -1;
+static pthread_t backendThread;
+static int stallListener = -1; // Listener that never accepts, standing in for the echo server while it stalls
+static vector<int> fillers; // Connections that fill the stalled listener's queue
+
+static double nowMs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static sockaddr_in loopback(int port) {
+	sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return a;
+}
+
+static int connectTo(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in a = loopback(port);
+	timeval tv = { 5, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if(connect(fd, (sockaddr*)&a, sizeof(a)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool readFull(int fd, char* buf, size_t len) {
+	for(size_t got = 0; got < len; ) {
+		ssize_t n = recv(fd, buf + got, len - got, 0);
+		if(n <= 0)
+			return false;
+		got += n;
+	}
+	return true;
+}
+
+/*
+ * Echo server
+ */
+
+static void* echoConnection(void* arg) {
+	int fd = (int)(long)arg;
+	char buf[65536];
+	for(;;) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if(n <= 0 || send(fd, buf, n, MSG_NOSIGNAL) != n)
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void* echoAccept(void* arg) {
+	for(;;) {
+		int fd = accept(backendListener, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		pthread_t t;
+		pthread_create(&t, NULL, echoConnection, (void*)(long)fd);
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+static int listenOn(int port, int backlog) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in a = loopback(port);
+	if(bind(fd, (sockaddr*)&a, sizeof(a)) != 0 || listen(fd, backlog) != 0) {
+		printf("tunneltest: Could not listen on backend port %i\n", port);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool startBackend() {
+	backendListener = listenOn(backendPort, 128);
+	if(backendListener < 0)
+		return false;
+	pthread_create(&backendThread, NULL, echoAccept, NULL);
+	return true;
+}
+
+// Established echo connections outlive the listener
+static void stopBackend() {
+	shutdown(backendListener, SHUT_RDWR);
+	pthread_join(backendThread, NULL);
+	close(backendListener);
+	backendListener = -1;
+}
+
+// Swap the echo server for a listener with a one entry queue that never accepts and fill it, connects hang from here on
+static void stallBackend() {
+	stopBackend();
+	stallListener = listenOn(backendPort, 1);
+	sockaddr_in a = loopback(backendPort);
+	for(int i = 0; i < 4; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		connect(fd, (sockaddr*)&a, sizeof(a));
+		fillers.push_back(fd);
+	}
+	usleep(50000);
+}
+
+static void resumeBackend() {
+	for(unsigned int i = 0; i < fillers.size(); i++)
+		close(fillers[i]);
+	fillers.clear();
+	close(stallListener);
+	stallListener = -1;
+	startBackend();
+}
+
+/*
+ * Proxies
+ */
+
+static pid_t startProxy(const char* name, const char* settings) {
+	char conf[64];
+	snprintf(conf, sizeof(conf), "/tmp/tunneltest.%i.%s.conf", getpid(), name);
+	FILE* f = fopen(conf, "w");
+	if(f == NULL)
+		return -1;
+	fputs(settings, f);
+	fclose(f);
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		if(!verbose) {
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			close(null);
+		}
+		execl(binary, binary, conf, (char*)NULL);
+		_exit(127);
+	}
+	// Give it time to listen
+	usleep(300000);
+	unlink(conf);
+	int status;
+	if(waitpid(pid, &status, WNOHANG) != 0) {
+		printf("tunneltest: The %s end proxy exited on startup\n", name);
+		return -1;
+	}
+	return pid;
+}
+
+static pid_t startServerEnd() {
+	char settings[256];
+	snprintf(settings, sizeof(settings), "server_port = %i\nproxy_host = 127.0.0.1\nproxy_port = %i\ntunnel_mode = server\n"
+		"connect_timeout = %i\n", peerPort, backendPort, CONNECT_TIMEOUT);
+	return startProxy("server", settings);
+}
+
+static pid_t startClientEnd() {
+	char settings[256];
+	snprintf(settings, sizeof(settings), "server_port = %i\nproxy_host = 127.0.0.1\nproxy_port = %i\ntunnel_mode = client\n"
+		"tunnel_connections = 2\n", proxyPort, peerPort);
+	return startProxy("client", settings);
+}
+
+static bool stopProxy(pid_t* pid, const char* name) {
+	if(*pid < 0)
+		return false;
+	kill(*pid, SIGTERM);
+	int status;
+	waitpid(*pid, &status, 0);
+	*pid = -1;
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("tunneltest: The %s end didn't shut down cleanly (status %#x)\n", name, status);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Checks
+ */
+
+static int failed = 0;
+
+static void result(const char* name, bool ok, const char* detail) {
+	printf("tunneltest: %-16s %s%s%s\n", name, ok ? "ok" : "FAILED", (detail[0] != 0) ? ", " : "", detail);
+	if(!ok)
+		failed++;
+}
+
+// One session: send len patterned bytes, read them back and compare
+static void* transferSession(void* arg) {
+	long len = (long)arg;
+	int fd = connectTo(proxyPort);
+	if(fd < 0)
+		return (void*)0;
+	vector<char> out(len), in(len);
+	for(long i = 0; i < len; i++)
+		out[i] = (char)(i * 131 + len);
+
+	bool ok = true;
+	long sent = 0, got = 0;
+	while(ok && got < len) {
+		// Keep at most 256KB outstanding so the echo never backs up against a full send buffer
+		if(sent < len && sent - got < 256 * 1024) {
+			ssize_t n = send(fd, &out[sent], (len - sent < 65536) ? len - sent : 65536, MSG_NOSIGNAL);
+			ok = n > 0;
+			sent += (n > 0) ? n : 0;
+		}
+		ssize_t n = recv(fd, &in[got], len - got, (sent < len) ? MSG_DONTWAIT : 0);
+		if(n > 0)
+			got += n;
+		else if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			ok = false;
+	}
+	close(fd);
+	return (void*)(long)(ok && memcmp(out.data(), in.data(), len) == 0);
+}
+
+static void checkEcho() {
+	long sizes[] = { 1, 1000, 65536, 300000, 1 << 20, 4 << 20 };
+	int n = sizeof(sizes) / sizeof(sizes[0]);
+	pthread_t t[8];
+	int good = 0;
+	for(int i = 0; i < 8; i++)
+		pthread_create(&t[i], NULL, transferSession, (void*)sizes[i % n]);
+	for(int i = 0; i < 8; i++) {
+		void* r;
+		pthread_join(t[i], &r);
+		good += (r != NULL);
+	}
+	char detail[64];
+	snprintf(detail, sizeof(detail), "%i of 8 sessions echoed intact", good);
+	result("echo", good == 8, detail);
+}
+
+// Time until the proxy closes a session, -1 if it is still open after ms
+static double timeToClose(int fd, int ms) {
+	timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	double start = nowMs();
+	char c;
+	ssize_t n = recv(fd, &c, 1, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return -1;
+	return nowMs() - start;
+}
+
+struct PingState {
+	int fd;
+	atomic<bool> run;
+	double maxRtt;
+	int pings;
+	bool ok;
+};
+
+// Round trips on an established session every 10ms, timing each
+static void* pingSession(void* arg) {
+	PingState* p = (PingState*)arg;
+	char buf[32];
+	memset(buf, 'p', sizeof(buf));
+	while(p->run) {
+		double start = nowMs();
+		if(send(p->fd, buf, sizeof(buf), MSG_NOSIGNAL) != sizeof(buf) || !readFull(p->fd, buf, sizeof(buf))) {
+			p->ok = false;
+			break;
+		}
+		double rtt = nowMs() - start;
+		if(rtt > p->maxRtt)
+			p->maxRtt = rtt;
+		p->pings++;
+		usleep(10000);
+	}
+	return NULL;
+}
+
+// A stream whose backend connect hangs is closed after connect_timeout, and doesn't hold up the streams already flowing
+static void checkStalledConnect() {
+	PingState ping;
+	ping.fd = connectTo(proxyPort);
+	ping.run = true;
+	ping.maxRtt = 0;
+	ping.pings = 0;
+	ping.ok = ping.fd >= 0;
+	char buf[32];
+	memset(buf, 'p', sizeof(buf));
+	if(!ping.ok || send(ping.fd, buf, sizeof(buf), MSG_NOSIGNAL) != sizeof(buf) || !readFull(ping.fd, buf, sizeof(buf))) {
+		result("stalled connect", false, "the ping session didn't connect");
+		if(ping.fd >= 0)
+			close(ping.fd);
+		return;
+	}
+
+	stallBackend();
+	pthread_t t;
+	pthread_create(&t, NULL, pingSession, &ping);
+
+	int fd = connectTo(proxyPort);
+	double closedAfter = -1;
+	if(fd >= 0) {
+		send(fd, "hello", 5, MSG_NOSIGNAL);
+		closedAfter = timeToClose(fd, CONNECT_TIMEOUT + 2000);
+		close(fd);
+	}
+
+	ping.run = false;
+	pthread_join(t, NULL);
+	close(ping.fd);
+	resumeBackend();
+
+	char detail[160];
+	snprintf(detail, sizeof(detail), "stalled stream closed after %.0f ms (connect_timeout %i), %i pings meanwhile, slowest %.1f ms",
+		closedAfter, CONNECT_TIMEOUT, ping.pings, ping.maxRtt);
+	result("stalled connect", closedAfter >= CONNECT_TIMEOUT * 0.8 && closedAfter < CONNECT_TIMEOUT + 1000 && ping.ok && ping.pings > 10
+		&& ping.maxRtt < 200, detail);
+}
+
+// Nothing listening on the backend port: the stream is closed right away and the tunnel stays up
+static void checkRefused() {
+	stopBackend();
+	int fd = connectTo(proxyPort);
+	double closedAfter = -1;
+	if(fd >= 0) {
+		send(fd, "hello", 5, MSG_NOSIGNAL);
+		closedAfter = timeToClose(fd, 2000);
+		close(fd);
+	}
+	startBackend();
+	void* r = transferSession((void*)100000);
+
+	char detail[128];
+	snprintf(detail, sizeof(detail), "refused stream closed after %.0f ms, next session %s", closedAfter, r ? "intact" : "broken");
+	result("refused", closedAfter >= 0 && closedAfter < 500 && r != NULL, detail);
+}
+
+// The server end goes away: sessions are closed while it is unreachable and carried again once it is back
+static void checkPeerDown() {
+	stopProxy(&serverEnd, "server");
+	int fd = connectTo(proxyPort);
+	double closedAfter = -1;
+	if(fd >= 0) {
+		send(fd, "hello", 5, MSG_NOSIGNAL);
+		closedAfter = timeToClose(fd, 2000);
+		close(fd);
+	}
+	serverEnd = startServerEnd();
+	void* r = (serverEnd > 0) ? transferSession((void*)100000) : NULL;
+
+	char detail[128];
+	snprintf(detail, sizeof(detail), "session closed after %.0f ms while the peer was down, %s once it was back", closedAfter,
+		r ? "intact" : "broken");
+	result("peer down", closedAfter >= 0 && closedAfter < 500 && r != NULL, detail);
+}
+
+int main(int argc, const char* argv[]) {
+	int pos = 0;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+			binary = argv[++i];
+		else if(strcmp(argv[i], "-v") == 0)
+			verbose = true;
+		else if(pos == 0 && ++pos)
+			proxyPort = atoi(argv[i]);
+		else if(pos == 1 && ++pos)
+			peerPort = atoi(argv[i]);
+		else if(pos == 2 && ++pos)
+			backendPort = atoi(argv[i]);
+		else
+			pos = -1;
+	}
+	if(pos != 3) {
+		printf("Usage: %s [-x proxy binary] [-v] proxy_port peer_port backend_port\n", argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if(!startBackend())
+		return 1;
+	serverEnd = startServerEnd();
+	clientEnd = startClientEnd();
+	if(serverEnd < 0 || clientEnd < 0) {
+		if(serverEnd > 0)
+			stopProxy(&serverEnd, "server");
+		if(clientEnd > 0)
+			stopProxy(&clientEnd, "client");
+		return 1;
+	}
+
+	checkEcho();
+	checkStalledConnect();
+	checkRefused();
+	checkPeerDown();
+	checkEcho();
+
+	if(!stopProxy(&clientEnd, "client"))
+		failed++;
+	if(serverEnd > 0 && !stopProxy(&serverEnd, "server"))
+		failed++;
+	printf("tunneltest: %s\n", (failed == 0) ? "ok" : "FAILED");
+	return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+/**
+   tcp_proxy
+   UdpBench.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// UDP relay benchmark. The benchmark is also the target host, a UDP echo server on the backend port, so the proxy must run in
+// udp mode pointed at it:
+//   mode = udp, proxy_host = 127.0.0.1, proxy_port = <backend port>
+// Usage: udpbench [-f flows] [-w window] [-t seconds] [-s datagram size] proxy_port backend_port
+// Every flow is its own client socket (so its own relay flow) that sends a window of datagrams with one sendmmsg() and collects
+// the echoes, waiting at most 50ms before counting the missing ones as lost. Reported: datagrams/s and MB/s echoed, loss, and the
+// window round trip percentiles
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#define BENCH_BATCH 64
+
+using namespace std;
+
+static atomic<bool> running(true);
+static atomic<bool> measuring(false);
+static atomic<unsigned long long> sentCount(0), echoedCount(0), echoedBytes(0);
+static pthread_mutex_t rttLock = PTHREAD_MUTEX_INITIALIZER;
+static vector<double> rtts; // Microseconds
+static int proxyPort, window = 32, dgramSize = 512;
+
+static double nowUs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void loopback(sockaddr_in* a, int port) {
+	memset(a, 0, sizeof(sockaddr_in));
+	a->sin_family = AF_INET;
+	a->sin_port = htons(port);
+	a->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+// Backend: echo every datagram to its sender, a batch at a time so the echo server isn't what's measured
+static void* echoThread(void* arg) {
+	int fd = (int)(long)arg;
+	vector<char> data(BENCH_BATCH * 65536);
+	mmsghdr msgs[BENCH_BATCH];
+	iovec iovs[BENCH_BATCH];
+	sockaddr_in addrs[BENCH_BATCH];
+	for(;;) {
+		for(int i = 0; i < BENCH_BATCH; i++) {
+			iovs[i].iov_base = data.data() + i * 65536;
+			iovs[i].iov_len = 65536;
+			memset(&msgs[i].msg_hdr, 0, sizeof(msghdr));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		}
+		int n = recvmmsg(fd, msgs, BENCH_BATCH, MSG_WAITFORONE, NULL);
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		for(int i = 0; i < n; i++)
+			iovs[i].iov_len = msgs[i].msg_len;
+		for(int done = 0; done < n; ) {
+			int w = sendmmsg(fd, msgs + done, n - done, 0);
+			if(w <= 0) {
+				done++; // Skip the slot that failed
+				continue;
+			}
+			done += w;
+		}
+	}
+	return NULL;
+}
+
+static void* flowThread(void* arg) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int buf = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+	sockaddr_in a;
+	loopback(&a, proxyPort);
+	if(connect(fd, (sockaddr*)&a, sizeof(a)) != 0) {
+		printf("udpbench: Flow could not connect\n");
+		close(fd);
+		return NULL;
+	}
+
+	vector<char> out(dgramSize, 'u'), in(65536);
+	mmsghdr msgs[BENCH_BATCH];
+	iovec iov;
+	iov.iov_base = out.data();
+	iov.iov_len = dgramSize;
+	for(int i = 0; i < window; i++) {
+		memset(&msgs[i].msg_hdr, 0, sizeof(msghdr));
+		msgs[i].msg_hdr.msg_iov = &iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	vector<double> mine;
+	while(running) {
+		double start = nowUs();
+		int sent = 0;
+		while(sent < window) {
+			int n = sendmmsg(fd, msgs + sent, window - sent, 0);
+			if(n <= 0)
+				break;
+			sent += n;
+		}
+
+		// Collect the echoes, giving up on the rest of the window after 50ms
+		int got = 0;
+		pollfd p = { fd, POLLIN, 0 };
+		while(got < sent) {
+			int wait = 50 - (int)((nowUs() - start) / 1000);
+			if(wait <= 0 || poll(&p, 1, wait) <= 0)
+				break;
+			ssize_t n;
+			while(got < sent && (n = recv(fd, in.data(), in.size(), MSG_DONTWAIT)) > 0) {
+				got++;
+				if(measuring)
+					echoedBytes += n;
+			}
+		}
+
+		if(measuring) {
+			sentCount += sent;
+			echoedCount += got;
+			if(got == sent)
+				mine.push_back(nowUs() - start);
+		}
+		// Drain late echoes so they aren't counted against the next window
+		while(recv(fd, in.data(), in.size(), MSG_DONTWAIT) > 0)
+			;
+	}
+
+	close(fd);
+	pthread_mutex_lock(&rttLock);
+	rtts.insert(rtts.end(), mine.begin(), mine.end());
+	pthread_mutex_unlock(&rttLock);
+	return NULL;
+}
+
+int main(int argc, const char* argv[]) {
+	int flows = 4, seconds = 5, backendPort = 0;
+	int pos = 0;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			flows = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			window = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			seconds = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			dgramSize = atoi(argv[++i]);
+		else if(pos == 0 && ++pos)
+			proxyPort = atoi(argv[i]);
+		else if(pos == 1 && ++pos)
+			backendPort = atoi(argv[i]);
+		else
+			pos = -1;
+	}
+	if(pos != 2 || flows <= 0 || seconds <= 0 || window <= 0 || window > BENCH_BATCH || dgramSize <= 0 || dgramSize > 65507) {
+		printf("Usage: %s [-f flows] [-w window, 1-%i] [-t seconds] [-s datagram size] proxy_port backend_port\n", argv[0],
+			BENCH_BATCH);
+		return 1;
+	}
+
+	int efd = socket(AF_INET, SOCK_DGRAM, 0);
+	int buf = 8 * 1024 * 1024;
+	setsockopt(efd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+	setsockopt(efd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+	sockaddr_in a;
+	loopback(&a, backendPort);
+	if(bind(efd, (sockaddr*)&a, sizeof(a)) != 0) {
+		printf("udpbench: Could not bind backend port %i\n", backendPort);
+		return 1;
+	}
+	pthread_t backend;
+	pthread_create(&backend, NULL, echoThread, (void*)(long)efd);
+	pthread_detach(backend);
+
+	vector<pthread_t> threads;
+	for(int i = 0; i < flows; i++) {
+		pthread_t t;
+		pthread_create(&t, NULL, flowThread, NULL);
+		threads.push_back(t);
+	}
+
+	// Let the relay set up its flows before measuring
+	usleep(500000);
+	measuring = true;
+	double start = nowUs();
+	sleep(seconds);
+	measuring = false;
+	double sec = (nowUs() - start) / 1e6;
+	running = false;
+	for(unsigned int i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	printf("udpbench: %i flows, window %i, %i byte datagrams, %.1f s\n", flows, window, dgramSize, sec);
+	printf("echoed      %.0f datagrams/s, %.1f MB/s\n", echoedCount / sec, echoedBytes / (1024.0 * 1024.0) / sec);
+	printf("lost        %.2f%% of %llu sent\n", sentCount ? 100.0 * (sentCount - echoedCount) / sentCount : 0.0,
+		(unsigned long long)sentCount);
+	if(rtts.empty()) {
+		printf("window      no complete windows\n");
+		return 1;
+	}
+	sort(rtts.begin(), rtts.end());
+	size_t n = rtts.size();
+	printf("window      %zu complete, p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us\n", n, rtts[n / 2], rtts[n * 9 / 10],
+		rtts[n * 99 / 100], rtts[n - 1]);
+	return 0;
+}
@@ -0,0 +1,407 @@
+/**
+   tcp_proxy
+   UdpRelay.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "UdpRelay.h"
+
+/**
+ * UdpRelay Constructor
+ *
+ * @param c Runtime configuration, must outlive the relay
+ */
+UdpRelay::UdpRelay(Config* c) {
+	cfg = c;
+	listenSocket = INVALID_SOCKET;
+	memset(&upstreamAddr, 0, sizeof(upstreamAddr));
+	upstreamAddrLen = 0;
+	flowMap = new map<uint64_t, UdpFlow*>();
+	upstreamMap = new map<SOCKET, UdpFlow*>();
+	FD_ZERO(&fd_master);
+	FD_ZERO(&fd_read);
+	fdmax = 0;
+	lastSweep = 0;
+	dropped = 0;
+	offload = cfg->udpOffload;
+
+	batch = cfg->udpBatch;
+	if(batch < 1)
+		batch = 1;
+	if(batch > UDP_BATCH_MAX)
+		batch = UDP_BATCH_MAX;
+
+	data = new char[batch * UDP_SLOT_SIZE];
+}
+
+/**
+ * UdpRelay Destructor
+ */
+UdpRelay::~UdpRelay() {
+	if(listenSocket != INVALID_SOCKET)
+		closeSockets();
+	delete flowMap;
+	delete upstreamMap;
+	delete [] data;
+}
+
+/**
+ * Init
+ * Resolve the target host and bind the client facing datagram socket
+ *
+ * @return True if the relay is ready to process(). False if otherwise
+ */
+bool UdpRelay::init() {
+	if(!resolveUpstream())
+		return false;
+	return initSocket(cfg->serverPort);
+}
+
+/**
+ * Resolve Upstream
+ * Look up the target host once, every flow connects its upstream socket to this address
+ *
+ * @return True if the target host resolved. False if otherwise
+ */
+bool UdpRelay::resolveUpstream() {
+	struct addrinfo hints, *res;
+	char portstr[8];
+	sprintf(portstr, "%i", cfg->proxyPort);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if(getaddrinfo(cfg->proxyHost.c_str(), portstr, &hints, &res) != 0 || res == NULL) {
+		printf("UdpRelay: Could not resolve %s\n", cfg->proxyHost.c_str());
+		return false;
+	}
+
+	memcpy(&upstreamAddr, res->ai_addr, res->ai_addrlen);
+	upstreamAddrLen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+/**
+ * Init Socket
+ * Bind the datagram socket clients send to
+ *
+ * @param port Port to listen on
+ * @return True if initialization succeeded. False if otherwise
+ */
+bool UdpRelay::initSocket(int port) {
+	listenSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if(listenSocket == INVALID_SOCKET) {
+		printf("UdpRelay: Could not create socket.\n");
+		return false;
+	}
+
+	SocketOptions::applyDatagram(listenSocket, cfg, true);
+	if(offload) {
+		int on = 1;
+		if(setsockopt(listenSocket, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0) {
+			printf("UdpRelay: UDP_GRO not supported, segmentation offload disabled\n");
+			offload = false;
+		}
+	}
+
+	sockaddr_in serverAddr;
+	memset(&serverAddr, 0, sizeof(serverAddr));
+	serverAddr.sin_family = AF_INET;
+	serverAddr.sin_port = htons(port);
+	serverAddr.sin_addr.s_addr = INADDR_ANY;
+	if(bind(listenSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) != 0) {
+		printf("UdpRelay: Failed to bind to the address\n");
+		return false;
+	}
+
+	FD_SET(listenSocket, &fd_master);
+	fdmax = listenSocket;
+	lastSweep = time(NULL);
+
+	return true;
+}
+
+/**
+ * Get Flow
+ * Lookup the flow for a client address, creating it (and its connected upstream socket) on the first datagram
+ *
+ * @param addr Client address
+ * @return Pointer to the flow. NULL if a new flow couldn't be created
+ */
+UdpFlow* UdpRelay::getFlow(sockaddr_in* addr) {
+	map<uint64_t, UdpFlow*>::const_iterator it = flowMap->find(flowKey(addr));
+	if(it != flowMap->end())
+		return it->second;
+
+	SOCKET sd = socket(upstreamAddr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if(sd == INVALID_SOCKET)
+		return NULL;
+
+	// select() can't track descriptors past FD_SETSIZE
+	if(sd >= FD_SETSIZE || connect(sd, (sockaddr*)&upstreamAddr, upstreamAddrLen) != 0) {
+		close(sd);
+		return NULL;
+	}
+
+	SocketOptions::applyDatagram(sd, cfg, false);
+	if(offload) {
+		int on = 1;
+		setsockopt(sd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+	}
+
+	UdpFlow* flow = new UdpFlow();
+	flow->upstreamSocket = sd;
+	flow->clientAddr = *addr;
+	flow->lastActive = time(NULL);
+
+	flowMap->insert(pair<uint64_t, UdpFlow*>(flowKey(addr), flow));
+	upstreamMap->insert(pair<SOCKET, UdpFlow*>(sd, flow));
+	FD_SET(sd, &fd_master);
+	if(sd > fdmax)
+		fdmax = sd;
+
+	printf("UdpRelay: New flow from %s:%i\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	return flow;
+}
+
+/**
+ * Remove Flow
+ * Close the flow's upstream socket and release it from the FD set, both maps, and memory
+ *
+ * @param flow Pointer to the flow
+ */
+void UdpRelay::removeFlow(UdpFlow* flow) {
+	close(flow->upstreamSocket);
+	FD_CLR(flow->upstreamSocket, &fd_master);
+	upstreamMap->erase(flow->upstreamSocket);
+	flowMap->erase(flowKey(&flow->clientAddr));
+	delete flow;
+}
+
+/**
+ * Expire Flows
+ * Remove every flow that hasn't seen a datagram in either direction for udpIdleTimeout seconds. Runs at most once a second
+ *
+ * @param now Current time
+ */
+void UdpRelay::expireFlows(time_t now) {
+	if(now == lastSweep)
+		return;
+	lastSweep = now;
+
+	map<uint64_t, UdpFlow*>::iterator it = flowMap->begin();
+	while(it != flowMap->end()) {
+		UdpFlow* flow = it->second;
+		it++; // Advance before removeFlow() erases the entry
+		if(now - flow->lastActive >= cfg->udpIdleTimeout)
+			removeFlow(flow);
+	}
+}
+
+/**
+ * Recv Batch
+ * Receive up to batch datagrams from a socket into the batch slots
+ *
+ * @param sd Socket descriptor to read
+ * @return Number of datagrams received. 0 if none were waiting
+ */
+int UdpRelay::recvBatch(SOCKET sd) {
+	for(unsigned int i = 0; i < batch; i++) {
+		iovs[i].iov_base = data + (i * UDP_SLOT_SIZE);
+		iovs[i].iov_len = UDP_SLOT_SIZE;
+		memset(&msgs[i].msg_hdr, 0, sizeof(msghdr));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		if(offload) {
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		}
+	}
+
+	int n = recvmmsg(sd, msgs, batch, MSG_DONTWAIT, NULL);
+	if(n <= 0)
+		return 0;
+
+	// Record the segment size of coalesced receives so they are split again on send
+	for(int i = 0; i < n; i++) {
+		segSize[i] = 0;
+		if(!offload)
+			continue;
+		for(cmsghdr* cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+			if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+				int gso = 0;
+				memcpy(&gso, CMSG_DATA(cm), sizeof(gso));
+				segSize[i] = (uint16_t)gso;
+			}
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Send Batch
+ * Send a run of received slots with a single sendmmsg(). Datagrams the socket can't take right now are dropped, as the network would.
+ * sendmmsg() stops at the first datagram that fails, so a hard error (EMSGSIZE, ECONNREFUSED from an earlier ICMP, ...) drops only
+ * that slot and the rest of the run is still sent. A full send buffer (EAGAIN) drops the remainder
+ *
+ * @param sd Socket descriptor to send on (a connected upstream socket or the listening socket)
+ * @param start Index of the first slot
+ * @param count Number of slots
+ * @param dest Destination address when sending on the listening socket. NULL for connected sockets
+ */
+void UdpRelay::sendBatch(SOCKET sd, unsigned int start, unsigned int count, sockaddr_in* dest) {
+	for(unsigned int i = start; i < start + count; i++) {
+		iovs[i].iov_len = msgs[i].msg_len;
+		msgs[i].msg_hdr.msg_name = dest;
+		msgs[i].msg_hdr.msg_namelen = (dest != NULL) ? sizeof(sockaddr_in) : 0;
+		msgs[i].msg_hdr.msg_control = NULL;
+		msgs[i].msg_hdr.msg_controllen = 0;
+
+		// Let the kernel split a coalesced slot back into the original datagrams
+		if(segSize[i] > 0 && msgs[i].msg_len > segSize[i]) {
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			cmsghdr* cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			memcpy(CMSG_DATA(cm), &segSize[i], sizeof(uint16_t));
+		}
+	}
+
+	unsigned int done = 0;
+	while(done < count) {
+		int n = sendmmsg(sd, &msgs[start + done], count - done, MSG_DONTWAIT);
+		if(n > 0) {
+			done += n;
+			continue;
+		}
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+
+		// This slot failed on its own, skip it and keep going
+		dropped++;
+		done++;
+	}
+
+	dropped += count - done;
+}
+
+/**
+ * Handle Clients
+ * Drain datagrams from the listening socket and forward each run belonging to the same client to that client's upstream socket
+ *
+ * @param now Current time
+ */
+void UdpRelay::handleClients(time_t now) {
+	for(int round = 0; round < UDP_BATCH_ROUNDS; round++) {
+		int n = recvBatch(listenSocket);
+		if(n == 0)
+			return;
+
+		int i = 0;
+		while(i < n) {
+			UdpFlow* flow = getFlow(&addrs[i]);
+
+			// Consecutive datagrams from the same client go out in one sendmmsg()
+			int run = 1;
+			while(i + run < n && flowKey(&addrs[i + run]) == flowKey(&addrs[i]))
+				run++;
+
+			if(flow == NULL) {
+				dropped += run;
+			} else {
+				flow->lastActive = now;
+				sendBatch(flow->upstreamSocket, i, run, NULL);
+			}
+			i += run;
+		}
+
+		if((unsigned int)n < batch)
+			return;
+	}
+}
+
+/**
+ * Handle Upstream
+ * Drain datagrams from a flow's upstream socket and send them back to the flow's client through the listening socket
+ *
+ * @param flow Flow whose upstream socket is readable
+ * @param now Current time
+ */
+void UdpRelay::handleUpstream(UdpFlow* flow, time_t now) {
+	for(int round = 0; round < UDP_BATCH_ROUNDS; round++) {
+		int n = recvBatch(flow->upstreamSocket);
+		if(n == 0)
+			return;
+
+		flow->lastActive = now;
+		sendBatch(listenSocket, 0, n, &flow->clientAddr);
+
+		if((unsigned int)n < batch)
+			return;
+	}
+}
+
+/**
+ * Process
+ * Run a single pass of the relay: wait (up to a second) for readable sockets, relay their datagrams, then expire idle flows
+ */
+void UdpRelay::process() {
+	fd_read = fd_master;
+
+	// Wake up at least once a second so idle flows expire even without traffic
+	timeval tv = { 1, 0 };
+	int ready = select(fdmax + 1, &fd_read, NULL, NULL, &tv);
+	time_t now = time(NULL);
+
+	if(ready > 0) {
+		for(int i = 0; i <= fdmax; i++) {
+			if(!FD_ISSET(i, &fd_read))
+				continue;
+
+			if(i == listenSocket) {
+				handleClients(now);
+				continue;
+			}
+
+			map<SOCKET, UdpFlow*>::const_iterator it = upstreamMap->find(i);
+			if(it != upstreamMap->end())
+				handleUpstream(it->second, now);
+		}
+	}
+
+	expireFlows(now);
+}
+
+/**
+ * Close Sockets
+ * Remove every flow and close the listening socket. Called on server shutdown
+ */
+void UdpRelay::closeSockets() {
+	printf("UdpRelay: Closing %u flows (%llu datagrams dropped)\n", (unsigned int)flowMap->size(), dropped);
+
+	while(!flowMap->empty())
+		removeFlow(flowMap->begin()->second);
+
+	close(listenSocket);
+	listenSocket = INVALID_SOCKET;
+}
@@ -0,0 +1,112 @@
+/**
+   tcp_proxy
+   UdpRelay.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef UDPRELAY_H_
+#define UDPRELAY_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <map>
+
+#include "Config.h"
+#include "SocketOptions.h"
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+// Largest number of datagrams moved per recvmmsg()/sendmmsg() call
+#define UDP_BATCH_MAX 64
+// Size of each datagram slot. Large enough for a GRO coalesced receive
+#define UDP_SLOT_SIZE 65536
+// Number of batches drained from one socket per wakeup before moving on
+#define UDP_BATCH_ROUNDS 8
+
+using namespace std;
+
+/**
+ * UDP Flow
+ * One client address and the connected upstream socket its datagrams are relayed through
+ */
+struct UdpFlow {
+	SOCKET upstreamSocket;
+	sockaddr_in clientAddr;
+	time_t lastActive;
+};
+
+class UdpRelay {
+private:
+	Config* cfg;
+	SOCKET listenSocket; // Datagram socket clients send to
+	sockaddr_storage upstreamAddr; // Resolved target host address
+	socklen_t upstreamAddrLen;
+	map<uint64_t, UdpFlow*> *flowMap; // Maps a client address (ip:port) to its flow
+	map<SOCKET, UdpFlow*> *upstreamMap; // Maps an upstream socket descriptor to its flow
+	fd_set fd_master; // Listening socket + upstream sockets
+	fd_set fd_read;
+	int fdmax;
+	time_t lastSweep; // Last time idle flows were expired
+	unsigned int batch; // Datagrams per recvmmsg()/sendmmsg() call
+	bool offload; // UDP_GRO on receive, UDP_SEGMENT on send
+	unsigned long long dropped; // Datagrams that couldn't be forwarded
+
+	// Batch state, reused by every call
+	mmsghdr msgs[UDP_BATCH_MAX];
+	iovec iovs[UDP_BATCH_MAX];
+	sockaddr_in addrs[UDP_BATCH_MAX];
+	uint16_t segSize[UDP_BATCH_MAX]; // GRO segment size of each received slot, 0 if not coalesced
+	char ctrl[UDP_BATCH_MAX][CMSG_SPACE(sizeof(int))];
+	char* data; // batch * UDP_SLOT_SIZE bytes
+
+private:
+	bool resolveUpstream();
+	bool initSocket(int port);
+	UdpFlow* getFlow(sockaddr_in* addr);
+	void removeFlow(UdpFlow* flow);
+	void expireFlows(time_t now);
+	int recvBatch(SOCKET sd);
+	void sendBatch(SOCKET sd, unsigned int start, unsigned int count, sockaddr_in* dest);
+	void handleClients(time_t now);
+	void handleUpstream(UdpFlow* flow, time_t now);
+
+	static uint64_t flowKey(sockaddr_in* addr) {
+		return ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+	}
+
+public:
+	UdpRelay(Config* c);
+	~UdpRelay();
+
+	bool init();
+	void process();
+	void closeSockets();
+};
+
+#endif
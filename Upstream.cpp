@@ -0,0 +1,314 @@
+/**
+   tcp_proxy
+   Upstream.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Upstream.h"
+
+/**
+ * Upstream Constructor
+ */
+Upstream::Upstream() {
+	count = 0;
+}
+
+/**
+ * Resolve
+ * Look up every address of the target. The resolver has already sorted them (RFC 6724), they are then interleaved by family
+ * starting with the family of the first one, so a broken family costs one attempt delay instead of one attempt per address
+ *
+ * @param host Host name or address
+ * @param port Port number or service name
+ * @return True if at least one address was found. False if otherwise
+ */
+bool Upstream::resolve(string host, string port) {
+	addrinfo hints;
+	addrinfo* res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC; // Will be determined by getaddrinfo (IPv4/v6)
+	hints.ai_socktype = SOCK_STREAM;
+	target = host + ":" + port;
+	if(getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || res == NULL) {
+		printf("Upstream: Could not resolve %s\n", target.c_str());
+		return false;
+	}
+
+	// Split by family, keeping the resolver's order within each
+	addrinfo* first[UPSTREAM_MAX_ADDRS];
+	addrinfo* other[UPSTREAM_MAX_ADDRS];
+	unsigned int nFirst = 0, nOther = 0;
+	for(addrinfo* ai = res; ai != NULL && nFirst + nOther < UPSTREAM_MAX_ADDRS; ai = ai->ai_next) {
+		if(ai->ai_addrlen > sizeof(sockaddr_storage))
+			continue;
+		if(ai->ai_family == res->ai_family)
+			first[nFirst++] = ai;
+		else
+			other[nOther++] = ai;
+	}
+
+	count = 0;
+	for(unsigned int i = 0; i < nFirst || i < nOther; i++) {
+		addrinfo* pick[2] = { (i < nFirst) ? first[i] : NULL, (i < nOther) ? other[i] : NULL };
+		for(int j = 0; j < 2; j++) {
+			if(pick[j] == NULL)
+				continue;
+			UpstreamAddr* a = &addrs[count++];
+			memcpy(&a->addr, pick[j]->ai_addr, pick[j]->ai_addrlen);
+			a->addrLen = pick[j]->ai_addrlen;
+			a->latencyUs.store(0);
+			a->failures.store(0);
+			a->failedAt.store(0);
+		}
+	}
+	freeaddrinfo(res);
+
+	printf("Upstream: %s resolved to %u address%s\n", target.c_str(), count, (count == 1) ? "" : "es");
+	return count > 0;
+}
+
+/**
+ * Resolve
+ * Look up a "host:port" target. IPv6 literals may be written in brackets
+ *
+ * @param hostPort Target string
+ * @return True if at least one address was found. False if otherwise
+ */
+bool Upstream::resolve(string hostPort) {
+	size_t colon = hostPort.rfind(':');
+	if(colon == string::npos || colon == 0) {
+		printf("Upstream: Target %s must be host:port\n", hostPort.c_str());
+		return false;
+	}
+	string host = hostPort.substr(0, colon);
+	if(host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr(1, host.size() - 2);
+	return resolve(host, hostPort.substr(colon + 1));
+}
+
+/**
+ * Order
+ * The order to attempt the addresses in right now. Addresses with a known connect time come first, fastest first, then the ones
+ * never tried in resolver order. The families are interleaved again so a family that just went bad can't take every early slot.
+ * Addresses that failed in the last UPSTREAM_FAIL_HOLD ms go last, those that failed least first
+ *
+ * @param out Receives the address indexes, size() entries
+ * @param now nowMs()
+ * @return Number of entries written
+ */
+unsigned int Upstream::order(uint8_t* out, long now) {
+	uint8_t idx[UPSTREAM_MAX_ADDRS];
+	uint64_t key[UPSTREAM_MAX_ADDRS];
+
+	// Stable insertion sort on the rank, there are never more than UPSTREAM_MAX_ADDRS entries
+	for(unsigned int i = 0; i < count; i++) {
+		uint64_t k;
+		uint32_t fails = addrs[i].failures.load(memory_order_relaxed);
+		if(fails > 0 && now - addrs[i].failedAt.load(memory_order_relaxed) < UPSTREAM_FAIL_HOLD)
+			k = (2ULL << 32) + fails;
+		else if(addrs[i].latencyUs.load(memory_order_relaxed) > 0)
+			k = addrs[i].latencyUs.load(memory_order_relaxed);
+		else
+			k = 1ULL << 32;
+
+		unsigned int j = i;
+		for(; j > 0 && key[j - 1] > k; j--) {
+			idx[j] = idx[j - 1];
+			key[j] = key[j - 1];
+		}
+		idx[j] = i;
+		key[j] = k;
+	}
+
+	// Interleave the healthy addresses by family starting with the best one's, then append the ones that failed lately
+	unsigned int healthy = 0;
+	while(healthy < count && key[healthy] < (2ULL << 32))
+		healthy++;
+
+	bool used[UPSTREAM_MAX_ADDRS] = { false };
+	unsigned int n = 0;
+	sa_family_t family = (healthy > 0) ? addrs[idx[0]].addr.ss_family : AF_UNSPEC;
+	while(n < healthy) {
+		unsigned int pick = healthy;
+		for(unsigned int i = 0; i < healthy; i++) {
+			if(!used[i] && addrs[idx[i]].addr.ss_family == family) {
+				pick = i;
+				break;
+			}
+		}
+		// The wanted family has run out, take the best of what is left
+		if(pick == healthy) {
+			for(pick = 0; used[pick]; pick++)
+				;
+		}
+		used[pick] = true;
+		out[n++] = idx[pick];
+		family = (addrs[idx[pick]].addr.ss_family == AF_INET6) ? AF_INET : AF_INET6;
+	}
+	for(unsigned int i = healthy; i < count; i++)
+		out[n++] = idx[i];
+	return n;
+}
+
+/**
+ * Succeeded
+ * Record a completed connect. The connect time is averaged with weight 1/8 so one slow handshake doesn't reorder the addresses
+ *
+ * @param i Address index
+ * @param us Time from connect() to completion in microseconds
+ */
+void Upstream::succeeded(unsigned int i, uint32_t us) {
+	if(us == 0)
+		us = 1;
+	uint32_t avg = addrs[i].latencyUs.load(memory_order_relaxed);
+	avg = (avg == 0) ? us : avg - avg / 8 + us / 8;
+	addrs[i].latencyUs.store((avg == 0) ? 1 : avg, memory_order_relaxed);
+	addrs[i].failures.store(0, memory_order_relaxed);
+}
+
+/**
+ * Failed
+ * Record a failed or timed out connect
+ *
+ * @param i Address index
+ * @param now nowMs()
+ */
+void Upstream::failed(unsigned int i, long now) {
+	addrs[i].failures.fetch_add(1, memory_order_relaxed);
+	addrs[i].failedAt.store(now, memory_order_relaxed);
+}
+
+/**
+ * ConnectRace Constructor
+ * Take a snapshot of the address order. No attempt is started until the first launch()
+ *
+ * @param u Addresses to race
+ * @param c Configuration (connectAttemptDelay, connectTimeout and the upstream socket options)
+ * @param now nowMs()
+ */
+ConnectRace::ConnectRace(Upstream* u, Config* c, long now) {
+	upstream = u;
+	cfg = c;
+	count = upstream->order(order, now);
+	next = 0;
+	inFlight = 0;
+	nextAttemptAt = now;
+	deadline = (cfg->connectTimeout > 0) ? now + cfg->connectTimeout : 0;
+	lastError = 0;
+	winner = 0;
+	slot = 0;
+}
+
+/**
+ * ConnectRace Destructor
+ * Cancel the attempts still in flight. A winner has already been taken out of the attempts by finish()
+ */
+ConnectRace::~ConnectRace() {
+	for(unsigned int i = 0; i < inFlight; i++)
+		close(attempts[i].fd);
+}
+
+/**
+ * Launch
+ * Start the next attempt. An address that fails on the spot is recorded and the one after it is started in its place
+ *
+ * @param now nowMs()
+ * @return Descriptor of the attempt to watch for writability, INVALID_SOCKET if there was nothing left to start
+ */
+SOCKET ConnectRace::launch(long now) {
+	while(next < count) {
+		unsigned int a = order[next++];
+		nextAttemptAt = now + cfg->connectAttemptDelay;
+
+		const sockaddr* addr = upstream->getAddr(a);
+		SOCKET fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(fd == INVALID_SOCKET) {
+			lastError = errno;
+			continue;
+		}
+		// Out of descriptors select() can watch. Not the address' fault
+		if(fd >= FD_SETSIZE) {
+			close(fd);
+			lastError = EMFILE;
+			continue;
+		}
+
+		SocketOptions::applyUpstream(fd, cfg);
+		uint64_t started = Upstream::nowUs();
+		if(connect(fd, addr, upstream->getAddrLen(a)) < 0 && errno != EINPROGRESS) {
+			lastError = errno;
+			upstream->failed(a, now);
+			close(fd);
+			continue;
+		}
+
+		attempts[inFlight].fd = fd;
+		attempts[inFlight].addr = a;
+		attempts[inFlight].startedUs = started;
+		inFlight++;
+		return fd;
+	}
+	return INVALID_SOCKET;
+}
+
+/**
+ * Finish
+ * An attempt's descriptor became writable, its connect has completed one way or the other. A failed attempt is closed and makes
+ * the next one due right away
+ *
+ * @param fd Attempt descriptor
+ * @param now nowMs()
+ * @return True if the attempt connected, it is then the caller's. False if it failed and was closed
+ */
+bool ConnectRace::finish(SOCKET fd, long now) {
+	unsigned int i = 0;
+	while(i < inFlight && attempts[i].fd != fd)
+		i++;
+	if(i == inFlight)
+		return false;
+
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	ConnectAttempt at = attempts[i];
+	attempts[i] = attempts[--inFlight];
+
+	if(err == 0) {
+		upstream->succeeded(at.addr, Upstream::nowUs() - at.startedUs);
+		winner = at.addr;
+		return true;
+	}
+
+	lastError = err;
+	upstream->failed(at.addr, now);
+	close(fd);
+	nextAttemptAt = now;
+	return false;
+}
+
+/**
+ * Expire
+ * The race ran out of time, count the attempts still in flight as failures
+ *
+ * @param now nowMs()
+ */
+void ConnectRace::expire(long now) {
+	for(unsigned int i = 0; i < inFlight; i++)
+		upstream->failed(attempts[i].addr, now);
+	if(inFlight > 0 || lastError == 0)
+		lastError = ETIMEDOUT;
+}
@@ -0,0 +1,184 @@
+/**
+   tcp_proxy
+   Upstream.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef UPSTREAM_H_
+#define UPSTREAM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <atomic>
+#include <string>
+
+#include "Config.h"
+#include "SocketOptions.h"
+
+#define SOCKET int
+#define INVALID_SOCKET -1
+
+using namespace std;
+
+#define UPSTREAM_MAX_ADDRS 16 // Resolved addresses kept per target
+#define UPSTREAM_FAIL_HOLD 30000 // Milliseconds an address that failed is tried after the others
+
+/**
+ * Upstream Address
+ * One resolved address and how connecting to it has gone. The history is shared by every event loop, updates are racy on purpose:
+ * a lost update only makes the ordering a little stale
+ */
+struct UpstreamAddr {
+	sockaddr_storage addr;
+	socklen_t addrLen;
+	atomic<uint32_t> latencyUs; // Moving average of successful connect times, 0 until one has succeeded
+	atomic<uint32_t> failures; // Failures since the last success
+	atomic<long> failedAt; // nowMs() of the last failure
+};
+
+/**
+ * Upstream
+ * Every address a target host resolves to, in RFC 8305 order: the resolver's (RFC 6724) order with the address families interleaved.
+ * order() refines that with the connect history so the addresses that answered fastest are tried first and ones that failed lately
+ * are tried last. Resolved once at startup, shared read only by the event loops apart from the history
+ */
+class Upstream {
+private:
+	string target; // "host:port", for logging
+	UpstreamAddr addrs[UPSTREAM_MAX_ADDRS];
+	unsigned int count;
+
+public:
+	Upstream();
+
+	bool resolve(string host, string port);
+	bool resolve(string hostPort);
+	unsigned int order(uint8_t* out, long now);
+	void succeeded(unsigned int i, uint32_t us);
+	void failed(unsigned int i, long now);
+
+	static uint64_t nowUs() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	}
+
+	unsigned int size() {
+		return count;
+	}
+
+	const sockaddr* getAddr(unsigned int i) {
+		return (const sockaddr*)&addrs[i].addr;
+	}
+
+	socklen_t getAddrLen(unsigned int i) {
+		return addrs[i].addrLen;
+	}
+
+	const string& getTarget() {
+		return target;
+	}
+};
+
+/**
+ * Connect Attempt
+ */
+struct ConnectAttempt {
+	SOCKET fd;
+	uint8_t addr; // Index into the Upstream
+	uint64_t startedUs; // Upstream::nowUs() of the connect()
+};
+
+/**
+ * Connect Race
+ * Happy eyeballs (RFC 8305) for one session, tunnel connection or tunnel stream. Non blocking connects are started down the address
+ * order, a new one every connectAttemptDelay ms or as soon as an earlier one fails, and race each other. The first to complete wins,
+ * the others are cancelled. The owner watches the descriptors of the attempts in flight for writability
+ */
+class ConnectRace {
+private:
+	Upstream* upstream; // Not owned
+	Config* cfg;
+	uint8_t order[UPSTREAM_MAX_ADDRS];
+	unsigned int count;
+	unsigned int next; // Next address in order to try
+	ConnectAttempt attempts[UPSTREAM_MAX_ADDRS];
+	unsigned int inFlight;
+	long nextAttemptAt; // nowMs() the next attempt is due
+	long deadline; // nowMs() the race gives up, 0 = no limit
+	int lastError;
+	unsigned int winner; // Address index of the attempt that connected
+
+public:
+	unsigned int slot; // Position in the owner's list of races
+
+public:
+	ConnectRace(Upstream* u, Config* c, long now);
+	~ConnectRace();
+
+	SOCKET launch(long now);
+	bool finish(SOCKET fd, long now);
+	void expire(long now);
+
+	// The next attempt is due or the race has run out of time
+	bool due(long now) {
+		return (next < count && now >= nextAttemptAt) || (deadline > 0 && now >= deadline);
+	}
+
+	// Nothing left to try and nothing in flight, or out of time
+	bool lost(long now) {
+		return (next >= count && inFlight == 0) || (deadline > 0 && now >= deadline);
+	}
+
+	// When the owner has to look at the race again, -1 if only an attempt completing can change anything
+	long wakeAt() {
+		long at = (next < count) ? nextAttemptAt : -1;
+		if(deadline > 0 && (at < 0 || deadline < at))
+			at = deadline;
+		return at;
+	}
+
+	unsigned int getInFlight() {
+		return inFlight;
+	}
+
+	SOCKET getAttempt(unsigned int i) {
+		return attempts[i].fd;
+	}
+
+	int getLastError() {
+		return lastError;
+	}
+
+	Upstream* getUpstream() {
+		return upstream;
+	}
+
+	// Address the connected attempt went to, once finish() returned true
+	const sockaddr* getWinner() {
+		return upstream->getAddr(winner);
+	}
+};
+
+#endif
@@ -0,0 +1,176 @@
+/**
+   tcp_proxy
+   ZeroCopy.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "ZeroCopy.h"
+
+/**
+ * ZeroCopy Constructor
+ *
+ * @param s Socket with SO_ZEROCOPY set
+ * @param t Smallest send that uses MSG_ZEROCOPY
+ * @param b Memory budget the pinned bytes are charged to
+ * @param c Event loop counters
+ */
+ZeroCopy::ZeroCopy(SOCKET s, unsigned int t, MemoryBudget* b, StatsCounters* c) {
+	sd = s;
+	nextId = 0;
+	threshold = t;
+	copiedRun = 0;
+	budget = b;
+	stats = c;
+	deadline = 0;
+}
+
+/**
+ * ZeroCopy Destructor
+ * Drops the references still held. Only safe once the kernel is done with them: the socket is idle, or was reset or closed along
+ * with the process. A lingering socket is closed here
+ */
+ZeroCopy::~ZeroCopy() {
+	for(list<Pinned>::iterator it = pinned.begin(); it != pinned.end(); it++)
+		budget->release(NULL, it->data.size());
+	pinned.clear();
+	if(deadline != 0)
+		close(sd);
+}
+
+/**
+ * Enable
+ * Turn on SO_ZEROCOPY for a socket
+ *
+ * @param s Connected socket
+ * @param t Smallest send that uses MSG_ZEROCOPY
+ * @param b Memory budget the pinned bytes are charged to
+ * @param c Event loop counters
+ * @return Zerocopy state for the socket, NULL if the kernel doesn't support it
+ */
+ZeroCopy* ZeroCopy::enable(SOCKET s, unsigned int t, MemoryBudget* b, StatsCounters* c) {
+	int one = 1;
+	if(setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+		return NULL;
+	return new ZeroCopy(s, t, b, c);
+}
+
+/**
+ * Send
+ * Hand part of a buffer to the kernel without copying it. The part that was taken is pinned until its completion arrives
+ *
+ * @param buf Buffer holding the data
+ * @param start Offset of the data in buf
+ * @param len Length of the data
+ * @return Bytes sent, -1 and errno as for send()
+ */
+ssize_t ZeroCopy::send(const ByteBuffer& buf, unsigned int start, unsigned int len) {
+	const uint8_t* data = buf.getData() + start;
+	ssize_t n = ::send(sd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT | MSG_ZEROCOPY);
+
+	// Out of option memory for the notifications (optmem_max), this send is copied
+	if(n < 0 && errno == ENOBUFS)
+		return ::send(sd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if(n <= 0)
+		return n;
+
+	pinned.emplace_back(nextId++, buf, start, (unsigned int)n);
+	budget->charge(NULL, n, true);
+	stats->zerocopyBytes += n;
+	return n;
+}
+
+/**
+ * Reap
+ * Read the completions off the socket's error queue and drop the references to the buffers the kernel is done with. Pending
+ * completions make select() report the socket readable
+ */
+void ZeroCopy::reap() {
+	while(!pinned.empty()) {
+		char control[128];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			sock_extended_err* ee = (sock_extended_err*)CMSG_DATA(cm);
+			if(ee->ee_errno == 0 && ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+				complete(ee->ee_info, ee->ee_data, (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+		}
+	}
+}
+
+/**
+ * Complete
+ * The sends numbered lo to hi have completed. Notifications cover ranges and may arrive out of order
+ *
+ * @param lo First send id
+ * @param hi Last send id
+ * @param copied The kernel copied the data after all
+ */
+void ZeroCopy::complete(uint32_t lo, uint32_t hi, bool copied) {
+	for(list<Pinned>::iterator it = pinned.begin(); it != pinned.end(); ) {
+		if(it->id - lo <= hi - lo) {
+			budget->release(NULL, it->data.size());
+			it = pinned.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	if(!copied) {
+		copiedRun = 0;
+		return;
+	}
+	stats->zerocopyCopied += hi - lo + 1;
+	copiedRun += hi - lo + 1;
+	if(threshold > 0 && copiedRun >= ZEROCOPY_COPIED_LIMIT) {
+		threshold = 0;
+		stats->zerocopyFallbacks++;
+	}
+}
+
+/**
+ * Linger
+ * The socket's session has closed while the kernel still sends from its buffers. Keep a duplicate of the descriptor to read the
+ * completions on, and send the FIN the session's close() no longer does
+ *
+ * @param now nowMs()
+ */
+void ZeroCopy::linger(long now) {
+	sd = dup(sd);
+	deadline = now + ZEROCOPY_LINGER;
+	if(sd >= 0)
+		shutdown(sd, SHUT_WR);
+}
+
+/**
+ * Expired
+ * A lingering socket has been given long enough. Reset it, the kernel then discards the unsent data that was still using the buffers
+ *
+ * @param now nowMs()
+ * @return True if the socket has been reset and can be deleted
+ */
+bool ZeroCopy::expired(long now) {
+	if(now < deadline)
+		return false;
+	struct linger l = { 1, 0 };
+	setsockopt(sd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	return true;
+}
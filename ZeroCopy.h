@@ -0,0 +1,96 @@
+/**
+   tcp_proxy
+   ZeroCopy.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef ZEROCOPY_H_
+#define ZEROCOPY_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <list>
+
+#include "ByteBuffer.h"
+#include "MemoryBudget.h"
+#include "Stats.h"
+
+#define SOCKET int
+
+#define ZEROCOPY_COPIED_LIMIT 8 // Completions in a row the kernel had to copy after all before a socket falls back to plain sends
+#define ZEROCOPY_LINGER 30000 // Milliseconds a closed socket is kept open for its outstanding completions before it is reset
+
+using namespace std;
+
+/**
+ * Zero Copy
+ * MSG_ZEROCOPY sends for one socket. The kernel transmits straight from the buffers it is handed, so each buffer stays referenced
+ * until the socket's error queue reports the send that used it complete. Sends below the threshold are cheaper copied and go the
+ * plain way, and a socket whose data the kernel ends up copying anyway (loopback, devices without scatter/gather) falls back for good
+ */
+class ZeroCopy {
+private:
+	struct Pinned {
+		uint32_t id; // Notification id of the send that handed the data to the kernel
+		ByteBuffer data;
+
+		Pinned(uint32_t i, const ByteBuffer& src, unsigned int start, unsigned int len) : id(i), data(src, start, len) {}
+	};
+
+	SOCKET sd;
+	list<Pinned> pinned;
+	uint32_t nextId; // The kernel numbers the successful MSG_ZEROCOPY sends of a socket from 0
+	unsigned int threshold; // Smallest send that uses MSG_ZEROCOPY, 0 once the socket has fallen back
+	unsigned int copiedRun; // Completions in a row the kernel copied
+	MemoryBudget* budget; // Pinned bytes are charged to the global budget
+	StatsCounters* stats;
+	long deadline; // While lingering, nowMs() the socket is reset at
+
+	void complete(uint32_t lo, uint32_t hi, bool copied);
+
+public:
+	ZeroCopy(SOCKET s, unsigned int t, MemoryBudget* b, StatsCounters* c);
+	~ZeroCopy();
+
+	static ZeroCopy* enable(SOCKET s, unsigned int t, MemoryBudget* b, StatsCounters* c);
+
+	ssize_t send(const ByteBuffer& buf, unsigned int start, unsigned int len);
+	void reap();
+	void linger(long now);
+	bool expired(long now);
+
+	// False once the socket has fallen back to plain sends
+	bool active() {
+		return threshold > 0;
+	}
+
+	// True if a send of len bytes should go zerocopy
+	bool wants(unsigned int len) {
+		return threshold > 0 && len >= threshold;
+	}
+
+	// True if no buffer is waiting for a completion
+	bool idle() {
+		return pinned.empty();
+	}
+};
+
+#endif
@@ -23,6 +23,8 @@
 
 // Proxy Server
 #define PROXYSERVER_PORT 443
+// Default maximum number of pending connections accepted per wakeup of the listening socket (accept_batch)
+#define PROXYSERVER_ACCEPT_BATCH 64
 
 // Proxy Client
 #define PROXYCLIENT_HOST "192.168.1.123"
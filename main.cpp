@@ -18,25 +18,66 @@
 
 #include <signal.h>
 #include "ProxyServer.h"
+#include "RelayCore.h"
 
 ProxyServer *svr;
+RelayServer *relay; // Runs instead of svr when session_engine is policy
 
 // Handles an unix terminiation signals (Ctrl C)
 void sighandler(int sig) {
-	svr->stopServer();
+	if(relay != NULL)
+		relay->stopServer();
+	else
+		svr->stopServer();
+}
+
+// SIGUSR2: stop accepting and let the open sessions finish
+void drainhandler(int sig) {
+	if(svr != NULL)
+		svr->drainServer();
+}
+
+// SIGUSR1: write the event trace rings
+void tracehandler(int sig) {
+	if(svr != NULL)
+		svr->dumpTrace();
 }
 
 int main (int argc, const char * argv[])
 {
+	// Load the runtime configuration, an optional config file may be passed as the first argument
+	Config* cfg = new Config();
+	if(argc > 1 && !cfg->load(argv[1])) {
+		printf("Usage: %s [config file]\n", argv[0]);
+		delete cfg;
+		return 1;
+	}
+	if(!cfg->validate()) {
+		delete cfg;
+		return 1;
+	}
+
 	// Register sighandler for terminiation signals:
 	signal(SIGABRT, &sighandler);
 	signal(SIGINT, &sighandler);
 	signal(SIGTERM, &sighandler);
+	signal(SIGUSR2, &drainhandler);
+	signal(SIGUSR1, &tracehandler);
+
+	// The policy relay only does plain TCP relaying and has none of ProxyServer's runtime features
+	if(cfg->sessionEngine == ENGINE_POLICY) {
+		relay = RelayServer::create(cfg);
+		relay->runServer();
+		delete relay;
+		delete cfg;
+		return 0;
+	}
 
 	// Instance and start the proxy server
-    svr = new ProxyServer();
+    svr = new ProxyServer(cfg);
     svr->runServer();
     delete svr;
+    delete cfg;
 
 
 